@@ -0,0 +1,205 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _XOPEN_SOURCE 700
+
+#include <glib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "avc.h"
+#include "config.h"
+
+GQuark restraint_avc_error (void) {
+    return g_quark_from_static_string ("restraint-avc-error-quark");
+}
+
+/*
+ * Match the same records as
+ * ausearch -m AVC -m USER_AVC -m SELINUX_ERR -sv no
+ */
+gboolean
+restraint_avc_is_denial (const gchar *line)
+{
+    if (strstr (line, "type=SELINUX_ERR ") != NULL) {
+        return TRUE;
+    }
+    if (strstr (line, "type=AVC ") != NULL ||
+        strstr (line, "type=USER_AVC ") != NULL) {
+        return strstr (line, " denied ") != NULL;
+    }
+    return FALSE;
+}
+
+static gboolean
+avc_scan_file (const gchar *path, FILE *fp, goffset *offset,
+               guint *denials, GError **error)
+{
+    gchar *line = NULL;
+    size_t len = 0;
+    ssize_t nread;
+    gboolean ret = TRUE;
+
+    if (fseeko (fp, *offset, SEEK_SET) != 0) {
+        g_set_error (error, RESTRAINT_AVC_ERROR, RESTRAINT_AVC_READ_ERROR,
+                     "Failed to seek %s: %s", path, g_strerror (errno));
+        return FALSE;
+    }
+
+    while ((nread = getline (&line, &len, fp)) != -1) {
+        // auditd may be in the middle of writing this record,
+        // leave it for the next scan.
+        if (line[nread - 1] != '\n') {
+            break;
+        }
+        *offset += nread;
+        if (restraint_avc_is_denial (line)) {
+            (*denials)++;
+        }
+    }
+
+    if (ferror (fp)) {
+        g_set_error (error, RESTRAINT_AVC_ERROR, RESTRAINT_AVC_READ_ERROR,
+                     "Failed to read %s: %s", path, g_strerror (errno));
+        ret = FALSE;
+    }
+
+    free (line);
+    return ret;
+}
+
+/*
+ * Count the denials logged to audit_log since the previous call.
+ *
+ * The inode and byte offset of the last complete record read are kept
+ * under section in config_file so only new records are parsed, even
+ * across reboots.  Each reader passes its own section so one reader
+ * doesn't consume the denials another one still has to report.  If
+ * section has no mark yet it starts from the one in seed_section.
+ * If auditd rotated the log we finish reading the old file from
+ * audit_log.1 before starting on the new one.  If the old file can't
+ * be found anymore the mark is moved to the end of the current log and
+ * RESTRAINT_AVC_MARK_LOST_ERROR is returned so the caller can fall back
+ * to a full search.
+ */
+gboolean
+restraint_avc_scan (const gchar *audit_log, gchar *config_file,
+                    gchar *section, gchar *seed_section,
+                    guint *denials, GError **error)
+{
+    g_return_val_if_fail (audit_log != NULL, FALSE);
+    g_return_val_if_fail (config_file != NULL, FALSE);
+    g_return_val_if_fail (section != NULL, FALSE);
+    g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+    GError *tmp_error = NULL;
+    gboolean mark_lost = FALSE;
+    gboolean ret = FALSE;
+    struct stat st;
+    guint64 mark_inode;
+    goffset offset = 0;
+    gchar *mark_section = section;
+    FILE *fp;
+
+    *denials = 0;
+
+    mark_inode = restraint_config_get_uint64 (config_file, mark_section,
+                                              AVC_INODE_KEY, &tmp_error);
+    if (tmp_error == NULL && mark_inode == 0 && seed_section != NULL) {
+        mark_section = seed_section;
+        mark_inode = restraint_config_get_uint64 (config_file, mark_section,
+                                                  AVC_INODE_KEY, &tmp_error);
+    }
+    if (tmp_error == NULL) {
+        offset = restraint_config_get_uint64 (config_file, mark_section,
+                                              AVC_OFFSET_KEY, &tmp_error);
+    }
+    if (tmp_error) {
+        g_propagate_prefixed_error (error, tmp_error, "avc scan, ");
+        return FALSE;
+    }
+
+    fp = fopen (audit_log, "r");
+    if (fp == NULL) {
+        g_set_error (error, RESTRAINT_AVC_ERROR, RESTRAINT_AVC_OPEN_ERROR,
+                     "Failed to open %s: %s", audit_log, g_strerror (errno));
+        return FALSE;
+    }
+    if (fstat (fileno (fp), &st) != 0) {
+        g_set_error (error, RESTRAINT_AVC_ERROR, RESTRAINT_AVC_OPEN_ERROR,
+                     "Failed to stat %s: %s", audit_log, g_strerror (errno));
+        goto error;
+    }
+
+    if (mark_inode != 0 && mark_inode != (guint64) st.st_ino) {
+        gchar *rotated = g_strdup_printf ("%s.1", audit_log);
+        FILE *rfp = fopen (rotated, "r");
+        struct stat rst;
+
+        if (rfp != NULL && fstat (fileno (rfp), &rst) == 0 &&
+            (guint64) rst.st_ino == mark_inode && rst.st_size >= offset) {
+            if (!avc_scan_file (rotated, rfp, &offset, denials, &tmp_error)) {
+                g_propagate_error (error, tmp_error);
+                fclose (rfp);
+                g_free (rotated);
+                goto error;
+            }
+        } else {
+            mark_lost = TRUE;
+        }
+        if (rfp != NULL) {
+            fclose (rfp);
+        }
+        g_free (rotated);
+        offset = 0;
+    } else if (st.st_size < offset) {
+        // Log was truncated in place (97_audit_rotate)
+        offset = 0;
+    }
+
+    if (!avc_scan_file (audit_log, fp, &offset, denials, &tmp_error)) {
+        g_propagate_error (error, tmp_error);
+        goto error;
+    }
+
+    restraint_config_set (config_file, section, AVC_INODE_KEY,
+                          &tmp_error, G_TYPE_UINT64, (guint64) st.st_ino);
+    if (tmp_error == NULL) {
+        restraint_config_set (config_file, section, AVC_OFFSET_KEY,
+                              &tmp_error, G_TYPE_UINT64, (guint64) offset);
+    }
+    if (tmp_error) {
+        g_propagate_prefixed_error (error, tmp_error, "avc scan, ");
+        goto error;
+    }
+
+    if (mark_lost) {
+        g_set_error (error, RESTRAINT_AVC_ERROR, RESTRAINT_AVC_MARK_LOST_ERROR,
+                     "%s was rotated past the last scanned record", audit_log);
+        goto error;
+    }
+
+    ret = TRUE;
+
+error:
+    fclose (fp);
+    return ret;
+}
@@ -0,0 +1,43 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RESTRAINT_AVC_H
+#define _RESTRAINT_AVC_H
+
+#include <glib.h>
+
+#define AVC_AUDIT_LOG "/var/log/audit/audit.log"
+#define AVC_CHECK_PLUGIN "10_avc_check"
+#define AVC_CLEAR_PLUGIN "20_avc_clear"
+#define AVC_INODE_KEY "avc_inode"
+#define AVC_OFFSET_KEY "avc_offset"
+
+#define RESTRAINT_AVC_ERROR restraint_avc_error ()
+GQuark restraint_avc_error (void);
+
+typedef enum {
+    RESTRAINT_AVC_OPEN_ERROR,
+    RESTRAINT_AVC_READ_ERROR,
+    RESTRAINT_AVC_MARK_LOST_ERROR,
+} RestraintAvcError;
+
+gboolean restraint_avc_is_denial (const gchar *line);
+gboolean restraint_avc_scan (const gchar *audit_log, gchar *config_file,
+                             gchar *section, gchar *seed_section,
+                             guint *denials, GError **error);
+
+#endif
@@ -0,0 +1,335 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+
+#define CGROUP_CONTROLLERS "+cpu +memory +io"
+#define CGROUP_KILL_ROUNDS 10
+#define CGROUP_KILL_INTERVAL 10 // milliseconds
+#define CGROUP_RMDIR_INTERVAL 100 // milliseconds
+#define CGROUP_RMDIR_TRIES 50
+
+typedef struct {
+    gchar *path;
+    guint tries;
+} CgroupRemoval;
+
+/* Parent of the task cgroups, NULL when they are not used */
+static gchar *cgroup_root = NULL;
+
+GQuark restraint_cgroup_error(void) {
+    return g_quark_from_static_string("restraint-cgroup-error-quark");
+}
+
+static gboolean
+cgroup_write (gint dirfd, const gchar *name, const gchar *value)
+{
+    gint fd = openat (dirfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return FALSE;
+    }
+    gssize len = strlen (value);
+    gboolean ret = write (fd, value, len) == len;
+    gint saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return ret;
+}
+
+static gchar *
+cgroup_read (gint dirfd, const gchar *name)
+{
+    gint fd = openat (dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    GString *contents = g_string_new (NULL);
+    gchar buf[4096];
+    gssize len;
+    while ((len = read (fd, buf, sizeof (buf))) > 0) {
+        g_string_append_len (contents, buf, len);
+    }
+    close (fd);
+    return g_string_free (contents, len < 0);
+}
+
+/*
+ * Finds the cgroup restraintd was started in, moves restraintd into a
+ * leaf below it and turns on the controllers it can for the task
+ * cgroups.  Systemd has to delegate the cgroup for this to stick.
+ */
+gboolean
+restraint_cgroup_init (GError **error)
+{
+    g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+    gchar *self = NULL;
+    gchar *base = NULL;
+    gboolean ret = FALSE;
+
+    if (!g_file_test (CGROUP_FS "/cgroup.controllers", G_FILE_TEST_EXISTS)) {
+        g_set_error (error, RESTRAINT_CGROUP_ERROR,
+                     RESTRAINT_CGROUP_UNAVAILABLE,
+                     "No cgroup v2 hierarchy mounted on %s", CGROUP_FS);
+        return FALSE;
+    }
+    if (!g_file_get_contents ("/proc/self/cgroup", &self, NULL, error)) {
+        g_prefix_error (error, "Unable to find our cgroup: ");
+        return FALSE;
+    }
+
+    // The unified hierarchy is the "0::/path" line
+    gchar **lines = g_strsplit (self, "\n", -1);
+    for (gchar **line = lines; *line != NULL; line++) {
+        if (g_str_has_prefix (*line, "0::")) {
+            base = g_build_filename (CGROUP_FS, *line + 3, NULL);
+        }
+    }
+    g_strfreev (lines);
+    if (base == NULL) {
+        g_set_error (error, RESTRAINT_CGROUP_ERROR,
+                     RESTRAINT_CGROUP_UNAVAILABLE,
+                     "Not running in a cgroup v2 hierarchy");
+        goto out;
+    }
+
+    // Already moved when restraintd re-executes itself
+    if (g_str_has_suffix (base, "/" CGROUP_SUPERVISOR)) {
+        gchar *parent = g_path_get_dirname (base);
+        g_free (base);
+        base = parent;
+    }
+
+    gint dirfd = open (base, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1 ||
+            (mkdirat (dirfd, CGROUP_SUPERVISOR, 0755) == -1 &&
+             errno != EEXIST) ||
+            !cgroup_write (dirfd, CGROUP_SUPERVISOR "/cgroup.procs", "0")) {
+        g_set_error (error, RESTRAINT_CGROUP_ERROR,
+                     RESTRAINT_CGROUP_CREATE_ERROR,
+                     "Unable to move into %s/%s: %s", base,
+                     CGROUP_SUPERVISOR, g_strerror (errno));
+        if (dirfd != -1) {
+            close (dirfd);
+        }
+        goto out;
+    }
+
+    // One by one, as the write fails as a whole on a missing controller
+    gchar **controllers = g_strsplit (CGROUP_CONTROLLERS, " ", -1);
+    for (gchar **controller = controllers; *controller != NULL; controller++) {
+        if (!cgroup_write (dirfd, "cgroup.subtree_control", *controller)) {
+            g_message ("cgroup controller %s unavailable: %s", *controller + 1,
+                       g_strerror (errno));
+        }
+    }
+    g_strfreev (controllers);
+    close (dirfd);
+
+    restraint_cgroup_configure (base);
+    ret = TRUE;
+
+out:
+    g_free (base);
+    g_free (self);
+    return ret;
+}
+
+/* Creates task cgroups under root from now on, or none when NULL */
+void
+restraint_cgroup_configure (const gchar *root)
+{
+    g_free (cgroup_root);
+    cgroup_root = g_strdup (root);
+}
+
+RestraintCgroup *
+restraint_cgroup_new (const gchar *name, GError **error)
+{
+    g_return_val_if_fail (name != NULL, NULL);
+    g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+    if (cgroup_root == NULL) {
+        g_set_error_literal (error, RESTRAINT_CGROUP_ERROR,
+                             RESTRAINT_CGROUP_UNAVAILABLE,
+                             "cgroups are not in use");
+        return NULL;
+    }
+
+    RestraintCgroup *cgroup = g_slice_new0 (RestraintCgroup);
+    cgroup->path = g_build_filename (cgroup_root, name, NULL);
+    cgroup->fd = -1;
+
+    // A leftover from before a restart may still hold processes
+    gboolean stale = g_mkdir (cgroup->path, 0755) == -1 && errno == EEXIST;
+    if (g_file_test (cgroup->path, G_FILE_TEST_IS_DIR)) {
+        cgroup->fd = open (cgroup->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (cgroup->fd == -1) {
+        g_set_error (error, RESTRAINT_CGROUP_ERROR,
+                     RESTRAINT_CGROUP_CREATE_ERROR,
+                     "Unable to create cgroup %s: %s", cgroup->path,
+                     g_strerror (errno));
+        g_free (cgroup->path);
+        g_slice_free (RestraintCgroup, cgroup);
+        return NULL;
+    }
+    if (stale) {
+        restraint_cgroup_kill (cgroup);
+    }
+    return cgroup;
+}
+
+static gint64
+cgroup_read_key (const gchar *contents, const gchar *key)
+{
+    gint64 value = -1;
+
+    gchar **lines = g_strsplit (contents ? contents : "", "\n", -1);
+    for (gchar **line = lines; *line != NULL; line++) {
+        gchar **fields = g_strsplit (*line, " ", 2);
+        if (fields[1] != NULL && g_str_equal (fields[0], key)) {
+            value = g_ascii_strtoll (fields[1], NULL, 10);
+        }
+        g_strfreev (fields);
+    }
+    g_strfreev (lines);
+    return value;
+}
+
+/*
+ * Kills every process in the cgroup at once through cgroup.kill.  When
+ * that can't be used, on kernels before 5.14 or when the write fails,
+ * the cgroup is frozen so nothing forks meanwhile and what cgroup.procs
+ * lists is signalled until cgroup.events says it is empty.
+ */
+void
+restraint_cgroup_kill (RestraintCgroup *cgroup)
+{
+    g_return_if_fail (cgroup != NULL);
+
+    if (cgroup_write (cgroup->fd, "cgroup.kill", "1")) {
+        return;
+    }
+
+    // SIGKILL still reaches frozen processes
+    gboolean frozen = cgroup_write (cgroup->fd, "cgroup.freeze", "1");
+    for (gint round = 0; round < CGROUP_KILL_ROUNDS; round++) {
+        gchar *procs = cgroup_read (cgroup->fd, "cgroup.procs");
+        gboolean empty = TRUE;
+
+        gchar **pids = g_strsplit (procs ? procs : "", "\n", -1);
+        for (gchar **pid = pids; *pid != NULL; pid++) {
+            // 0 or less would signal a whole process group
+            gint64 value = g_ascii_strtoll (*pid, NULL, 10);
+            if (value > 0) {
+                kill (value, SIGKILL);
+                empty = FALSE;
+            }
+        }
+        g_strfreev (pids);
+        g_free (procs);
+
+        gchar *events = cgroup_read (cgroup->fd, "cgroup.events");
+        gint64 populated = cgroup_read_key (events, "populated");
+        g_free (events);
+        // Without cgroup.events go by what was listed
+        if (populated == 0 || (populated == -1 && empty)) {
+            break;
+        }
+        g_usleep (CGROUP_KILL_INTERVAL * 1000);
+    }
+    if (frozen) {
+        cgroup_write (cgroup->fd, "cgroup.freeze", "0");
+    }
+}
+
+void
+restraint_cgroup_get_stats (RestraintCgroup *cgroup,
+                            RestraintCgroupStats *stats)
+{
+    g_return_if_fail (cgroup != NULL);
+    g_return_if_fail (stats != NULL);
+
+    gchar *cpu = cgroup_read (cgroup->fd, "cpu.stat");
+    stats->cpu_usec = cgroup_read_key (cpu, "usage_usec");
+    g_free (cpu);
+
+    gchar *memory = cgroup_read (cgroup->fd, "memory.peak");
+    stats->memory_peak = memory ? g_ascii_strtoll (memory, NULL, 10) : -1;
+    g_free (memory);
+
+    // One "MAJ:MIN rbytes=N wbytes=N ..." line per device
+    gchar *io = cgroup_read (cgroup->fd, "io.stat");
+    stats->io_rbytes = io ? 0 : -1;
+    stats->io_wbytes = io ? 0 : -1;
+    gchar **fields = g_strsplit_set (io ? io : "", " \n", -1);
+    for (gchar **field = fields; *field != NULL; field++) {
+        if (g_str_has_prefix (*field, "rbytes=")) {
+            stats->io_rbytes += g_ascii_strtoll (*field + 7, NULL, 10);
+        } else if (g_str_has_prefix (*field, "wbytes=")) {
+            stats->io_wbytes += g_ascii_strtoll (*field + 7, NULL, 10);
+        }
+    }
+    g_strfreev (fields);
+    g_free (io);
+}
+
+static gboolean
+cgroup_rmdir (gpointer user_data)
+{
+    CgroupRemoval *removal = user_data;
+
+    // Killed processes leave the cgroup once they have finished exiting
+    if (g_rmdir (removal->path) == -1 && errno != ENOENT) {
+        if (errno == EBUSY && ++removal->tries < CGROUP_RMDIR_TRIES) {
+            return G_SOURCE_CONTINUE;
+        }
+        g_warning ("Unable to remove cgroup %s: %s", removal->path,
+                   g_strerror (errno));
+    }
+    g_free (removal->path);
+    g_slice_free (CgroupRemoval, removal);
+    return G_SOURCE_REMOVE;
+}
+
+/* Kills whatever is left in the cgroup and removes it. */
+void
+restraint_cgroup_free (RestraintCgroup *cgroup)
+{
+    if (cgroup == NULL) {
+        return;
+    }
+    restraint_cgroup_kill (cgroup);
+    close (cgroup->fd);
+
+    CgroupRemoval *removal = g_slice_new0 (CgroupRemoval);
+    removal->path = cgroup->path;
+    if (cgroup_rmdir (removal) == G_SOURCE_CONTINUE) {
+        g_timeout_add (CGROUP_RMDIR_INTERVAL, cgroup_rmdir, removal);
+    }
+    g_slice_free (RestraintCgroup, cgroup);
+}
@@ -0,0 +1,60 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RESTRAINT_CGROUP_H
+#define _RESTRAINT_CGROUP_H
+
+#include <glib.h>
+
+#define CGROUP_FS "/sys/fs/cgroup"
+/* Leaf restraintd moves itself into so its own cgroup can have children */
+#define CGROUP_SUPERVISOR "restraintd"
+
+#define RESTRAINT_CGROUP_ERROR restraint_cgroup_error()
+GQuark restraint_cgroup_error(void);
+
+typedef enum {
+    RESTRAINT_CGROUP_UNAVAILABLE,
+    RESTRAINT_CGROUP_CREATE_ERROR,
+} RestraintCgroupError;
+
+/*
+ * A cgroup v2 leaf holding one task or plugin run.  fd is an O_PATH
+ * descriptor for the directory, used to spawn straight into it.
+ */
+typedef struct {
+    gchar *path;
+    gint fd;
+} RestraintCgroup;
+
+/* Resource usage of a cgroup, -1 where the kernel doesn't account for it */
+typedef struct {
+    gint64 cpu_usec;
+    gint64 memory_peak;
+    gint64 io_rbytes;
+    gint64 io_wbytes;
+} RestraintCgroupStats;
+
+gboolean restraint_cgroup_init (GError **error);
+void restraint_cgroup_configure (const gchar *root);
+RestraintCgroup *restraint_cgroup_new (const gchar *name, GError **error);
+void restraint_cgroup_kill (RestraintCgroup *cgroup);
+void restraint_cgroup_get_stats (RestraintCgroup *cgroup,
+                                 RestraintCgroupStats *stats);
+void restraint_cgroup_free (RestraintCgroup *cgroup);
+
+#endif
@@ -458,6 +458,83 @@ static gchar *format_datetime(time_t time) {
     return timestr;
 }
 
+static void
+timing_set_prop (xmlNodePtr node_ptr, struct json_object *entry,
+                 const gchar *key)
+{
+    struct json_object *value;
+    gchar *prop = NULL;
+
+    if (!json_object_object_get_ex (entry, key, &value)) {
+        return;
+    }
+    // Offsets and durations are sent in milliseconds, shown in seconds
+    if (json_object_get_type (value) == json_type_int &&
+            g_strcmp0 (key, "status") != 0) {
+        prop = g_strdup_printf ("%.3f", json_object_get_int64 (value) / 1000.0);
+    } else {
+        prop = g_strdup (json_object_get_string (value));
+    }
+    xmlSetProp (node_ptr, (xmlChar *) key, (xmlChar *) prop);
+    g_free (prop);
+}
+
+static void
+timing_add_entries (xmlNodePtr timing_node_ptr, struct json_object *timing,
+                    const gchar *array, const gchar *element,
+                    const gchar **keys)
+{
+    struct json_object *entries;
+
+    if (!json_object_object_get_ex (timing, array, &entries) ||
+            json_object_get_type (entries) != json_type_array) {
+        return;
+    }
+    for (size_t i = 0; i < json_object_array_length (entries); i++) {
+        struct json_object *entry = json_object_array_get_idx (entries, i);
+        xmlNodePtr node_ptr = xmlNewChild (timing_node_ptr, NULL,
+                                           (xmlChar *) element, NULL);
+        for (const gchar **key = keys; *key != NULL; key++) {
+            timing_set_prop (node_ptr, entry, *key);
+        }
+    }
+}
+
+/*
+ * Replaces the <timing/> of the task with the phases and processes of the
+ * timeline sent with its status.
+ */
+static void
+task_set_timing (xmlNodePtr task_node_ptr, const gchar *timing_json)
+{
+    const gchar *phase_keys[] = { "name", "start", "duration", NULL };
+    const gchar *process_keys[] = { "command", "phase", "start", "duration",
+                                    "status", NULL };
+
+    struct json_object *timing = json_tokener_parse (timing_json);
+    if (timing == NULL) {
+        return;
+    }
+
+    for (xmlNodePtr child = task_node_ptr->children; child != NULL;
+            child = child->next) {
+        if (child->type == XML_ELEMENT_NODE &&
+                xmlStrcmp (child->name, (xmlChar *) "timing") == 0) {
+            xmlUnlinkNode (child);
+            xmlFreeNode (child);
+            break;
+        }
+    }
+
+    xmlNodePtr timing_node_ptr = xmlNewChild (task_node_ptr, NULL,
+                                              (xmlChar *) "timing", NULL);
+    timing_add_entries (timing_node_ptr, timing, "phases", "phase",
+                        phase_keys);
+    timing_add_entries (timing_node_ptr, timing, "processes", "process",
+                        process_keys);
+    json_object_put (timing);
+}
+
 void
 tasks_status_cb (const char *path,
                  GHashTable *headers,
@@ -495,6 +572,19 @@ tasks_status_cb (const char *path,
     if (version) {
         xmlSetProp (task_node_ptr, (xmlChar *)"version", (xmlChar *) version);
     }
+    // Resource usage of the task's cgroup, sent with its final status
+    const gchar *resources[] = { "cpu_usec", "memory_peak", "io_read_bytes",
+                                 "io_write_bytes", NULL };
+    for (const gchar **resource = resources; *resource != NULL; resource++) {
+        gchar *value = g_hash_table_lookup (body, *resource);
+        if (value) {
+            xmlSetProp (task_node_ptr, (xmlChar *) *resource, (xmlChar *) value);
+        }
+    }
+    gchar *timing = g_hash_table_lookup (body, "timing");
+    if (timing) {
+        task_set_timing (task_node_ptr, timing);
+    }
     time_t stime = 0;
     time_t etime = 0;
     if (g_hash_table_contains(body, "stime")) {
@@ -1053,6 +1143,7 @@ run_recipe_handler (gpointer user_data)
                   size,
                   TRUE,
                   recipe_data->cancellable,
+                  NULL,
                   recipe_data);
 
     g_free (command);
@@ -104,7 +104,7 @@ upload_abort (AbortAppData *app_data, GError **error)
     char *form = soup_form_encode("status", "Aborted", NULL);
     soup_message_set_request (msg, "application/x-www-form-urlencoded",
                               SOUP_MEMORY_TAKE, form, strlen (form));
-    ret = soup_session_send_message(session, msg);
+    ret = rstrnt_send_message(session, msg);
     if (!SOUP_STATUS_IS_SUCCESSFUL(ret)) {
         g_warning ("Failed to abort job, status: %d Message: %s\n", ret,
                    msg->reason_phrase);
@@ -310,7 +310,7 @@ gboolean upload_results(AppData *app_data) {
     g_print ("** %s %s Score:%s\n", app_data->test_name, app_data->test_result,
         app_data->score != NULL ? app_data->score : "N/A");
 
-    ret = soup_session_send_message (session, server_msg);
+    ret = rstrnt_send_message (session, server_msg);
     if (SOUP_STATUS_IS_SUCCESSFUL (ret)) {
         gchar *location = g_strdup_printf ("%s/logs/",
                                            soup_message_headers_get_one (server_msg->response_headers, "Location"));
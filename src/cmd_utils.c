@@ -17,7 +17,9 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
 #include <glib/gstdio.h>
+#include <libsoup/soup.h>
 #include <errno.h>
 
 #include <stdlib.h>
@@ -149,6 +151,130 @@ clear_server_data(ServerData *s_data)
     }
 }
 
+static void
+append_request_header (const char *name, const char *value, gpointer user_data)
+{
+    GString *request = (GString *) user_data;
+
+    if (g_ascii_strcasecmp (name, "Host") != 0 &&
+        g_ascii_strcasecmp (name, "Connection") != 0 &&
+        g_ascii_strcasecmp (name, "Content-Length") != 0) {
+        g_string_append_printf (request, "%s: %s\r\n", name, value);
+    }
+}
+
+/*
+ * Send msg to restraintd over its unix socket, one request per
+ * connection.  Returns FALSE only if nothing was sent so the caller can
+ * still use TCP, once connected the outcome is in msg's status.
+ */
+static gboolean
+send_message_unix (const gchar *socket_path, SoupMessage *msg)
+{
+    GError *error = NULL;
+    GSocketClient *client = g_socket_client_new ();
+    GSocketAddress *address = g_unix_socket_address_new (socket_path);
+    GSocketConnection *connection;
+    GByteArray *response = NULL;
+    GString *request;
+    SoupBuffer *body;
+    gchar *path;
+    gchar buf[4096];
+    gssize bytes_read;
+
+    connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (address),
+                                          NULL, &error);
+    g_object_unref (address);
+    g_object_unref (client);
+    if (connection == NULL) {
+        g_clear_error (&error);
+        return FALSE;
+    }
+
+    path = soup_uri_to_string (soup_message_get_uri (msg), TRUE);
+    body = soup_message_body_flatten (msg->request_body);
+    request = g_string_new (NULL);
+    g_string_append_printf (request, "%s %s HTTP/1.1\r\n"
+                            "Host: localhost\r\n"
+                            "Connection: close\r\n", msg->method, path);
+    soup_message_headers_foreach (msg->request_headers, append_request_header,
+                                  request);
+    g_string_append_printf (request, "Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n",
+                            body->length);
+    g_free (path);
+
+    GOutputStream *out = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+    GInputStream *in = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+    if (!g_output_stream_write_all (out, request->str, request->len, NULL,
+                                    NULL, &error) ||
+        !g_output_stream_write_all (out, body->data, body->length, NULL,
+                                    NULL, &error)) {
+        goto out;
+    }
+
+    // restraintd closes the connection after its response
+    response = g_byte_array_new ();
+    while ((bytes_read = g_input_stream_read (in, buf, sizeof (buf), NULL,
+                                              &error)) > 0) {
+        g_byte_array_append (response, (guint8 *) buf, bytes_read);
+    }
+    if (bytes_read < 0) {
+        goto out;
+    }
+
+    const gchar *data = (const gchar *) response->data;
+    const gchar *end = g_strstr_len (data, response->len, "\r\n\r\n");
+    guint status;
+    gchar *reason = NULL;
+    if (end == NULL ||
+        !soup_headers_parse_response (data, end + 4 - data,
+                                      msg->response_headers, NULL,
+                                      &status, &reason)) {
+        g_set_error (&error, RESTRAINT_ERROR, RESTRAINT_PARSE_ERROR_BAD_SYNTAX,
+                     "Malformed response on %s", socket_path);
+        goto out;
+    }
+    soup_message_body_append (msg->response_body, SOUP_MEMORY_COPY, end + 4,
+                              response->len - (end + 4 - data));
+    soup_message_set_status_full (msg, status, reason);
+    g_free (reason);
+
+out:
+    if (error != NULL) {
+        soup_message_set_status_full (msg, SOUP_STATUS_IO_ERROR, error->message);
+        g_clear_error (&error);
+    }
+    if (response != NULL) {
+        g_byte_array_free (response, TRUE);
+    }
+    g_string_free (request, TRUE);
+    soup_buffer_free (body);
+    g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+    g_object_unref (connection);
+    return TRUE;
+}
+
+/*
+ * Like soup_session_send_message, but a message for the local restraintd
+ * goes over its unix socket when the environment has one and it accepts
+ * the connection.
+ */
+guint
+rstrnt_send_message (SoupSession *session, SoupMessage *msg)
+{
+    const gchar *socket_path = get_socket ();
+    const gchar *host = soup_message_get_uri (msg)->host;
+
+    if (socket_path != NULL && strlen (socket_path) != 0 &&
+        (g_strcmp0 (host, "localhost") == 0 ||
+         g_strcmp0 (host, "127.0.0.1") == 0 ||
+         g_strcmp0 (host, "::1") == 0) &&
+        send_message_unix (socket_path, msg)) {
+        return msg->status_code;
+    }
+    return soup_session_send_message (session, msg);
+}
+
 void cmd_usage(GOptionContext *context) {
     gchar *usage_str = g_option_context_get_help(context, FALSE, NULL);
     g_print("%s", usage_str);
@@ -2,6 +2,7 @@
 #define _RESTRAINT_CMD_UTILS_H
 
 #include <glib.h>
+#include <libsoup/soup.h>
 
 typedef struct {
     guint port;
@@ -14,6 +15,7 @@ const gchar *rstrnt_getenv (const gchar *name);
 
 #define get_taskid()     ((gchar *) rstrnt_getenv ("TASKID"))
 #define get_recipe_url() ((gchar *) rstrnt_getenv ("RECIPE_URL"))
+#define get_socket()     ((gchar *) rstrnt_getenv ("SOCKET"))
 
 void clear_server_data(ServerData *s_data);
 void get_env_vars_and_format_ServerData(ServerData *s_data);
@@ -24,6 +26,8 @@ void format_server_string(ServerData *s_data,
 void set_envvar_from_file(guint port, GError **error);
 void unset_envvar_from_file(guint port, GError **error);
 
+guint rstrnt_send_message(SoupSession *session, SoupMessage *msg);
+
 void cmd_usage(GOptionContext *context);
 
 #endif
@@ -129,7 +129,7 @@ upload_watchdog (WatchdogAppData *app_data, GError **error)
     soup_message_set_request (server_msg, "application/x-www-form-urlencoded",
                               SOUP_MEMORY_TAKE, form_data, strlen (form_data));
 
-    ret = soup_session_send_message (session, server_msg);
+    ret = rstrnt_send_message (session, server_msg);
     if (SOUP_STATUS_IS_SUCCESSFUL (ret)) {
         if (app_data->seconds < HEARTBEAT) {
             g_warning ("Expect up to a 1 minute delay for watchdog thread to notice change.\n");
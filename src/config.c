@@ -189,6 +189,25 @@ restraint_config_get_keys (gchar *config_file, gchar *section, GError **error)
     return ret;
 }
 
+/* The sections of config_file, NULL if it can't be read */
+gchar **
+restraint_config_get_groups (gchar *config_file)
+{
+    g_return_val_if_fail(config_file != NULL, NULL);
+
+    GKeyFile *keyfile = NULL;
+    gchar **ret = NULL;
+    GKeyFileFlags flags = G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS;
+
+    keyfile = g_key_file_new ();
+    if (g_key_file_load_from_file (keyfile, config_file, flags, NULL)) {
+        ret = g_key_file_get_groups (keyfile, NULL);
+    }
+
+    g_key_file_free (keyfile);
+    return ret;
+}
+
 void
 restraint_config_trunc (gchar *config_file, GError **error)
 {
@@ -20,6 +20,7 @@ guint64 restraint_config_get_uint64 (gchar *config_file, gchar *section, gchar *
 gboolean restraint_config_get_boolean (gchar *config_file, gchar *section, gchar *key, GError **error);
 gchar *restraint_config_get_string (gchar *config_file, gchar *section, gchar *key, GError **error);
 gchar **restraint_config_get_keys (gchar *config_file, gchar *section, GError **error);
+gchar **restraint_config_get_groups (gchar *config_file);
 void restraint_config_set (gchar *config_file, const gchar *section,
                            const gchar *key, GError **gerror, GType type, ...);
 void restraint_config_trunc (gchar *config_file, GError **error);
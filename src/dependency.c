@@ -24,37 +24,55 @@
 #include "fetch_git.h"
 #include "fetch_uri.h"
 
+#define REPODEP_MAX_FETCHES 4
+
+/*
+ * The repodep graph of a task is fetched breadth first with up to
+ * REPODEP_MAX_FETCHES fetches in flight, all fragments queued from an
+ * archive URL are extracted in a single pass.  Every path is fetched at
+ * most once no matter how many libraries ask for it, and the package
+ * dependencies of all the libraries are installed together with the
+ * task's own.
+ */
 typedef struct {
-    SoupURI *url;
-    gchar *path;
     DependencyData *dependency_data;
-} RepoDepData;
+    GQueue *queue;
+    GHashTable *seen;
+    GSList *dependencies;
+    guint in_flight;
+    gboolean pumping;
+    GError *error;
+} RepoDepGraph;
 
 typedef struct {
-    char *path;
-    MetaData *tmp_meta;
-    DependencyData *dependency_data;
-} MetadataFetchInfo;
+    SoupURI *url;
+    gchar *path;
+    MetaData *metadata;
+    RepoDepGraph *graph;
+} RepoDepData;
 
 static void dependency_handler (gpointer user_data);
-static void restraint_fetch_repodeps(DependencyData *dependency_data);
+static void repodep_graph_pump (RepoDepGraph *graph);
 static void dependency_batch_rpms(DependencyData *dependency_data);
 
 static void
-mtfi_archive_entry_callback (const gchar *entry, gpointer user_data)
+dependency_data_free (DependencyData *dependency_data)
 {
-    MetadataFetchInfo *mtfi = (MetadataFetchInfo*)user_data;
-    DependencyData *dependency_data = mtfi->dependency_data;
-    if (dependency_data->archive_entry_callback != NULL) {
-        return dependency_data->archive_entry_callback (entry, dependency_data->user_data);
+    if (dependency_data->remove_rpms != NULL) {
+        g_string_free(dependency_data->remove_rpms, TRUE);
+    }
+    if (dependency_data->install_rpms != NULL) {
+        g_string_free(dependency_data->install_rpms, TRUE);
     }
+    g_slist_free_full(dependency_data->merged_dependencies, g_free);
+    g_slice_free (DependencyData, dependency_data);
 }
 
 static void
 repo_dep_data_archive_callback (const gchar *entry, gpointer user_data)
 {
     RepoDepData *rd_data = (RepoDepData*)user_data;
-    DependencyData *dependency_data = rd_data->dependency_data;
+    DependencyData *dependency_data = rd_data->graph->dependency_data;
     if (dependency_data->archive_entry_callback != NULL) {
         return dependency_data->archive_entry_callback (entry, dependency_data->user_data);
     }
@@ -68,10 +86,87 @@ dependency_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_da
 }
 
 static gboolean
-mtfi_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data)
+repo_dep_data_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data)
+{
+    RepoDepData *rd_data = (RepoDepData *) user_data;
+    return dependency_io_callback (io, condition, rd_data->graph->dependency_data);
+}
+
+/*
+ * Packages already installed for the whole recipe up front,
+ * see RSTRNT_BATCH_DEPENDENCIES.
+ */
+static gboolean
+dependency_preinstalled (DependencyData *dependency_data, const gchar *package_name)
 {
-    MetadataFetchInfo *mtfi_data = (MetadataFetchInfo *) user_data;
-    return dependency_io_callback (io, condition, mtfi_data->dependency_data);
+    return dependency_data->preinstalled != NULL &&
+           g_hash_table_contains (dependency_data->preinstalled, package_name);
+}
+
+static gboolean dependency_process_errors(DependencyData *dependency_data,
+                                          GError *error, gint pid_result);
+
+/*
+ * A task which ran since may have removed some of the packages installed
+ * up front.  Check the ones this task needs are still there before
+ * skipping them, if not they are installed again and no longer skipped
+ * for the rest of the recipe.
+ */
+static void
+preinstalled_callback (gint pid_result, gboolean localwatchdog, gpointer user_data, GError *error)
+{
+    DependencyData *dependency_data = (DependencyData *) user_data;
+
+    g_cancellable_set_error_if_cancelled (dependency_data->cancellable, &error);
+
+    if (dependency_process_errors (dependency_data, error, 0)) {
+        if (pid_result != 0) {
+            for (GSList *l = dependency_data->dependencies; l; l = g_slist_next (l)) {
+                g_hash_table_remove (dependency_data->preinstalled, l->data);
+            }
+        }
+        dependency_data->state = DEPENDENCY_RPM;
+        dependency_handler (dependency_data);
+    }
+}
+
+static void
+dependency_verify_preinstalled (DependencyData *dependency_data)
+{
+    GString *packages = g_string_new (NULL);
+
+    for (GSList *l = dependency_data->dependencies; l; l = g_slist_next (l)) {
+        gchar *package_name = l->data;
+        if (!g_str_has_prefix (package_name, "-") &&
+            dependency_preinstalled (dependency_data, package_name)) {
+            g_string_append_printf (packages, " %s", package_name);
+        }
+    }
+
+    if (packages->len == 0) {
+        g_string_free (packages, TRUE);
+        dependency_data->state = DEPENDENCY_RPM;
+        dependency_handler (dependency_data);
+        return;
+    }
+
+    gchar *command = g_strdup_printf ("rpm -q --whatprovides --quiet%s", packages->str);
+    process_run ((const gchar *)command,
+                 NULL,
+                 NULL,
+                 FALSE,
+                 0,
+                 NULL,
+                 dependency_io_callback,
+                 preinstalled_callback,
+                 NULL,
+                 0,
+                 FALSE,
+                 dependency_data->cancellable,
+                 dependency_data->timing_data,
+                 dependency_data);
+    g_free (command);
+    g_string_free (packages, TRUE);
 }
 
 static gboolean dependency_process_errors(DependencyData *dependency_data,
@@ -82,16 +177,7 @@ static gboolean dependency_process_errors(DependencyData *dependency_data,
             dependency_data->finish_cb (dependency_data->user_data, error);
         }
 
-        if (dependency_data->remove_rpms != NULL) {
-            g_string_free(dependency_data->remove_rpms, TRUE);
-            dependency_data->remove_rpms = NULL;
-        }
-        if (dependency_data->install_rpms != NULL) {
-            g_string_free(dependency_data->install_rpms, TRUE);
-            dependency_data->install_rpms = NULL;
-        }
-        g_slist_free_full(dependency_data->processed_deps, g_free);
-        g_slice_free (DependencyData, dependency_data);
+        dependency_data_free (dependency_data);
         return FALSE;
     } else if (dependency_data->ignore_failed_install != TRUE && pid_result != 0) {
         // If running in rhts_compat mode we don't check whether a packge installed
@@ -104,16 +190,7 @@ static gboolean dependency_process_errors(DependencyData *dependency_data,
             dependency_data->finish_cb (dependency_data->user_data, error);
         }
 
-        if (dependency_data->remove_rpms != NULL) {
-            g_string_free(dependency_data->remove_rpms, TRUE);
-            dependency_data->remove_rpms = NULL;
-        }
-        if (dependency_data->install_rpms != NULL) {
-            g_string_free(dependency_data->install_rpms, TRUE);
-            dependency_data->install_rpms = NULL;
-        }
-        g_slist_free_full(dependency_data->processed_deps, g_free);
-        g_slice_free (DependencyData, dependency_data);
+        dependency_data_free (dependency_data);
         return FALSE;
     } else {
         return TRUE;
@@ -219,6 +296,7 @@ dependency_batch_rpms(DependencyData *dependency_data)
                          0,
                          FALSE,
                          dependency_data->cancellable,
+                         dependency_data->timing_data,
                          dependency_data);
             g_free (command);
         } else {
@@ -243,6 +321,7 @@ dependency_batch_rpms(DependencyData *dependency_data)
                          0,
                          FALSE,
                          dependency_data->cancellable,
+                         dependency_data->timing_data,
                          dependency_data);
             g_free (command);
         } else {
@@ -268,8 +347,7 @@ softdependency_callback (gint pid_result, gboolean localwatchdog, gpointer user_
             dependency_data->finish_cb (dependency_data->user_data, error);
         }
 
-        g_slist_free_full(dependency_data->processed_deps, g_free);
-        g_slice_free (DependencyData, dependency_data);
+        dependency_data_free (dependency_data);
     } else {
         dependency_data->softdependencies = dependency_data->softdependencies->next;
         dependency_handler (dependency_data);
@@ -290,6 +368,8 @@ dependency_rpm(DependencyData *dependency_data)
             if (g_str_has_prefix (package_name, "-") == TRUE) {
                 g_string_append_printf(dependency_data->remove_rpms,
                                        " %s", package_name + 1);
+            } else if (dependency_preinstalled (dependency_data, package_name)) {
+                continue;
             } else {
                 g_string_append_printf(dependency_data->install_rpms,
                                        " %s", package_name);
@@ -332,6 +412,7 @@ dependency_soft_rpm(DependencyData *dependency_data)
                      0,
                      FALSE,
                      dependency_data->cancellable,
+                     dependency_data->timing_data,
                      dependency_data);
         g_free (command);
     } else {
@@ -352,6 +433,11 @@ dependency_single_rpm(DependencyData *dependency_data)
     if (dependency_data->dependencies) {
         gchar *package_name = dependency_data->dependencies->data;
         gchar *command;
+        if (dependency_preinstalled (dependency_data, package_name)) {
+            dependency_data->dependencies = dependency_data->dependencies->next;
+            dependency_handler (dependency_data);
+            return;
+        }
         if (g_str_has_prefix (package_name, "-") == TRUE) {
             command = g_strdup_printf ("rstrnt-package remove %s", &package_name[1]);
         } else {
@@ -370,6 +456,7 @@ dependency_single_rpm(DependencyData *dependency_data)
                      0,
                      FALSE,
                      dependency_data->cancellable,
+                     dependency_data->timing_data,
                      dependency_data);
         g_free (command);
     } else {
@@ -382,66 +469,106 @@ dependency_single_rpm(DependencyData *dependency_data)
 
 }
 
-static void ldep_finish_cb(gpointer user_data, GError *error)
+static void
+repodep_graph_add (RepoDepGraph *graph, GSList *repodeps)
 {
-    MetadataFetchInfo *mtfi = (MetadataFetchInfo*)user_data;
-    DependencyData *dependency_data = mtfi->dependency_data;
+    DependencyData *dependency_data = graph->dependency_data;
+
+    for (GSList *iter = repodeps; iter != NULL; iter = g_slist_next (iter)) {
+        gchar *path = g_build_filename(dependency_data->base_path,
+                                       dependency_data->fetch_url->host,
+                                       dependency_data->fetch_url->path,
+                                       (gchar *) iter->data,
+                                       NULL);
+        if (g_hash_table_contains (graph->seen, path)) {
+            g_free (path);
+            continue;
+        }
+        g_hash_table_add (graph->seen, path);
+        g_queue_push_tail (graph->queue, g_strdup (iter->data));
+    }
+}
+
+/*
+ * graph->dependencies is kept in reverse order until the graph is done.
+ */
+static void
+repodep_graph_add_packages (RepoDepGraph *graph, GSList *dependencies)
+{
+    for (GSList *iter = dependencies; iter != NULL; iter = g_slist_next (iter)) {
+        if (g_slist_find_custom (graph->dependencies, iter->data,
+                                 (GCompareFunc) g_strcmp0) == NULL) {
+            graph->dependencies = g_slist_prepend (graph->dependencies,
+                                                   g_strdup (iter->data));
+        }
+    }
+}
+
+static void
+repodep_graph_finish (RepoDepGraph *graph)
+{
+    DependencyData *dependency_data = graph->dependency_data;
+    GError *error = graph->error;
+
+    g_queue_free_full (graph->queue, g_free);
+    g_hash_table_destroy (graph->seen);
 
     if (error) {
+        g_slist_free_full (graph->dependencies, g_free);
+        g_slice_free (RepoDepGraph, graph);
         if (dependency_data->finish_cb) {
             dependency_data->finish_cb (dependency_data->user_data, error);
         }
-        g_slist_free_full(dependency_data->processed_deps, g_free);
-        g_slice_free (DependencyData, dependency_data);
-    } else {
-        dependency_data->repodeps = g_slist_next(dependency_data->repodeps);
-        restraint_fetch_repodeps(dependency_data);
+        dependency_data_free (dependency_data);
+        return;
     }
 
-    g_free(mtfi->path);
-    restraint_metadata_free(mtfi->tmp_meta);
-    g_slice_free(MetadataFetchInfo, mtfi);
-}
+    // Library packages go ahead of the task's own, like they did when
+    // each library was installed on its own before the task.
+    repodep_graph_add_packages (graph, dependency_data->dependencies);
+    dependency_data->merged_dependencies = g_slist_reverse (graph->dependencies);
+    dependency_data->dependencies = dependency_data->merged_dependencies;
+    g_slice_free (RepoDepGraph, graph);
 
-static gboolean ldep_io_cb(GIOChannel *io, GIOCondition condition,
-                           gpointer user_data)
-{
-    MetadataFetchInfo *mtfi = (MetadataFetchInfo*)user_data;
-    DependencyData *dependency_data = mtfi->dependency_data;
-    return dependency_data->io_callback(io, condition,
-                                        dependency_data->user_data);
+    dependency_data->state = DEPENDENCY_PREINSTALLED;
+    dependency_handler (dependency_data);
 }
 
-static void dep_mtdata_finish_cb(gpointer user_data, GError *error)
+static void
+repodep_done (RepoDepData *rd_data, GError *error)
 {
-    MetadataFetchInfo *mtfi = (MetadataFetchInfo*)user_data;
-    DependencyData *dependency_data = mtfi->dependency_data;
+    RepoDepGraph *graph = rd_data->graph;
 
     if (error) {
-        if (dependency_data->finish_cb) {
-            dependency_data->finish_cb(dependency_data->user_data, error);
+        if (graph->error == NULL) {
+            graph->error = error;
+        } else {
+            g_error_free (error);
         }
-        g_free(mtfi->path);
-        g_slice_free(MetadataFetchInfo, mtfi);
-    } else if (mtfi->tmp_meta != NULL) {
-        DependencyData *newdd = g_slice_dup(DependencyData, dependency_data);
-        newdd->dependencies = mtfi->tmp_meta->dependencies;
-        newdd->repodeps = mtfi->tmp_meta->repodeps;
-        newdd->finish_cb = ldep_finish_cb;
-        newdd->io_callback = ldep_io_cb;
-        newdd->archive_entry_callback = mtfi_archive_entry_callback;
-        newdd->user_data = mtfi;
-        newdd->processed_deps = g_slist_copy_deep(
-                                    dependency_data->processed_deps,
-                                    (GCopyFunc)g_strdup, NULL);
-        restraint_fetch_repodeps(newdd);
-    } else {
-        g_warning("No metadata for dependency '%s'\n", mtfi->path);
-        g_free(mtfi->path);
-        g_slice_free(MetadataFetchInfo, mtfi);
-        dependency_data->repodeps = g_slist_next(dependency_data->repodeps);
-        restraint_fetch_repodeps(dependency_data);
     }
+    graph->in_flight--;
+
+    soup_uri_free (rd_data->url);
+    g_free (rd_data->path);
+    restraint_metadata_free (rd_data->metadata);
+    g_slice_free (RepoDepData, rd_data);
+
+    repodep_graph_pump (graph);
+}
+
+static void
+repodep_metadata_finish_cb (gpointer user_data, GError *error)
+{
+    RepoDepData *rd_data = (RepoDepData *) user_data;
+    RepoDepGraph *graph = rd_data->graph;
+
+    if (error == NULL && rd_data->metadata != NULL) {
+        repodep_graph_add (graph, rd_data->metadata->repodeps);
+        repodep_graph_add_packages (graph, rd_data->metadata->dependencies);
+    } else if (error == NULL) {
+        g_warning("No metadata for dependency '%s'\n", rd_data->path);
+    }
+    repodep_done (rd_data, error);
 }
 
 static void
@@ -449,64 +576,98 @@ fetch_repodeps_finish_callback(GError *error, guint32 match_cnt,
                                guint32 nonmatch_cnt, gpointer user_data)
 {
     RepoDepData *rd_data = (RepoDepData*)user_data;
-    DependencyData *dependency_data = rd_data->dependency_data;
+    RepoDepGraph *graph = rd_data->graph;
+    DependencyData *dependency_data = graph->dependency_data;
 
-    GSList *pdep = g_slist_find_custom(dependency_data->processed_deps, rd_data->path, (GCompareFunc)g_strcmp0);
-    if (error) {
-        if (dependency_data->finish_cb) {
-            dependency_data->finish_cb (dependency_data->user_data, error);
-        }
-        g_slist_free_full(dependency_data->processed_deps, g_free);
-        g_slice_free (DependencyData, dependency_data);
-    } else if (pdep == NULL) {
-        MetadataFetchInfo *mtfi = g_slice_new0(MetadataFetchInfo);
-        dependency_data->processed_deps = g_slist_prepend(
-                                            dependency_data->processed_deps,
-                                            g_strdup(rd_data->path));
-        mtfi->path = g_strdup(rd_data->path);
-        mtfi->dependency_data = dependency_data;
-        restraint_get_metadata(mtfi->path, dependency_data->osmajor,
-                               &mtfi->tmp_meta,
-                               dependency_data->cancellable,
-                               dep_mtdata_finish_cb, mtfi_io_callback, mtfi);
+    if (error || graph->error) {
+        // once one fetch has failed the others are only drained
+        repodep_done (rd_data, error);
     } else {
-        dependency_data->repodeps = g_slist_next(dependency_data->repodeps);
-        restraint_fetch_repodeps(dependency_data);
+        restraint_get_metadata(rd_data->path, dependency_data->osmajor,
+                               &rd_data->metadata,
+                               dependency_data->cancellable,
+                               repodep_metadata_finish_cb,
+                               repo_dep_data_io_callback, dependency_data->timing_data, rd_data);
     }
-    soup_uri_free(rd_data->url);
-    g_free(rd_data->path);
-    g_slice_free(RepoDepData, rd_data);
+}
+
+static RepoDepData *
+repodep_data_new (RepoDepGraph *graph)
+{
+    DependencyData *dependency_data = graph->dependency_data;
+    RepoDepData *rd_data = g_slice_new0(RepoDepData);
+
+    rd_data->graph = graph;
+    rd_data->url = soup_uri_copy(dependency_data->fetch_url);
+    g_free(rd_data->url->fragment);
+    rd_data->url->fragment = g_queue_pop_head (graph->queue);
+    rd_data->path = g_build_filename(dependency_data->base_path,
+                                     rd_data->url->host,
+                                     rd_data->url->path,
+                                     rd_data->url->fragment,
+                                     NULL);
+    graph->in_flight++;
+    return rd_data;
 }
 
 static void
-restraint_fetch_repodeps(DependencyData *dependency_data)
+repodep_graph_pump (RepoDepGraph *graph)
 {
-    if (dependency_data->repodeps != NULL) {
-        RepoDepData *rd_data = g_slice_new0(RepoDepData);
-        rd_data->dependency_data = dependency_data;
-        rd_data->url = soup_uri_copy(dependency_data->fetch_url);
-        g_free(rd_data->url->fragment);
-        rd_data->url->fragment = g_strdup((char *)dependency_data->repodeps->data);
-        rd_data->path = g_build_filename(dependency_data->base_path,
-                                         rd_data->url->host,
-                                         rd_data->url->path,
-                                         rd_data->url->fragment,
-                                         NULL);
-        if (g_strcmp0(rd_data->url->scheme, "git") == 0) {
+    DependencyData *dependency_data = graph->dependency_data;
+
+    // A fetch may complete synchronously from within the loop below,
+    // the outer call picks up whatever it queued.
+    if (graph->pumping) {
+        return;
+    }
+    graph->pumping = TRUE;
+
+    while (graph->error == NULL &&
+           graph->in_flight < REPODEP_MAX_FETCHES &&
+           !g_queue_is_empty (graph->queue)) {
+        if (g_strcmp0(dependency_data->fetch_url->scheme, "git") == 0) {
+            RepoDepData *rd_data = repodep_data_new (graph);
             restraint_fetch_git(rd_data->url, rd_data->path,
                                 dependency_data->keepchanges, repo_dep_data_archive_callback,
                                 fetch_repodeps_finish_callback, rd_data);
         } else {
-            restraint_fetch_uri(rd_data->url, rd_data->path,
-                                 dependency_data->keepchanges, dependency_data->ssl_verify, repo_dep_data_archive_callback,
-                                 fetch_repodeps_finish_callback, rd_data);
+            // Every fragment queued so far comes out of one download
+            GSList *targets = NULL;
+            while (!g_queue_is_empty (graph->queue)) {
+                RepoDepData *rd_data = repodep_data_new (graph);
+                targets = g_slist_prepend (targets,
+                                           restraint_fetch_uri_target_new (rd_data->url->fragment,
+                                                                           rd_data->path,
+                                                                           dependency_data->keepchanges,
+                                                                           repo_dep_data_archive_callback,
+                                                                           fetch_repodeps_finish_callback,
+                                                                           rd_data));
+            }
+            restraint_fetch_uri_targets (dependency_data->fetch_url,
+                                         dependency_data->ssl_verify,
+                                         g_slist_reverse (targets));
         }
-    } else {
-        dependency_data->state = DEPENDENCY_RPM;
-        dependency_handler(dependency_data);
+    }
+    graph->pumping = FALSE;
+
+    if (graph->in_flight == 0 &&
+        (graph->error != NULL || g_queue_is_empty (graph->queue))) {
+        repodep_graph_finish (graph);
     }
 }
 
+static void
+restraint_fetch_repodeps(DependencyData *dependency_data)
+{
+    RepoDepGraph *graph = g_slice_new0 (RepoDepGraph);
+
+    graph->dependency_data = dependency_data;
+    graph->queue = g_queue_new ();
+    graph->seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    repodep_graph_add (graph, dependency_data->repodeps);
+    repodep_graph_pump (graph);
+}
+
 static void
 dependency_handler (gpointer user_data)
 {
@@ -515,6 +676,9 @@ dependency_handler (gpointer user_data)
         case DEPENDENCY_REPO:
             restraint_fetch_repodeps(dependency_data);
             break;
+        case DEPENDENCY_PREINSTALLED:
+            dependency_verify_preinstalled(dependency_data);
+            break;
         case DEPENDENCY_RPM:
             dependency_rpm(dependency_data);
             break;
@@ -528,8 +692,7 @@ dependency_handler (gpointer user_data)
             if (dependency_data->finish_cb) {
                 dependency_data->finish_cb(dependency_data->user_data, NULL);
             }
-            g_slist_free_full(dependency_data->processed_deps, g_free);
-            g_slice_free (DependencyData, dependency_data);
+            dependency_data_free (dependency_data);
             break;
         default:
             break;
@@ -547,6 +710,7 @@ restraint_install_dependencies (Task *task,
     DependencyData *dependency_data;
     dependency_data = g_slice_new0 (DependencyData);
     dependency_data->user_data = user_data;
+    dependency_data->timing_data = task;
     dependency_data->dependencies = task->metadata->dependencies;
     dependency_data->softdependencies = task->metadata->softdependencies;
     dependency_data->repodeps = task->metadata->repodeps;
@@ -560,13 +724,14 @@ restraint_install_dependencies (Task *task,
     dependency_data->cancellable = cancellable;
     dependency_data->osmajor = task->recipe->osmajor;
     dependency_data->ssl_verify = task->ssl_verify;
+    dependency_data->preinstalled = task->recipe->installed_dependencies;
     switch (task->fetch_method) {
         case TASK_FETCH_UNPACK:
             dependency_data->fetch_url = task->fetch.url;
             dependency_data->state = DEPENDENCY_REPO;
             break;
         case TASK_FETCH_INSTALL_PACKAGE:
-            dependency_data->state = DEPENDENCY_RPM;
+            dependency_data->state = DEPENDENCY_PREINSTALLED;
             break;
         default:
             dependency_data->state = DEPENDENCY_DONE;
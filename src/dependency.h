@@ -25,6 +25,7 @@ typedef void (*DependencyCallback)   (gpointer user_data, GError *error);
 
 typedef enum {
     DEPENDENCY_REPO,
+    DEPENDENCY_PREINSTALLED,
     DEPENDENCY_RPM,
     DEPENDENCY_SINGLE_RPM,
     DEPENDENCY_SOFT_RPM,
@@ -35,7 +36,7 @@ typedef struct {
     GSList *dependencies;
     GSList *softdependencies;
     GSList *repodeps;
-    GSList *processed_deps;
+    GSList *merged_dependencies;
     SoupURI *fetch_url;
     gboolean keepchanges;
     const gchar *main_task_name;
@@ -46,11 +47,14 @@ typedef struct {
     DependencyCallback finish_cb;
     GCancellable *cancellable;
     DependencyState state;
+    // what the processes run for the dependencies are timed with
+    gpointer timing_data;
     gpointer user_data;
     char *osmajor;
     GString *install_rpms;
     GString *remove_rpms;
     gboolean ssl_verify;
+    GHashTable *preinstalled;
 } DependencyData;
 
 void restraint_install_dependencies (Task *task, GIOFunc io_callback,
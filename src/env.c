@@ -126,6 +126,9 @@ void build_env(gchar *restraint_url, guint port, Task *task) {
     gchar *recipe_url = g_strdup_printf ("%s/recipes/%s", restraint_url, task->recipe->recipe_id);
     array_add (env, prefix, "RECIPE_URL", recipe_url);
     g_free (recipe_url);
+    gchar *socket_filename = get_socket_filename (port);
+    array_add (env, prefix, "SOCKET", socket_filename);
+    g_free (socket_filename);
     array_add (env, prefix, "OWNER", task->recipe->owner);
     array_add (env, prefix, "JOBID", task->recipe->job_id);
     array_add (env, prefix, "RECIPESETID", task->recipe->recipe_set_id);
@@ -151,7 +154,8 @@ void build_env(gchar *restraint_url, guint port, Task *task) {
     g_list_foreach(task->recipe->params, (GFunc) build_param_var, env);
     // Override with task level params
     g_list_foreach(task->params, (GFunc) build_param_var, env);
-    // Leave four NULL slots for PLUGIN variables.
+    // Leave five NULL slots for PLUGIN variables.
+    g_ptr_array_add(env, NULL);
     g_ptr_array_add(env, NULL);
     g_ptr_array_add(env, NULL);
     g_ptr_array_add(env, NULL);
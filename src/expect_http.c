@@ -86,3 +86,15 @@ void expect_http_finish(ExpectHttpServer *expect_http) {
     g_queue_free(expect_http->expected_requests);
     g_slice_free(ExpectHttpServer, expect_http);
 }
+
+SoupURI *expect_http_listen_local(SoupServer *server) {
+    GError *error = NULL;
+
+    soup_server_listen_local(server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+    g_assert_no_error(error);
+    GSList *uris = soup_server_get_uris(server);
+    g_assert(uris != NULL);
+    SoupURI *uri = soup_uri_copy(uris->data);
+    g_slist_free_full(uris, (GDestroyNotify) soup_uri_free);
+    return uri;
+}
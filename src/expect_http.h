@@ -47,4 +47,11 @@ void expect_http_add_request(ExpectHttpServer *expect_http,
         const ExpectHttpRequest *request);
 void expect_http_finish(ExpectHttpServer *expect_http);
 
+/*
+ * For tests which answer requests from their own handlers on the main loop:
+ * listens on a free local port and returns the server's base URI, to be
+ * freed with soup_uri_free().
+ */
+SoupURI *expect_http_listen_local(SoupServer *server);
+
 #endif
@@ -15,14 +15,22 @@
     along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include "fetch.h"
+#include <glib/gstdio.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <ftw.h>
+#include <errno.h>
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
 
 GQuark restraint_fetch_libarchive_error(void) {
     return g_quark_from_static_string("restraint-fetch-libarchive-error-quark");
@@ -47,3 +55,211 @@ int rmrf(const char *path)
 {
     return nftw(path, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
 }
+
+// Trash queued or being deleted
+static GHashTable *trash_pending;
+G_LOCK_DEFINE_STATIC (trash_pending);
+
+static void
+trash_delete (gpointer data, gpointer user_data)
+{
+    gchar *path = data;
+
+    // Only this thread, whatever else restraintd does comes first
+    setpriority (PRIO_PROCESS, syscall (SYS_gettid), 19);
+#ifdef SYS_ioprio_set
+    syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+             IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+    rmrf (path);
+    g_debug ("Deleted %s", path);
+
+    G_LOCK (trash_pending);
+    g_hash_table_remove (trash_pending, path);
+    G_UNLOCK (trash_pending);
+}
+
+static gpointer
+trash_pool_new (gpointer data)
+{
+    trash_pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    // exclusive, the lowered priorities must not carry over to other pools
+    return g_thread_pool_new (trash_delete, NULL, 1, TRUE, NULL);
+}
+
+static gchar *trash_dir;
+
+/*
+ * Hand trash over to the background thread unless it is already queued
+ * or being deleted, takes ownership of trash.
+ */
+static void
+trash_queue (gchar *trash)
+{
+    static GOnce trash_once = G_ONCE_INIT;
+    GThreadPool *trash_pool = g_once (&trash_once, trash_pool_new, NULL);
+
+    G_LOCK (trash_pending);
+    if (g_hash_table_contains (trash_pending, trash)) {
+        g_free (trash);
+        trash = NULL;
+    } else {
+        g_hash_table_add (trash_pending, trash);
+    }
+    G_UNLOCK (trash_pending);
+    if (trash != NULL) {
+        g_thread_pool_push (trash_pool, trash, NULL);
+    }
+}
+
+/*
+ * Set the directory restraint_rmrf_async() moves things to, NULL for the
+ * default.  Trash left in it by an earlier run is queued for deletion.
+ */
+void
+restraint_rmrf_configure (const gchar *dir)
+{
+    GDir *trash;
+    const gchar *name;
+
+    g_free (trash_dir);
+    trash_dir = g_strdup (dir);
+    if (trash_dir == NULL) {
+        return;
+    }
+
+    trash = g_dir_open (trash_dir, 0, NULL);
+    if (trash == NULL) {
+        return;
+    }
+    while ((name = g_dir_read_name (trash)) != NULL) {
+        if (g_str_has_prefix (name, FETCH_TRASH_PREFIX)) {
+            trash_queue (g_build_filename (trash_dir, name, NULL));
+        }
+    }
+    g_dir_close (trash);
+}
+
+/*
+ * Move a directory out of the way into the trash directory and leave
+ * deleting it to a background thread at idle priority, so that a large
+ * tree does not hold up whoever wants it gone.  Anything else, or a
+ * directory that can't be moved there (another file system), is
+ * removed right away.
+ */
+void
+restraint_rmrf_async (const gchar *path)
+{
+    const gchar *dir = trash_dir != NULL ? trash_dir : FETCH_TRASH_DIR;
+    gchar *trash;
+
+    if (!g_file_test (path, G_FILE_TEST_IS_DIR) ||
+            g_file_test (path, G_FILE_TEST_IS_SYMLINK)) {
+        rmrf (path);
+        return;
+    }
+
+    g_mkdir_with_parents (dir, 0700);
+    trash = g_build_filename (dir, FETCH_TRASH_PREFIX "XXXXXX", NULL);
+    // renaming a directory over an empty one replaces it
+    if (g_mkdtemp (trash) == NULL || g_rename (path, trash) != 0) {
+        if (errno != EXDEV) {
+            g_warning ("Unable to move %s aside, deleting it now", path);
+        }
+        if (g_file_test (trash, G_FILE_TEST_IS_DIR)) {
+            g_rmdir (trash);
+        }
+        g_free (trash);
+        rmrf (path);
+        return;
+    }
+
+    trash_queue (trash);
+}
+
+typedef struct {
+    FetchData *fetch_data;
+    FetchExtractFunc extract_func;
+    GSourceFunc finish_func;
+} FetchExtract;
+
+typedef struct {
+    ArchiveEntryCallback archive_entry_callback;
+    gchar *entry;
+    gpointer user_data;
+} FetchEntryNotify;
+
+static void
+fetch_extract_thread (GTask *task, gpointer source_object,
+                      gpointer task_data, GCancellable *cancellable)
+{
+    FetchExtract *extract = task_data;
+
+    extract->extract_func (extract->fetch_data);
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+fetch_extract_done (GObject *source_object, GAsyncResult *result,
+                    gpointer user_data)
+{
+    FetchExtract *extract = g_task_get_task_data (G_TASK (result));
+
+    extract->finish_func (extract->fetch_data);
+}
+
+static void
+fetch_extract_free (gpointer data)
+{
+    g_slice_free (FetchExtract, data);
+}
+
+/*
+ * Run extract_func in a worker thread so that unpacking an archive does
+ * not hold up the main loop, finish_func is called back in the main
+ * loop once it returns.  Anything extract_func needs to report on the
+ * way goes through restraint_fetch_notify_entry().
+ */
+void
+restraint_fetch_extract (FetchData *fetch_data,
+                         FetchExtractFunc extract_func,
+                         GSourceFunc finish_func)
+{
+    FetchExtract *extract = g_slice_new (FetchExtract);
+    extract->fetch_data = fetch_data;
+    extract->extract_func = extract_func;
+    extract->finish_func = finish_func;
+
+    GTask *task = g_task_new (NULL, NULL, fetch_extract_done, NULL);
+    g_task_set_task_data (task, extract, fetch_extract_free);
+    g_task_run_in_thread (task, fetch_extract_thread);
+    g_object_unref (task);
+}
+
+static gboolean
+fetch_notify_entry_callback (gpointer user_data)
+{
+    FetchEntryNotify *notify = user_data;
+
+    notify->archive_entry_callback (notify->entry, notify->user_data);
+    g_free (notify->entry);
+    g_slice_free (FetchEntryNotify, notify);
+    return FALSE;
+}
+
+/*
+ * Pass an extracted entry from the worker thread to archive_entry_callback
+ * in the main loop, ahead of the finish_func of the extraction.
+ */
+void
+restraint_fetch_notify_entry (ArchiveEntryCallback archive_entry_callback,
+                              const gchar *entry,
+                              gpointer user_data)
+{
+    FetchEntryNotify *notify = g_slice_new (FetchEntryNotify);
+    notify->archive_entry_callback = archive_entry_callback;
+    notify->entry = g_strdup (entry);
+    notify->user_data = user_data;
+    g_idle_add_full (G_PRIORITY_DEFAULT, fetch_notify_entry_callback,
+                     notify, NULL);
+}
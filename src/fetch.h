@@ -63,9 +63,25 @@ typedef enum {
     RESTRAINT_FETCH_GIT_PROTOCOL_ERROR,
     RESTRAINT_FETCH_GIT_NAK_ERROR,
     RESTRAINT_FETCH_GIT_REMOTE_ERROR,
+    RESTRAINT_FETCH_GIT_REF_ERROR,
 } RestraintFetchError;
 
 #define RESTRAINT_FETCH_LIBARCHIVE_ERROR restraint_fetch_libarchive_error()
 GQuark restraint_fetch_libarchive_error(void);
 
+// Where restraint_rmrf_async() leaves things until deleted
+#define FETCH_TRASH_DIR "/var/lib/restraint/trash"
+#define FETCH_TRASH_PREFIX ".restraint-trash-"
+
 int rmrf(const char *path);
+void restraint_rmrf_configure (const gchar *dir);
+void restraint_rmrf_async (const gchar *path);
+
+typedef void (*FetchExtractFunc) (FetchData *fetch_data);
+
+void restraint_fetch_extract (FetchData *fetch_data,
+                              FetchExtractFunc extract_func,
+                              GSourceFunc finish_func);
+void restraint_fetch_notify_entry (ArchiveEntryCallback archive_entry_callback,
+                                   const gchar *entry,
+                                   gpointer user_data);
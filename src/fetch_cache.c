@@ -0,0 +1,467 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "fetch_cache.h"
+
+#define FETCH_CACHE_GROUP "cache"
+
+static gchar *cache_dir = NULL;
+static guint64 cache_max_size = 0;
+
+// git archives are committed from the extraction thread
+G_LOCK_DEFINE_STATIC (fetch_cache);
+
+typedef struct {
+    gchar *path;
+    goffset size;
+    time_t mtime;
+} FetchCacheBlob;
+
+GQuark restraint_fetch_cache_error (void) {
+    return g_quark_from_static_string ("restraint-fetch-cache-error-quark");
+}
+
+/*
+ * A max_size of 0 turns the cache off.  Until this is called the cache
+ * is off too, so only restraintd, which turns it on by default, and
+ * whoever else asks for it use it.
+ */
+void
+restraint_fetch_cache_configure (const gchar *dir, guint64 max_size)
+{
+    g_free (cache_dir);
+    cache_dir = NULL;
+    cache_max_size = max_size;
+    if (dir != NULL && max_size > 0) {
+        cache_dir = g_strdup (dir);
+    }
+}
+
+static gchar *
+fetch_cache_blob_path (const gchar *checksum)
+{
+    return g_build_filename (cache_dir, "blobs", checksum, NULL);
+}
+
+static gchar *
+fetch_cache_index_path (const gchar *key)
+{
+    return g_build_filename (cache_dir, "index", key, NULL);
+}
+
+FetchCacheEntry *
+restraint_fetch_cache_lookup (SoupURI *url)
+{
+    FetchCacheEntry *entry;
+    GKeyFile *keyfile;
+    gchar *index_path;
+
+    if (cache_dir == NULL || url == NULL ||
+        (g_strcmp0 (url->scheme, "http") != 0 &&
+         g_strcmp0 (url->scheme, "https") != 0 &&
+         g_strcmp0 (url->scheme, "git") != 0)) {
+        return NULL;
+    }
+
+    // The fragment only selects what to extract, the archive is the same,
+    // except for git where only the fragment is archived.
+    SoupURI *archive_url = soup_uri_copy (url);
+    if (g_strcmp0 (url->scheme, "git") != 0) {
+        soup_uri_set_fragment (archive_url, NULL);
+    }
+
+    entry = g_slice_new0 (FetchCacheEntry);
+    entry->url = soup_uri_to_string (archive_url, FALSE);
+    entry->key = g_compute_checksum_for_string (G_CHECKSUM_SHA256,
+                                                entry->url, -1);
+    soup_uri_free (archive_url);
+
+    index_path = fetch_cache_index_path (entry->key);
+    keyfile = g_key_file_new ();
+    if (g_key_file_load_from_file (keyfile, index_path, G_KEY_FILE_NONE, NULL)) {
+        gchar *indexed_url = g_key_file_get_string (keyfile, FETCH_CACHE_GROUP,
+                                                    "url", NULL);
+        if (g_strcmp0 (indexed_url, entry->url) == 0) {
+            entry->etag = g_key_file_get_string (keyfile, FETCH_CACHE_GROUP,
+                                                 "etag", NULL);
+            entry->last_modified = g_key_file_get_string (keyfile,
+                                                          FETCH_CACHE_GROUP,
+                                                          "last_modified",
+                                                          NULL);
+            entry->checksum = g_key_file_get_string (keyfile, FETCH_CACHE_GROUP,
+                                                     "checksum", NULL);
+        }
+        g_free (indexed_url);
+    }
+    g_key_file_free (keyfile);
+    g_free (index_path);
+
+    return entry;
+}
+
+/*
+ * Whether a conditional GET can be made, the blob may have been
+ * evicted since the index entry was written.  The blob is opened here
+ * and kept open for restraint_fetch_cache_read(), so a commit evicting
+ * it while the request is made doesn't take it away from under a 304.
+ */
+gboolean
+restraint_fetch_cache_valid (FetchCacheEntry *entry)
+{
+    if (entry == NULL || entry->checksum == NULL ||
+        (entry->etag == NULL && entry->last_modified == NULL)) {
+        return FALSE;
+    }
+    if (entry->blob != NULL) {
+        return TRUE;
+    }
+
+    gchar *blob_path = fetch_cache_blob_path (entry->checksum);
+    GFile *file = g_file_new_for_path (blob_path);
+
+    G_LOCK (fetch_cache);
+    entry->blob = (GInputStream *) g_file_read (file, NULL, NULL);
+    if (entry->blob != NULL) {
+        // Most recently used from now on
+        utime (blob_path, NULL);
+    }
+    G_UNLOCK (fetch_cache);
+
+    g_object_unref (file);
+    g_free (blob_path);
+    return entry->blob != NULL;
+}
+
+/*
+ * Fed every raw response header line.  A status line starts a new
+ * response (after a redirect), so the validators seen so far are
+ * dropped.
+ */
+void
+restraint_fetch_cache_header (FetchCacheEntry *entry, const gchar *header,
+                              gsize len)
+{
+    gchar *line;
+    gchar *value;
+
+    if (entry == NULL) {
+        return;
+    }
+
+    line = g_strstrip (g_strndup (header, len));
+    if (g_str_has_prefix (line, "HTTP/")) {
+        g_clear_pointer (&entry->etag, g_free);
+        g_clear_pointer (&entry->last_modified, g_free);
+    } else if ((value = strchr (line, ':')) != NULL) {
+        *value++ = '\0';
+        value = g_strstrip (value);
+        if (g_ascii_strcasecmp (line, "ETag") == 0) {
+            g_free (entry->etag);
+            entry->etag = g_strdup (value);
+        } else if (g_ascii_strcasecmp (line, "Last-Modified") == 0) {
+            g_free (entry->last_modified);
+            entry->last_modified = g_strdup (value);
+        }
+    }
+    g_free (line);
+}
+
+static void
+fetch_cache_abort (FetchCacheEntry *entry)
+{
+    if (entry->tmp_file != NULL) {
+        fclose (entry->tmp_file);
+        entry->tmp_file = NULL;
+    }
+    if (entry->tmp_path != NULL) {
+        g_unlink (entry->tmp_path);
+        g_clear_pointer (&entry->tmp_path, g_free);
+    }
+    if (entry->tmp_checksum != NULL) {
+        g_checksum_free (entry->tmp_checksum);
+        entry->tmp_checksum = NULL;
+    }
+}
+
+/*
+ * Body data of a 200 response, spooled to a temporary file next to the
+ * blobs so that commit is a rename.  Any failure just leaves the
+ * archive out of the cache.
+ */
+void
+restraint_fetch_cache_write (FetchCacheEntry *entry, const gchar *data,
+                             gsize len)
+{
+    if (entry == NULL || entry->write_failed) {
+        return;
+    }
+
+    if (entry->tmp_file == NULL) {
+        gchar *blobs_dir = g_build_filename (cache_dir, "blobs", NULL);
+        gint fd = -1;
+
+        if (g_mkdir_with_parents (blobs_dir, 0755) == 0) {
+            entry->tmp_path = g_build_filename (blobs_dir, ".tmp-XXXXXX", NULL);
+            fd = g_mkstemp (entry->tmp_path);
+        }
+        g_free (blobs_dir);
+        if (fd == -1 || (entry->tmp_file = fdopen (fd, "w")) == NULL) {
+            g_warning ("Unable to cache %s: %s", entry->url, g_strerror (errno));
+            if (fd != -1) {
+                close (fd);
+            }
+            fetch_cache_abort (entry);
+            entry->write_failed = TRUE;
+            return;
+        }
+        entry->tmp_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    }
+
+    if (fwrite (data, 1, len, entry->tmp_file) != len) {
+        g_warning ("Unable to cache %s: %s", entry->url, g_strerror (errno));
+        fetch_cache_abort (entry);
+        entry->write_failed = TRUE;
+        return;
+    }
+    g_checksum_update (entry->tmp_checksum, (const guchar *) data, len);
+}
+
+static gint
+fetch_cache_blob_cmp (gconstpointer a, gconstpointer b)
+{
+    const FetchCacheBlob *blob_a = a;
+    const FetchCacheBlob *blob_b = b;
+
+    return (blob_a->mtime > blob_b->mtime) - (blob_a->mtime < blob_b->mtime);
+}
+
+static void
+fetch_cache_blob_free (gpointer data)
+{
+    FetchCacheBlob *blob = data;
+    g_free (blob->path);
+    g_slice_free (FetchCacheBlob, blob);
+}
+
+/*
+ * Least recently used blobs go first, a cache hit bumps the blob's
+ * mtime.
+ */
+static void
+fetch_cache_evict (void)
+{
+    gchar *blobs_dir = g_build_filename (cache_dir, "blobs", NULL);
+    GDir *dir = g_dir_open (blobs_dir, 0, NULL);
+    GSList *blobs = NULL;
+    guint64 total = 0;
+    const gchar *name;
+
+    if (dir == NULL) {
+        g_free (blobs_dir);
+        return;
+    }
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        struct stat st;
+        gchar *path;
+
+        if (name[0] == '.') {
+            continue;
+        }
+        path = g_build_filename (blobs_dir, name, NULL);
+        if (g_stat (path, &st) != 0) {
+            g_free (path);
+            continue;
+        }
+        FetchCacheBlob *blob = g_slice_new (FetchCacheBlob);
+        blob->path = path;
+        blob->size = st.st_size;
+        blob->mtime = st.st_mtime;
+        blobs = g_slist_prepend (blobs, blob);
+        total += st.st_size;
+    }
+    g_dir_close (dir);
+    g_free (blobs_dir);
+
+    blobs = g_slist_sort (blobs, fetch_cache_blob_cmp);
+    for (GSList *iter = blobs; iter != NULL && total > cache_max_size;
+         iter = g_slist_next (iter)) {
+        FetchCacheBlob *blob = iter->data;
+        if (g_unlink (blob->path) == 0) {
+            total -= blob->size;
+        }
+    }
+    g_slist_free_full (blobs, fetch_cache_blob_free);
+}
+
+static gboolean
+fetch_cache_commit (FetchCacheEntry *entry, GError **error)
+{
+    if (entry == NULL || entry->tmp_file == NULL) {
+        return TRUE;
+    }
+    // Without a validator the archive could never be revalidated
+    if (entry->etag == NULL && entry->last_modified == NULL) {
+        fetch_cache_abort (entry);
+        return TRUE;
+    }
+
+    gchar *checksum = g_strdup (g_checksum_get_string (entry->tmp_checksum));
+    gchar *blob_path = fetch_cache_blob_path (checksum);
+    gchar *index_dir = g_build_filename (cache_dir, "index", NULL);
+    gchar *index_path = fetch_cache_index_path (entry->key);
+    GKeyFile *keyfile = NULL;
+    gchar *s_data = NULL;
+    gsize length;
+    gboolean ret = FALSE;
+
+    if (fclose (entry->tmp_file) != 0) {
+        entry->tmp_file = NULL;
+        g_set_error (error, RESTRAINT_FETCH_CACHE_ERROR,
+                     RESTRAINT_FETCH_CACHE_WRITE_ERROR,
+                     "Failed to write %s: %s", entry->tmp_path,
+                     g_strerror (errno));
+        goto out;
+    }
+    entry->tmp_file = NULL;
+
+    // Identical content fetched from another URL is already there
+    if (g_file_test (blob_path, G_FILE_TEST_IS_REGULAR)) {
+        g_unlink (entry->tmp_path);
+        utime (blob_path, NULL);
+    } else if (g_rename (entry->tmp_path, blob_path) != 0) {
+        g_set_error (error, RESTRAINT_FETCH_CACHE_ERROR,
+                     RESTRAINT_FETCH_CACHE_WRITE_ERROR,
+                     "Failed to rename %s to %s: %s", entry->tmp_path,
+                     blob_path, g_strerror (errno));
+        goto out;
+    }
+    g_clear_pointer (&entry->tmp_path, g_free);
+
+    g_free (entry->checksum);
+    entry->checksum = g_strdup (checksum);
+    g_clear_object (&entry->blob);
+
+    keyfile = g_key_file_new ();
+    g_key_file_set_string (keyfile, FETCH_CACHE_GROUP, "url", entry->url);
+    g_key_file_set_string (keyfile, FETCH_CACHE_GROUP, "checksum", checksum);
+    if (entry->etag != NULL) {
+        g_key_file_set_string (keyfile, FETCH_CACHE_GROUP, "etag", entry->etag);
+    }
+    if (entry->last_modified != NULL) {
+        g_key_file_set_string (keyfile, FETCH_CACHE_GROUP, "last_modified",
+                               entry->last_modified);
+    }
+    s_data = g_key_file_to_data (keyfile, &length, NULL);
+    if (g_mkdir_with_parents (index_dir, 0755) != 0) {
+        g_set_error (error, RESTRAINT_FETCH_CACHE_ERROR,
+                     RESTRAINT_FETCH_CACHE_WRITE_ERROR,
+                     "Failed to create %s: %s", index_dir, g_strerror (errno));
+        goto out;
+    }
+    if (!g_file_set_contents (index_path, s_data, length, error)) {
+        goto out;
+    }
+
+    fetch_cache_evict ();
+    ret = TRUE;
+
+out:
+    if (!ret) {
+        fetch_cache_abort (entry);
+    }
+    if (keyfile != NULL) {
+        g_key_file_free (keyfile);
+    }
+    g_free (s_data);
+    g_free (index_path);
+    g_free (index_dir);
+    g_free (blob_path);
+    g_free (checksum);
+    return ret;
+}
+
+gboolean
+restraint_fetch_cache_commit (FetchCacheEntry *entry, GError **error)
+{
+    g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+    gboolean ret;
+
+    G_LOCK (fetch_cache);
+    ret = fetch_cache_commit (entry, error);
+    G_UNLOCK (fetch_cache);
+    return ret;
+}
+
+GInputStream *
+restraint_fetch_cache_read (FetchCacheEntry *entry, GError **error)
+{
+    g_return_val_if_fail (entry != NULL, NULL);
+    g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+    GInputStream *blob = entry->blob;
+
+    if (blob != NULL) {
+        entry->blob = NULL;
+        return blob;
+    }
+
+    GError *tmp_error = NULL;
+    gchar *blob_path = fetch_cache_blob_path (entry->checksum);
+    GFile *file = g_file_new_for_path (blob_path);
+    GFileInputStream *istream = g_file_read (file, NULL, &tmp_error);
+
+    if (istream == NULL) {
+        g_propagate_prefixed_error (error, tmp_error,
+                                    "Failed to read cached %s: ", entry->url);
+    } else {
+        utime (blob_path, NULL);
+    }
+    g_object_unref (file);
+    g_free (blob_path);
+    return G_INPUT_STREAM (istream);
+}
+
+void
+restraint_fetch_cache_entry_free (FetchCacheEntry *entry)
+{
+    if (entry == NULL) {
+        return;
+    }
+    fetch_cache_abort (entry);
+    g_clear_object (&entry->blob);
+    g_free (entry->key);
+    g_free (entry->url);
+    g_free (entry->etag);
+    g_free (entry->last_modified);
+    g_free (entry->checksum);
+    g_slice_free (FetchCacheEntry, entry);
+}
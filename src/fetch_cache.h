@@ -0,0 +1,69 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RESTRAINT_FETCH_CACHE_H
+#define _RESTRAINT_FETCH_CACHE_H
+
+#include <stdio.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#define FETCH_CACHE_DIR "/var/lib/restraint/fetch-cache"
+#define FETCH_CACHE_DEFAULT_SIZE 1024 // MiB
+
+#define RESTRAINT_FETCH_CACHE_ERROR restraint_fetch_cache_error ()
+GQuark restraint_fetch_cache_error (void);
+
+typedef enum {
+    RESTRAINT_FETCH_CACHE_WRITE_ERROR,
+} RestraintFetchCacheError;
+
+/*
+ * Archives are stored once per content checksum under blobs/, the
+ * index/ entry for a URL records which blob it last returned together
+ * with the validators needed for a conditional GET.  For git the etag
+ * is the commit the ref resolved to.
+ */
+typedef struct {
+    gchar *key;
+    gchar *url;
+    gchar *etag;
+    gchar *last_modified;
+    gchar *checksum;
+    /* The blob, opened by restraint_fetch_cache_valid() so eviction can't
+       remove it before it is read */
+    GInputStream *blob;
+    gchar *tmp_path;
+    FILE *tmp_file;
+    GChecksum *tmp_checksum;
+    gboolean write_failed;
+} FetchCacheEntry;
+
+void restraint_fetch_cache_configure (const gchar *cache_dir, guint64 max_size);
+FetchCacheEntry *restraint_fetch_cache_lookup (SoupURI *url);
+gboolean restraint_fetch_cache_valid (FetchCacheEntry *entry);
+void restraint_fetch_cache_header (FetchCacheEntry *entry, const gchar *header,
+                                   gsize len);
+void restraint_fetch_cache_write (FetchCacheEntry *entry, const gchar *data,
+                                  gsize len);
+gboolean restraint_fetch_cache_commit (FetchCacheEntry *entry, GError **error);
+GInputStream *restraint_fetch_cache_read (FetchCacheEntry *entry,
+                                          GError **error);
+void restraint_fetch_cache_entry_free (FetchCacheEntry *entry);
+
+#endif
@@ -29,6 +29,14 @@
 
 #include "fetch.h"
 #include "fetch_git.h"
+#include "fetch_cache.h"
+#include "fetch_manifest.h"
+
+typedef struct {
+    FetchCacheEntry *cache;
+    FetchManifest *manifest;
+    gboolean eof;
+} GitData;
 
 static gint
 packet_length(const gchar *linelen)
@@ -160,6 +168,7 @@ static ssize_t
 myread(struct archive *a, void *client_data, const void **abuf)
 {
     FetchData *fetch_data = client_data;
+    GitData *git_data = fetch_data->private_data;
     gint band;
     gsize len = 0;
     *abuf = fetch_data->buf + 1;
@@ -171,8 +180,10 @@ myread(struct archive *a, void *client_data, const void **abuf)
         archive_set_error(fetch_data->a, error->code, "%s", error->message);
         return -1;
     }
-    if (len == 0)
+    if (len == 0) {
+        git_data->eof = TRUE;
         return 0;
+    }
     band = fetch_data->buf[0] & 0xff;
     len--;
     if (band == 2) {
@@ -182,9 +193,149 @@ myread(struct archive *a, void *client_data, const void **abuf)
         archive_set_error(fetch_data->a, 1, "Received data over unrecognized side-band %d", band);
         return -1;
     }
+    restraint_fetch_cache_write(git_data->cache, fetch_data->buf + 1, len);
+    return len;
+}
+
+static ssize_t
+cache_read(struct archive *a, void *client_data, const void **abuf)
+{
+    FetchData *fetch_data = client_data;
+    GError *error = NULL;
+    gssize len;
+
+    *abuf = fetch_data->buf;
+    len = g_input_stream_read(fetch_data->istream, fetch_data->buf,
+                              sizeof(fetch_data->buf), NULL, &error);
+    if (error != NULL) {
+        archive_set_error(fetch_data->a, error->code, "%s", error->message);
+        g_error_free(error);
+        return -1;
+    }
     return len;
 }
 
+static int
+cache_close(struct archive *a, void *client_data)
+{
+    FetchData *fetch_data = client_data;
+    GError *error = NULL;
+
+    g_input_stream_close(fetch_data->istream, NULL, &error);
+    g_clear_object(&fetch_data->istream);
+    if (error != NULL) {
+        archive_set_error(fetch_data->a, error->code, "%s", error->message);
+        g_error_free(error);
+        return ARCHIVE_FATAL;
+    }
+    return ARCHIVE_OK;
+}
+
+/*
+ * Resolve the ref being fetched to a commit from the ref advertisement
+ * of git-upload-pack, a commit id is taken as is.
+ */
+static gchar *
+git_resolve_ref(FetchData *fetch_data, GError **error)
+{
+    g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+    const gchar *ref = fetch_data->url->query == NULL ? GIT_BRANCH :
+                                                        fetch_data->url->query;
+    GSocketConnection *connection = NULL;
+    GSocketClient *client = NULL;
+    GError *tmp_error = NULL;
+    gchar *commit = NULL;
+    gchar *head = NULL;
+    gchar *tag = NULL;
+    gint path_offset = 0;
+    gsize len;
+    gint n;
+
+    for (n = 0; g_ascii_isxdigit(ref[n]); n++);
+    if (n == 40 && ref[n] == '\0') {
+        return g_ascii_strdown(ref, -1);
+    }
+
+    client = g_socket_client_new();
+    guint port = fetch_data->url->port != 0 ? fetch_data->url->port : GIT_PORT;
+    connection = g_socket_client_connect_to_host(client,
+                                                 fetch_data->url->host,
+                                                 port,
+                                                 NULL,
+                                                 &tmp_error);
+    if (tmp_error != NULL) {
+        g_propagate_prefixed_error(error, tmp_error,
+                "While connecting to %s:%u: ", fetch_data->url->host, port);
+        goto out;
+    }
+
+    GInputStream *istream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    GOutputStream *ostream = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+    // path can't start with /~
+    if (g_str_has_prefix (fetch_data->url->path + 1, "~"))
+        path_offset = 1;
+
+    gboolean write_succeeded = packet_write(ostream, &tmp_error,
+                 "git-upload-pack %s\0host=%s\0",
+                 fetch_data->url->path + path_offset, fetch_data->url->host);
+    if (!write_succeeded) {
+        g_propagate_prefixed_error(error, tmp_error,
+                "While writing to %s: ", fetch_data->url->host);
+        goto out;
+    }
+
+    // <commit> <refname>\0<capabilities> for the first ref, then
+    // <commit> <refname> up to a flush
+    head = g_strdup_printf("refs/heads/%s", ref);
+    tag = g_strdup_printf("refs/tags/%s", ref);
+    while (TRUE) {
+        gboolean read_succeeded = packet_read_line(istream, fetch_data->buf,
+                sizeof(fetch_data->buf), &len, &tmp_error);
+        if (!read_succeeded) {
+            g_propagate_error(error, tmp_error);
+            g_clear_pointer(&commit, g_free);
+            goto out;
+        }
+        if (!len)
+            break;
+        if (len < 42 || fetch_data->buf[40] != ' ') {
+            g_set_error(error, RESTRAINT_FETCH_ERROR,
+                    RESTRAINT_FETCH_GIT_PROTOCOL_ERROR,
+                    "protocol error: bad ref advertisement");
+            g_clear_pointer(&commit, g_free);
+            goto out;
+        }
+        gchar *name = fetch_data->buf + 41;
+        fetch_data->buf[40] = '\0';
+        name[strcspn(name, "\n")] = '\0';
+        if (commit == NULL && (strcmp(name, ref) == 0 ||
+                               strcmp(name, head) == 0 ||
+                               strcmp(name, tag) == 0)) {
+            commit = g_strdup(fetch_data->buf);
+        }
+    }
+    // Nothing wanted, which ends the conversation
+    packet_write(ostream, NULL, "");
+
+    if (commit == NULL) {
+        g_set_error(error, RESTRAINT_FETCH_ERROR,
+                RESTRAINT_FETCH_GIT_REF_ERROR,
+                "Remote git daemon has no ref %s", ref);
+    }
+
+out:
+    if (connection != NULL) {
+        g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+        g_object_unref(connection);
+    }
+    g_object_unref(client);
+    g_free(head);
+    g_free(tag);
+    return commit;
+}
+
 static gboolean
 myopen(FetchData *fetch_data, GError **error)
 {
@@ -328,6 +479,7 @@ archive_finish_callback (gpointer user_data)
         g_warning("%s: fetch_data is NULL", __func__);
         return FALSE;
     }
+    GitData *git_data = fetch_data->private_data;
 
     if (fetch_data->ext != NULL) {
         free_result = archive_write_free(fetch_data->ext);
@@ -339,6 +491,8 @@ archive_finish_callback (gpointer user_data)
         if (free_result != ARCHIVE_OK)
             g_warning("Failed to free archive_read");
     }
+    restraint_fetch_cache_entry_free(git_data->cache);
+    g_slice_free(GitData, git_data);
 
     if (fetch_data->finish_callback) {
         fetch_data->finish_callback (fetch_data->error,
@@ -353,31 +507,34 @@ archive_finish_callback (gpointer user_data)
     return FALSE;
 }
 
+/*
+ * Runs in the extraction thread, returns FALSE once there is nothing
+ * more to extract.
+ */
 static gboolean
-git_archive_read_callback (gpointer user_data)
+git_archive_read_entry (FetchData *fetch_data)
 {
-    FetchData *fetch_data = (FetchData *) user_data;
-
+    GitData *git_data = fetch_data->private_data;
+    FetchManifestAction action;
     gint r;
     struct archive_entry *entry;
     gchar *newPath = NULL;
 
     r = archive_read_next_header(fetch_data->a, &entry);
     if (r == ARCHIVE_EOF) {
-        g_idle_add (archive_finish_callback, fetch_data);
         return FALSE;
     }
 
     if (r != ARCHIVE_OK) {
         g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, r,
                 "archive_read_next_header failed: %s", archive_error_string(fetch_data->a));
-        g_idle_add (archive_finish_callback, fetch_data);
         return FALSE;
     }
 
     if (fetch_data->archive_entry_callback) {
-        fetch_data->archive_entry_callback (archive_entry_pathname (entry),
-                                            fetch_data->user_data);
+        restraint_fetch_notify_entry (fetch_data->archive_entry_callback,
+                                      archive_entry_pathname (entry),
+                                      fetch_data->user_data);
     }
 
     // Update pathname
@@ -385,22 +542,135 @@ git_archive_read_callback (gpointer user_data)
     archive_entry_set_pathname( entry, newPath );
     g_free(newPath);
 
-    if (fetch_data->keepchanges == FALSE ||
-            access(archive_entry_pathname(entry), F_OK) == -1) {
-        r = archive_read_extract2(fetch_data->a, entry, fetch_data->ext);
+    action = restraint_fetch_manifest_action(git_data->manifest,
+                                             archive_entry_pathname(entry),
+                                             entry);
+    if (action == FETCH_MANIFEST_EXTRACT) {
+        gchar *checksum = NULL;
+        r = restraint_fetch_extract_entry(fetch_data->a, fetch_data->ext,
+                                          entry, &checksum);
         if (r != ARCHIVE_OK) {
             g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, r,
                     "archive_read_extract2 failed: %s", archive_error_string(fetch_data->ext));
-            g_idle_add (archive_finish_callback, fetch_data);
             return FALSE;
         }
-
+        restraint_fetch_manifest_add(git_data->manifest,
+                                     archive_entry_pathname(entry),
+                                     entry, checksum);
+        g_free(checksum);
+    }
+    if (action != FETCH_MANIFEST_KEEP) {
         fetch_data->match_cnt++;
     }
 
     return TRUE;
 }
 
+/*
+ * When the fetch cache is on, the archive of a fragment is reused for as
+ * long as the ref still resolves to the commit it was archived from.  If
+ * the ref can't be resolved it is fetched without the cache.
+ */
+static void
+git_cache_lookup (FetchData *fetch_data)
+{
+    GitData *git_data = fetch_data->private_data;
+    GError *tmp_error = NULL;
+    gchar *commit;
+
+    git_data->cache = restraint_fetch_cache_lookup(fetch_data->url);
+    if (git_data->cache == NULL) {
+        return;
+    }
+
+    commit = git_resolve_ref(fetch_data, &tmp_error);
+    if (commit == NULL) {
+        g_warning("Not caching %s: %s", git_data->cache->url, tmp_error->message);
+        g_clear_error(&tmp_error);
+        g_clear_pointer(&git_data->cache, restraint_fetch_cache_entry_free);
+        return;
+    }
+
+    if (restraint_fetch_cache_valid(git_data->cache) &&
+            g_strcmp0(git_data->cache->etag, commit) == 0) {
+        fetch_data->istream = restraint_fetch_cache_read(git_data->cache,
+                                                         &tmp_error);
+        if (fetch_data->istream != NULL) {
+            g_free(commit);
+            return;
+        }
+        g_warning("%s", tmp_error->message);
+        g_clear_error(&tmp_error);
+    }
+
+    g_free(git_data->cache->etag);
+    git_data->cache->etag = commit;
+    g_clear_pointer(&git_data->cache->last_modified, g_free);
+}
+
+static void
+git_archive_fetch (FetchData *fetch_data)
+{
+    GitData *git_data = fetch_data->private_data;
+    GError *tmp_error = NULL;
+    gint r;
+
+    git_cache_lookup(fetch_data);
+
+    if (fetch_data->istream != NULL) {
+        r = archive_read_open(fetch_data->a, fetch_data, NULL, cache_read, cache_close);
+    } else {
+        gboolean open_succeeded = myopen(fetch_data, &tmp_error);
+        if (!open_succeeded) {
+            g_propagate_error(&fetch_data->error, tmp_error);
+            return;
+        }
+        r = archive_read_open(fetch_data->a, fetch_data, NULL, myread, myclose);
+    }
+    if (r != ARCHIVE_OK) {
+        g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, r,
+                "archive_read_open failed: %s", archive_error_string(fetch_data->a));
+        return;
+    }
+    while (git_archive_read_entry(fetch_data));
+
+    if (fetch_data->error != NULL || git_data->cache == NULL ||
+            fetch_data->connection == NULL) {
+        return;
+    }
+    // libarchive can stop short of the end of the archive
+    const void *buf;
+    ssize_t len = 0;
+    while (!git_data->eof && (len = myread(fetch_data->a, fetch_data, &buf)) > 0);
+    if (len < 0 || !restraint_fetch_cache_commit(git_data->cache, &tmp_error)) {
+        g_warning("Unable to cache %s: %s", git_data->cache->url,
+                  tmp_error ? tmp_error->message : archive_error_string(fetch_data->a));
+        g_clear_error(&tmp_error);
+    }
+}
+
+/*
+ * Talking to the git daemon blocks as well, so the whole fetch runs in
+ * the extraction thread.
+ */
+static void
+git_archive_extract (FetchData *fetch_data)
+{
+    GitData *git_data = fetch_data->private_data;
+    GError *tmp_error = NULL;
+
+    git_data->manifest = restraint_fetch_manifest_open(fetch_data->base_path,
+                                                       fetch_data->keepchanges);
+    git_archive_fetch(fetch_data);
+    if (!restraint_fetch_manifest_close(git_data->manifest,
+                                        fetch_data->error == NULL,
+                                        &tmp_error)) {
+        g_warning("%s", tmp_error->message);
+        g_clear_error(&tmp_error);
+    }
+    git_data->manifest = NULL;
+}
+
 void
 restraint_fetch_git (SoupURI *url,
                      const gchar *base_path,
@@ -413,6 +683,7 @@ restraint_fetch_git (SoupURI *url,
     g_return_if_fail(base_path != NULL);
 
     FetchData *fetch_data = g_slice_new0(FetchData);
+    fetch_data->private_data = g_slice_new0(GitData);
     fetch_data->archive_entry_callback = archive_entry_callback;
     fetch_data->finish_callback = finish_callback;
     fetch_data->user_data = user_data;
@@ -420,13 +691,6 @@ restraint_fetch_git (SoupURI *url,
     fetch_data->base_path = base_path;
     fetch_data->keepchanges = keepchanges;
 
-    GError *tmp_error = NULL;
-    gint r;
-
-    if (keepchanges == FALSE) {
-        rmrf(base_path);
-    }
-
     if (fetch_data->archive_entry_callback) {
         gchar *url_string = soup_uri_to_string(url, FALSE);
         gchar *entry = g_strdup_printf ("%s%s", url_string, base_path);
@@ -453,18 +717,6 @@ restraint_fetch_git (SoupURI *url,
     }
     archive_read_support_filter_all(fetch_data->a);
     archive_read_support_format_all(fetch_data->a);
-    gboolean open_succeeded = myopen(fetch_data, &tmp_error);
-    if (!open_succeeded) {
-        g_propagate_error(&fetch_data->error, tmp_error);
-        g_idle_add (archive_finish_callback, fetch_data);
-        return;
-    }
-    r = archive_read_open(fetch_data->a, fetch_data, NULL, myread, myclose);
-    if (r != ARCHIVE_OK) {
-        g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, r,
-                "archive_read_open failed: %s", archive_error_string(fetch_data->a));
-        g_idle_add (archive_finish_callback, fetch_data);
-        return;
-    }
-    g_idle_add (git_archive_read_callback, fetch_data);
+    restraint_fetch_extract(fetch_data, git_archive_extract,
+                            archive_finish_callback);
 }
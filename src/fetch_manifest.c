@@ -0,0 +1,408 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fetch.h"
+#include "fetch_manifest.h"
+
+typedef struct {
+    // "-" for anything but a regular file
+    gchar *checksum;
+    gint64 size;
+    gint64 mtime;
+    gint64 disk_mtime;
+} FetchManifestRecord;
+
+static void
+fetch_manifest_record_free (gpointer data)
+{
+    FetchManifestRecord *record = data;
+    g_free (record->checksum);
+    g_slice_free (FetchManifestRecord, record);
+}
+
+static FetchManifestRecord *
+fetch_manifest_record_copy (FetchManifestRecord *record)
+{
+    FetchManifestRecord *copy = g_slice_dup (FetchManifestRecord, record);
+    copy->checksum = g_strdup (record->checksum);
+    return copy;
+}
+
+/*
+ * path relative to the task directory, with "." components dropped so
+ * that "./subdir/" and "subdir" are the same entry.
+ */
+static gchar *
+fetch_manifest_relative (FetchManifest *manifest, const gchar *path)
+{
+    gsize len = strlen (manifest->base_path);
+    GString *relative;
+    gchar **parts;
+
+    if (strncmp (path, manifest->base_path, len) != 0 ||
+        (path[len] != '/' && path[len] != '\0')) {
+        return NULL;
+    }
+
+    relative = g_string_new (NULL);
+    parts = g_strsplit (path + len, "/", -1);
+    for (gchar **part = parts; *part != NULL; part++) {
+        if (**part == '\0' || strcmp (*part, ".") == 0) {
+            continue;
+        }
+        if (relative->len > 0) {
+            g_string_append_c (relative, '/');
+        }
+        g_string_append (relative, *part);
+    }
+    g_strfreev (parts);
+
+    // The directory itself
+    if (relative->len == 0) {
+        g_string_free (relative, TRUE);
+        return NULL;
+    }
+    return g_string_free (relative, FALSE);
+}
+
+/*
+ * Records the parent directories as well, entries don't have to come
+ * with one.
+ */
+static void
+fetch_manifest_insert (FetchManifest *manifest, gchar *relative,
+                       FetchManifestRecord *record)
+{
+    gchar *slash = relative;
+
+    while ((slash = strchr (slash, '/')) != NULL) {
+        gchar *parent = g_strndup (relative, slash - relative);
+        if (!g_hash_table_contains (manifest->new_records, parent)) {
+            FetchManifestRecord *dir = g_slice_new0 (FetchManifestRecord);
+            dir->checksum = g_strdup ("-");
+            g_hash_table_insert (manifest->new_records, parent, dir);
+        } else {
+            g_free (parent);
+        }
+        slash++;
+    }
+    g_hash_table_replace (manifest->new_records, relative, record);
+}
+
+static gchar *
+fetch_manifest_checksum (const gchar *path)
+{
+    GMappedFile *file = g_mapped_file_new (path, FALSE, NULL);
+    gchar *checksum;
+
+    if (file == NULL) {
+        return NULL;
+    }
+    checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                            (const guchar *) g_mapped_file_get_contents (file),
+                                            g_mapped_file_get_length (file));
+    g_mapped_file_unref (file);
+    return checksum;
+}
+
+FetchManifest *
+restraint_fetch_manifest_open (const gchar *base_path, gboolean keepchanges)
+{
+    FetchManifest *manifest = g_slice_new0 (FetchManifest);
+    gchar *manifest_path = g_build_filename (base_path, FETCH_MANIFEST_NAME, NULL);
+    gchar *contents = NULL;
+
+    manifest->base_path = g_strdup (base_path);
+    manifest->keepchanges = keepchanges;
+    manifest->old_records = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                   fetch_manifest_record_free);
+    manifest->new_records = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                   fetch_manifest_record_free);
+
+    // <checksum> <size> <mtime> <disk mtime> <path>, path as g_strescape()
+    if (g_file_get_contents (manifest_path, &contents, NULL, NULL)) {
+        gchar **lines = g_strsplit (contents, "\n", -1);
+        for (gchar **line = lines; *line != NULL; line++) {
+            gchar **fields = g_strsplit (*line, " ", 5);
+            if (g_strv_length (fields) == 5) {
+                FetchManifestRecord *record = g_slice_new0 (FetchManifestRecord);
+                record->checksum = g_strdup (fields[0]);
+                record->size = g_ascii_strtoll (fields[1], NULL, 10);
+                record->mtime = g_ascii_strtoll (fields[2], NULL, 10);
+                record->disk_mtime = g_ascii_strtoll (fields[3], NULL, 10);
+                g_hash_table_replace (manifest->old_records,
+                                      g_strcompress (fields[4]), record);
+            }
+            g_strfreev (fields);
+        }
+        g_strfreev (lines);
+        g_free (contents);
+    }
+    g_free (manifest_path);
+
+    return manifest;
+}
+
+/*
+ * Decide what to do with an archive entry about to be written to path.
+ * A regular file is unchanged when the archive has the same size and
+ * mtime as last time and the file on disk is still what was extracted
+ * then, its checksum is only computed when the disk mtime moved.
+ */
+FetchManifestAction
+restraint_fetch_manifest_action (FetchManifest *manifest, const gchar *path,
+                                 struct archive_entry *entry)
+{
+    FetchManifestAction action = FETCH_MANIFEST_EXTRACT;
+    FetchManifestRecord *record = NULL;
+    gchar *relative;
+    struct stat st;
+
+    if (lstat (path, &st) != 0) {
+        return FETCH_MANIFEST_EXTRACT;
+    }
+
+    relative = fetch_manifest_relative (manifest, path);
+    if (relative != NULL) {
+        record = g_hash_table_lookup (manifest->old_records, relative);
+    }
+
+    if (manifest->keepchanges) {
+        action = FETCH_MANIFEST_KEEP;
+    } else {
+        switch (archive_entry_filetype (entry)) {
+            case AE_IFDIR:
+                if (S_ISDIR (st.st_mode)) {
+                    action = FETCH_MANIFEST_UNCHANGED;
+                }
+                break;
+            case AE_IFLNK:
+                if (S_ISLNK (st.st_mode)) {
+                    gchar *target = g_file_read_link (path, NULL);
+                    if (g_strcmp0 (target, archive_entry_symlink (entry)) == 0) {
+                        action = FETCH_MANIFEST_UNCHANGED;
+                    }
+                    g_free (target);
+                }
+                break;
+            case AE_IFREG:
+                if (record != NULL && S_ISREG (st.st_mode) &&
+                    strcmp (record->checksum, "-") != 0 &&
+                    record->size == archive_entry_size (entry) &&
+                    record->mtime == archive_entry_mtime (entry) &&
+                    record->size == st.st_size) {
+                    if (record->disk_mtime == st.st_mtime) {
+                        action = FETCH_MANIFEST_UNCHANGED;
+                    } else {
+                        gchar *checksum = fetch_manifest_checksum (path);
+                        if (g_strcmp0 (checksum, record->checksum) == 0) {
+                            record->disk_mtime = st.st_mtime;
+                            action = FETCH_MANIFEST_UNCHANGED;
+                        }
+                        g_free (checksum);
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (relative == NULL) {
+        return action;
+    }
+    if (action == FETCH_MANIFEST_EXTRACT) {
+        g_free (relative);
+    } else if (record != NULL) {
+        fetch_manifest_insert (manifest, relative,
+                               fetch_manifest_record_copy (record));
+    } else {
+        FetchManifestRecord *dir = g_slice_new0 (FetchManifestRecord);
+        dir->checksum = g_strdup ("-");
+        fetch_manifest_insert (manifest, relative, dir);
+    }
+    return action;
+}
+
+/*
+ * Record an entry just written to path, checksum is that of its data
+ * for a regular file.
+ */
+void
+restraint_fetch_manifest_add (FetchManifest *manifest, const gchar *path,
+                              struct archive_entry *entry,
+                              const gchar *checksum)
+{
+    gchar *relative = fetch_manifest_relative (manifest, path);
+    struct stat st;
+
+    if (relative == NULL) {
+        return;
+    }
+    if (lstat (path, &st) != 0) {
+        g_free (relative);
+        return;
+    }
+
+    FetchManifestRecord *record = g_slice_new0 (FetchManifestRecord);
+    record->checksum = g_strdup (checksum != NULL ? checksum : "-");
+    record->size = archive_entry_size (entry);
+    record->mtime = archive_entry_mtime (entry);
+    record->disk_mtime = st.st_mtime;
+    fetch_manifest_insert (manifest, relative, record);
+}
+
+/*
+ * Remove whatever is in the task directory but not in the archive.
+ */
+static void
+fetch_manifest_prune (FetchManifest *manifest, const gchar *dir_path,
+                      const gchar *relative_dir)
+{
+    GDir *dir = g_dir_open (dir_path, 0, NULL);
+    const gchar *name;
+
+    if (dir == NULL) {
+        return;
+    }
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (*relative_dir == '\0' && strcmp (name, FETCH_MANIFEST_NAME) == 0) {
+            continue;
+        }
+        gchar *path = g_build_filename (dir_path, name, NULL);
+        gchar *relative = *relative_dir == '\0' ? g_strdup (name) :
+                          g_strconcat (relative_dir, "/", name, NULL);
+        if (!g_hash_table_contains (manifest->new_records, relative)) {
+            restraint_rmrf_async (path);
+        } else if (g_file_test (path, G_FILE_TEST_IS_DIR) &&
+                   !g_file_test (path, G_FILE_TEST_IS_SYMLINK)) {
+            fetch_manifest_prune (manifest, path, relative);
+        }
+        g_free (relative);
+        g_free (path);
+    }
+    g_dir_close (dir);
+}
+
+static void
+fetch_manifest_write_record (gpointer key, gpointer value, gpointer user_data)
+{
+    FetchManifestRecord *record = value;
+    // a name may hold a newline
+    gchar *path = g_strescape (key, NULL);
+    g_string_append_printf (user_data,
+                            "%s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+                            " %" G_GINT64_FORMAT " %s\n",
+                            record->checksum, record->size, record->mtime,
+                            record->disk_mtime, path);
+    g_free (path);
+}
+
+/*
+ * With commit the fetch succeeded, files no longer in the archive are
+ * removed unless keepchanges is set and the manifest is saved.  The
+ * manifest is freed either way.
+ */
+gboolean
+restraint_fetch_manifest_close (FetchManifest *manifest, gboolean commit,
+                                GError **error)
+{
+    g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+    gboolean ret = TRUE;
+
+    if (manifest == NULL) {
+        return TRUE;
+    }
+
+    if (commit) {
+        gchar *manifest_path = g_build_filename (manifest->base_path,
+                                                 FETCH_MANIFEST_NAME, NULL);
+        GString *contents = g_string_new (NULL);
+
+        if (!manifest->keepchanges) {
+            fetch_manifest_prune (manifest, manifest->base_path, "");
+        }
+        g_hash_table_foreach (manifest->new_records,
+                              fetch_manifest_write_record, contents);
+        if (g_mkdir_with_parents (manifest->base_path, 0755) == 0) {
+            ret = g_file_set_contents (manifest_path, contents->str,
+                                       contents->len, error);
+        }
+        g_string_free (contents, TRUE);
+        g_free (manifest_path);
+    }
+
+    g_hash_table_destroy (manifest->old_records);
+    g_hash_table_destroy (manifest->new_records);
+    g_free (manifest->base_path);
+    g_slice_free (FetchManifest, manifest);
+    return ret;
+}
+
+/*
+ * archive_read_extract2() with a checksum of the data of a regular file
+ * computed on the way, returns the libarchive status.
+ */
+gint
+restraint_fetch_extract_entry (struct archive *a, struct archive *ext,
+                               struct archive_entry *entry, gchar **checksum)
+{
+    GChecksum *sum = NULL;
+    const void *buff;
+    size_t size;
+    int64_t offset;
+    gint r;
+
+    r = archive_write_header (ext, entry);
+    if (r != ARCHIVE_OK) {
+        return r;
+    }
+
+    if (archive_entry_filetype (entry) == AE_IFREG) {
+        sum = g_checksum_new (G_CHECKSUM_SHA256);
+    }
+    while ((r = archive_read_data_block (a, &buff, &size, &offset)) == ARCHIVE_OK) {
+        if (sum != NULL) {
+            g_checksum_update (sum, buff, size);
+        }
+        if (archive_write_data_block (ext, buff, size, offset) != ARCHIVE_OK) {
+            r = ARCHIVE_FAILED;
+            break;
+        }
+    }
+    if (r == ARCHIVE_EOF) {
+        r = archive_write_finish_entry (ext);
+    }
+
+    if (r == ARCHIVE_OK && sum != NULL && checksum != NULL) {
+        *checksum = g_strdup (g_checksum_get_string (sum));
+    }
+    if (sum != NULL) {
+        g_checksum_free (sum);
+    }
+    return r;
+}
@@ -0,0 +1,62 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RESTRAINT_FETCH_MANIFEST_H
+#define _RESTRAINT_FETCH_MANIFEST_H
+
+#include <glib.h>
+#include <archive.h>
+#include <archive_entry.h>
+
+#define FETCH_MANIFEST_NAME ".restraint-manifest"
+
+/*
+ * What was extracted into a task directory by the last successful
+ * fetch, so that the next fetch only writes what changed and removes
+ * what is gone instead of wiping the directory.
+ */
+typedef struct {
+    gchar *base_path;
+    gboolean keepchanges;
+    // relative path -> FetchManifestRecord
+    GHashTable *old_records;
+    GHashTable *new_records;
+} FetchManifest;
+
+typedef enum {
+    FETCH_MANIFEST_EXTRACT,
+    // Same as in the archive, counts as extracted
+    FETCH_MANIFEST_UNCHANGED,
+    // Left alone for keepchanges
+    FETCH_MANIFEST_KEEP,
+} FetchManifestAction;
+
+FetchManifest *restraint_fetch_manifest_open (const gchar *base_path,
+                                              gboolean keepchanges);
+FetchManifestAction restraint_fetch_manifest_action (FetchManifest *manifest,
+                                                     const gchar *path,
+                                                     struct archive_entry *entry);
+void restraint_fetch_manifest_add (FetchManifest *manifest, const gchar *path,
+                                   struct archive_entry *entry,
+                                   const gchar *checksum);
+gboolean restraint_fetch_manifest_close (FetchManifest *manifest,
+                                         gboolean commit, GError **error);
+gint restraint_fetch_extract_entry (struct archive *a, struct archive *ext,
+                                    struct archive_entry *entry,
+                                    gchar **checksum);
+
+#endif
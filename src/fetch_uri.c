@@ -22,21 +22,76 @@
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <gio/gio.h>
+#include <glib/gstdio.h>
 #include <fcntl.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <unistd.h>
+#include <errno.h>
 #include <curl/curl.h>
 
 #include "fetch.h"
 #include "fetch_uri.h"
+#include "fetch_cache.h"
+#include "fetch_manifest.h"
+
+#define FETCH_BUFFER_SIZE (4 * 1024 * 1024)
+
+/*
+ * Bounded buffer between curl, which fills it from the main loop, and
+ * libarchive, which drains it from the extraction thread.  When it is
+ * full the transfer is paused until the extractor has made room, so a
+ * large archive never has to fit in memory.  libarchive is handed
+ * pointers straight into the buffer, what it was given last is only
+ * released on its next read.
+ */
+struct stream_buffer {
+    GMutex lock;
+    GCond cond;
+    gchar *data;
+    gsize head;
+    gsize len;
+    gsize lent;
+    gboolean paused;
+    gboolean eof;
+    // Set once the rest of the transfer is not wanted
+    gboolean aborted;
+    // Only set by the main loop before eof
+    gchar *error;
+    GInputStream *istream;
+};
 
-struct curl_data {
+/*
+ * Every fetch goes through the one multi handle so that connections
+ * (multiplexed over HTTP/2 where the server allows it), DNS lookups and
+ * TLS sessions are reused from one task or repodep to the next.  It is
+ * only ever used from the main loop.
+ */
+static struct {
     CURLM *curlm;
+    CURLSH *share;
     int to_ev;
     int running;
+    // FetchData of the transfers still running
+    GSList *fetches;
+} fetch_curl;
+
+/*
+ * Freed with the last reference, idle callbacks queued from the
+ * extraction thread may still hold one after archive_finish_callback.
+ */
+struct curl_data {
+    gint ref_count;
+    CURL *easy;
+    long response_code;
+    struct curl_slist *headers;
+    FetchCacheEntry *cache;
+    GSList *targets;
+    struct stream_buffer stream;
 };
 
+static void fetch_uri_target_free (FetchUriTarget *target);
+
 struct socket_data {
     GIOChannel *ch;
     int ev;
@@ -45,31 +100,195 @@ struct socket_data {
 static size_t cwrite_callback(char *ptr, size_t size, size_t nmemb,
                               void *userdata)
 {
-    GMemoryInputStream *stream = (GMemoryInputStream *)userdata;
+    FetchData *fetch_data = (FetchData *)userdata;
+    struct curl_data *cd = fetch_data->private_data;
+    struct stream_buffer *stream = &cd->stream;
+    gsize len = size * nmemb;
+    gsize tail, first;
+
+    g_mutex_lock(&stream->lock);
+    if (stream->aborted) {
+        // makes curl fail the transfer
+        g_mutex_unlock(&stream->lock);
+        return 0;
+    }
+    if (FETCH_BUFFER_SIZE - stream->len < len) {
+        // curl hands us the same data again once resumed
+        stream->paused = TRUE;
+        g_mutex_unlock(&stream->lock);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    tail = (stream->head + stream->len) % FETCH_BUFFER_SIZE;
+    first = MIN(len, FETCH_BUFFER_SIZE - tail);
+    memcpy(stream->data + tail, ptr, first);
+    memcpy(stream->data, ptr + first, len - first);
+    stream->len += len;
+    g_cond_signal(&stream->cond);
+    g_mutex_unlock(&stream->lock);
 
-    g_memory_input_stream_add_data(stream, g_memdup(ptr, size * nmemb),
-                                   size * nmemb, g_free);
+    // only committed to the cache if this turns out to be a 200
+    restraint_fetch_cache_write(cd->cache, ptr, len);
+
+    return len;
+}
+
+static FetchData *
+fetch_uri_data_ref (FetchData *fetch_data)
+{
+    struct curl_data *cd = fetch_data->private_data;
 
-    return size * nmemb;
+    g_atomic_int_inc(&cd->ref_count);
+    return fetch_data;
+}
+
+static void
+fetch_uri_data_unref (gpointer user_data)
+{
+    FetchData *fetch_data = (FetchData *)user_data;
+    struct curl_data *cd = fetch_data->private_data;
+
+    if (!g_atomic_int_dec_and_test(&cd->ref_count)) {
+        return;
+    }
+    g_clear_object(&cd->stream.istream);
+    g_free(cd->stream.data);
+    g_free(cd->stream.error);
+    g_mutex_clear(&cd->stream.lock);
+    g_cond_clear(&cd->stream.cond);
+    curl_slist_free_all(cd->headers);
+    restraint_fetch_cache_entry_free(cd->cache);
+    g_slist_free_full(cd->targets, (GDestroyNotify) fetch_uri_target_free);
+    g_free(fetch_data->private_data);
+    g_slice_free(FetchData, fetch_data);
+}
+
+static gboolean
+resume_transfer (gpointer user_data)
+{
+    FetchData *fetch_data = (FetchData *)user_data;
+    struct curl_data *cd = fetch_data->private_data;
+
+    if (cd->easy != NULL) {
+        curl_easy_pause(cd->easy, CURLPAUSE_CONT);
+    }
+    return FALSE;
+}
+
+/*
+ * Called with the lock held, gives back what libarchive got last time.
+ */
+static void
+stream_release (FetchData *fetch_data)
+{
+    struct curl_data *cd = fetch_data->private_data;
+    struct stream_buffer *stream = &cd->stream;
+
+    stream->head = (stream->head + stream->lent) % FETCH_BUFFER_SIZE;
+    stream->len -= stream->lent;
+    stream->lent = 0;
+    if (stream->paused && stream->len <= FETCH_BUFFER_SIZE / 2) {
+        stream->paused = FALSE;
+        g_idle_add_full(G_PRIORITY_DEFAULT, resume_transfer,
+                        fetch_uri_data_ref(fetch_data), fetch_uri_data_unref);
+    }
+}
+
+static void
+stream_end (FetchData *fetch_data, const gchar *error)
+{
+    struct curl_data *cd = fetch_data->private_data;
+    struct stream_buffer *stream = &cd->stream;
+
+    g_mutex_lock(&stream->lock);
+    if (!stream->eof) {
+        stream->eof = TRUE;
+        if (error != NULL) {
+            stream->error = g_strdup(error);
+        }
+    }
+    g_cond_signal(&stream->cond);
+    g_mutex_unlock(&stream->lock);
+}
+
+/*
+ * libarchive may stop reading before the end of the transfer, let it
+ * complete anyway so that the archive can still go into the cache.
+ * Without a cache entry to write the rest is of no use, the transfer
+ * is aborted instead.
+ */
+static void
+stream_drain (FetchData *fetch_data)
+{
+    struct curl_data *cd = fetch_data->private_data;
+    struct stream_buffer *stream = &cd->stream;
+
+    g_mutex_lock(&stream->lock);
+    if (cd->cache == NULL) {
+        stream->aborted = TRUE;
+    }
+    while (TRUE) {
+        stream->lent = stream->len;
+        // a paused transfer is resumed to find out it was aborted
+        stream_release(fetch_data);
+        if (stream->eof || stream->aborted) {
+            break;
+        }
+        g_cond_wait(&stream->cond, &stream->lock);
+    }
+    g_mutex_unlock(&stream->lock);
+}
+
+static size_t cheader_callback(char *buffer, size_t size, size_t nitems,
+                               void *userdata)
+{
+    struct curl_data *cd = (struct curl_data *)userdata;
+
+    restraint_fetch_cache_header(cd->cache, buffer, size * nitems);
+
+    return size * nitems;
 }
 
 static ssize_t
 myread(struct archive *a, void *client_data, const void **abuf)
 {
     FetchData *fetch_data = client_data;
-    gsize len = 0;
-    *abuf = fetch_data->buf;
-
-    GError *error = NULL;
+    struct curl_data *cd = fetch_data->private_data;
+    struct stream_buffer *stream = &cd->stream;
+    gssize len = 0;
 
-    len = g_input_stream_read (fetch_data->istream, fetch_data->buf, sizeof (fetch_data->buf),
-                               NULL, &error);
+    g_mutex_lock(&stream->lock);
+    stream_release(fetch_data);
+    while (stream->len == 0 && !stream->eof) {
+        g_cond_wait(&stream->cond, &stream->lock);
+    }
+    if (stream->len > 0) {
+        len = MIN(stream->len, FETCH_BUFFER_SIZE - stream->head);
+        stream->lent = len;
+        *abuf = stream->data + stream->head;
+        g_mutex_unlock(&stream->lock);
+        return len;
+    }
+    g_mutex_unlock(&stream->lock);
 
-    if (error) {
-        archive_set_error(fetch_data->a, error->code, "%s", error->message);
+    if (stream->error != NULL) {
+        archive_set_error(fetch_data->a, EIO, "%s", stream->error);
         return -1;
     }
 
+    // Not modified, the archive comes from the cache
+    if (stream->istream != NULL) {
+        GError *error = NULL;
+
+        *abuf = fetch_data->buf;
+        len = g_input_stream_read (stream->istream, fetch_data->buf,
+                                   sizeof (fetch_data->buf), NULL, &error);
+        if (error) {
+            archive_set_error(fetch_data->a, error->code, "%s", error->message);
+            g_error_free(error);
+            return -1;
+        }
+    }
+
     return len;
 }
 
@@ -80,19 +299,45 @@ myopen(FetchData *fetch_data, GError **error)
     g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
     CURLMcode res;
     struct curl_data *cd = fetch_data->private_data;
-    CURLM *curlm = cd->curlm;
+    CURLM *curlm = fetch_curl.curlm;
     CURL *curl = curl_easy_init();
     gchar *uri = soup_uri_to_string(fetch_data->url, FALSE);
 
-    fetch_data->istream = g_memory_input_stream_new();
     curl_easy_setopt(curl, CURLOPT_URL, uri);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cwrite_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fetch_data->istream);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fetch_data);
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, fetch_data->curl_error_buf);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, fetch_data);
+    curl_easy_setopt(curl, CURLOPT_SHARE, fetch_curl.share);
+#ifdef CURL_HTTP_VERSION_2TLS
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    // rather wait for a connection that can be multiplexed than open another
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
 
     g_free(uri);
 
+    if (cd->cache != NULL) {
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, cheader_callback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, cd);
+        if (restraint_fetch_cache_valid(cd->cache)) {
+            gchar *header;
+            if (cd->cache->etag != NULL) {
+                header = g_strdup_printf("If-None-Match: %s", cd->cache->etag);
+                cd->headers = curl_slist_append(cd->headers, header);
+                g_free(header);
+            }
+            if (cd->cache->last_modified != NULL) {
+                header = g_strdup_printf("If-Modified-Since: %s",
+                                         cd->cache->last_modified);
+                cd->headers = curl_slist_append(cd->headers, header);
+                g_free(header);
+            }
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, cd->headers);
+        }
+    }
+
     if (fetch_data->ssl_verify == FALSE) {
         curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
     }
@@ -102,8 +347,11 @@ myopen(FetchData *fetch_data, GError **error)
     if (res != CURLM_OK) {
         g_set_error(error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, 0,
                 "Failed to fetch url: %s", fetch_data->curl_error_buf);
+        curl_easy_cleanup(curl);
         return FALSE;
     }
+    cd->easy = curl;
+    fetch_curl.fetches = g_slist_prepend(fetch_curl.fetches, fetch_data);
 
     return TRUE;
 }
@@ -112,14 +360,20 @@ static int
 myclose(struct archive *a, void *client_data)
 {
     FetchData *fetch_data = client_data;
+    struct curl_data *cd = fetch_data->private_data;
     GError * error = NULL;
 
-    g_input_stream_close(fetch_data->istream,
+    if (cd->stream.istream == NULL) {
+        return ARCHIVE_OK;
+    }
+
+    g_input_stream_close(cd->stream.istream,
                       NULL,
                       &error);
-    g_object_unref(fetch_data->istream);
+    g_clear_object(&cd->stream.istream);
     if (error != NULL) {
         archive_set_error(fetch_data->a, error->code, "%s", error->message);
+        g_error_free(error);
         return ARCHIVE_FATAL;
     }
     return ARCHIVE_OK;
@@ -130,7 +384,6 @@ archive_finish_callback (gpointer user_data)
 {
     FetchData *fetch_data = (FetchData*)user_data;
     struct curl_data *cd = fetch_data->private_data;
-    CURLM *curlm = cd->curlm;
     gint free_result;
 
     if (fetch_data == NULL) {
@@ -149,140 +402,321 @@ archive_finish_callback (gpointer user_data)
             g_warning("Failed to free archive_read");
     }
 
-    if (fetch_data->finish_callback) {
-        fetch_data->finish_callback (fetch_data->error,
-                                     fetch_data->match_cnt,
-                                     fetch_data->nonmatch_cnt,
-                                     fetch_data->user_data);
-    } else {
-        g_clear_error(&fetch_data->error);
-    }
+    // A failure of the fetch itself is reported to every target.
+    for (GSList *iter = cd->targets; iter != NULL; iter = g_slist_next(iter)) {
+        FetchUriTarget *target = iter->data;
+        GError *error = target->error;
 
-    curl_multi_cleanup(curlm);
-    g_free(fetch_data->private_data);
-    g_slice_free(FetchData, fetch_data);
+        target->error = NULL;
+        if (fetch_data->error != NULL) {
+            g_clear_error(&error);
+            error = g_error_copy(fetch_data->error);
+        }
+        if (target->finish_callback) {
+            target->finish_callback (error,
+                                     target->match_cnt,
+                                     target->nonmatch_cnt,
+                                     target->user_data);
+        } else {
+            g_clear_error(&error);
+        }
+    }
+    g_clear_error(&fetch_data->error);
+
+    // extraction may have failed before the transfer was done
+    if (cd->easy != NULL) {
+        curl_multi_remove_handle(fetch_curl.curlm, cd->easy);
+        curl_easy_cleanup(cd->easy);
+        cd->easy = NULL;
+        fetch_curl.fetches = g_slist_remove(fetch_curl.fetches, fetch_data);
+    }
+    fetch_uri_data_unref(fetch_data);
     return FALSE;
 }
 
 static gboolean
-http_archive_read_callback (gpointer user_data)
+fetch_uri_entry_matches (const gchar *fragment, const gchar *entry_path)
+{
+    return fragment == NULL || (g_strstr_len(entry_path, -1, fragment) != NULL &&
+            !(fragment[strlen(fragment)] != '/' && strlen(entry_path) ==
+                strlen(fragment) + 1));
+}
+
+/*
+ * Where entry_path from the archive lands for target, NULL when the
+ * target doesn't want it.
+ */
+static gchar *
+fetch_uri_target_path (FetchUriTarget *target, const gchar *entry_path)
+{
+    const gchar *fragment = target->fragment;
+
+    if (!fetch_uri_entry_matches(fragment, entry_path)) {
+        return NULL;
+    }
+    if (fragment != NULL) {
+        return g_build_filename(target->base_path,
+                                g_strstr_len(entry_path, -1, fragment) +
+                                strlen(fragment), NULL);
+    }
+    return g_build_filename(target->base_path, entry_path, NULL);
+}
+
+/*
+ * An archive entry can only be read once, a second target wanting the
+ * same entry gets a copy of what was extracted for the first one.  A
+ * hardlink is linked again to its target's own copy of the file.
+ */
+static gboolean
+fetch_uri_copy_entry (struct archive_entry *entry, const gchar *src,
+                      const gchar *hardlink, const gchar *dest, GError **error)
+{
+    gchar *parent = g_path_get_dirname(dest);
+    gboolean ret = TRUE;
+
+    g_mkdir_with_parents(parent, 0755);
+    g_free(parent);
+
+    if (hardlink != NULL) {
+        g_unlink(dest);
+        if (link(hardlink, dest) != 0) {
+            g_set_error(error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, ARCHIVE_FAILED,
+                        "Failed to link %s to %s: %s", dest, hardlink,
+                        g_strerror(errno));
+            ret = FALSE;
+        }
+        return ret;
+    }
+
+    switch (archive_entry_filetype(entry)) {
+        case AE_IFDIR:
+            if (g_mkdir_with_parents(dest, archive_entry_perm(entry)) != 0) {
+                g_set_error(error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, ARCHIVE_FAILED,
+                            "Failed to create %s: %s", dest, g_strerror(errno));
+                ret = FALSE;
+            }
+            break;
+        case AE_IFLNK:
+            g_unlink(dest);
+            if (symlink(archive_entry_symlink(entry), dest) != 0) {
+                g_set_error(error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, ARCHIVE_FAILED,
+                            "Failed to create %s: %s", dest, g_strerror(errno));
+                ret = FALSE;
+            }
+            break;
+        default:
+        {
+            GFile *src_file = g_file_new_for_path(src);
+            GFile *dest_file = g_file_new_for_path(dest);
+            ret = g_file_copy(src_file, dest_file,
+                              G_FILE_COPY_OVERWRITE | G_FILE_COPY_NOFOLLOW_SYMLINKS |
+                              G_FILE_COPY_ALL_METADATA,
+                              NULL, NULL, NULL, error);
+            g_object_unref(src_file);
+            g_object_unref(dest_file);
+            break;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Runs in the extraction thread, returns FALSE once there is nothing
+ * more to extract.  Entry callbacks are passed back to the main loop.
+ */
+static gboolean
+http_archive_read_entry (FetchData *fetch_data)
 {
-    FetchData *fetch_data = (FetchData *) user_data;
+    struct curl_data *cd = fetch_data->private_data;
 
     gint r;
     struct archive_entry *entry;
-    gchar *newPath = NULL;
+    gchar *entry_path = NULL;
+    gchar *hardlink_path = NULL;
+    gchar *extracted = NULL;
+    gchar *checksum = NULL;
 
     r = archive_read_next_header(fetch_data->a, &entry);
     if (r == ARCHIVE_EOF) {
-        if (fetch_data->match_cnt == 0) {
-            g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, ARCHIVE_WARN,
-                    "Nothing was extracted from archive");
+        for (GSList *iter = cd->targets; iter != NULL; iter = g_slist_next(iter)) {
+            FetchUriTarget *target = iter->data;
+            if (target->match_cnt == 0) {
+                g_set_error(&target->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, ARCHIVE_WARN,
+                        "Nothing was extracted from archive");
+            }
         }
-        g_idle_add (archive_finish_callback, fetch_data);
         return FALSE;
     }
 
     if (r != ARCHIVE_OK) {
         g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, r,
                 "archive_read_next_header failed: %s", archive_error_string(fetch_data->a));
-        g_idle_add (archive_finish_callback, fetch_data);
         return FALSE;
     }
 
-    const gchar *fragment = fetch_data->url->fragment;
-    const gchar *entry_path = archive_entry_pathname(entry);
-    if (fragment == NULL || (g_strstr_len(entry_path, -1, fragment) != NULL &&
-            !(fragment[strlen(fragment)] != '/' && strlen(entry_path) ==
-                strlen(fragment) + 1))
-            ) {
-        // Update pathname
-        if (fragment != NULL) {
-            newPath = g_build_filename(fetch_data->base_path,
-                                       g_strstr_len(entry_path, -1, fragment) +
-                                       strlen(fragment), NULL);
-        } else {
-            newPath = g_build_filename(fetch_data->base_path, entry_path, NULL);
+    entry_path = g_strdup(archive_entry_pathname(entry));
+    // Hardlinks point at archive paths, which move along with the entry
+    hardlink_path = g_strdup(archive_entry_hardlink(entry));
+    for (GSList *iter = cd->targets; iter != NULL; iter = g_slist_next(iter)) {
+        FetchUriTarget *target = iter->data;
+        const gchar *fragment = target->fragment;
+        gchar *newPath = NULL;
+        gchar *newLink = NULL;
+
+        newPath = fetch_uri_target_path(target, entry_path);
+        if (newPath == NULL) {
+            target->nonmatch_cnt++;
+            continue;
+        }
+        if (hardlink_path != NULL) {
+            newLink = fetch_uri_target_path(target, hardlink_path);
         }
-        archive_entry_set_pathname( entry, newPath );
-        g_free(newPath);
 
-        if (fetch_data->keepchanges == FALSE ||
-                access(archive_entry_pathname(entry), F_OK) == -1) {
-            r = archive_read_extract2(fetch_data->a, entry, fetch_data->ext);
-            if (r != ARCHIVE_OK) {
-                g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, r,
-                        "archive_read_extract2 failed: %s", archive_error_string(fetch_data->ext));
-                g_idle_add (archive_finish_callback, fetch_data);
+        FetchManifestAction action = restraint_fetch_manifest_action(target->manifest,
+                                                                     newPath, entry);
+        if (action == FETCH_MANIFEST_EXTRACT) {
+            if (extracted == NULL) {
+                archive_entry_set_pathname( entry, newPath );
+                if (newLink != NULL) {
+                    archive_entry_set_hardlink(entry, newLink);
+                }
+                r = restraint_fetch_extract_entry(fetch_data->a, fetch_data->ext,
+                                                  entry, &checksum);
+                if (r != ARCHIVE_OK) {
+                    g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, r,
+                            "archive_read_extract2 failed: %s", archive_error_string(fetch_data->ext));
+                }
+                extracted = g_strdup(newPath);
+            } else {
+                fetch_uri_copy_entry(entry, extracted, newLink, newPath,
+                                     &fetch_data->error);
+            }
+            if (fetch_data->error != NULL) {
+                g_free(newPath);
+                g_free(newLink);
+                g_free(hardlink_path);
+                g_free(extracted);
+                g_free(checksum);
+                g_free(entry_path);
                 return FALSE;
             }
+            restraint_fetch_manifest_add(target->manifest, newPath, entry,
+                                         checksum);
+        }
+
+        // An unchanged entry counts as extracted
+        if (action != FETCH_MANIFEST_KEEP) {
             gchar *strbegin = NULL;
             if (fragment) {
-                strbegin = g_strstr_len(archive_entry_pathname(entry), -1,
-                                        fragment);
+                strbegin = g_strstr_len(newPath, -1, fragment);
             } else {
-                strbegin = (gchar *)archive_entry_pathname(entry) + strlen(fetch_data->base_path);
+                strbegin = newPath + strlen(target->base_path);
                 if (g_strstr_len(strbegin, 1, "/")) {
                     strbegin += 1;
                 }
             }
-            if ((fetch_data->archive_entry_callback) && (strbegin)) {
-                fetch_data->archive_entry_callback (strbegin,
-                                                    fetch_data->user_data);
+            if ((target->archive_entry_callback) && (strbegin)) {
+                restraint_fetch_notify_entry (target->archive_entry_callback,
+                                              strbegin,
+                                              target->user_data);
             }
 
-            fetch_data->match_cnt++;
+            target->match_cnt++;
         }
-    } else {
-        fetch_data->nonmatch_cnt++;
+        g_free(newPath);
+        g_free(newLink);
     }
+    g_free(extracted);
+    g_free(checksum);
+    g_free(hardlink_path);
+    g_free(entry_path);
     return TRUE;
 }
 
-static void check_multi_info(FetchData *fetch_data)
+static void check_multi_info(void)
 {
-    struct curl_data *cd = fetch_data->private_data;
-    CURLM *curlm = cd->curlm;
+    CURLM *curlm = fetch_curl.curlm;
     CURLMsg *msg;
     int msgs_left;
 
     while((msg = curl_multi_info_read(curlm, &msgs_left))) {
         if (msg->msg == CURLMSG_DONE) {
             CURL *easy = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            FetchData *fetch_data = NULL;
+            gchar *stream_error = NULL;
+
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **) &fetch_data);
+            struct curl_data *cd = fetch_data->private_data;
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &cd->response_code);
             curl_multi_remove_handle(curlm, easy);
             curl_easy_cleanup(easy);
+            cd->easy = NULL;
+            fetch_curl.fetches = g_slist_remove(fetch_curl.fetches, fetch_data);
+
+            if (result != CURLE_OK) {
+                stream_error = g_strdup_printf("Failed to fetch url: %s",
+                                               fetch_data->curl_error_buf);
+            } else if (cd->cache != NULL) {
+                GError *tmp_error = NULL;
+                if (cd->response_code == 304) {
+                    cd->stream.istream = restraint_fetch_cache_read(cd->cache,
+                                                                    &tmp_error);
+                    if (cd->stream.istream == NULL) {
+                        stream_error = g_strdup(tmp_error->message);
+                        g_clear_error(&tmp_error);
+                    }
+                } else if (cd->response_code == 200 &&
+                           !restraint_fetch_cache_commit(cd->cache, &tmp_error)) {
+                    g_warning("%s", tmp_error->message);
+                    g_clear_error(&tmp_error);
+                }
+            }
+            stream_end(fetch_data, stream_error);
+            g_free(stream_error);
         }
     }
 }
 
+/*
+ * The multi handle failed as a whole, which ends every transfer on it.
+ */
+static void fetch_curl_failed(void)
+{
+    while (fetch_curl.fetches != NULL) {
+        FetchData *fetch_data = fetch_curl.fetches->data;
+        struct curl_data *cd = fetch_data->private_data;
+
+        curl_multi_remove_handle(fetch_curl.curlm, cd->easy);
+        curl_easy_cleanup(cd->easy);
+        cd->easy = NULL;
+        fetch_curl.fetches = g_slist_delete_link(fetch_curl.fetches,
+                                                 fetch_curl.fetches);
+        stream_end(fetch_data, "curl failed");
+    }
+}
+
 static gboolean event_cb(GIOChannel *ch, GIOCondition condition, gpointer data)
 {
     CURLMcode res;
-    FetchData *fetch_data = (FetchData*)data;
-    struct curl_data *cd = fetch_data->private_data;
-    CURLM *curl = cd->curlm;
     int fd = g_io_channel_unix_get_fd(ch);
     int action = (condition & G_IO_IN ? CURL_CSELECT_IN : 0) |
                  (condition & G_IO_OUT ? CURL_CSELECT_OUT : 0);
 
-    res = curl_multi_socket_action(curl, fd, action, &cd->running);
+    res = curl_multi_socket_action(fetch_curl.curlm, fd, action,
+                                   &fetch_curl.running);
     if (res != CURLM_OK) {
-        g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, res,
-                    "curl failed");
-        g_idle_add (archive_finish_callback, fetch_data);
-        return FALSE;
+        fetch_curl_failed();
+        return TRUE;
     }
 
-    check_multi_info(fetch_data);
-    if (cd->running) {
-        return TRUE;
-    } else {
-        if (cd->to_ev != 0) {
-            g_source_remove(cd->to_ev);
-            cd->to_ev = 0;
-        }
-        return FALSE;
+    check_multi_info();
+    if (!fetch_curl.running && fetch_curl.to_ev != 0) {
+        g_source_remove(fetch_curl.to_ev);
+        fetch_curl.to_ev = 0;
     }
+    // the watch is removed through sock_cb once curl is done with fd
+    return TRUE;
 }
 
 static int sock_cb(CURL *easy,      /* easy handle */
@@ -291,9 +725,7 @@ static int sock_cb(CURL *easy,      /* easy handle */
                    void *userp,     /* private callback pointer */
                    void *socketp)   /* private socket pointer */
 {
-    FetchData *fetch_data = (FetchData*)userp;
-    struct curl_data *cd = fetch_data->private_data;
-    CURLM *curl = cd->curlm;
+    CURLM *curl = fetch_curl.curlm;
     struct socket_data *sd = socketp;
     int action = (what & CURL_POLL_IN ? G_IO_IN : 0) |
                  (what & CURL_POLL_OUT ? G_IO_OUT : 0);
@@ -319,32 +751,25 @@ static int sock_cb(CURL *easy,      /* easy handle */
             g_source_remove(sd->ev);
             sd->ev = 0;
         }
-        sd->ev = g_io_add_watch(sd->ch, action, event_cb, fetch_data);
+        sd->ev = g_io_add_watch(sd->ch, action, event_cb, NULL);
     }
     return 0;
 }
 
 static gboolean timer_cb(gpointer data)
 {
-    FetchData *fetch_data = (FetchData*)data;
-    struct curl_data *cd = fetch_data->private_data;
-    int cur_timer = cd->to_ev;
-    CURLM *curl = cd->curlm;
+    int cur_timer = fetch_curl.to_ev;
     CURLMcode res;
-    res = curl_multi_socket_action(curl, CURL_SOCKET_TIMEOUT, 0, &cd->running);
+    res = curl_multi_socket_action(fetch_curl.curlm, CURL_SOCKET_TIMEOUT, 0,
+                                   &fetch_curl.running);
+    if (fetch_curl.to_ev == cur_timer) {
+        fetch_curl.to_ev = 0;
+    }
     if (res != CURLM_OK) {
-        g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, res,
-                    "curl failed");
-        g_idle_add (archive_finish_callback, fetch_data);
-        if (cd->to_ev == cur_timer) {
-            cd->to_ev = 0;
-        }
+        fetch_curl_failed();
         return FALSE;
     }
-    check_multi_info(fetch_data);
-    if (cd->to_ev == cur_timer) {
-        cd->to_ev = 0;
-    }
+    check_multi_info();
     return FALSE;
 }
 
@@ -352,42 +777,129 @@ static int update_timeout_cb(CURLM *multi,    /* multi handle */
                              long timeout_ms, /* see above */
                              void *userp)     /* private callback pointer */
 {
-    FetchData *fetch_data = (FetchData*)userp;
-    struct curl_data *cd = fetch_data->private_data;
-
     if (timeout_ms >= 0) {
-        if (cd->to_ev != 0) {
-            g_source_remove(cd->to_ev);
+        if (fetch_curl.to_ev != 0) {
+            g_source_remove(fetch_curl.to_ev);
         }
-        cd->to_ev = g_timeout_add(timeout_ms, timer_cb, userp);
+        fetch_curl.to_ev = g_timeout_add(timeout_ms, timer_cb, NULL);
     } else {
-        if (cd->to_ev != 0) {
-            g_source_remove(cd->to_ev);
-            cd->to_ev = 0;
+        if (fetch_curl.to_ev != 0) {
+            g_source_remove(fetch_curl.to_ev);
+            fetch_curl.to_ev = 0;
         }
     }
     return 0;
 }
 
-static gboolean start_unpack(gpointer data)
+static gboolean
+fetch_curl_init(void)
 {
-    FetchData *fetch_data = data;
-    struct curl_data *cd = fetch_data->private_data;
-
-    if (cd->running > 0) {
+    if (fetch_curl.curlm != NULL) {
         return TRUE;
     }
 
+    fetch_curl.curlm = curl_multi_init();
+    if (fetch_curl.curlm == NULL) {
+        return FALSE;
+    }
+    curl_multi_setopt(fetch_curl.curlm, CURLMOPT_SOCKETFUNCTION, sock_cb);
+    curl_multi_setopt(fetch_curl.curlm, CURLMOPT_TIMERFUNCTION, update_timeout_cb);
+#ifdef CURLPIPE_MULTIPLEX
+    curl_multi_setopt(fetch_curl.curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+    fetch_curl.share = curl_share_init();
+    if (fetch_curl.share != NULL) {
+        curl_share_setopt(fetch_curl.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(fetch_curl.share, CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_SSL_SESSION);
+    }
+    return TRUE;
+}
+
+/*
+ * Close the connections kept open by the shared multi handle, there must
+ * be no fetch running.
+ */
+void
+restraint_fetch_uri_cleanup (void)
+{
+    if (fetch_curl.curlm != NULL) {
+        curl_multi_cleanup(fetch_curl.curlm);
+        fetch_curl.curlm = NULL;
+    }
+    if (fetch_curl.share != NULL) {
+        curl_share_cleanup(fetch_curl.share);
+        fetch_curl.share = NULL;
+    }
+    if (fetch_curl.to_ev != 0) {
+        g_source_remove(fetch_curl.to_ev);
+        fetch_curl.to_ev = 0;
+    }
+}
+
+static void
+http_archive_extract (FetchData *fetch_data)
+{
+    struct curl_data *cd = fetch_data->private_data;
+    GError *tmp_error = NULL;
+    GSList *iter;
     gint r;
+
+    for (iter = cd->targets; iter != NULL; iter = g_slist_next(iter)) {
+        FetchUriTarget *target = iter->data;
+        target->manifest = restraint_fetch_manifest_open(target->base_path,
+                                                         target->keepchanges);
+    }
+
     r = archive_read_open(fetch_data->a, fetch_data, NULL, myread, myclose);
     if (r != ARCHIVE_OK) {
         g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, r,
                 "archive_read_open failed: %s", archive_error_string(fetch_data->a));
-        g_idle_add (archive_finish_callback, fetch_data);
-        return FALSE;
+    } else {
+        while (http_archive_read_entry(fetch_data));
     }
-    g_idle_add (http_archive_read_callback, fetch_data);
-    return FALSE;
+    if (fetch_data->error == NULL) {
+        stream_drain(fetch_data);
+    }
+
+    for (iter = cd->targets; iter != NULL; iter = g_slist_next(iter)) {
+        FetchUriTarget *target = iter->data;
+        if (!restraint_fetch_manifest_close(target->manifest,
+                                            fetch_data->error == NULL,
+                                            &tmp_error)) {
+            g_warning("%s", tmp_error->message);
+            g_clear_error(&tmp_error);
+        }
+        target->manifest = NULL;
+    }
+}
+
+FetchUriTarget *
+restraint_fetch_uri_target_new (const gchar *fragment,
+                                const gchar *base_path,
+                                gboolean keepchanges,
+                                ArchiveEntryCallback archive_entry_callback,
+                                FetchFinishCallback finish_callback,
+                                gpointer user_data)
+{
+    FetchUriTarget *target = g_slice_new0(FetchUriTarget);
+    target->fragment = g_strdup(fragment);
+    target->base_path = g_strdup(base_path);
+    target->keepchanges = keepchanges;
+    target->archive_entry_callback = archive_entry_callback;
+    target->finish_callback = finish_callback;
+    target->user_data = user_data;
+    return target;
+}
+
+static void
+fetch_uri_target_free (FetchUriTarget *target)
+{
+    g_free(target->fragment);
+    g_free(target->base_path);
+    g_clear_error(&target->error);
+    g_slice_free(FetchUriTarget, target);
 }
 
 void
@@ -402,22 +914,41 @@ restraint_fetch_uri (SoupURI *url,
     g_return_if_fail(url != NULL);
     g_return_if_fail(base_path != NULL);
 
+    FetchUriTarget *target = restraint_fetch_uri_target_new(url->fragment,
+                                                            base_path,
+                                                            keepchanges,
+                                                            archive_entry_callback,
+                                                            finish_callback,
+                                                            user_data);
+    restraint_fetch_uri_targets(url, ssl_verify, g_slist_prepend(NULL, target));
+}
+
+/*
+ * Download the archive at url once and extract the fragment of every
+ * target from it in the same pass, the fragment of url itself is
+ * ignored.  Each target gets its own finish_callback.
+ */
+void
+restraint_fetch_uri_targets (SoupURI *url,
+                             gboolean ssl_verify,
+                             GSList *targets)
+{
+    g_return_if_fail(url != NULL);
+    g_return_if_fail(targets != NULL);
+
     FetchData *fetch_data = g_slice_new0(FetchData);
-    fetch_data->archive_entry_callback = archive_entry_callback;
-    fetch_data->finish_callback = finish_callback;
-    fetch_data->user_data = user_data;
+    struct curl_data *cd = g_new0(struct curl_data, 1);
+
+    fetch_data->private_data = cd;
+    cd->ref_count = 1;
+    g_mutex_init(&cd->stream.lock);
+    g_cond_init(&cd->stream.cond);
     fetch_data->url = url;
-    fetch_data->base_path = base_path;
-    fetch_data->match_cnt = 0;
-    fetch_data->keepchanges = keepchanges;
     fetch_data->ssl_verify = ssl_verify;
+    cd->targets = targets;
 
     GError *tmp_error = NULL;
 
-    if (keepchanges == FALSE) {
-        rmrf(base_path);
-    }
-
     fetch_data->a = archive_read_new();
     if (fetch_data->a == NULL) {
         g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, 0,
@@ -436,23 +967,16 @@ restraint_fetch_uri (SoupURI *url,
     archive_read_support_filter_all(fetch_data->a);
     archive_read_support_format_all(fetch_data->a);
 
-    struct curl_data *cd = g_new0(struct curl_data, 1);
-    cd->curlm = curl_multi_init();
-
-    if (cd->curlm == NULL) {
+    if (!fetch_curl_init()) {
         g_set_error(&fetch_data->error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, 0,
                 "failed to init curl");
         g_idle_add (archive_finish_callback, fetch_data);
         return;
     }
 
-    fetch_data->private_data = cd;
-
-    curl_multi_setopt(cd->curlm, CURLMOPT_SOCKETFUNCTION, sock_cb);
-    curl_multi_setopt(cd->curlm, CURLMOPT_SOCKETDATA, fetch_data);
-    curl_multi_setopt(cd->curlm, CURLMOPT_TIMERFUNCTION, update_timeout_cb);
-    curl_multi_setopt(cd->curlm, CURLMOPT_TIMERDATA, fetch_data);
+    cd->cache = restraint_fetch_cache_lookup(url);
 
+    cd->stream.data = g_malloc(FETCH_BUFFER_SIZE);
     gboolean open_succeeded = myopen(fetch_data, &tmp_error);
     if (!open_succeeded) {
         g_propagate_error(&fetch_data->error, tmp_error);
@@ -460,5 +984,6 @@ restraint_fetch_uri (SoupURI *url,
         return;
     }
 
-    g_timeout_add(500, start_unpack, fetch_data);
+    restraint_fetch_extract(fetch_data, http_archive_extract,
+                            archive_finish_callback);
 }
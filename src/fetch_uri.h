@@ -18,6 +18,21 @@
 
 #include <libsoup/soup.h>
 
+#include "fetch_manifest.h"
+
+typedef struct {
+    gchar *fragment;
+    gchar *base_path;
+    gboolean keepchanges;
+    FetchManifest *manifest;
+    ArchiveEntryCallback archive_entry_callback;
+    FetchFinishCallback finish_callback;
+    gpointer user_data;
+    GError *error;
+    guint32 match_cnt;
+    guint32 nonmatch_cnt;
+} FetchUriTarget;
+
 void restraint_fetch_uri(SoupURI *url,
                      const gchar *base_path,
                      gboolean keepchanges,
@@ -25,3 +40,14 @@ void restraint_fetch_uri(SoupURI *url,
                      ArchiveEntryCallback entry_callback,
                      FetchFinishCallback finish_callback,
                      gpointer user_data);
+
+FetchUriTarget *restraint_fetch_uri_target_new (const gchar *fragment,
+                                                const gchar *base_path,
+                                                gboolean keepchanges,
+                                                ArchiveEntryCallback entry_callback,
+                                                FetchFinishCallback finish_callback,
+                                                gpointer user_data);
+void restraint_fetch_uri_targets (SoupURI *url,
+                                  gboolean ssl_verify,
+                                  GSList *targets);
+void restraint_fetch_uri_cleanup (void);
@@ -22,6 +22,8 @@
 #include <json.h>
 #include "message.h"
 
+#define MESSAGE_SUPERSEDES "restraint-message-supersedes"
+
 static GQueue *message_queue = NULL;
 static gboolean queue_active = FALSE;
 
@@ -112,6 +114,47 @@ message_handler (gpointer data)
     return FALSE;
 }
 
+/*
+ * Marks msg as carrying the whole state of its resource, like the
+ * external watchdog, so a later one to the same URI makes it redundant.
+ */
+void
+restraint_message_supersedes (SoupMessage *msg)
+{
+    g_object_set_data (G_OBJECT (msg), MESSAGE_SUPERSEDES, GINT_TO_POINTER (TRUE));
+}
+
+static gboolean
+message_superseded_by (MessageData *queued, SoupMessage *msg)
+{
+    return queued->finish_callback == NULL &&
+           g_object_get_data (G_OBJECT (queued->msg), MESSAGE_SUPERSEDES) &&
+           g_strcmp0 (queued->msg->method, msg->method) == 0 &&
+           soup_uri_equal (soup_message_get_uri (queued->msg),
+                           soup_message_get_uri (msg));
+}
+
+/*
+ * Drop queued messages the new one replaces.  The one being sent is
+ * not in the queue and nobody is waiting on the dropped ones.
+ */
+static void
+message_drop_superseded (SoupMessage *msg)
+{
+    GList *iter = message_queue->head;
+
+    while (iter != NULL) {
+        GList *next = iter->next;
+        MessageData *queued = (MessageData *) iter->data;
+        if (message_superseded_by (queued, msg)) {
+            g_object_unref (queued->msg);
+            g_slice_free (MessageData, queued);
+            g_queue_delete_link (message_queue, iter);
+        }
+        iter = next;
+    }
+}
+
 void
 restraint_queue_message (SoupSession *session,
                          SoupMessage *msg,
@@ -133,6 +176,10 @@ restraint_queue_message (SoupSession *session,
         message_queue = g_queue_new ();
     }
 
+    if (g_object_get_data (G_OBJECT (msg), MESSAGE_SUPERSEDES)) {
+        message_drop_superseded (msg);
+    }
+
     // push the message onto the queue.
     g_queue_push_tail (message_queue, message_data);
 
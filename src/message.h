@@ -35,6 +35,8 @@ typedef struct {
     SoupMessage *client_msg;
     SoupServer *server;
     gpointer user_data;
+    // The Task a request to restraintd is for
+    gpointer task;
 } ClientData;
 
 typedef struct {
@@ -50,6 +52,8 @@ typedef struct {
     guint delay;
 } MessageData;
 
+void restraint_message_supersedes (SoupMessage *msg);
+
 void restraint_queue_message (SoupSession *session,
                               SoupMessage *msg,
                               gpointer msg_data,
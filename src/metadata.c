@@ -23,6 +23,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <utime.h>
+#include <sys/stat.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
@@ -32,6 +34,8 @@
 #include "utils.h"
 #include "param.h"
 
+#define METADATA_CACHE_GROUP "metadata"
+
 typedef struct _MetadataData {
     char *path;
     char *osmajor;
@@ -39,9 +43,19 @@ typedef struct _MetadataData {
     GCancellable *cancellable;
     GIOFunc io_callback;
     metadata_cb finish_cb;
+    gpointer timing_data;
     void *user_data;
+    gchar *cache_key;
 } MetadataData;
 
+static gchar *metadata_cache_dir = NULL;
+
+static gboolean get_metadata (char *path, char *osmajor, MetaData **metadata,
+                              GCancellable *cancellable,
+                              metadata_cb finish_cb, GIOFunc io_callback,
+                              gpointer timing_data, void *user_data,
+                              const gchar *premake_key);
+
 void
 restraint_metadata_free (MetaData *metadata)
 {
@@ -493,6 +507,817 @@ restraint_parse_testinfo(gchar *filename,
     return metadata;
 }
 
+/*
+ * Parsed metadata is kept across tasks and reboots, NULL turns the
+ * cache off which is the default.  Entries nothing has used for
+ * METADATA_CACHE_MAX_AGE days are removed.
+ */
+void
+restraint_metadata_cache_configure (const gchar *cache_dir)
+{
+    gint64 expires = g_get_real_time () / G_USEC_PER_SEC -
+                     METADATA_CACHE_MAX_AGE * 24 * 60 * 60;
+    const gchar *name;
+    GDir *dir;
+
+    g_free (metadata_cache_dir);
+    metadata_cache_dir = g_strdup (cache_dir);
+    if (metadata_cache_dir == NULL) {
+        return;
+    }
+
+    dir = g_dir_open (metadata_cache_dir, 0, NULL);
+    if (dir == NULL) {
+        return;
+    }
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *filename = g_build_filename (metadata_cache_dir, name, NULL);
+        struct stat st;
+        if (g_lstat (filename, &st) == 0 && S_ISREG (st.st_mode) &&
+            st.st_mtime < expires) {
+            g_unlink (filename);
+        }
+        g_free (filename);
+    }
+    g_dir_close (dir);
+}
+
+/*
+ * Key for the metadata of the task in path, from the content of the
+ * files it comes from: metadata alone if there is one, otherwise
+ * testinfo.desc and the Makefile it may be generated from.
+ */
+static gchar *
+metadata_cache_key (const gchar *path, const gchar *osmajor)
+{
+    const gchar *sources[] = { "metadata", "testinfo.desc", "Makefile", NULL };
+    GChecksum *checksum;
+    gchar *key;
+
+    if (metadata_cache_dir == NULL) {
+        return NULL;
+    }
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    g_checksum_update (checksum, (const guchar *) path, strlen (path) + 1);
+    if (osmajor != NULL) {
+        g_checksum_update (checksum, (const guchar *) osmajor, strlen (osmajor));
+    }
+    g_checksum_update (checksum, (const guchar *) "", 1);
+    for (gint i = 0; sources[i] != NULL; i++) {
+        gchar *filename = g_build_filename (path, sources[i], NULL);
+        gchar *contents = NULL;
+        gsize length;
+        gboolean found = g_file_get_contents (filename, &contents, &length, NULL);
+        g_free (filename);
+        if (!found) {
+            continue;
+        }
+        g_checksum_update (checksum, (const guchar *) sources[i],
+                           strlen (sources[i]) + 1);
+        g_checksum_update (checksum, (const guchar *) contents, length);
+        g_free (contents);
+        if (i == 0) {
+            break;
+        }
+    }
+    key = g_strdup (g_checksum_get_string (checksum));
+    g_checksum_free (checksum);
+    return key;
+}
+
+static gchar **
+metadata_cache_strv (GSList *list)
+{
+    gchar **strv = g_new0 (gchar *, g_slist_length (list) + 1);
+    gint i = 0;
+
+    for (GSList *iter = list; iter != NULL; iter = g_slist_next (iter)) {
+        strv[i++] = g_strdup (iter->data);
+    }
+    return strv;
+}
+
+static void
+metadata_cache_store (const gchar *key, MetaData *metadata,
+                      gboolean rhts_compat)
+{
+    GKeyFile *keyfile;
+    GError *error = NULL;
+    gchar **strv;
+    gchar *s_data;
+    gchar *filename;
+    gsize length;
+
+    if (key == NULL || metadata == NULL) {
+        return;
+    }
+
+    keyfile = g_key_file_new ();
+    if (metadata->name != NULL) {
+        g_key_file_set_string (keyfile, METADATA_CACHE_GROUP, "name",
+                               metadata->name);
+    }
+    if (metadata->entry_point != NULL) {
+        g_key_file_set_string (keyfile, METADATA_CACHE_GROUP, "entry_point",
+                               metadata->entry_point);
+    }
+    g_key_file_set_int64 (keyfile, METADATA_CACHE_GROUP, "max_time",
+                          metadata->max_time);
+    strv = metadata_cache_strv (metadata->dependencies);
+    g_key_file_set_string_list (keyfile, METADATA_CACHE_GROUP, "dependencies",
+                                (const gchar * const *) strv, g_strv_length (strv));
+    g_strfreev (strv);
+    strv = metadata_cache_strv (metadata->softdependencies);
+    g_key_file_set_string_list (keyfile, METADATA_CACHE_GROUP, "softdependencies",
+                                (const gchar * const *) strv, g_strv_length (strv));
+    g_strfreev (strv);
+    strv = metadata_cache_strv (metadata->repodeps);
+    g_key_file_set_string_list (keyfile, METADATA_CACHE_GROUP, "repodeps",
+                                (const gchar * const *) strv, g_strv_length (strv));
+    g_strfreev (strv);
+    strv = g_new0 (gchar *, g_slist_length (metadata->envvars) + 1);
+    gint i = 0;
+    for (GSList *iter = metadata->envvars; iter != NULL; iter = g_slist_next (iter)) {
+        Param *p = iter->data;
+        strv[i++] = g_strdup_printf ("%s=%s", p->name, p->value);
+    }
+    g_key_file_set_string_list (keyfile, METADATA_CACHE_GROUP, "environment",
+                                (const gchar * const *) strv, g_strv_length (strv));
+    g_strfreev (strv);
+    g_key_file_set_boolean (keyfile, METADATA_CACHE_GROUP, "no_localwatchdog",
+                            metadata->nolocalwatchdog);
+    g_key_file_set_boolean (keyfile, METADATA_CACHE_GROUP, "use_pty",
+                            metadata->use_pty);
+    g_key_file_set_boolean (keyfile, METADATA_CACHE_GROUP, "rhts_compat",
+                            rhts_compat);
+
+    s_data = g_key_file_to_data (keyfile, &length, NULL);
+    filename = g_build_filename (metadata_cache_dir, key, NULL);
+    if (g_mkdir_with_parents (metadata_cache_dir, 0755) != 0 ||
+        !g_file_set_contents (filename, s_data, length, &error)) {
+        g_warning ("Unable to cache metadata in %s: %s", filename,
+                   error != NULL ? error->message : g_strerror (errno));
+        g_clear_error (&error);
+    }
+    g_free (filename);
+    g_free (s_data);
+    g_key_file_free (keyfile);
+}
+
+static GSList *
+metadata_cache_list (GKeyFile *keyfile, const gchar *key)
+{
+    gchar **strv = g_key_file_get_string_list (keyfile, METADATA_CACHE_GROUP,
+                                               key, NULL, NULL);
+    GSList *list = NULL;
+
+    for (gchar **iter = strv; iter != NULL && *iter != NULL; iter++) {
+        list = g_slist_prepend (list, g_strdup (*iter));
+    }
+    g_strfreev (strv);
+    return g_slist_reverse (list);
+}
+
+static MetaData *
+metadata_cache_load (const gchar *key, gboolean *rhts_compat)
+{
+    GKeyFile *keyfile;
+    MetaData *metadata = NULL;
+    gchar *filename;
+
+    if (key == NULL) {
+        return NULL;
+    }
+
+    filename = g_build_filename (metadata_cache_dir, key, NULL);
+    keyfile = g_key_file_new ();
+    if (g_key_file_load_from_file (keyfile, filename, G_KEY_FILE_NONE, NULL)) {
+        // still in use, keeps it from expiring
+        utime (filename, NULL);
+        metadata = g_slice_new0 (MetaData);
+        metadata->name = g_key_file_get_string (keyfile, METADATA_CACHE_GROUP,
+                                                "name", NULL);
+        metadata->entry_point = g_key_file_get_string (keyfile,
+                                                       METADATA_CACHE_GROUP,
+                                                       "entry_point", NULL);
+        metadata->max_time = g_key_file_get_int64 (keyfile, METADATA_CACHE_GROUP,
+                                                   "max_time", NULL);
+        metadata->dependencies = metadata_cache_list (keyfile, "dependencies");
+        metadata->softdependencies = metadata_cache_list (keyfile,
+                                                          "softdependencies");
+        metadata->repodeps = metadata_cache_list (keyfile, "repodeps");
+        GSList *envvars = metadata_cache_list (keyfile, "environment");
+        for (GSList *iter = envvars; iter != NULL; iter = g_slist_next (iter)) {
+            gchar **split = g_strsplit (iter->data, "=", 2);
+            if (split[0] != NULL && split[1] != NULL) {
+                Param *p = restraint_param_new ();
+                p->name = g_strdup (split[0]);
+                p->value = g_strdup (split[1]);
+                metadata->envvars = g_slist_append (metadata->envvars, p);
+            }
+            g_strfreev (split);
+        }
+        g_slist_free_full (envvars, g_free);
+        metadata->nolocalwatchdog = g_key_file_get_boolean (keyfile,
+                                                            METADATA_CACHE_GROUP,
+                                                            "no_localwatchdog",
+                                                            NULL);
+        metadata->use_pty = g_key_file_get_boolean (keyfile, METADATA_CACHE_GROUP,
+                                                    "use_pty", NULL);
+        *rhts_compat = g_key_file_get_boolean (keyfile, METADATA_CACHE_GROUP,
+                                               "rhts_compat", NULL);
+    }
+    g_key_file_free (keyfile);
+    g_free (filename);
+    return metadata;
+}
+
+/*
+ * Native evaluation of the testinfo.desc rule found in RHTS style
+ * Makefiles.  Only plain variable assignments, the rhts-make.include
+ * defaults and recipes made of echo, touch, rm and rhts-lint are
+ * understood; anything else returns FALSE so that make is run instead.
+ */
+#define TESTINFO_TARGET "testinfo.desc"
+#define TESTINFO_MAX_DEPTH 32
+
+typedef struct {
+    gchar *value;
+    gboolean simple;
+} MakeVar;
+
+typedef struct {
+    const gchar *path;
+    GHashTable *vars;
+    GPtrArray *recipe;
+    gboolean in_rule;
+    gboolean seen_rule;
+} TestinfoMake;
+
+static void
+make_var_free (gpointer data)
+{
+    MakeVar *var = data;
+    g_free (var->value);
+    g_slice_free (MakeVar, var);
+}
+
+static gboolean make_expand (TestinfoMake *make, const gchar *text,
+                             gint depth, GString *out);
+
+static gboolean
+make_expand_var (TestinfoMake *make, const gchar *name, gint depth,
+                 GString *out)
+{
+    MakeVar *var = g_hash_table_lookup (make->vars, name);
+
+    if (var == NULL) {
+        // Make falls back to the environment, then to its own defaults
+        const gchar *value = g_getenv (name);
+        if (value == NULL && g_strcmp0 (name, "CURDIR") == 0) {
+            value = make->path;
+        }
+        if (value != NULL) {
+            g_string_append (out, value);
+        }
+        return TRUE;
+    }
+    if (var->simple) {
+        g_string_append (out, var->value);
+        return TRUE;
+    }
+    if (depth >= TESTINFO_MAX_DEPTH) {
+        return FALSE;
+    }
+    return make_expand (make, var->value, depth + 1, out);
+}
+
+static gboolean
+make_expand (TestinfoMake *make, const gchar *text, gint depth, GString *out)
+{
+    const gchar *p = text;
+
+    while (*p != '\0') {
+        if (*p != '$') {
+            g_string_append_c (out, *p++);
+            continue;
+        }
+        p++;
+        if (*p == '$') {
+            g_string_append_c (out, '$');
+            p++;
+        } else if (*p == '(' || *p == '{') {
+            gchar close = *p == '(' ? ')' : '}';
+            const gchar *end = strchr (p + 1, close);
+            if (end == NULL) {
+                return FALSE;
+            }
+            gchar *name = g_strndup (p + 1, end - p - 1);
+            // Functions, substitution refs and computed names need make
+            gboolean plain = *name != '\0' &&
+                             strpbrk (name, " \t:$,=()") == NULL;
+            gboolean ret = plain && make_expand_var (make, name, depth, out);
+            g_free (name);
+            if (!ret) {
+                return FALSE;
+            }
+            p = end + 1;
+        } else if (*p == '@' && make->in_rule) {
+            g_string_append (out, TESTINFO_TARGET);
+            p++;
+        } else if (g_ascii_isalnum (*p) || *p == '_') {
+            gchar name[2] = { *p, '\0' };
+            if (!make_expand_var (make, name, depth, out)) {
+                return FALSE;
+            }
+            p++;
+        } else if (*p != '\0') {
+            // Other automatic variables
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gchar *
+make_expand_string (TestinfoMake *make, const gchar *text)
+{
+    GString *out = g_string_new (NULL);
+
+    if (!make_expand (make, text, 0, out)) {
+        g_string_free (out, TRUE);
+        return NULL;
+    }
+    return g_string_free (out, FALSE);
+}
+
+static void
+make_set_var (TestinfoMake *make, const gchar *name, gchar *value,
+              gboolean simple)
+{
+    MakeVar *var = g_slice_new (MakeVar);
+    var->value = value;
+    var->simple = simple;
+    g_hash_table_replace (make->vars, g_strdup (name), var);
+}
+
+static gboolean
+make_assign (TestinfoMake *make, const gchar *name, const gchar *op,
+             const gchar *value)
+{
+    MakeVar *var = g_hash_table_lookup (make->vars, name);
+
+    if (g_str_equal (op, "?=")) {
+        if (var == NULL && g_getenv (name) == NULL) {
+            make_set_var (make, name, g_strdup (value), FALSE);
+        }
+    } else if (g_str_equal (op, "+=")) {
+        if (var == NULL) {
+            make_set_var (make, name, g_strdup (value), FALSE);
+        } else if (var->simple) {
+            gchar *expanded = make_expand_string (make, value);
+            if (expanded == NULL) {
+                return FALSE;
+            }
+            gchar *joined = g_strjoin (" ", var->value, expanded, NULL);
+            g_free (expanded);
+            make_set_var (make, name, joined, TRUE);
+        } else {
+            make_set_var (make, name,
+                          g_strjoin (" ", var->value, value, NULL), FALSE);
+        }
+    } else if (g_str_equal (op, "=")) {
+        make_set_var (make, name, g_strdup (value), FALSE);
+    } else {
+        gchar *expanded = make_expand_string (make, value);
+        if (expanded == NULL) {
+            return FALSE;
+        }
+        make_set_var (make, name, expanded, TRUE);
+    }
+    return TRUE;
+}
+
+/* Mirrors the variables set by legacy/lib/rhts-make.include */
+static void
+make_include_rhts (TestinfoMake *make)
+{
+    make_assign (make, "TEST_DIR", "=", "/mnt/tests$(TEST)");
+    make_assign (make, "INSTALL_DIR", "=", "$(DEST)$(TEST_DIR)");
+    make_assign (make, "METADATA", "=", TESTINFO_TARGET);
+}
+
+/*
+ * Prerequisites have to be plain files already in the task, otherwise make
+ * would have other rules to run first.
+ */
+static gboolean
+make_check_prerequisites (TestinfoMake *make, const gchar *prerequisites)
+{
+    gchar *expanded = make_expand_string (make, prerequisites);
+    if (expanded == NULL || strpbrk (expanded, ";=") != NULL) {
+        g_free (expanded);
+        return FALSE;
+    }
+
+    gboolean ret = TRUE;
+    gchar **names = g_strsplit_set (g_strstrip (expanded), " \t", -1);
+    for (gchar **name = names; ret && *name != NULL; name++) {
+        if (**name == '\0' || g_str_equal (*name, "|")) {
+            continue;
+        }
+        gchar *filename = g_build_filename (make->path, *name, NULL);
+        ret = g_file_test (filename, G_FILE_TEST_IS_REGULAR);
+        g_free (filename);
+    }
+    g_strfreev (names);
+    g_free (expanded);
+    return ret;
+}
+
+static gboolean
+make_parse_rule (TestinfoMake *make, const gchar *line)
+{
+    const gchar *colon = strchr (line, ':');
+    gboolean ret = TRUE;
+
+    gchar *targets = g_strndup (line, colon - line);
+    gchar *expanded = make_expand_string (make, targets);
+    g_free (targets);
+    if (expanded == NULL) {
+        return FALSE;
+    }
+
+    gchar **names = g_strsplit_set (g_strstrip (expanded), " \t", -1);
+    for (gchar **name = names; ret && *name != NULL; name++) {
+        if (!g_str_equal (*name, TESTINFO_TARGET) &&
+                !g_str_equal (*name, "./" TESTINFO_TARGET)) {
+            continue;
+        }
+        // Double colon rules and a second recipe are left to make
+        ret = !make->seen_rule && colon[1] != ':' &&
+              make_check_prerequisites (make, colon + 1);
+        make->in_rule = TRUE;
+        make->seen_rule = TRUE;
+    }
+    g_strfreev (names);
+    g_free (expanded);
+    return ret;
+}
+
+static gboolean
+make_parse_line (TestinfoMake *make, gchar *line)
+{
+    static const gchar *unsupported[] = {
+        "ifeq", "ifneq", "ifdef", "ifndef", "else", "endif", "define",
+        "endef", "override", "vpath", "private", NULL
+    };
+    static GRegex *assign_re = NULL;
+    GMatchInfo *match = NULL;
+    gboolean ret = TRUE;
+
+    gchar *comment = strchr (line, '#');
+    if (comment != NULL) {
+        if (comment != line && comment[-1] == '\\') {
+            return FALSE;
+        }
+        *comment = '\0';
+    }
+    g_strstrip (line);
+    if (*line == '\0') {
+        return TRUE;
+    }
+    make->in_rule = FALSE;
+
+    gchar **words = g_strsplit_set (line, " \t", 2);
+    for (const gchar **keyword = unsupported; *keyword != NULL; keyword++) {
+        if (g_str_equal (words[0], *keyword)) {
+            g_strfreev (words);
+            return FALSE;
+        }
+    }
+    gboolean export = g_str_equal (words[0], "export") ||
+                      g_str_equal (words[0], "unexport");
+    if (words[1] != NULL && (g_str_equal (words[0], "include") ||
+                             g_str_equal (words[0], "-include") ||
+                             g_str_equal (words[0], "sinclude"))) {
+        gchar *files = make_expand_string (make, words[1]);
+        gchar **names = g_strsplit_set (files ? g_strstrip (files) : "",
+                                        " \t", -1);
+        ret = files != NULL && names[0] != NULL;
+        for (gchar **name = names; ret && *name != NULL; name++) {
+            if (g_str_has_suffix (*name, "/rhts-make.include")) {
+                make_include_rhts (make);
+            } else if (**name != '\0') {
+                ret = FALSE;
+            }
+        }
+        g_strfreev (names);
+        g_free (files);
+        g_strfreev (words);
+        return ret;
+    }
+    g_strfreev (words);
+
+    if (g_once_init_enter (&assign_re)) {
+        GRegex *re = g_regex_new ("^(?:export[ \t]+)?([A-Za-z0-9_.-]+)[ \t]*"
+                                  "(=|:=|::=|\\?=|\\+=)[ \t]*(.*)$",
+                                  G_REGEX_OPTIMIZE, 0, NULL);
+        g_once_init_leave (&assign_re, re);
+    }
+    if (g_regex_match (assign_re, line, 0, &match)) {
+        gchar *name = g_match_info_fetch (match, 1);
+        gchar *op = g_match_info_fetch (match, 2);
+        gchar *value = g_match_info_fetch (match, 3);
+        ret = make_assign (make, name, op, value);
+        g_free (value);
+        g_free (op);
+        g_free (name);
+    } else if (export) {
+        // Exporting only matters to the shell running the recipe
+        ret = TRUE;
+    } else if (strchr (line, ':') != NULL) {
+        ret = make_parse_rule (make, line);
+    } else {
+        ret = FALSE;
+    }
+    g_match_info_free (match);
+    return ret;
+}
+
+/*
+ * Splits a recipe line into words the way sh would, refusing anything that
+ * would need a shell to run: expansions, globs, pipes and lists.  At most
+ * one output redirection is allowed.
+ */
+static gboolean
+testinfo_shell_split (const gchar *cmd, GPtrArray *words, gchar **redirect,
+                      gboolean *append)
+{
+    GString *word = g_string_new (NULL);
+    gboolean in_word = FALSE;
+    gboolean want_redirect = FALSE;
+    gboolean ret = TRUE;
+    const gchar *p = cmd;
+
+    for (;;) {
+        gchar c = *p;
+        if (c == '\0' || c == ' ' || c == '\t' || c == '>' ||
+                (c == '#' && !in_word)) {
+            if (in_word) {
+                if (want_redirect) {
+                    if (*redirect != NULL) {
+                        ret = FALSE;
+                        break;
+                    }
+                    *redirect = g_strdup (word->str);
+                    want_redirect = FALSE;
+                } else {
+                    g_ptr_array_add (words, g_strdup (word->str));
+                }
+                g_string_truncate (word, 0);
+                in_word = FALSE;
+            }
+            if (c == '\0' || c == '#') {
+                break;
+            }
+            if (c == '>') {
+                if (want_redirect) {
+                    ret = FALSE;
+                    break;
+                }
+                want_redirect = TRUE;
+                *append = p[1] == '>';
+                p += *append ? 2 : 1;
+                if (*p == '&' || *p == '|') {
+                    ret = FALSE;
+                    break;
+                }
+                continue;
+            }
+            p++;
+        } else if (c == '\'') {
+            const gchar *end = strchr (p + 1, '\'');
+            if (end == NULL) {
+                ret = FALSE;
+                break;
+            }
+            g_string_append_len (word, p + 1, end - p - 1);
+            in_word = TRUE;
+            p = end + 1;
+        } else if (c == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0' || *p == '$' || *p == '`') {
+                    ret = FALSE;
+                    break;
+                }
+                if (*p == '\\' && strchr ("\\\"", p[1]) && p[1] != '\0') {
+                    p++;
+                }
+                g_string_append_c (word, *p);
+            }
+            if (!ret) {
+                break;
+            }
+            in_word = TRUE;
+            p++;
+        } else if (c == '\\') {
+            if (p[1] == '\0') {
+                ret = FALSE;
+                break;
+            }
+            g_string_append_c (word, p[1]);
+            in_word = TRUE;
+            p += 2;
+        } else if (strchr ("$`;&|<()*?[{}~!", c)) {
+            ret = FALSE;
+            break;
+        } else {
+            g_string_append_c (word, c);
+            in_word = TRUE;
+            p++;
+        }
+    }
+    g_string_free (word, TRUE);
+    return ret && !want_redirect;
+}
+
+static gboolean
+testinfo_is_target (const gchar *name)
+{
+    return g_str_equal (name, TESTINFO_TARGET) ||
+           g_str_equal (name, "./" TESTINFO_TARGET);
+}
+
+static gboolean
+testinfo_run_command (const gchar *cmd, GString *testinfo, gboolean *created)
+{
+    GPtrArray *words = g_ptr_array_new_with_free_func (g_free);
+    gchar *redirect = NULL;
+    gboolean append = FALSE;
+    gboolean ret = testinfo_shell_split (cmd, words, &redirect, &append);
+
+    if (ret && redirect != NULL && !testinfo_is_target (redirect)) {
+        ret = FALSE;
+    }
+    if (!ret || words->len == 0) {
+        goto out;
+    }
+
+    const gchar *command = g_ptr_array_index (words, 0);
+    if (g_str_equal (command, "echo")) {
+        // Options to echo differ between shells
+        if (words->len > 1 &&
+                *(gchar *) g_ptr_array_index (words, 1) == '-') {
+            ret = FALSE;
+            goto out;
+        }
+        if (redirect != NULL) {
+            if (!append) {
+                g_string_truncate (testinfo, 0);
+            }
+            *created = TRUE;
+            for (guint i = 1; i < words->len; i++) {
+                g_string_append_printf (testinfo, "%s%s", i > 1 ? " " : "",
+                                        (gchar *) g_ptr_array_index (words, i));
+            }
+            g_string_append_c (testinfo, '\n');
+        }
+    } else if (redirect != NULL) {
+        ret = FALSE;
+    } else if (g_str_equal (command, "rhts-lint") ||
+               g_str_equal (command, "touch")) {
+        ret = words->len == 2 &&
+              testinfo_is_target (g_ptr_array_index (words, 1));
+        *created |= ret && g_str_equal (command, "touch");
+    } else if (g_str_equal (command, "rm")) {
+        for (guint i = 1; ret && i < words->len; i++) {
+            const gchar *arg = g_ptr_array_index (words, i);
+            if (testinfo_is_target (arg)) {
+                g_string_truncate (testinfo, 0);
+                *created = FALSE;
+            } else if (!g_str_equal (arg, "-f")) {
+                ret = FALSE;
+            }
+        }
+    } else {
+        ret = FALSE;
+    }
+
+out:
+    g_free (redirect);
+    g_ptr_array_free (words, TRUE);
+    return ret;
+}
+
+static gboolean
+testinfo_run_recipe (TestinfoMake *make, GString *testinfo)
+{
+    gboolean created = FALSE;
+
+    make->in_rule = TRUE;
+    for (guint i = 0; i < make->recipe->len; i++) {
+        gchar *cmd = make_expand_string (make,
+                                         g_ptr_array_index (make->recipe, i));
+        if (cmd == NULL) {
+            return FALSE;
+        }
+        gchar *start = cmd;
+        while (*start == '@' || *start == '-' || *start == '+' ||
+               g_ascii_isspace (*start)) {
+            start++;
+        }
+        gboolean ret = testinfo_run_command (start, testinfo, &created);
+        g_free (cmd);
+        if (!ret) {
+            return FALSE;
+        }
+    }
+    // A recipe that never writes the file is make's to report
+    return created;
+}
+
+/*
+ * Writes testinfo.desc in path by evaluating its Makefile in process.
+ * Returns FALSE without touching anything when make has to do it.
+ */
+static gboolean
+testinfo_make_native (const gchar *path, const gchar *testinfo_file)
+{
+    gchar *gnu_makefile = g_build_filename (path, "GNUmakefile", NULL);
+    gchar *lower_makefile = g_build_filename (path, "makefile", NULL);
+    gchar *makefile = g_build_filename (path, "Makefile", NULL);
+    gchar *contents = NULL;
+    gboolean ret = FALSE;
+    TestinfoMake make = {
+        .path = path,
+        .vars = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, make_var_free),
+        .recipe = g_ptr_array_new_with_free_func (g_free),
+    };
+
+    // make prefers the other names when present
+    if (file_exists (gnu_makefile) || file_exists (lower_makefile) ||
+            !g_file_get_contents (makefile, &contents, NULL, NULL)) {
+        goto out;
+    }
+
+    gchar **lines = g_strsplit (contents, "\n", -1);
+    gboolean in_recipe = FALSE;
+    ret = TRUE;
+    for (gchar **line = lines; ret && *line != NULL; line++) {
+        gsize len = strlen (*line);
+        if (len > 0 && (*line)[len - 1] == '\r') {
+            (*line)[--len] = '\0';
+        }
+        gboolean continued = len > 0 && (*line)[len - 1] == '\\';
+
+        if (in_recipe || **line == '\t') {
+            // Only the recipe for testinfo.desc is ever run
+            if (make.in_rule) {
+                if (continued) {
+                    ret = FALSE;
+                }
+                g_ptr_array_add (make.recipe, g_strdup (*line + 1));
+            }
+            in_recipe = continued;
+            continue;
+        }
+
+        GString *logical = g_string_new (*line);
+        while (continued && line[1] != NULL) {
+            g_string_truncate (logical, logical->len - 1);
+            line++;
+            g_string_append_printf (logical, " %s", g_strchug (*line));
+            continued = logical->len > 0 &&
+                        logical->str[logical->len - 1] == '\\';
+        }
+        ret = !continued && make_parse_line (&make, logical->str);
+        g_string_free (logical, TRUE);
+    }
+    g_strfreev (lines);
+
+    if (ret && make.seen_rule) {
+        GString *testinfo = g_string_new (NULL);
+        ret = testinfo_run_recipe (&make, testinfo) &&
+              g_file_set_contents (testinfo_file, testinfo->str,
+                                   testinfo->len, NULL);
+        g_string_free (testinfo, TRUE);
+    } else {
+        ret = FALSE;
+    }
+
+out:
+    g_ptr_array_free (make.recipe, TRUE);
+    g_hash_table_destroy (make.vars);
+    g_free (contents);
+    g_free (makefile);
+    g_free (lower_makefile);
+    g_free (gnu_makefile);
+    return ret;
+}
+
 gboolean
 mktinfo_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data) {
     MetadataData *mtdata = (MetadataData*)user_data;
@@ -510,32 +1335,55 @@ static void mktinfo_cb(gint pid_result, gboolean localwatchdog,
     if (error || !file_exists(testinfo_file)) {
         mtdata->finish_cb(mtdata->user_data, error);
     } else {
-        restraint_get_metadata(mtdata->path, mtdata->osmajor, mtdata->metadata,
-                               mtdata->cancellable, mtdata->finish_cb,
-                               mtdata->io_callback, mtdata->user_data);
+        get_metadata(mtdata->path, mtdata->osmajor, mtdata->metadata,
+                     mtdata->cancellable, mtdata->finish_cb,
+                     mtdata->io_callback, mtdata->timing_data,
+                     mtdata->user_data, mtdata->cache_key);
     }
     g_free (testinfo_file);
+    g_free (mtdata->cache_key);
     g_slice_free(MetadataData, mtdata);
 }
 
-gboolean restraint_get_metadata(char *path, char *osmajor, MetaData **metadata,
-                                GCancellable *cancellable,
-                                metadata_cb finish_cb,
-                                GIOFunc io_callback, void *user_data)
+/*
+ * premake_key is the cache key from before testinfo.desc was generated,
+ * so that the result is found again if it goes missing.
+ */
+static gboolean get_metadata(char *path, char *osmajor, MetaData **metadata,
+                             GCancellable *cancellable,
+                             metadata_cb finish_cb,
+                             GIOFunc io_callback, gpointer timing_data,
+                             void *user_data, const gchar *premake_key)
 {
     GError *error = NULL;
     gboolean ret = TRUE;
+    gchar *cache_key = metadata_cache_key(path, osmajor);
+
+    MetaData *cached = metadata_cache_load(cache_key, &ret);
+    if (cached != NULL) {
+        *metadata = cached;
+        g_free (cache_key);
+        finish_cb(user_data, NULL);
+        return ret;
+    }
+
     gchar *metadata_file = g_build_filename(path, "metadata", NULL);
     gchar *testinfo_file = g_build_filename(path, "testinfo.desc", NULL);
 
     if (file_exists(metadata_file)) {
         ret = FALSE;
         *metadata = restraint_parse_metadata(metadata_file, osmajor, &error);
+        metadata_cache_store(cache_key, *metadata, ret);
         finish_cb(user_data, error);
     } else if (file_exists(testinfo_file)) {
         ret = TRUE;
         *metadata = restraint_parse_testinfo(testinfo_file, &error);
+        metadata_cache_store(cache_key, *metadata, ret);
+        metadata_cache_store(premake_key, *metadata, ret);
         finish_cb(user_data, error);
+    } else if (testinfo_make_native(path, testinfo_file)) {
+        ret = get_metadata(path, osmajor, metadata, cancellable, finish_cb,
+                           io_callback, timing_data, user_data, cache_key);
     } else {
         ret = TRUE;
 
@@ -547,14 +1395,27 @@ gboolean restraint_get_metadata(char *path, char *osmajor, MetaData **metadata,
         mtdata->cancellable = cancellable;
         mtdata->io_callback = io_callback;
         mtdata->finish_cb = finish_cb;
+        mtdata->timing_data = timing_data;
         mtdata->user_data = user_data;
+        mtdata->cache_key = g_strdup(cache_key);
 
         process_run(command, NULL, path, FALSE, 0,
                     NULL, mktinfo_io_callback, mktinfo_cb,
-                    NULL, 0, FALSE, cancellable, mtdata);
+                    NULL, 0, FALSE, cancellable, timing_data, mtdata);
     }
 
     g_free (testinfo_file);
     g_free (metadata_file);
+    g_free (cache_key);
     return ret;
 }
+
+gboolean restraint_get_metadata(char *path, char *osmajor, MetaData **metadata,
+                                GCancellable *cancellable,
+                                metadata_cb finish_cb,
+                                GIOFunc io_callback, gpointer timing_data,
+                                void *user_data)
+{
+    return get_metadata(path, osmajor, metadata, cancellable, finish_cb,
+                        io_callback, timing_data, user_data, NULL);
+}
@@ -40,13 +40,17 @@ typedef struct {
     gboolean use_pty;
 } MetaData;
 
+#define METADATA_CACHE_DIR "/var/lib/restraint/metadata-cache"
+#define METADATA_CACHE_MAX_AGE 30 // days
+
 typedef void (*metadata_cb) (gpointer user_data, GError *error);
 
 MetaData* restraint_parse_metadata (gchar *filename, gchar *locale, GError **error);
 MetaData* restraint_parse_testinfo (gchar *filename, GError **error);
 void restraint_metadata_free (MetaData *metadata);
+void restraint_metadata_cache_configure (const gchar *cache_dir);
 gboolean restraint_get_metadata(char *path, char *osmajor, MetaData **metadata,
                                 GCancellable *cancellable,
                                 metadata_cb finish_cb, GIOFunc io_callback,
-                                void *user_data);
+                                gpointer timing_data, void *user_data);
 #endif
@@ -15,24 +15,55 @@
     along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <pty.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <signal.h>
+#include <spawn.h>
 #include "common.h"
 #include "process.h"
 
+/* posix_spawn is only used once it can chdir for us */
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 29)
+#define PROCESS_USE_SPAWN 1
+#endif
+#endif
+
+/* Can posix_spawn start a child straight in its cgroup, otherwise the
+   child would only be moved there after exec and whatever it forks
+   before that escapes.  A forked child joins it before exec. */
+#ifdef POSIX_SPAWN_SETCGROUP
+#define PROCESS_SPAWN_CGROUP TRUE
+#else
+#define PROCESS_SPAWN_CGROUP FALSE
+#endif
+
 GQuark restraint_process_error (void)
 {
     return g_quark_from_static_string("restraint-process-error-quark");
 }
 
+static ProcessTimingCallback timing_callback = NULL;
+
+/* Registers the one callback told how long each process took */
+void
+process_set_timing_callback (ProcessTimingCallback callback)
+{
+    timing_callback = callback;
+}
+
 /*
   A child process will inherit signal handlers
   from the parent.  We don't want the child processes
@@ -228,6 +259,282 @@ restraint_fork (gint     *fd_out,
     return pid;
 }
 
+/* Moves pid, or the calling process when 0, into the cgroup. */
+static void
+process_enter_cgroup (gint cgroup_fd, pid_t pid)
+{
+    gchar procs[32];
+    gint len = g_snprintf (procs, sizeof (procs), "%d", pid);
+
+    gint fd = openat (cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write (fd, procs, len) != len)
+        g_warning ("Failed to move %d into its cgroup: %s\n", pid, g_strerror (errno));
+    if (fd != -1)
+        close (fd);
+}
+
+/* Runs in the forked child, never returns. */
+static void
+process_exec_child (ProcessData *process_data, const gchar **envp)
+{
+    // Flush any input that hasn't been read
+    if (fflush (stdin) != 0)
+        g_warning ("Failed to flush stdin: %s\n", g_strerror (errno));
+
+    setbuf (stdout, NULL);
+    setbuf (stderr, NULL);
+
+    if (process_data->cgroup_fd != -1)
+        process_enter_cgroup (process_data->cgroup_fd, 0);
+
+    if (process_data->path && (chdir (process_data->path) == -1)) {
+        /* command_path was supplied and we failed to chdir to it. */
+        g_warning ("Failed to chdir() to %s: %s\n", process_data->path, g_strerror (errno));
+        exit (INVALID_COMMAND_PATH);
+    }
+    if (envp)
+        environ = (gchar **) envp;
+
+    /* Spawn the command */
+    if (execvp (*process_data->command, (gchar **) process_data->command) == -1) {
+        g_warning ("Failed to exec() %s, %s error:%s\n",
+                   *process_data->command,
+                   process_data->path,
+                   g_strerror (errno));
+        exit (SPAWN_COMMAND_FAILED);
+    }
+}
+
+/* Forks with restraint_fork and execs the command in the child. */
+static gboolean
+process_fork (ProcessData *process_data, const gchar **envp, gint *fd_in,
+              gboolean use_pty)
+{
+    process_data->pid = restraint_fork (&process_data->fd_out, fd_in, use_pty);
+
+    if (process_data->pid == 0) {
+        /* Child process. */
+        process_exec_child (process_data, envp);
+    }
+    return process_data->pid > 0;
+}
+
+#ifdef PROCESS_USE_SPAWN
+/*
+ * Looks the command up the way execvp would from the child: using the PATH
+ * of envp, with relative entries taken from the directory it starts in.
+ */
+static gchar *
+process_find_program (ProcessData *process_data, const gchar **envp)
+{
+    const gchar *name = process_data->command[0];
+    const gchar *search;
+    gchar *program = NULL;
+
+    if (name == NULL || *name == '\0')
+        return NULL;
+    if (strchr (name, '/') != NULL)
+        return g_strdup (name);
+
+    if (envp)
+        search = g_environ_getenv ((gchar **) envp, "PATH");
+    else
+        search = g_getenv ("PATH");
+    if (search == NULL)
+        search = "/bin:/usr/bin";
+
+    gchar **dirs = g_strsplit (search, ":", -1);
+    for (gchar **dir = dirs; program == NULL && *dir != NULL; dir++) {
+        gchar *candidate = g_build_filename (**dir ? *dir : ".", name, NULL);
+        gchar *filename;
+
+        if (process_data->path && !g_path_is_absolute (candidate))
+            filename = g_build_filename (process_data->path, candidate, NULL);
+        else
+            filename = g_strdup (candidate);
+
+        if (g_file_test (filename, G_FILE_TEST_IS_EXECUTABLE) &&
+                !g_file_test (filename, G_FILE_TEST_IS_DIR))
+            program = candidate;
+        else
+            g_free (candidate);
+        g_free (filename);
+    }
+    g_strfreev (dirs);
+    return program;
+}
+
+/*
+ * posix_spawn counterpart of restraint_fork for the non pty case.  glibc
+ * creates the child with CLONE_VFORK, so restraintd's memory is never
+ * copied however large it has grown.
+ *
+ * When the command can't be started the error is written to the output
+ * pipe and pid_result is set to the exit code the forked child would have
+ * used, with pid left at 0.  Returns FALSE only when the pipes can't be
+ * created.
+ */
+static gboolean
+restraint_spawn (ProcessData *process_data, const gchar **envp, gint *fd_in)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t all_signals;
+    gint pipe_in[2] = { -1, -1 };  /* Child reads, parent writes */
+    gint pipe_out[2];              /* Parent reads, child writes */
+    gchar **argv = process_data->command;
+    pid_t pid = 0;
+    gint ret;
+
+    if (pipe2 (pipe_out, O_CLOEXEC) == -1)
+        return FALSE;
+
+    if (fd_in != NULL && pipe2 (pipe_in, O_CLOEXEC) == -1) {
+        close (pipe_out[0]);
+        close (pipe_out[1]);
+        return FALSE;
+    }
+
+    posix_spawn_file_actions_init (&actions);
+    if (fd_in != NULL)
+        posix_spawn_file_actions_adddup2 (&actions, pipe_in[0], STDIN_FILENO);
+    else
+        posix_spawn_file_actions_addopen (&actions, STDIN_FILENO, "/dev/null",
+                                          O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2 (&actions, pipe_out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2 (&actions, pipe_out[1], STDERR_FILENO);
+    if (process_data->path)
+        posix_spawn_file_actions_addchdir_np (&actions, process_data->path);
+
+    // Same as reset_signal_handlers () in a forked child
+    posix_spawnattr_init (&attr);
+    sigfillset (&all_signals);
+    posix_spawnattr_setsigdefault (&attr, &all_signals);
+#ifdef POSIX_SPAWN_SETCGROUP
+    // clone3 (CLONE_INTO_CGROUP), the child never runs outside of it
+    if (process_data->cgroup_fd != -1) {
+        posix_spawnattr_setcgroup_np (&attr, process_data->cgroup_fd);
+        posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETCGROUP);
+    } else
+#endif
+    posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGDEF);
+
+    gchar *program = process_find_program (process_data, envp);
+    if (program == NULL) {
+        ret = ENOENT;
+    } else {
+        ret = posix_spawn (&pid, program, &actions, &attr, argv,
+                           envp ? (gchar **) envp : environ);
+        if (ret == ENOEXEC) {
+            // execvp hands files without a #! line to the shell
+            gint argc = g_strv_length (argv);
+            gchar **sh_argv = g_new0 (gchar *, argc + 2);
+            sh_argv[0] = "/bin/sh";
+            sh_argv[1] = program;
+            for (gint i = 1; i < argc; i++)
+                sh_argv[i + 1] = argv[i];
+            ret = posix_spawn (&pid, "/bin/sh", &actions, &attr, sh_argv,
+                               envp ? (gchar **) envp : environ);
+            g_free (sh_argv);
+        }
+    }
+
+    posix_spawnattr_destroy (&attr);
+    posix_spawn_file_actions_destroy (&actions);
+
+    if (ret != 0) {
+        gchar *message;
+        gint code;
+
+        if (process_data->path &&
+                !g_file_test (process_data->path, G_FILE_TEST_IS_DIR)) {
+            message = g_strdup_printf ("Failed to chdir() to %s: %s\n",
+                                       process_data->path, g_strerror (ret));
+            code = INVALID_COMMAND_PATH;
+        } else {
+            message = g_strdup_printf ("Failed to exec() %s, %s error:%s\n",
+                                       *argv, process_data->path,
+                                       g_strerror (ret));
+            code = SPAWN_COMMAND_FAILED;
+        }
+        if (write (pipe_out[1], message, strlen (message)) == -1)
+            g_warning ("%s", message);
+        g_free (message);
+
+        process_data->pid_result = W_EXITCODE (code, 0);
+        pid = 0;
+        // Nobody is there to read what would have been written
+        if (fd_in != NULL) {
+            close (pipe_in[1]);
+            pipe_in[1] = -1;
+        }
+    }
+    g_free (program);
+
+    process_data->pid = pid;
+    close (pipe_out[1]);
+    process_data->fd_out = pipe_out[0];
+    if (fd_in != NULL) {
+        close (pipe_in[0]);
+        *fd_in = pipe_in[1];
+    }
+    return TRUE;
+}
+#endif
+
+#ifdef SYS_pidfd_open
+static void
+process_pidfd_close (gpointer user_data)
+{
+    ProcessData *process_data = (ProcessData *) user_data;
+
+    close (process_data->pidfd);
+    process_data->pidfd = -1;
+}
+
+static gboolean
+process_pidfd_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+    ProcessData *process_data = (ProcessData *) user_data;
+    pid_t pid = process_data->pid;
+    gint status = 0;
+
+    if (waitpid (pid, &status, WNOHANG) == 0)
+        return G_SOURCE_CONTINUE;
+
+    process_data->pid_handler_id = 0;
+    process_pid_callback (pid, status, process_data);
+    return G_SOURCE_REMOVE;
+}
+#endif
+
+/*
+ * Watches for the child to exit.  A pidfd becomes readable when it does,
+ * so the main loop polls it like any other fd instead of going through
+ * GLib's SIGCHLD handling; kernels without pidfd_open use a child watch.
+ */
+static void
+process_watch_pid (ProcessData *process_data)
+{
+#ifdef SYS_pidfd_open
+    process_data->pidfd = syscall (SYS_pidfd_open, process_data->pid, 0);
+    if (process_data->pidfd >= 0) {
+        process_data->pid_handler_id = g_unix_fd_add_full (G_PRIORITY_DEFAULT,
+                                                   process_data->pidfd,
+                                                   G_IO_IN,
+                                                   process_pidfd_cb,
+                                                   process_data,
+                                                   process_pidfd_close);
+        return;
+    }
+#endif
+    process_data->pid_handler_id = g_child_watch_add_full (G_PRIORITY_DEFAULT,
+                                                   process_data->pid,
+                                                   process_pid_callback,
+                                                   process_data,
+                                                   NULL);
+}
+
 void
 process_run (const gchar *command,
              const gchar **envp,
@@ -241,11 +548,41 @@ process_run (const gchar *command,
              gssize content_size,
              gboolean buffer,
              GCancellable *cancellable,
+             gpointer timing_data,
              gpointer user_data)
+{
+    process_run_in_cgroup (-1, command, envp, path, use_pty, max_time,
+                           timeout_callback, io_callback, finish_callback,
+                           content_input, content_size, buffer, cancellable,
+                           timing_data, user_data);
+}
+
+/*
+ * Same as process_run, with the command started inside the cgroup whose
+ * directory cgroup_fd refers to.  The local watchdog and cancellation then
+ * kill everything in the cgroup rather than just the command.
+ */
+void
+process_run_in_cgroup (gint cgroup_fd,
+                       const gchar *command,
+                       const gchar **envp,
+                       const gchar *path,
+                       gboolean use_pty,
+                       guint64 max_time,
+                       ProcessTimeoutCallback timeout_callback,
+                       GIOFunc io_callback,
+                       ProcessFinishCallback finish_callback,
+                       const gchar *content_input,
+                       gssize content_size,
+                       gboolean buffer,
+                       GCancellable *cancellable,
+                       gpointer timing_data,
+                       gpointer user_data)
 {
     ProcessData *process_data;
     gint        *process_stdin;
     guint64      timeout;
+    gboolean     started;
 
     /* Passing content_input is not supported with PTY */
     g_return_if_fail (!use_pty || content_input == NULL);
@@ -264,6 +601,8 @@ process_run (const gchar *command,
 
     process_data->fd_in = -1;
     process_data->fd_out = -1;
+    process_data->pidfd = -1;
+    process_data->cgroup_fd = cgroup_fd;
 
     if (fflush (stdout) != 0)
         g_warning ("Failed to flush stdout: %s\n", g_strerror (errno));
@@ -277,41 +616,23 @@ process_run (const gchar *command,
     else
         process_stdin = NULL;
 
-    process_data->pid = restraint_fork (&process_data->fd_out, process_stdin, use_pty);
+    process_data->start_time = g_get_monotonic_time ();
+    process_data->timing_data = timing_data;
+
+#ifdef PROCESS_USE_SPAWN
+    if (!use_pty && (cgroup_fd == -1 || PROCESS_SPAWN_CGROUP))
+        started = restraint_spawn (process_data, envp, process_stdin);
+    else
+#endif
+        started = process_fork (process_data, envp, process_stdin, use_pty);
 
-    if (process_data->pid < 0) {
+    if (!started) {
         /* Failed to fork */
         g_set_error (&process_data->error, RESTRAINT_PROCESS_ERROR,
                      RESTRAINT_PROCESS_FORK_ERROR,
                      "Failed to fork: %s", g_strerror (errno));
         g_idle_add (process_pid_finish, process_data);
         return;
-    } else if (process_data->pid == 0) {
-        /* Child process. */
-
-        // Flush any input that hasn't been read
-        if (fflush (stdin) != 0)
-            g_warning ("Failed to flush stdin: %s\n", g_strerror (errno));
-
-        setbuf (stdout, NULL);
-        setbuf (stderr, NULL);
-
-        if (process_data->path && (chdir (process_data->path) == -1)) {
-            /* command_path was supplied and we failed to chdir to it. */
-            g_warning ("Failed to chdir() to %s: %s\n", process_data->path, g_strerror (errno));
-            exit (INVALID_COMMAND_PATH);
-        }
-        if (envp)
-            environ = (gchar **) envp;
-
-        /* Spawn the command */
-        if (execvp (*process_data->command, (gchar **) process_data->command) == -1) {
-            g_warning ("Failed to exec() %s, %s error:%s\n",
-                       *process_data->command,
-                       process_data->path,
-                       g_strerror (errno));
-            exit (SPAWN_COMMAND_FAILED);
-        }
     }
 
     /* Parent process. */
@@ -378,11 +699,12 @@ process_run (const gchar *command,
                                                    process_io_finish);
     }
     // Monitor pid for return code
-    process_data->pid_handler_id = g_child_watch_add_full (G_PRIORITY_DEFAULT,
-                                                   process_data->pid,
-                                                   process_pid_callback,
-                                                   process_data,
-                                                   NULL);
+    if (process_data->pid != 0) {
+        process_watch_pid (process_data);
+    } else if (io_callback == NULL) {
+        // Never started, pid_result already holds the exit code
+        process_pid_callback (0, process_data->pid_result, process_data);
+    }
 }
 
 void
@@ -424,6 +746,15 @@ process_pid_finish (gpointer user_data)
         process_data->timeout_handler_id = 0;
     }
 
+    if (timing_callback != NULL && process_data->timing_data != NULL &&
+        process_data->error == NULL) {
+        gchar *command = g_strjoinv (" ", process_data->command);
+        timing_callback (command, process_data->start_time,
+                         g_get_monotonic_time (), process_data->pid_result,
+                         process_data->timing_data);
+        g_free (command);
+    }
+
     process_data->finish_callback (process_data->pid_result,
                                    process_data->localwatchdog,
                                    process_data->user_data,
@@ -444,6 +775,18 @@ process_kill (gpointer user_data)
         return;
     }
 
+    // Kill the whole cgroup, which includes anything started with setsid
+    if (process_data->cgroup_fd != -1) {
+        gint fd = openat (process_data->cgroup_fd, "cgroup.kill", O_WRONLY | O_CLOEXEC);
+        gboolean killed = fd != -1 && write (fd, "1", 1) == 1;
+        if (fd != -1)
+            close (fd);
+        if (killed) {
+            process_data->localwatchdog = TRUE;
+            return;
+        }
+    }
+
     // Kill process pid
     if (kill (process_data->pid, SIGKILL) == 0) {
         process_data->localwatchdog = TRUE;
@@ -27,6 +27,16 @@ typedef void (*ProcessFinishCallback)   (gint           pid_result,
                                          gpointer       user_data,
                                          GError         *error);
 
+/*
+ * Told about every finished process run with timing_data, times are from
+ * g_get_monotonic_time ().  Processes run without timing_data aren't timed.
+ */
+typedef void (*ProcessTimingCallback)   (const gchar    *command,
+                                         gint64         start_time,
+                                         gint64         end_time,
+                                         gint           pid_result,
+                                         gpointer       timing_data);
+
 #define RESTRAINT_PROCESS_ERROR restraint_process_error()
 GQuark restraint_process_error(void);
 
@@ -55,6 +65,14 @@ typedef struct {
     GIOChannel *io;
     // id of the pid handler
     guint pid_handler_id;
+    // pidfd watched for the exit of pid, -1 when using a child watch
+    gint pidfd;
+    // cgroup directory the command runs in, -1 for none
+    gint cgroup_fd;
+    // monotonic time the command was started at
+    gint64 start_time;
+    // passed to the timing callback when the command finishes
+    gpointer timing_data;
     // id of finish handler
     guint finish_handler_id;
     // id of the timeout handler
@@ -85,7 +103,25 @@ process_run (const gchar *command,
                       gssize content_size,
                       gboolean buffer,
                       GCancellable *cancellable,
+                      gpointer timing_data,
                       gpointer user_data);
+void
+process_run_in_cgroup (gint cgroup_fd,
+                       const gchar *command,
+                       const gchar **environ,
+                       const gchar *path,
+                       gboolean use_pty,
+                       guint64 max_time,
+                       ProcessTimeoutCallback timeout_callback,
+                       GIOFunc io_callback,
+                       ProcessFinishCallback finish_callback,
+                       const gchar *content_input,
+                       gssize content_size,
+                       gboolean buffer,
+                       GCancellable *cancellable,
+                       gpointer timing_data,
+                       gpointer user_data);
+void process_set_timing_callback (ProcessTimingCallback callback);
 //gboolean process_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data);
 void process_pid_callback (GPid pid, gint status, gpointer user_data);
 gboolean process_pid_finish (gpointer user_data);
@@ -31,6 +31,7 @@
 #include "utils.h"
 #include "config.h"
 #include "xml.h"
+#include "process.h"
 
 GQuark restraint_recipe_parse_error_quark(void) {
     return g_quark_from_static_string("restraint-recipe-parse-error-quark");
@@ -202,7 +203,6 @@ error:
 static Task *parse_task(xmlNode *task_node, Recipe *recipe, GError **error) {
     g_return_val_if_fail(task_node != NULL, NULL);
     g_return_val_if_fail(error == NULL || *error == NULL, NULL);
-    GError *tmp_error = NULL;
 
     Task *task = restraint_task_new();
     g_return_val_if_fail(task != NULL, NULL);
@@ -288,27 +288,8 @@ static Task *parse_task(xmlNode *task_node, Recipe *recipe, GError **error) {
         xmlFree(rpm_path);
     }
 
-    xmlNode *params_node = first_child_with_name(task_node, "params", FALSE);
-    if (params_node != NULL) {
-        task->params = parse_params(params_node, &tmp_error);
-        /* params could be empty, but if parsing causes an error then fail */
-        if (tmp_error != NULL) {
-            g_propagate_prefixed_error(error, tmp_error,
-                    "Task %s has ", task->task_id);
-            goto error;
-        }
-    }
-
-    xmlNode *roles_node = first_child_with_name(task_node, "roles", FALSE);
-    if (roles_node != NULL) {
-        task->roles = parse_roles(roles_node, &tmp_error);
-        /* roles could be empty, but if parsing causes an error then fail */
-        if (tmp_error != NULL) {
-            g_propagate_prefixed_error(error, tmp_error,
-                    "Task %s has ", task->task_id);
-            goto error;
-        }
-    }
+    /* params and roles are left for restraint_recipe_materialize_task */
+    task->node = task_node;
 
     xmlChar *status = xmlGetNoNsProp(task_node, (xmlChar *)"status");
     if (g_strcmp0((gchar *)status, "Running") == 0) {
@@ -332,6 +313,56 @@ error:
     return NULL;
 }
 
+/*
+ * Only what is needed to find, fetch and skip a task is read when the recipe
+ * is parsed.  Its params and roles are read from its <task/> element once
+ * something needs them, normally when the task becomes the current one.
+ * The recipe document stays in memory for that and every Task is still
+ * allocated up front, so this does not make the recipe any smaller.
+ */
+gboolean restraint_recipe_materialize_task(Task *task, GError **error) {
+    g_return_val_if_fail(task != NULL, FALSE);
+    g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+    GError *tmp_error = NULL;
+
+    if (task->node == NULL) {
+        return TRUE;
+    }
+
+    xmlNode *params_node = first_child_with_name(task->node, "params", FALSE);
+    if (params_node != NULL) {
+        task->params = parse_params(params_node, &tmp_error);
+        /* params could be empty, but if parsing causes an error then fail */
+        if (tmp_error != NULL) {
+            g_propagate_prefixed_error(error, tmp_error,
+                    "Task %s has ", task->task_id);
+            return FALSE;
+        }
+    }
+
+    xmlNode *roles_node = first_child_with_name(task->node, "roles", FALSE);
+    if (roles_node != NULL) {
+        task->roles = parse_roles(roles_node, &tmp_error);
+        /* roles could be empty, but if parsing causes an error then fail */
+        if (tmp_error != NULL) {
+            g_list_free_full(task->params, (GDestroyNotify) restraint_param_free);
+            task->params = NULL;
+            g_propagate_prefixed_error(error, tmp_error,
+                    "Task %s has ", task->task_id);
+            return FALSE;
+        }
+    }
+
+    task->node = NULL;
+    return TRUE;
+}
+
+/*
+ * Tasks already read get their roles from doc straight away.  Tasks not
+ * read yet are pointed at their <task/> in doc instead, so they get the
+ * new roles when they are read, doc must then be kept as long as the
+ * recipe.  On error the tasks not read yet are left alone.
+ */
 void restraint_recipe_update_roles(Recipe *recipe, xmlDoc *doc, GError **error) {
     g_return_if_fail(recipe != NULL);
     g_return_if_fail(doc != NULL);
@@ -363,7 +394,8 @@ void restraint_recipe_update_roles(Recipe *recipe, xmlDoc *doc, GError **error)
                 g_strcmp0((gchar *)child->name, "task") == 0) {
             g_return_if_fail(tasks != NULL);
             Task *task = tasks->data;
-            xmlNode *roles_node = first_child_with_name(child, "roles", FALSE);
+            xmlNode *roles_node = task->node == NULL ?
+                    first_child_with_name(child, "roles", FALSE) : NULL;
             if (roles_node != NULL) {
                 GList *roles = parse_roles(roles_node, &tmp_error);
                 if (tmp_error != NULL) {
@@ -382,6 +414,37 @@ void restraint_recipe_update_roles(Recipe *recipe, xmlDoc *doc, GError **error)
     // We should have reached the end of the tasks list. If we didn't it means
     // there were somehow too few <task/> nodes in the XML.
     g_warn_if_fail(!tasks);
+
+    tasks = recipe->tasks;
+    for (child = recipe_node->children; child != NULL && tasks != NULL;
+            child = child->next) {
+        if (child->type == XML_ELEMENT_NODE &&
+                g_strcmp0((gchar *)child->name, "task") == 0) {
+            Task *task = tasks->data;
+            if (task->node != NULL) {
+                task->node = child;
+            }
+            tasks = tasks->next;
+        }
+    }
+}
+
+/*
+ * Look up a recipe level param, the last one wins like it does
+ * when the env is built.
+ */
+const gchar *restraint_recipe_get_param(Recipe *recipe, const gchar *name) {
+    g_return_val_if_fail(recipe != NULL, NULL);
+    g_return_val_if_fail(name != NULL, NULL);
+
+    const gchar *value = NULL;
+    for (GList *iter = recipe->params; iter != NULL; iter = g_list_next(iter)) {
+        Param *param = iter->data;
+        if (g_strcmp0(param->name, name) == 0) {
+            value = param->value;
+        }
+    }
+    return value;
 }
 
 void restraint_recipe_free(Recipe *recipe) {
@@ -398,11 +461,15 @@ void restraint_recipe_free(Recipe *recipe) {
     g_list_free_full(recipe->tasks, (GDestroyNotify) restraint_task_free);
     g_list_free_full(recipe->params, (GDestroyNotify) restraint_param_free);
     g_list_free_full(recipe->roles, (GDestroyNotify) restraint_role_free);
+    if (recipe->installed_dependencies) {
+        g_hash_table_destroy(recipe->installed_dependencies);
+    }
     g_slice_free(Recipe, recipe);
 }
 
 static Recipe *
-recipe_parse (xmlDoc *doc, SoupURI *recipe_uri, GError **error, gchar **cfg_file)
+recipe_parse (xmlDoc *doc, SoupURI *recipe_uri, const gchar *base_path,
+              GError **error, gchar **cfg_file)
 {
     g_return_val_if_fail(doc != NULL, NULL);
     g_return_val_if_fail(error == NULL || *error == NULL, NULL);
@@ -445,7 +512,7 @@ recipe_parse (xmlDoc *doc, SoupURI *recipe_uri, GError **error, gchar **cfg_file
         g_free (tmp_str);
     }
     result->recipe_uri = recipe_uri;
-    result->base_path = TASK_LOCATION;
+    result->base_path = (gchar *) base_path;
 
     GList *tasks = NULL;
     xmlNode *child = recipe->children;
@@ -536,6 +603,224 @@ restraint_recipe_parse_stream (GInputStream *stream, gpointer user_data)
     restraint_xml_parse_from_stream(stream, app_data->recipe_url, fetch_completed, app_data);
 }
 
+typedef struct {
+    AppData *app_data;
+    gchar **packages;
+    gchar *section;
+} BatchDependencyData;
+
+static gboolean
+batch_dependency_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data)
+{
+    gchar buf[10000];
+    gsize bytes_read;
+
+    // No task is running yet, this only goes to the journal.
+    if (condition & G_IO_IN) {
+        switch (g_io_channel_read_chars (io, buf, sizeof (buf), &bytes_read, NULL)) {
+          case G_IO_STATUS_NORMAL:
+            if (fwrite (buf, sizeof (gchar), bytes_read, stderr) != bytes_read)
+                g_warning ("failed to write message");
+            return G_SOURCE_CONTINUE;
+          case G_IO_STATUS_AGAIN:
+            return G_SOURCE_CONTINUE;
+          default:
+            return G_SOURCE_REMOVE;
+        }
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void
+batch_dependency_finish_cb (gint pid_result, gboolean localwatchdog,
+                            gpointer user_data, GError *error)
+{
+    BatchDependencyData *batch_data = (BatchDependencyData *) user_data;
+    AppData *app_data = batch_data->app_data;
+    Recipe *recipe = app_data->recipe;
+
+    if (error == NULL && pid_result == 0) {
+        for (gchar **package = batch_data->packages; *package != NULL; package++) {
+            g_hash_table_add (recipe->installed_dependencies, g_strdup (*package));
+        }
+        gchar *installed = g_strjoinv (" ", batch_data->packages);
+        restraint_config_set (app_data->config_file, batch_data->section,
+                              "installed", NULL, G_TYPE_STRING, installed);
+        g_free (installed);
+    } else {
+        // Not fatal, each task will install what it needs itself.
+        g_warning ("* Recipe dependency install failed: %s",
+                   error ? error->message : "non-zero exit");
+    }
+
+    app_data->task_handler_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                                                 task_handler,
+                                                 app_data,
+                                                 NULL);
+    g_strfreev (batch_data->packages);
+    g_free (batch_data->section);
+    g_slice_free (BatchDependencyData, batch_data);
+}
+
+static gboolean
+param_is_true (const gchar *value)
+{
+    return g_strcmp0 (value, "1") == 0 ||
+           g_ascii_strcasecmp (value, "true") == 0 ||
+           g_ascii_strcasecmp (value, "yes") == 0;
+}
+
+/*
+ * Union of the hard dependencies of every task which hasn't started
+ * yet and already has its metadata on disk.  Packages which any task
+ * wants removed are left for the tasks to deal with.
+ *
+ * This runs before the first task is fetched, so tasks unpacked from
+ * git or an archive are only included when they are left over from an
+ * earlier run.  Everything else installs its own dependencies.
+ */
+static gchar **
+recipe_collect_dependencies (Recipe *recipe, gchar *config_file)
+{
+    GHashTable *removed = g_hash_table_new (g_str_hash, g_str_equal);
+    GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+    GPtrArray *packages = g_ptr_array_new ();
+    GSList *metadata_list = NULL;
+
+    for (GList *iter = recipe->tasks; iter != NULL; iter = g_list_next (iter)) {
+        Task *task = iter->data;
+        MetaData *metadata = NULL;
+        GError *tmp_error = NULL;
+
+        if (task->finished ||
+            restraint_config_get_boolean (config_file, task->task_id,
+                                          "started", NULL)) {
+            continue;
+        }
+
+        gchar *metadata_file = g_build_filename (task->path, "metadata", NULL);
+        gchar *testinfo_file = g_build_filename (task->path, "testinfo.desc", NULL);
+        if (file_exists (metadata_file)) {
+            metadata = restraint_parse_metadata (metadata_file, recipe->osmajor,
+                                                 &tmp_error);
+        } else if (file_exists (testinfo_file)) {
+            metadata = restraint_parse_testinfo (testinfo_file, &tmp_error);
+        }
+        g_free (metadata_file);
+        g_free (testinfo_file);
+
+        if (tmp_error) {
+            g_warning ("* Ignoring metadata of task %s: %s", task->task_id,
+                       tmp_error->message);
+            g_clear_error (&tmp_error);
+        }
+        if (metadata != NULL) {
+            metadata_list = g_slist_prepend (metadata_list, metadata);
+            for (GSList *dep = metadata->dependencies; dep != NULL; dep = g_slist_next (dep)) {
+                const gchar *package_name = dep->data;
+                if (g_str_has_prefix (package_name, "-")) {
+                    g_hash_table_add (removed, (gpointer) (package_name + 1));
+                } else if (!g_hash_table_contains (seen, package_name)) {
+                    g_hash_table_add (seen, (gpointer) package_name);
+                    g_ptr_array_add (packages, (gpointer) package_name);
+                }
+            }
+            for (GSList *dep = metadata->softdependencies; dep != NULL; dep = g_slist_next (dep)) {
+                const gchar *package_name = dep->data;
+                if (g_str_has_prefix (package_name, "-")) {
+                    g_hash_table_add (removed, (gpointer) (package_name + 1));
+                }
+            }
+        }
+    }
+
+    GPtrArray *result = g_ptr_array_new ();
+    for (guint i = 0; i < packages->len; i++) {
+        const gchar *package_name = packages->pdata[i];
+        if (!g_hash_table_contains (removed, package_name)) {
+            g_ptr_array_add (result, g_strdup (package_name));
+        }
+    }
+    g_ptr_array_add (result, NULL);
+
+    g_ptr_array_free (packages, TRUE);
+    g_hash_table_destroy (seen);
+    g_hash_table_destroy (removed);
+    g_slist_free_full (metadata_list, (GDestroyNotify) restraint_metadata_free);
+
+    return (gchar **) g_ptr_array_free (result, FALSE);
+}
+
+/*
+ * With RSTRNT_BATCH_DEPENDENCIES set install the dependencies of all
+ * tasks in one go before the first task runs, saving a package manager
+ * run per task.  Returns TRUE if an install was started, the task
+ * handler is kicked off once it finishes.
+ */
+static gboolean
+recipe_install_dependencies (AppData *app_data, GString *message)
+{
+    Recipe *recipe = app_data->recipe;
+
+    if (!param_is_true (restraint_recipe_get_param (recipe, BATCH_DEPENDENCIES_PARAM))) {
+        return FALSE;
+    }
+
+    recipe->installed_dependencies = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                            g_free, NULL);
+    gchar *section = g_strdup_printf ("dependencies_%s", recipe->recipe_id);
+
+    // Already done before a reboot
+    gchar *installed = restraint_config_get_string (app_data->config_file,
+                                                    section, "installed", NULL);
+    if (installed != NULL) {
+        gchar **packages = g_strsplit (installed, " ", -1);
+        for (gchar **package = packages; *package != NULL; package++) {
+            if (**package != '\0') {
+                g_hash_table_add (recipe->installed_dependencies, g_strdup (*package));
+            }
+        }
+        g_strfreev (packages);
+        g_free (installed);
+        g_free (section);
+        return FALSE;
+    }
+
+    gchar **packages = recipe_collect_dependencies (recipe, app_data->config_file);
+    if (*packages == NULL) {
+        g_strfreev (packages);
+        g_free (section);
+        return FALSE;
+    }
+
+    gchar *package_list = g_strjoinv (" ", packages);
+    gchar *command = g_strdup_printf ("rstrnt-package install %s", package_list);
+    g_string_append_printf (message, "* Installing recipe dependencies: %s\n",
+                            package_list);
+
+    BatchDependencyData *batch_data = g_slice_new0 (BatchDependencyData);
+    batch_data->app_data = app_data;
+    batch_data->packages = packages;
+    batch_data->section = section;
+    process_run ((const gchar *) command,
+                 NULL,
+                 NULL,
+                 FALSE,
+                 0,
+                 NULL,
+                 batch_dependency_io_callback,
+                 batch_dependency_finish_cb,
+                 NULL,
+                 0,
+                 FALSE,
+                 app_data->cancellable,
+                 NULL,
+                 batch_data);
+    g_free (command);
+    g_free (package_list);
+    return TRUE;
+}
+
 gboolean
 recipe_handler (gpointer user_data)
 {
@@ -557,6 +842,7 @@ recipe_handler (gpointer user_data)
             if (app_data->recipe_url)
                 recipe_uri = soup_uri_new(app_data->recipe_url);
             app_data->recipe = recipe_parse(app_data->recipe_xmldoc, recipe_uri,
+                                            app_data->task_base ? app_data->task_base : TASK_LOCATION,
                                             &app_data->error, &app_data->config_file);
             if (app_data->recipe && ! app_data->error) {
                 app_data->tasks = app_data->recipe->tasks;
@@ -568,17 +854,19 @@ recipe_handler (gpointer user_data)
         case RECIPE_RUN:
             if (app_data->recipe_url) {
                 restraint_config_set (app_data->config_file,
-                                      "restraint",
+                                      app_data->config_section,
                                       "recipe_url",
                                       NULL,
                                       G_TYPE_STRING,
                                       app_data->recipe_url);
             }
-            app_data->task_handler_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-                                                        task_handler,
-                                                        app_data,
-                                                        NULL);
             g_string_printf(message, "* Running recipe\n");
+            if (!recipe_install_dependencies(app_data, message)) {
+                app_data->task_handler_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                                                            task_handler,
+                                                            app_data,
+                                                            NULL);
+            }
             app_data->state = RECIPE_RUNNING;
             break;
         case RECIPE_RUNNING:
@@ -598,7 +886,11 @@ recipe_handler (gpointer user_data)
                 app_data->recipe_xmldoc = NULL;
             }
             // free current recipe
+            restraint_task_prefetch_orphan(app_data);
             if (app_data->recipe) {
+              gchar *section = g_strdup_printf("dependencies_%s", app_data->recipe->recipe_id);
+              restraint_config_set(app_data->config_file, section, NULL, NULL, -1);
+              g_free(section);
               restraint_recipe_free(app_data->recipe);
               app_data->recipe = NULL;
               g_free (app_data->recipe_url);
@@ -26,6 +26,8 @@
 // XXX make this configurable
 #define TASK_LOCATION "/mnt/tests"
 
+#define BATCH_DEPENDENCIES_PARAM "RSTRNT_BATCH_DEPENDENCIES"
+
 extern SoupSession *soup_session;
 
 typedef enum {
@@ -53,6 +55,7 @@ typedef struct {
     GList *params; // list of Params
     GList *roles; // list of Roles
     SoupURI *recipe_uri;
+    GHashTable *installed_dependencies; // packages installed up front for all tasks
 } Recipe;
 
 #define RESTRAINT_RECIPE_PARSE_ERROR restraint_recipe_parse_error_quark()
@@ -64,6 +67,7 @@ typedef enum {
 gboolean recipe_handler (gpointer user_data);
 void restraint_recipe_parse_stream (GInputStream *stream, gpointer user_data);
 void restraint_recipe_update_roles(Recipe *recipe, xmlDoc *doc, GError **error);
+const gchar *restraint_recipe_get_param(Recipe *recipe, const gchar *name);
 void restraint_recipe_free(Recipe *recipe);
 void recipe_handler_finish (gpointer user_data);
 #endif
@@ -17,14 +17,14 @@
 
 #include <glib.h>
 #include <glib/gstdio.h>
-#include <glib-unix.h>
 #include <gio/gunixinputstream.h>
 #include <libsoup/soup.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
-#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "recipe.h"
 #include "task.h"
 #include "errors.h"
@@ -33,10 +33,16 @@
 #include "process.h"
 #include "message.h"
 #include "server.h"
+#include "avc.h"
+#include "fetch_cache.h"
+#include "fetch.h"
+#include "fetch_uri.h"
+#include "cgroup.h"
+#include "utils.h"
 
 SoupSession *soup_session;
-GMainLoop *loop;
-char *strsignal(int sig);
+// AppData of every recipe this restraintd runs, the one from [restraint] first
+GList *hosted_recipes = NULL;
 
 static void
 copy_header (SoupURI *uri, const char *name, const char *value, gpointer dest_headers)
@@ -84,13 +90,15 @@ swap_base (const gchar *orig, const gchar *new_base, gchar *split_string)
   return new;
 }
 
-static void restraint_free_app_data(AppData *app_data)
+void restraint_free_app_data(AppData *app_data)
 {
   g_return_if_fail (app_data != NULL);
 
   g_free(app_data->recipe_url);
   g_free(app_data->config_file);
   g_free(app_data->restraint_url);
+  g_free(app_data->config_section);
+  g_free(app_data->task_base);
 
   if (app_data->recipe != NULL) {
     restraint_recipe_free(app_data->recipe);
@@ -98,6 +106,7 @@ static void restraint_free_app_data(AppData *app_data)
   }
 
   g_clear_object (&app_data->cancellable);
+  g_clear_object (&app_data->prefetch_cancellable);
   g_clear_error(&app_data->error);
   g_slice_free(AppData, app_data);
 }
@@ -105,9 +114,18 @@ static void restraint_free_app_data(AppData *app_data)
 void connections_write (AppData *app_data, const gchar *path,
                         const gchar *msg_data, gsize msg_len)
 {
-    // Active parsed task?  Send the output to log via REST
-    if (app_data->tasks && ! g_cancellable_is_cancelled(app_data->cancellable)) {
-        Task *task = (Task *) app_data->tasks->data;
+    // Active parsed task?  Send the output to its log
+    if (app_data->tasks) {
+        connections_write_task (app_data, (Task *) app_data->tasks->data,
+                                path, msg_data, msg_len);
+    }
+}
+
+void connections_write_task (AppData *app_data, Task *task, const gchar *path,
+                             const gchar *msg_data, gsize msg_len)
+{
+    // Send the output to log via REST
+    if (! g_cancellable_is_cancelled(app_data->cancellable)) {
         SoupURI *task_output_uri = soup_uri_new_with_base (task->task_uri, path);
         SoupMessage *server_msg = soup_message_new_from_uri ("PUT", task_output_uri);
         soup_uri_free (task_output_uri);
@@ -144,11 +162,45 @@ void connections_write (AppData *app_data, const gchar *path,
 
 
 
+/* Report plugins run for a result, in a cgroup of their own */
+typedef struct {
+    ClientData *client_data;
+    Task *task;
+    RestraintCgroup *cgroup;
+} PluginRunData;
+
+/*
+ * The task a request from rstrnt-* commands is for, taken from the
+ * tasks/<id> part of its path, NULL when that task isn't running.  A
+ * path naming no task, like the recipe watchdog, is for the current
+ * task as long as no task of a concurrent group runs alongside it.
+ */
+static Task *
+server_request_task (AppData *app_data, const gchar *path)
+{
+    gchar **splitpath = g_strsplit (path, "/", -1);
+    gboolean named = FALSE;
+    Task *task = NULL;
+
+    for (gchar **part = splitpath; *part != NULL; part++) {
+        if (g_strcmp0 (*part, "tasks") == 0 && *(part + 1) != NULL) {
+            task = restraint_task_lookup (app_data, *(part + 1));
+            named = TRUE;
+            break;
+        }
+    }
+    g_strfreev (splitpath);
+
+    if (!named && app_data->running == NULL && app_data->tasks != NULL) {
+        task = app_data->tasks->data;
+    }
+    return task;
+}
+
 gboolean
 server_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data) {
-    //ProcessData *process_data = (ProcessData *) user_data;
-    ClientData *client_data = (ClientData *) user_data;
-    //ClientData *client_data = process_data->user_data;
+    PluginRunData *plugin_data = (PluginRunData *) user_data;
+    ClientData *client_data = plugin_data->client_data;
     AppData *app_data = (AppData *) client_data->user_data;
     GError *tmp_error = NULL;
 
@@ -163,7 +215,8 @@ server_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data)
               g_warning ("failed to write message");
 
             /* Push data to our connections.. */
-            connections_write(app_data, LOG_PATH_HARNESS, buf, bytes_read);
+            connections_write_task (app_data, plugin_data->task,
+                                    LOG_PATH_HARNESS, buf, bytes_read);
             return G_SOURCE_CONTINUE;
 
           case G_IO_STATUS_ERROR:
@@ -194,7 +247,11 @@ server_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data)
 void
 plugin_finish_callback (gint pid_result, gboolean localwatchdog, gpointer user_data, GError *error)
 {
-    ClientData *client_data = (ClientData *) user_data;
+    PluginRunData *plugin_data = (PluginRunData *) user_data;
+    ClientData *client_data = plugin_data->client_data;
+
+    restraint_cgroup_free (plugin_data->cgroup);
+    g_slice_free (PluginRunData, plugin_data);
     if (error) {
         g_warning ("** ERROR: running plugins, %s\n", error->message);
     }
@@ -205,13 +262,57 @@ plugin_finish_callback (gint pid_result, gboolean localwatchdog, gpointer user_d
     g_slice_free(ClientData, client_data);
 }
 
+/*
+ * Only let the avc_check plugin search when new denials were logged since the
+ * last result.  If we can't tell let the plugin do its full search.
+ *
+ * The mark is kept per recipe, and per task while it runs in a
+ * concurrent group, so no other result consumes this one's denials.
+ * It isn't moved when the result disabled the avc plugins, the next
+ * result that runs them still has to see those denials.
+ */
+static gboolean
+avc_check_needed (AppData *app_data, Task *task, const gchar *disabled)
+{
+    GError *tmp_error = NULL;
+    guint denials = 0;
+    gchar **plugins;
+    gboolean skip = FALSE;
+
+    if (app_data->config_file == NULL) {
+        return TRUE;
+    }
+
+    plugins = g_strsplit (disabled ? disabled : "", " ", -1);
+    skip = g_strv_contains ((const gchar * const *) plugins, AVC_CHECK_PLUGIN) ||
+           g_strv_contains ((const gchar * const *) plugins, AVC_CLEAR_PLUGIN);
+    g_strfreev (plugins);
+    if (skip) {
+        return TRUE;
+    }
+
+    if (!restraint_avc_scan (AVC_AUDIT_LOG, app_data->config_file,
+                             task->concurrent ? task->task_id : app_data->config_section,
+                             task->concurrent ? app_data->config_section : NULL,
+                             &denials, &tmp_error)) {
+        if (!g_error_matches (tmp_error, RESTRAINT_AVC_ERROR,
+                              RESTRAINT_AVC_OPEN_ERROR)) {
+            g_message ("%s", tmp_error->message);
+        }
+        g_clear_error (&tmp_error);
+        return TRUE;
+    }
+
+    return denials > 0;
+}
+
 static void
 server_msg_complete (SoupSession *session, SoupMessage *server_msg, gpointer user_data)
 {
     ClientData *client_data = (ClientData *) user_data;
     AppData *app_data = (AppData *) client_data->user_data;
     SoupMessage *client_msg = client_data->client_msg;
-    Task *task = app_data->tasks->data;
+    Task *task = client_data->task;
     GHashTable *table;
     gboolean no_plugins = FALSE;
     SoupMessageHeadersIter iter;
@@ -241,46 +342,67 @@ server_msg_complete (SoupSession *session, SoupMessage *server_msg, gpointer use
             // Create a new ProcessCommand
             gchar *command = g_strdup_printf ("%s %s", TASK_PLUGIN_SCRIPT, PLUGIN_SCRIPT);
 
-            // Last four entries are NULL.  Replace first three with plugin vars
+            // Last five entries are NULL.  Replace the first three with plugin
+            // vars, the optional ones follow them without a gap.
             gchar *result_server = g_strdup_printf("RSTRNT_RESULT_URL=%s", soup_message_headers_get_one (client_msg->response_headers, "Location"));
+            if (task->env->pdata[task->env->len - 6] != NULL) {
+                g_free (task->env->pdata[task->env->len - 6]);
+            }
+            task->env->pdata[task->env->len - 6] = result_server;
+
+            gchar *plugin_dir = g_strdup_printf("RSTRNT_PLUGINS_DIR=%s/report_result.d", PLUGIN_DIR);
             if (task->env->pdata[task->env->len - 5] != NULL) {
                 g_free (task->env->pdata[task->env->len - 5]);
             }
-            task->env->pdata[task->env->len - 5] = result_server;
+            task->env->pdata[task->env->len - 5] = plugin_dir;
 
-            gchar *plugin_dir = g_strdup_printf("RSTRNT_PLUGINS_DIR=%s/report_result.d", PLUGIN_DIR);
+            gchar *no_plugins = g_strdup_printf("RSTRNT_NOPLUGINS=1");
             if (task->env->pdata[task->env->len - 4] != NULL) {
                 g_free (task->env->pdata[task->env->len - 4]);
             }
-            task->env->pdata[task->env->len - 4] = plugin_dir;
+            task->env->pdata[task->env->len - 4] = no_plugins;
 
-            gchar *no_plugins = g_strdup_printf("RSTRNT_NOPLUGINS=1");
-            if (task->env->pdata[task->env->len - 3] != NULL) {
-                g_free (task->env->pdata[task->env->len - 3]);
+            guint optional = task->env->len - 3;
+            for (guint i = optional; i < task->env->len - 1; i++) {
+                g_free (task->env->pdata[i]);
+                task->env->pdata[i] = NULL;
             }
-            task->env->pdata[task->env->len - 3] = no_plugins;
-            gchar *disable_plugin = g_hash_table_lookup (table, "disable_plugin");
-            if (disable_plugin) {
-                gchar *disabled_plugins = g_strdup_printf ("RSTRNT_DISABLED=%s", disable_plugin);
-                if (task->env->pdata[task->env->len - 2] != NULL) {
-                    g_free (task->env->pdata[task->env->len - 2]);
-                }
-                task->env->pdata[task->env->len - 2] = disabled_plugins;
+            GString *disable_plugin = g_string_new (g_hash_table_lookup (table, "disable_plugin"));
+            if (disable_plugin->len) {
+                task->env->pdata[optional++] = g_strdup_printf ("RSTRNT_DISABLED=%s",
+                                                                disable_plugin->str);
             }
-
-            process_run ((const gchar *) command,
-                         (const gchar **) task->env->pdata,
-                         "/usr/share/restraint/plugins",
-                         FALSE,
-                         0,
-                         NULL,
-                         server_io_callback,
-                         plugin_finish_callback,
-                         NULL,
-                         0,
-                         FALSE,
-                         app_data->cancellable,
-                         client_data);
+            // Without new denials the avc plugin only uploads avc.log
+            if (!avc_check_needed (app_data, task, disable_plugin->str)) {
+                task->env->pdata[optional++] = g_strdup ("RSTRNT_AVC_NO_NEW=1");
+            }
+            g_string_free (disable_plugin, TRUE);
+
+            static guint report_count = 0;
+            PluginRunData *plugin_data = g_slice_new0 (PluginRunData);
+            plugin_data->client_data = client_data;
+            plugin_data->task = task;
+            gchar *cgroup_name = g_strdup_printf ("task-%s-report-%u",
+                                                  task->task_id, ++report_count);
+            g_strdelimit (cgroup_name, "/", '_');
+            plugin_data->cgroup = restraint_cgroup_new (cgroup_name, NULL);
+            g_free (cgroup_name);
+
+            process_run_in_cgroup (plugin_data->cgroup ? plugin_data->cgroup->fd : -1,
+                                   (const gchar *) command,
+                                   (const gchar **) task->env->pdata,
+                                   "/usr/share/restraint/plugins",
+                                   FALSE,
+                                   0,
+                                   NULL,
+                                   server_io_callback,
+                                   plugin_finish_callback,
+                                   NULL,
+                                   0,
+                                   FALSE,
+                                   app_data->cancellable,
+                                   task,
+                                   plugin_data);
             g_free (command);
         }
         g_hash_table_destroy (table);
@@ -296,12 +418,293 @@ server_msg_complete (SoupSession *session, SoupMessage *server_msg, gpointer use
     }
 }
 
+/*
+ * Several recipes can be run at once, requests for them are told apart by
+ * the recipes/<id> part of their path.  With a single recipe everything
+ * goes to it.
+ */
+static AppData *
+server_request_recipe (const gchar *path)
+{
+    if (g_list_length (hosted_recipes) == 1) {
+        return (AppData *) hosted_recipes->data;
+    }
+
+    gchar **splitpath = g_strsplit (path, "/", -1);
+    AppData *found = NULL;
+
+    for (gchar **part = splitpath; *part != NULL; part++) {
+        if (g_strcmp0 (*part, "recipes") != 0 || *(part + 1) == NULL) {
+            continue;
+        }
+        for (GList *iter = hosted_recipes; iter != NULL; iter = g_list_next (iter)) {
+            AppData *app_data = (AppData *) iter->data;
+            if (app_data->recipe != NULL &&
+                    g_strcmp0 (app_data->recipe->recipe_id, *(part + 1)) == 0) {
+                found = app_data;
+                break;
+            }
+        }
+        break;
+    }
+    g_strfreev (splitpath);
+    return found;
+}
+
+/*
+ * Anyone who can reach the unix socket could also use TCP, the socket
+ * is only there to be quicker.  Still only take commands from root or
+ * from whoever runs restraintd.
+ */
+static gboolean
+server_peer_allowed (SoupClientContext *context)
+{
+    GSocket *socket = soup_client_context_get_gsocket (context);
+    GCredentials *credentials;
+    GError *error = NULL;
+    uid_t uid;
+
+    if (socket == NULL || g_socket_get_family (socket) != G_SOCKET_FAMILY_UNIX) {
+        return TRUE;
+    }
+    credentials = g_socket_get_credentials (socket, &error);
+    if (credentials == NULL) {
+        g_warning ("Unable to get peer credentials: %s", error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+    uid = g_credentials_get_unix_user (credentials, &error);
+    g_object_unref (credentials);
+    if (error != NULL) {
+        g_warning ("Unable to get peer credentials: %s", error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+    return uid == 0 || uid == geteuid ();
+}
+
+/*
+ * Log PUTs bigger than LOG_STREAM_CHUNK are not accumulated, their body
+ * is passed on as it arrives in ranged PUTs of that size.  Once
+ * LOG_STREAM_PENDING of them are queued the client is paused until the
+ * lab controller catches up.
+ */
+#define LOG_STREAM "restraint-log-stream"
+#define LOG_STREAM_CHUNK 131072
+#define LOG_STREAM_PENDING 4
+
+typedef struct {
+    gint ref_count;
+    AppData *app_data;
+    SoupServer *server;
+    SoupMessage *client_msg;
+    SoupURI *server_uri;
+    GByteArray *buffer;
+    // where buffer starts in the log and its length for Content-Range
+    goffset offset;
+    gchar *total;
+    guint pending;
+    gboolean paused;
+    gboolean received;
+    gboolean finished;
+    guint status;
+} LogStream;
+
+static void
+log_stream_unref (LogStream *stream)
+{
+    if (--stream->ref_count > 0) {
+        return;
+    }
+    g_object_unref (stream->client_msg);
+    soup_uri_free (stream->server_uri);
+    g_byte_array_free (stream->buffer, TRUE);
+    g_free (stream->total);
+    g_slice_free (LogStream, stream);
+}
+
+static void
+log_stream_respond (LogStream *stream)
+{
+    soup_message_set_status (stream->client_msg, stream->status);
+    soup_server_unpause_message (stream->server, stream->client_msg);
+}
+
 static void
+log_stream_put_complete (SoupSession *session, SoupMessage *server_msg,
+                         gpointer user_data)
+{
+    LogStream *stream = (LogStream *) user_data;
+
+    stream->pending--;
+    // Keep the first failure, otherwise answer like the last PUT
+    if (stream->status == 0 || SOUP_STATUS_IS_SUCCESSFUL (stream->status)) {
+        stream->status = server_msg->status_code;
+    }
+    if (!stream->finished) {
+        if (stream->received && stream->pending == 0) {
+            log_stream_respond (stream);
+        } else if (stream->paused && stream->pending < LOG_STREAM_PENDING) {
+            stream->paused = FALSE;
+            soup_server_unpause_message (stream->server, stream->client_msg);
+        }
+    }
+    log_stream_unref (stream);
+}
+
+static void
+log_stream_send (LogStream *stream, guint len)
+{
+    SoupMessage *server_msg = soup_message_new_from_uri ("PUT", stream->server_uri);
+    SoupMessageHeadersIter iter;
+    const gchar *name, *value;
+
+    soup_message_headers_iter_init (&iter, stream->client_msg->request_headers);
+    while (soup_message_headers_iter_next (&iter, &name, &value)) {
+        if (g_ascii_strcasecmp (name, "Content-Range") != 0 &&
+            g_ascii_strcasecmp (name, "Content-Length") != 0 &&
+            g_ascii_strcasecmp (name, "Host") != 0) {
+            copy_header (stream->server_uri, name, value, server_msg->request_headers);
+        }
+    }
+    gchar *range = g_strdup_printf ("bytes %" G_GOFFSET_FORMAT "-%" G_GOFFSET_FORMAT "/%s",
+                                    stream->offset, stream->offset + len - 1,
+                                    stream->total);
+    soup_message_headers_replace (server_msg->request_headers, "Content-Range", range);
+    g_free (range);
+    soup_message_body_append (server_msg->request_body, SOUP_MEMORY_COPY,
+                              stream->buffer->data, len);
+    g_byte_array_remove_range (stream->buffer, 0, len);
+    stream->offset += len;
+    stream->pending++;
+    stream->ref_count++;
+
+    stream->app_data->queue_message (soup_session,
+                                     server_msg,
+                                     stream->app_data->message_data,
+                                     log_stream_put_complete,
+                                     stream->app_data->cancellable,
+                                     stream);
+}
+
+static void
+log_stream_got_chunk (SoupMessage *client_msg, SoupBuffer *chunk, gpointer user_data)
+{
+    LogStream *stream = (LogStream *) user_data;
+
+    g_byte_array_append (stream->buffer, (const guint8 *) chunk->data, chunk->length);
+    while (stream->buffer->len >= LOG_STREAM_CHUNK) {
+        log_stream_send (stream, LOG_STREAM_CHUNK);
+    }
+    if (!stream->paused && stream->pending >= LOG_STREAM_PENDING) {
+        stream->paused = TRUE;
+        soup_server_pause_message (stream->server, client_msg);
+    }
+}
+
+static void
+log_stream_finished (SoupMessage *client_msg, gpointer user_data)
+{
+    LogStream *stream = (LogStream *) user_data;
+
+    // Responded to, or the client went away
+    stream->finished = TRUE;
+    g_object_set_data (G_OBJECT (client_msg), LOG_STREAM, NULL);
+    log_stream_unref (stream);
+}
+
+/* The whole body has arrived, answer once the last PUT is sent */
+static void
+log_stream_received (LogStream *stream)
+{
+    stream->received = TRUE;
+    if (stream->buffer->len > 0) {
+        log_stream_send (stream, stream->buffer->len);
+    }
+    if (stream->pending == 0) {
+        soup_message_set_status (stream->client_msg, stream->status);
+    } else {
+        soup_server_pause_message (stream->server, stream->client_msg);
+    }
+}
+
+static void
+log_stream_got_headers (SoupMessage *client_msg, gpointer user_data)
+{
+    SoupServer *server = (SoupServer *) user_data;
+    const gchar *path = soup_uri_get_path (soup_message_get_uri (client_msg));
+    const gchar *range;
+    goffset offset = 0;
+    gchar *total;
+
+    if (g_strcmp0 (client_msg->method, "PUT") != 0 ||
+        g_strrstr (path, "/logs/") == NULL ||
+        soup_message_headers_get_encoding (client_msg->request_headers) != SOUP_ENCODING_CONTENT_LENGTH ||
+        soup_message_headers_get_content_length (client_msg->request_headers) <= LOG_STREAM_CHUNK) {
+        return;
+    }
+
+    AppData *app_data = server_request_recipe (path);
+    if (app_data == NULL || app_data->state == RECIPE_IDLE) {
+        return;
+    }
+    // Rejected by server_recipe_callback
+    Task *task = server_request_task (app_data, path);
+    if (task == NULL) {
+        return;
+    }
+
+    // A range of the log is split up further
+    range = soup_message_headers_get_one (client_msg->request_headers, "Content-Range");
+    if (range != NULL) {
+        const gchar *slash = strchr (range, '/');
+        if (!g_str_has_prefix (range, "bytes ") || slash == NULL) {
+            return;
+        }
+        offset = g_ascii_strtoll (range + strlen ("bytes "), NULL, BASE10);
+        total = g_strdup (slash + 1);
+    } else {
+        total = g_strdup_printf ("%" G_GOFFSET_FORMAT,
+                soup_message_headers_get_content_length (client_msg->request_headers));
+    }
+
+    gchar *uri = soup_uri_to_string (task->task_uri, FALSE);
+    gchar *log_url = swap_base (path, uri, "/recipes/");
+
+    LogStream *stream = g_slice_new0 (LogStream);
+    stream->ref_count = 1;
+    stream->app_data = app_data;
+    stream->server = server;
+    stream->client_msg = g_object_ref (client_msg);
+    stream->server_uri = soup_uri_new (log_url);
+    stream->buffer = g_byte_array_sized_new (LOG_STREAM_CHUNK);
+    stream->offset = offset;
+    stream->total = total;
+    g_free (log_url);
+    g_free (uri);
+
+    soup_message_body_set_accumulate (client_msg->request_body, FALSE);
+    g_object_set_data (G_OBJECT (client_msg), LOG_STREAM, stream);
+    g_signal_connect (client_msg, "got-chunk", G_CALLBACK (log_stream_got_chunk), stream);
+    g_signal_connect (client_msg, "finished", G_CALLBACK (log_stream_finished), stream);
+}
+
+void
+server_request_started (SoupServer *server, SoupMessage *client_msg,
+                        SoupClientContext *context, gpointer data)
+{
+    if (server_peer_allowed (context)) {
+        g_signal_connect (client_msg, "got-headers",
+                          G_CALLBACK (log_stream_got_headers), server);
+    }
+}
+
+void
 server_recipe_callback (SoupServer *server, SoupMessage *client_msg,
                      const char *path, GHashTable *query,
                      SoupClientContext *context, gpointer data)
 {
-    AppData *app_data = (AppData *) data;
+    AppData *app_data = server_request_recipe (path);
     SoupMessage *server_msg;
     SoupURI *server_uri;
     SoupMessageHeadersIter iter;
@@ -311,6 +714,22 @@ server_recipe_callback (SoupServer *server, SoupMessage *client_msg,
     gchar *form_data;
     gchar *form_seconds;
 
+    if (!server_peer_allowed (context)) {
+        soup_message_set_status (client_msg, SOUP_STATUS_FORBIDDEN);
+        return;
+    }
+
+    LogStream *stream = g_object_get_data (G_OBJECT (client_msg), LOG_STREAM);
+    if (stream != NULL) {
+        log_stream_received (stream);
+        return;
+    }
+
+    if (app_data == NULL) {
+        soup_message_set_status_full (client_msg, SOUP_STATUS_BAD_REQUEST, "No Recipe Running");
+        return;
+    }
+
     ClientData *client_data = g_slice_new0 (ClientData);
     client_data->path = path;
     client_data->user_data = app_data;
@@ -322,8 +741,16 @@ server_recipe_callback (SoupServer *server, SoupMessage *client_msg,
         g_slice_free (ClientData, client_data);
         return;
     }
-    // FIXME - make sure we have valid tasks first
-    Task *task = (Task *) app_data->tasks->data;
+    Task *task = server_request_task (app_data, path);
+    client_data->task = task;
+
+    // Only aborting the recipe works without a task
+    if (task == NULL && !g_str_has_suffix (path, "status")) {
+        soup_message_set_status_full (client_msg, SOUP_STATUS_NOT_FOUND,
+                                      "Task not running");
+        g_slice_free (ClientData, client_data);
+        return;
+    }
 
     if (g_str_has_suffix (path, "/results/")) {
         server_uri = soup_uri_new_with_base (task->task_uri, "results/");
@@ -376,6 +803,7 @@ server_recipe_callback (SoupServer *server, SoupMessage *client_msg,
         // Client msg content gets copied further below.
         server_uri = soup_uri_new_with_base (task->recipe->recipe_uri, "watchdog");
         server_msg = soup_message_new_from_uri ("POST", server_uri);
+        restraint_message_supersedes (server_msg);
 
         // This updates the local watchdog
         if (task->metadata->nolocalwatchdog) {
@@ -422,13 +850,17 @@ server_recipe_callback (SoupServer *server, SoupMessage *client_msg,
           goto status_cleanup;
         }
 
-        if (task_id != NULL && g_strcmp0(task_id, task->task_id) != 0) {
+        if (task_id != NULL && task == NULL) {
           soup_message_set_status_full(client_msg, SOUP_STATUS_BAD_REQUEST,
                                        "Wrong task id");
           goto status_cleanup;
         }
 
-        if (task_id != NULL && recipe_id != NULL) {
+        if (task_id != NULL && task->cancellable != NULL) {
+          // Only this one of the concurrently running tasks is aborted
+          g_cancellable_cancel(task->cancellable);
+          soup_message_set_status (client_msg, SOUP_STATUS_OK);
+        } else if (task_id != NULL && recipe_id != NULL) {
           app_data->aborted = ABORTED_TASK;
           g_cancellable_cancel(app_data->cancellable);
           soup_message_set_status (client_msg, SOUP_STATUS_OK);
@@ -509,7 +941,7 @@ client_cb (GIOChannel *io, GIOCondition condition, gpointer user_data)
     return FALSE;
 }
 
-static void
+void
 read_job_xml (AppData *app_data, SoupServer *soup_server)
 {
 
@@ -537,225 +969,45 @@ read_job_xml (AppData *app_data, SoupServer *soup_server)
                                                   recipe_handler_finish);
 }
 
-gboolean
-quit_loop_handler (gpointer user_data)
-{
-    printf("[*] Stopping mainloop\n");
-    g_main_loop_quit (loop);
-    return FALSE;
-}
-
-static gboolean
-on_signal_term (AppData *app_data)
-{
-  if (app_data->close_message && app_data->message_data) {
-      app_data->close_message(app_data->message_data);
-  }
-
-  g_idle_add_full (G_PRIORITY_LOW,
-                   quit_loop_handler,
-                   NULL,
-                   NULL);
-  return G_SOURCE_REMOVE;
-}
-
-static gboolean
-on_sighup_term (gpointer user_data)
-{
-  AppData *app_data = (AppData *) user_data;
-  app_data->last_signal = SIGHUP;
-  return(on_signal_term(app_data));
-}
-
-static gboolean
-on_sigterm_term (gpointer user_data)
-{
-  AppData *app_data = (AppData *) user_data;
-  app_data->last_signal = SIGTERM;
-  return(on_signal_term(app_data));
-}
-
-static gboolean
-on_sigint_term (gpointer user_data)
-{
-  AppData *app_data = (AppData *) user_data;
-  app_data->last_signal = SIGINT;
-  return(on_signal_term(app_data));
-}
-
-static GLogWriterOutput
-null_log_writer (GLogLevelFlags   log_level,
-                 const GLogField *fields,
-                 gsize            n_fields,
-                 gpointer         user_data)
-{
-  return G_LOG_WRITER_HANDLED;
-}
-
-/* Bind server to available IPv4 and IPv6 local addresses
- *
- * The server must NOT already be listening on any interface.
- *
- * If port is 0, the server will find an unused port to listen on. The
- * port will be the same for both addresses.
- *
- * Returns the port used if the server is bound to at least one address.
- * 0 otherwise.
- */
-static guint
-rstrnt_listen_any_local (SoupServer *server, guint port)
+AppData *
+server_app_data_new (const gchar *config_section)
 {
-    GError   *error;
-    GSList   *uris;
-    gboolean  is_listening;
-
-    g_return_val_if_fail (server != NULL, 0);
-
-    /* Ensure that server is not listening on any interface */
-    uris = soup_server_get_uris (server);
-    is_listening = g_slist_length (uris) > 0;
-    g_slist_free (uris);
-    g_return_val_if_fail (!is_listening, 0);
-
-    error = NULL;
-
-    is_listening = soup_server_listen_local (server, port, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
-
-    if (error != NULL) {
-        g_warning ("Unable to listen on local IPv4 address: %s\n", error->message);
-        g_clear_error (&error);
-    } else if (port == 0) {
-        /* When the port is chosen by the server, get the one used for
-           IPv4 to use the same value for IPv6 */
-
-        uris = soup_server_get_uris (server);
-        port = ((SoupURI *) uris->data)->port;
-
-        g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
-    }
-
-    is_listening |= soup_server_listen_local (server, port, SOUP_SERVER_LISTEN_IPV6_ONLY, &error);
-
-    if (error != NULL) {
-        g_warning ("Unable to listen on local IPv6 address: %s\n", error->message);
-        g_clear_error (&error);
-    }
-
-    return is_listening ? port : 0;
-}
-
-int main(int argc, char *argv[]) {
   AppData *app_data = g_slice_new0(AppData);
   app_data->cancellable = g_cancellable_new ();
   app_data->aborted = ABORTED_NONE;
   app_data->config_file = NULL;
-  const gchar *config = "config.conf";
-  SoupServer *soup_server = NULL;
-  GError *error = NULL;
-
-  app_data->port = 0;
-
-  GOptionEntry entries [] = {
-    { "port", 'p', 0, G_OPTION_ARG_INT, &app_data->port, "Port to listen on", "PORT" },
-    { "stdin", 's', 0, G_OPTION_ARG_NONE, &app_data->stdin, "Run from STDIN/STDOUT", NULL },
-    { NULL }
-  };
-  GOptionContext *context = g_option_context_new(NULL);
-  g_option_context_set_summary(context,
-          "Test harness for Beaker. Runs tasks according to a recipe.");
-  g_option_context_add_main_entries(context, entries, NULL);
-  gboolean parse_succeeded = g_option_context_parse(context, &argc, &argv, &app_data->error);
-  g_option_context_free(context);
-
-  if (!parse_succeeded) {
-    exit (PARSE_ARGS_FAILED);
-  }
-
-  if (app_data->stdin) {
-      g_set_printerr_handler (NULL);
-      g_log_set_writer_func (null_log_writer, NULL, NULL);
-  } else {
-      app_data->config_file = g_build_filename (VAR_LIB_PATH, config, NULL);
-      app_data->recipe_url = restraint_config_get_string (app_data->config_file,
-                                                          "restraint",
-                                                          "recipe_url", &error);
-  }
-
-  if (error) {
-      g_printerr ("%s [%s, %d]\n",
-                  error->message,
-                  g_quark_to_string (error->domain),
-                  error->code);
-      g_clear_error (&error);
-      exit (FAILED_GET_CONFIG_FILE);
-  }
-
-  if (app_data->recipe_url) {
-    app_data->queue_message = (QueueMessage) restraint_queue_message;
-    app_data->fetch_retries = 0;
-    app_data->state = RECIPE_FETCH;
-    app_data->recipe_handler_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-                                                  recipe_handler,
-                                                  app_data,
-                                                  recipe_handler_finish);
-  }
-
-  soup_session = soup_session_new();
-  soup_session_add_feature_by_type (soup_session, SOUP_TYPE_CONTENT_SNIFFER);
-
-  // Define a soup server
-  soup_server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "restraint ", NULL);
-
-  soup_server_add_handler (soup_server, "/recipes",
-                           server_recipe_callback, app_data, NULL);
-
-  /* Tell our soup server to listen on any local interface. This includes
-     IPv4 and IPv6 if available */
-  app_data->port = rstrnt_listen_any_local (soup_server, app_data->port);
-
-  if (app_data->port == 0) {
-      g_printerr ("Unable to listen on any IPv4 or IPv6 local address, exiting...\n");
-      exit (FAILED_LISTEN);
-  }
-
-  app_data->restraint_url = g_strdup_printf ("http://localhost:%d", app_data->port);
-  g_print ("Listening on %s\n", app_data->restraint_url);
-
-  g_unix_signal_add (SIGINT, on_sigint_term, app_data);
-  g_unix_signal_add (SIGTERM, on_sigterm_term, app_data);
-  g_unix_signal_add (SIGHUP, on_sighup_term, app_data);
-  int r = prctl(PR_SET_PDEATHSIG, SIGHUP);
-  if (r == -1) {
-     g_printerr ("Unable to set Parent Death Signal to SIGHUP: %s\n", g_strerror (errno));
-     exit (FAILED_SET_PDEATHSIG);
-  }
-
-  // Read job.xml from STDIN
-  if (app_data->stdin) {
-      read_job_xml(app_data, soup_server);
-  }
-
-  /* enter mainloop */
-  loop = g_main_loop_new (NULL, FALSE);
-  g_main_loop_run (loop);
+  app_data->config_section = g_strdup (config_section);
+  hosted_recipes = g_list_append (hosted_recipes, app_data);
+  return app_data;
+}
 
-  if (app_data->last_signal != 0) {
-      g_message("restraintd quit on received signal: %s(%u)\n",
-                strsignal(app_data->last_signal),
-                app_data->last_signal);
+/*
+ * Each [restraint:NAME] section of the config with a recipe_url is a further
+ * recipe to run alongside the one in [restraint].  Its tasks are unpacked
+ * under TASK_LOCATION/NAME so the recipes can't unpack on top of each other.
+ */
+void
+server_add_hosted_recipes (gchar *config_file)
+{
+  gchar **groups = restraint_config_get_groups (config_file);
+
+  for (gchar **group = groups; groups != NULL && *group != NULL; group++) {
+      if (!g_str_has_prefix (*group, HOSTED_SECTION_PREFIX)) {
+          continue;
+      }
+      const gchar *name = *group + strlen (HOSTED_SECTION_PREFIX);
+      gchar *recipe_url = restraint_config_get_string (config_file, *group,
+                                                       "recipe_url", NULL);
+      if (recipe_url == NULL || *name == '\0' || strchr (name, '/') != NULL) {
+          g_warning ("Ignoring config section [%s], it needs a recipe_url "
+                     "and a name without '/'", *group);
+          g_free (recipe_url);
+          continue;
+      }
+      AppData *app_data = server_app_data_new (*group);
+      app_data->config_file = g_strdup (config_file);
+      app_data->recipe_url = recipe_url;
+      app_data->task_base = g_build_filename (TASK_LOCATION, name, NULL);
   }
-
-  soup_session_abort(soup_session);
-  soup_session_remove_feature_by_type (soup_session, SOUP_TYPE_CONTENT_SNIFFER);
-  g_object_unref(soup_session);
-
-  // no longer need to call soup_server_quit as disconnect does it all.
-  soup_server_disconnect(soup_server);
-  g_object_unref(soup_server);
-
-  restraint_free_app_data(app_data);
-
-  g_main_loop_unref(loop);
-
-  return 0;
+  g_strfreev (groups);
 }
@@ -19,6 +19,7 @@
 #define _RESTRAINT_SERVER_H
 
 #include <libxml/tree.h>
+#include <libsoup/soup.h>
 
 #define VAR_LIB_PATH "/var/lib/restraint"
 #define PLUGIN_SCRIPT "/usr/share/restraint/plugins/run_plugins"
@@ -26,6 +27,8 @@
 #define PLUGIN_DIR "/usr/share/restraint/plugins"
 #define FETCH_RETRIES 3
 #define FETCH_INTERVAL 10
+#define CONFIG_SECTION "restraint"
+#define HOSTED_SECTION_PREFIX "restraint:" // sections of further recipes to run
 
 typedef enum {
   ABORTED_NONE,
@@ -56,8 +59,26 @@ typedef struct {
   guint fetch_retries;
   gboolean stdin;
   guint last_signal;
+  GSList *prefetches;
+  gboolean prefetch_waiting;
+  GCancellable *prefetch_cancellable;
+  GSList *running;
+  gboolean running_waiting;
+  gchar *config_section;
+  gchar *task_base;
 } AppData;
 
+extern GList *hosted_recipes;
+
 void connections_write (AppData *app_data, const gchar *path,
                         const gchar *msg_data, gsize msg_len);
+AppData *server_app_data_new (const gchar *config_section);
+void server_add_hosted_recipes (gchar *config_file);
+void restraint_free_app_data (AppData *app_data);
+void read_job_xml (AppData *app_data, SoupServer *soup_server);
+void server_request_started (SoupServer *server, SoupMessage *client_msg,
+                             SoupClientContext *context, gpointer data);
+void server_recipe_callback (SoupServer *server, SoupMessage *client_msg,
+                             const char *path, GHashTable *query,
+                             SoupClientContext *context, gpointer data);
 #endif
@@ -0,0 +1,347 @@
+/*
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <gio/gunixsocketaddress.h>
+#include <libsoup/soup.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include "recipe.h"
+#include "task.h"
+#include "common.h"
+#include "config.h"
+#include "process.h"
+#include "message.h"
+#include "server.h"
+#include "fetch_cache.h"
+#include "fetch.h"
+#include "fetch_uri.h"
+#include "metadata.h"
+#include "cgroup.h"
+#include "utils.h"
+
+GMainLoop *loop;
+char *strsignal(int sig);
+
+gboolean
+quit_loop_handler (gpointer user_data)
+{
+    printf("[*] Stopping mainloop\n");
+    g_main_loop_quit (loop);
+    return FALSE;
+}
+
+static gboolean
+on_signal_term (AppData *app_data)
+{
+  for (GList *iter = hosted_recipes; iter != NULL; iter = g_list_next (iter)) {
+      AppData *hosted = (AppData *) iter->data;
+      if (hosted->close_message && hosted->message_data) {
+          hosted->close_message(hosted->message_data);
+      }
+  }
+
+  g_idle_add_full (G_PRIORITY_LOW,
+                   quit_loop_handler,
+                   NULL,
+                   NULL);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_sighup_term (gpointer user_data)
+{
+  AppData *app_data = (AppData *) user_data;
+  app_data->last_signal = SIGHUP;
+  return(on_signal_term(app_data));
+}
+
+static gboolean
+on_sigterm_term (gpointer user_data)
+{
+  AppData *app_data = (AppData *) user_data;
+  app_data->last_signal = SIGTERM;
+  return(on_signal_term(app_data));
+}
+
+static gboolean
+on_sigint_term (gpointer user_data)
+{
+  AppData *app_data = (AppData *) user_data;
+  app_data->last_signal = SIGINT;
+  return(on_signal_term(app_data));
+}
+
+static GLogWriterOutput
+null_log_writer (GLogLevelFlags   log_level,
+                 const GLogField *fields,
+                 gsize            n_fields,
+                 gpointer         user_data)
+{
+  return G_LOG_WRITER_HANDLED;
+}
+
+/* Also listen on a unix socket at path for the rstrnt-* commands.
+ *
+ * Only restraintd's own user can connect, anyone else falls back to TCP.
+ */
+static gboolean
+rstrnt_listen_unix (SoupServer *server, const gchar *path)
+{
+    GError *error = NULL;
+    GSocketAddress *address = NULL;
+    GSocket *socket;
+    mode_t old_umask;
+    gboolean bound;
+
+    socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                           G_SOCKET_PROTOCOL_DEFAULT, &error);
+    if (socket == NULL) {
+        goto error;
+    }
+
+    // Left over from before a reboot
+    g_unlink (path);
+    address = g_unix_socket_address_new (path);
+    old_umask = umask (0077);
+    bound = g_socket_bind (socket, address, TRUE, &error);
+    umask (old_umask);
+    if (!bound ||
+        !g_socket_listen (socket, &error) ||
+        !soup_server_listen_socket (server, socket, 0, &error)) {
+        goto error;
+    }
+    g_object_unref (address);
+    g_object_unref (socket);
+    return TRUE;
+
+error:
+    g_warning ("Unable to listen on %s: %s", path, error->message);
+    g_clear_error (&error);
+    g_clear_object (&address);
+    g_clear_object (&socket);
+    return FALSE;
+}
+
+/* Bind server to available IPv4 and IPv6 local addresses
+ *
+ * The server must NOT already be listening on any interface.
+ *
+ * If port is 0, the server will find an unused port to listen on. The
+ * port will be the same for both addresses.
+ *
+ * Returns the port used if the server is bound to at least one address.
+ * 0 otherwise.
+ */
+static guint
+rstrnt_listen_any_local (SoupServer *server, guint port)
+{
+    GError   *error;
+    GSList   *uris;
+    gboolean  is_listening;
+
+    g_return_val_if_fail (server != NULL, 0);
+
+    /* Ensure that server is not listening on any interface */
+    uris = soup_server_get_uris (server);
+    is_listening = g_slist_length (uris) > 0;
+    g_slist_free (uris);
+    g_return_val_if_fail (!is_listening, 0);
+
+    error = NULL;
+
+    is_listening = soup_server_listen_local (server, port, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+
+    if (error != NULL) {
+        g_warning ("Unable to listen on local IPv4 address: %s\n", error->message);
+        g_clear_error (&error);
+    } else if (port == 0) {
+        /* When the port is chosen by the server, get the one used for
+           IPv4 to use the same value for IPv6 */
+
+        uris = soup_server_get_uris (server);
+        port = ((SoupURI *) uris->data)->port;
+
+        g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+    }
+
+    is_listening |= soup_server_listen_local (server, port, SOUP_SERVER_LISTEN_IPV6_ONLY, &error);
+
+    if (error != NULL) {
+        g_warning ("Unable to listen on local IPv6 address: %s\n", error->message);
+        g_clear_error (&error);
+    }
+
+    return is_listening ? port : 0;
+}
+
+int main(int argc, char *argv[]) {
+  AppData *app_data = server_app_data_new (CONFIG_SECTION);
+  const gchar *config = "config.conf";
+  SoupServer *soup_server = NULL;
+  gchar *socket_path = NULL;
+  GError *error = NULL;
+  gint fetch_cache_size = FETCH_CACHE_DEFAULT_SIZE;
+  gboolean no_cgroups = FALSE;
+
+  app_data->port = 0;
+
+  GOptionEntry entries [] = {
+    { "port", 'p', 0, G_OPTION_ARG_INT, &app_data->port, "Port to listen on", "PORT" },
+    { "stdin", 's', 0, G_OPTION_ARG_NONE, &app_data->stdin, "Run from STDIN/STDOUT", NULL },
+    { "fetch-cache-size", 0, 0, G_OPTION_ARG_INT, &fetch_cache_size,
+      "Size limit of the fetched archive cache, 0 disables it", "MiB" },
+    { "no-cgroups", 0, 0, G_OPTION_ARG_NONE, &no_cgroups,
+      "Don't run each task in a cgroup of its own", NULL },
+    { NULL }
+  };
+  GOptionContext *context = g_option_context_new(NULL);
+  g_option_context_set_summary(context,
+          "Test harness for Beaker. Runs tasks according to a recipe.");
+  g_option_context_add_main_entries(context, entries, NULL);
+  gboolean parse_succeeded = g_option_context_parse(context, &argc, &argv, &app_data->error);
+  g_option_context_free(context);
+
+  if (!parse_succeeded) {
+    exit (PARSE_ARGS_FAILED);
+  }
+
+  restraint_fetch_cache_configure (FETCH_CACHE_DIR,
+                                   (guint64) MAX (fetch_cache_size, 0) * 1024 * 1024);
+  restraint_metadata_cache_configure (METADATA_CACHE_DIR);
+  restraint_rmrf_configure (FETCH_TRASH_DIR);
+
+  if (!no_cgroups && !restraint_cgroup_init (&error)) {
+      g_message ("Running tasks without cgroups: %s", error->message);
+      g_clear_error (&error);
+  }
+  process_set_timing_callback (restraint_task_process_timing);
+
+  if (app_data->stdin) {
+      g_set_printerr_handler (NULL);
+      g_log_set_writer_func (null_log_writer, NULL, NULL);
+  } else {
+      app_data->config_file = g_build_filename (VAR_LIB_PATH, config, NULL);
+      app_data->recipe_url = restraint_config_get_string (app_data->config_file,
+                                                          CONFIG_SECTION,
+                                                          "recipe_url", &error);
+      if (!error) {
+          server_add_hosted_recipes (app_data->config_file);
+      }
+  }
+
+  if (error) {
+      g_printerr ("%s [%s, %d]\n",
+                  error->message,
+                  g_quark_to_string (error->domain),
+                  error->code);
+      g_clear_error (&error);
+      exit (FAILED_GET_CONFIG_FILE);
+  }
+
+  for (GList *iter = hosted_recipes; iter != NULL; iter = g_list_next (iter)) {
+    AppData *hosted = (AppData *) iter->data;
+    if (hosted->recipe_url) {
+      hosted->queue_message = (QueueMessage) restraint_queue_message;
+      hosted->fetch_retries = 0;
+      hosted->state = RECIPE_FETCH;
+      hosted->recipe_handler_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                                                  recipe_handler,
+                                                  hosted,
+                                                  recipe_handler_finish);
+    }
+  }
+
+  soup_session = soup_session_new();
+  soup_session_add_feature_by_type (soup_session, SOUP_TYPE_CONTENT_SNIFFER);
+
+  // Define a soup server
+  soup_server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "restraint ", NULL);
+
+  soup_server_add_handler (soup_server, "/recipes",
+                           server_recipe_callback, NULL, NULL);
+  g_signal_connect (soup_server, "request-started",
+                    G_CALLBACK (server_request_started), NULL);
+
+  /* Tell our soup server to listen on any local interface. This includes
+     IPv4 and IPv6 if available */
+  app_data->port = rstrnt_listen_any_local (soup_server, app_data->port);
+
+  if (app_data->port == 0) {
+      g_printerr ("Unable to listen on any IPv4 or IPv6 local address, exiting...\n");
+      exit (FAILED_LISTEN);
+  }
+
+  app_data->restraint_url = g_strdup_printf ("http://localhost:%d", app_data->port);
+  g_print ("Listening on %s\n", app_data->restraint_url);
+  socket_path = get_socket_filename (app_data->port);
+  if (rstrnt_listen_unix (soup_server, socket_path)) {
+      g_print ("Listening on %s\n", socket_path);
+  }
+  for (GList *iter = g_list_next (hosted_recipes); iter != NULL; iter = g_list_next (iter)) {
+      AppData *hosted = (AppData *) iter->data;
+      hosted->port = app_data->port;
+      hosted->restraint_url = g_strdup (app_data->restraint_url);
+  }
+
+  g_unix_signal_add (SIGINT, on_sigint_term, app_data);
+  g_unix_signal_add (SIGTERM, on_sigterm_term, app_data);
+  g_unix_signal_add (SIGHUP, on_sighup_term, app_data);
+  int r = prctl(PR_SET_PDEATHSIG, SIGHUP);
+  if (r == -1) {
+     g_printerr ("Unable to set Parent Death Signal to SIGHUP: %s\n", g_strerror (errno));
+     exit (FAILED_SET_PDEATHSIG);
+  }
+
+  // Read job.xml from STDIN
+  if (app_data->stdin) {
+      read_job_xml(app_data, soup_server);
+  }
+
+  /* enter mainloop */
+  loop = g_main_loop_new (NULL, FALSE);
+  g_main_loop_run (loop);
+
+  if (app_data->last_signal != 0) {
+      g_message("restraintd quit on received signal: %s(%u)\n",
+                strsignal(app_data->last_signal),
+                app_data->last_signal);
+  }
+
+  soup_session_abort(soup_session);
+  soup_session_remove_feature_by_type (soup_session, SOUP_TYPE_CONTENT_SNIFFER);
+  g_object_unref(soup_session);
+
+  // no longer need to call soup_server_quit as disconnect does it all.
+  soup_server_disconnect(soup_server);
+  g_object_unref(soup_server);
+  g_unlink(socket_path);
+  g_free(socket_path);
+
+  g_list_free_full(hosted_recipes, (GDestroyNotify) restraint_free_app_data);
+  hosted_recipes = NULL;
+  restraint_fetch_uri_cleanup();
+
+  g_main_loop_unref(loop);
+
+  return 0;
+}
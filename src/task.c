@@ -48,6 +48,13 @@ void
 restraint_task_result (Task *task, AppData *app_data, gchar *result,
                        gint int_score, gchar *path, gchar *message);
 
+static GSList *task_fetch_companions (AppData *app_data, Task *current);
+static void task_complete (AppData *app_data, Task *task, GString *message);
+static void task_status_post (Task *task, AppData *app_data, gchar *status,
+                              gchar *taskversion, GError *reason,
+                              MessageFinishCallback finish_callback,
+                              gpointer user_data);
+
 void
 archive_entry_callback (const gchar *entry, gpointer user_data)
 {
@@ -81,13 +88,20 @@ fetch_retry (gpointer user_data)
     return FALSE;
 }
 
+/* The task whose roles are being refreshed */
+typedef struct {
+    AppData *app_data;
+    Task *task;
+} RefreshRolesData;
+
 static gboolean
 refresh_role_retry (gpointer user_data)
 {
-    AppData *app_data = (AppData *) user_data;
-    Task *task = (Task *) app_data->tasks->data;
+    RefreshRolesData *refresh_data = (RefreshRolesData *) user_data;
+    AppData *app_data = refresh_data->app_data;
 
-    task->state = TASK_REFRESH_ROLES;
+    refresh_data->task->state = TASK_REFRESH_ROLES;
+    g_slice_free (RefreshRolesData, refresh_data);
 
     app_data->task_handler_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
                                                 task_handler,
@@ -153,13 +167,17 @@ restraint_task_fetch(AppData *app_data) {
             } else if (g_strcmp0(scheme, "http") == 0 ||
                        g_strcmp0(scheme, "https") == 0  ||
                        g_strcmp0(scheme, "file") == 0) {
-                restraint_fetch_uri (task->fetch.url,
-                                      task->path,
-                                      task->keepchanges,
-                                      task->ssl_verify,
-                                      archive_entry_callback,
-                                      fetch_finish_callback,
-                                      app_data);
+                GSList *targets = task_fetch_companions (app_data, task);
+                targets = g_slist_prepend (targets,
+                                           restraint_fetch_uri_target_new (task->fetch.url->fragment,
+                                                                           task->path,
+                                                                           task->keepchanges,
+                                                                           archive_entry_callback,
+                                                                           fetch_finish_callback,
+                                                                           app_data));
+                restraint_fetch_uri_targets (task->fetch.url,
+                                             task->ssl_verify,
+                                             targets);
             } else {
                 g_set_error (&error, RESTRAINT_ERROR,
                              RESTRAINT_TASK_RUNNER_SCHEMA_ERROR,
@@ -188,7 +206,7 @@ restraint_task_fetch(AppData *app_data) {
             task_run_data->logpath = LOG_PATH_HARNESS;
             process_run ((const gchar *)command, NULL, NULL, FALSE, 0,
                          NULL, task_io_callback, task_handler_callback,
-                         NULL, 0, FALSE, app_data->cancellable, task_run_data);
+                         NULL, 0, FALSE, app_data->cancellable, task, task_run_data);
             g_free (command);
             break;
         default:
@@ -201,8 +219,413 @@ restraint_task_fetch(AppData *app_data) {
     }
 }
 
+/*
+ * Prefetch
+ *
+ * While a task is running we can fetch and unpack the next few tasks
+ * of the recipe so they don't start with a cold fetch.  The number of
+ * tasks to look ahead is set with the RSTRNT_PREFETCH recipe param.
+ *
+ * Only tasks which are unpacked from an archive are prefetched, package
+ * installs would compete with the running task for the package manager.
+ * Tasks whose path overlaps the running task, its repo dependencies or
+ * a task that comes earlier are left alone.  Anything that goes wrong is
+ * ignored, the task will simply be fetched as usual when its turn comes.
+ * Prefetches have a cancellable of their own, aborting the running task
+ * leaves them be.
+ */
+typedef struct {
+    AppData *app_data;
+    /* NULL once the recipe has gone away */
+    Task *task;
+    GCancellable *cancellable;
+    SoupURI *url;
+    gchar *path;
+    gchar *osmajor;
+    MetaData *metadata;
+} PrefetchData;
+
+static void
+prefetch_data_free (PrefetchData *prefetch_data)
+{
+    g_clear_object (&prefetch_data->cancellable);
+    soup_uri_free (prefetch_data->url);
+    g_free (prefetch_data->path);
+    g_free (prefetch_data->osmajor);
+    restraint_metadata_free (prefetch_data->metadata);
+    g_slice_free (PrefetchData, prefetch_data);
+}
+
+static void
+prefetch_done (PrefetchData *prefetch_data)
+{
+    AppData *app_data = prefetch_data->app_data;
+
+    if (prefetch_data->task != NULL) {
+        app_data->prefetches = g_slist_remove (app_data->prefetches,
+                                               prefetch_data);
+        // The current task is waiting on us before it can fetch.
+        if (app_data->prefetches == NULL && app_data->prefetch_waiting) {
+            app_data->prefetch_waiting = FALSE;
+            app_data->task_handler_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                                                         task_handler,
+                                                         app_data,
+                                                         NULL);
+        }
+    }
+    prefetch_data_free (prefetch_data);
+}
+
+static gboolean
+prefetch_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data)
+{
+    gchar buf[10000];
+    gsize bytes_read;
+
+    // Output of make testinfo.desc doesn't belong to the running task's
+    // logs, keep it in the journal only.
+    if (condition & G_IO_IN) {
+        switch (g_io_channel_read_chars (io, buf, sizeof (buf), &bytes_read, NULL)) {
+          case G_IO_STATUS_NORMAL:
+            if (fwrite (buf, sizeof (gchar), bytes_read, stdout) != bytes_read)
+                g_warning ("failed to write message");
+            return G_SOURCE_CONTINUE;
+          case G_IO_STATUS_AGAIN:
+            return G_SOURCE_CONTINUE;
+          default:
+            return G_SOURCE_REMOVE;
+        }
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void
+prefetch_metadata_finish_cb (gpointer user_data, GError *error)
+{
+    PrefetchData *prefetch_data = (PrefetchData *) user_data;
+    Task *task = prefetch_data->task;
+
+    if (error) {
+        g_message ("* Prefetch metadata for %s failed: %s",
+                   prefetch_data->path, error->message);
+        g_clear_error (&error);
+    } else if (task != NULL && task->metadata == NULL &&
+               prefetch_data->metadata != NULL) {
+        // restraint_get_metadata() only uses the metadata file in
+        // non rhts_compat mode.
+        gchar *metadata_file = g_build_filename (prefetch_data->path,
+                                                 "metadata", NULL);
+        task->rhts_compat = !file_exists (metadata_file);
+        g_free (metadata_file);
+
+        task->metadata = prefetch_data->metadata;
+        prefetch_data->metadata = NULL;
+    }
+    prefetch_done (prefetch_data);
+}
+
+/*
+ * Returns whether the task is still there to parse the metadata for.
+ */
+static gboolean
+prefetch_fetched (PrefetchData *prefetch_data, GError *error)
+{
+    AppData *app_data = prefetch_data->app_data;
+    Task *task = prefetch_data->task;
+
+    if (error) {
+        g_message ("* Prefetch of %s failed: %s", prefetch_data->path,
+                   error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+    if (task == NULL) {
+        return FALSE;
+    }
+
+    task->prefetched = TRUE;
+    restraint_config_set (app_data->config_file, task->task_id,
+                          "prefetched", NULL,
+                          G_TYPE_BOOLEAN, task->prefetched);
+    return TRUE;
+}
+
+static void
+prefetch_fetch_finish_cb (GError *error, guint32 match_cnt,
+                          guint32 nonmatch_cnt, gpointer user_data)
+{
+    PrefetchData *prefetch_data = (PrefetchData *) user_data;
+
+    if (!prefetch_fetched (prefetch_data, error)) {
+        prefetch_done (prefetch_data);
+        return;
+    }
+
+    restraint_get_metadata (prefetch_data->path,
+                            prefetch_data->osmajor,
+                            &prefetch_data->metadata,
+                            prefetch_data->cancellable,
+                            prefetch_metadata_finish_cb,
+                            prefetch_io_callback,
+                            NULL,
+                            prefetch_data);
+}
+
+static gboolean
+paths_overlap (const gchar *a, const gchar *b)
+{
+    gsize a_len = strlen (a);
+    gsize b_len = strlen (b);
+    gsize len = MIN (a_len, b_len);
+
+    if (strncmp (a, b, len) != 0) {
+        return FALSE;
+    }
+    if (a_len == b_len) {
+        return TRUE;
+    }
+    // One is a prefix of the other, they only overlap on a directory boundary.
+    const gchar *longer = a_len > b_len ? a : b;
+    return longer[len] == '/' || (len > 0 && longer[len - 1] == '/');
+}
+
+static gboolean
+path_is_busy (GSList *busy, const gchar *path)
+{
+    for (GSList *iter = busy; iter != NULL; iter = g_slist_next (iter)) {
+        if (paths_overlap (iter->data, path)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean
+task_can_prefetch (AppData *app_data, Task *task)
+{
+    if (task->fetch_method != TASK_FETCH_UNPACK ||
+        task->finished || task->prefetched) {
+        return FALSE;
+    }
+
+    const gchar *scheme = task->fetch.url->scheme;
+    if (g_strcmp0 (scheme, "git") != 0 &&
+        g_strcmp0 (scheme, "http") != 0 &&
+        g_strcmp0 (scheme, "https") != 0 &&
+        g_strcmp0 (scheme, "file") != 0) {
+        return FALSE;
+    }
+
+    // Task config hasn't been read yet, we may be coming back from a reboot.
+    if (!task->config_read) {
+        task->started = restraint_config_get_boolean (app_data->config_file,
+                                                      task->task_id,
+                                                      "started", NULL);
+        task->prefetched = restraint_config_get_boolean (app_data->config_file,
+                                                         task->task_id,
+                                                         "prefetched", NULL);
+        task->config_read = TRUE;
+    }
+    return !task->started && !task->prefetched;
+}
+
+static PrefetchData *
+prefetch_data_new (AppData *app_data, Task *task)
+{
+    PrefetchData *prefetch_data = g_slice_new0 (PrefetchData);
+
+    if (app_data->prefetch_cancellable == NULL) {
+        app_data->prefetch_cancellable = g_cancellable_new ();
+    }
+    prefetch_data->app_data = app_data;
+    prefetch_data->task = task;
+    prefetch_data->cancellable = g_object_ref (app_data->prefetch_cancellable);
+    prefetch_data->url = soup_uri_copy (task->fetch.url);
+    prefetch_data->path = g_strdup (task->path);
+    app_data->prefetches = g_slist_prepend (app_data->prefetches,
+                                            prefetch_data);
+    return prefetch_data;
+}
+
+static gboolean
+task_is_prefetching (AppData *app_data, Task *task)
+{
+    for (GSList *iter = app_data->prefetches; iter != NULL; iter = g_slist_next (iter)) {
+        PrefetchData *prefetch_data = iter->data;
+        if (prefetch_data->task == task) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Prefetch the tasks following current, which has just started running.
+ */
+void
+restraint_task_prefetch (AppData *app_data, Task *current)
+{
+    g_return_if_fail (app_data != NULL);
+    g_return_if_fail (current != NULL);
+
+    const gchar *value = restraint_recipe_get_param (current->recipe,
+                                                     PREFETCH_PARAM);
+    if (value == NULL) {
+        return;
+    }
+    guint64 depth = MIN (g_ascii_strtoull (value, NULL, 10), PREFETCH_MAX);
+
+    // Paths which are in use by the running tasks.
+    GSList *busy = g_slist_prepend (NULL, g_strdup (current->path));
+    for (GSList *run = app_data->running; run != NULL; run = g_slist_next (run)) {
+        TaskRunData *task_run_data = (TaskRunData *) run->data;
+        busy = g_slist_prepend (busy, g_strdup (task_run_data->task->path));
+    }
+    if (current->fetch_method == TASK_FETCH_UNPACK && current->metadata) {
+        for (GSList *iter = current->metadata->repodeps; iter != NULL;
+             iter = g_slist_next (iter)) {
+            busy = g_slist_prepend (busy, g_build_filename (current->recipe->base_path,
+                                                            current->fetch.url->host,
+                                                            current->fetch.url->path,
+                                                            (gchar *) iter->data,
+                                                            NULL));
+        }
+    }
+
+    GList *iter = g_list_next (g_list_find (app_data->tasks, current));
+    for (guint64 i = 0; i < depth && iter != NULL; i++, iter = g_list_next (iter)) {
+        Task *task = (Task *) iter->data;
+
+        if (!task_is_prefetching (app_data, task) &&
+            !path_is_busy (busy, task->path) &&
+            task_can_prefetch (app_data, task)) {
+            PrefetchData *prefetch_data = prefetch_data_new (app_data, task);
+            prefetch_data->osmajor = g_strdup (task->recipe->osmajor);
+
+            g_message ("* Prefetching task: %s [%s]", task->task_id, task->path);
+            if (g_strcmp0 (prefetch_data->url->scheme, "git") == 0) {
+                restraint_fetch_git (prefetch_data->url,
+                                     prefetch_data->path,
+                                     task->keepchanges,
+                                     NULL,
+                                     prefetch_fetch_finish_cb,
+                                     prefetch_data);
+            } else {
+                restraint_fetch_uri (prefetch_data->url,
+                                     prefetch_data->path,
+                                     task->keepchanges,
+                                     task->ssl_verify,
+                                     NULL,
+                                     prefetch_fetch_finish_cb,
+                                     prefetch_data);
+            }
+        }
+        // Later tasks must not touch anything this one will use.
+        busy = g_slist_prepend (busy, g_strdup (task->path));
+    }
+    g_slist_free_full (busy, g_free);
+}
+
+/*
+ * Fetch once, extract many
+ *
+ * Recipes often point every task at a different fragment of the same
+ * tests archive.  When a task is unpacked from such an archive, the
+ * later tasks sharing it are extracted in the same pass and from then
+ * on treated like prefetched tasks, under the same rules about paths
+ * in use.  Their metadata is left for when their turn comes, there may
+ * be a lot of them.  Only the next COMPANIONS_MAX tasks are looked at so
+ * long recipes don't rescan all of their remaining tasks every time.
+ */
+static void
+companion_fetch_finish_cb (GError *error, guint32 match_cnt,
+                           guint32 nonmatch_cnt, gpointer user_data)
+{
+    PrefetchData *prefetch_data = (PrefetchData *) user_data;
+
+    prefetch_fetched (prefetch_data, error);
+    prefetch_done (prefetch_data);
+}
+
+static gboolean
+same_archive (SoupURI *a, SoupURI *b)
+{
+    SoupURI *archive_a = soup_uri_copy (a);
+    SoupURI *archive_b = soup_uri_copy (b);
+    gboolean same;
+
+    soup_uri_set_fragment (archive_a, NULL);
+    soup_uri_set_fragment (archive_b, NULL);
+    same = soup_uri_equal (archive_a, archive_b);
+    soup_uri_free (archive_a);
+    soup_uri_free (archive_b);
+    return same;
+}
+
+static GSList *
+task_fetch_companions (AppData *app_data, Task *current)
+{
+    GSList *targets = NULL;
+    GSList *busy = g_slist_prepend (NULL, g_strdup (current->path));
+    GList *iter = g_list_next (app_data->tasks);
+
+    for (guint i = 0; i < COMPANIONS_MAX && iter != NULL; i++, iter = g_list_next (iter)) {
+        Task *task = (Task *) iter->data;
+
+        if (task->fetch_method == TASK_FETCH_UNPACK &&
+            g_strcmp0 (task->fetch.url->scheme, "git") != 0 &&
+            task->ssl_verify == current->ssl_verify &&
+            same_archive (task->fetch.url, current->fetch.url) &&
+            !task_is_prefetching (app_data, task) &&
+            !path_is_busy (busy, task->path) &&
+            task_can_prefetch (app_data, task)) {
+            PrefetchData *prefetch_data = prefetch_data_new (app_data, task);
+
+            g_message ("* Extracting task %s along with %s [%s]",
+                       task->task_id, current->task_id, task->path);
+            targets = g_slist_prepend (targets,
+                                       restraint_fetch_uri_target_new (task->fetch.url->fragment,
+                                                                       task->path,
+                                                                       task->keepchanges,
+                                                                       NULL,
+                                                                       companion_fetch_finish_cb,
+                                                                       prefetch_data));
+        }
+        // Later tasks must not touch anything this one will use.
+        busy = g_slist_prepend (busy, g_strdup (task->path));
+    }
+    g_slist_free_full (busy, g_free);
+
+    return g_slist_reverse (targets);
+}
+
+/*
+ * The recipe is going away, let any fetches still running finish on
+ * their own without touching the tasks.  Nothing is left to parse the
+ * metadata for.
+ */
+void
+restraint_task_prefetch_orphan (AppData *app_data)
+{
+    g_return_if_fail (app_data != NULL);
+
+    if (app_data->prefetch_cancellable != NULL) {
+        g_cancellable_cancel (app_data->prefetch_cancellable);
+        g_clear_object (&app_data->prefetch_cancellable);
+    }
+
+    for (GSList *iter = app_data->prefetches; iter != NULL; iter = g_slist_next (iter)) {
+        PrefetchData *prefetch_data = iter->data;
+        prefetch_data->task = NULL;
+    }
+    g_slist_free (app_data->prefetches);
+    app_data->prefetches = NULL;
+    app_data->prefetch_waiting = FALSE;
+}
+
 gboolean
-io_callback (GIOChannel *io, GIOCondition condition, const gchar *logpath, gpointer user_data) {
+io_callback (GIOChannel *io, GIOCondition condition, const gchar *logpath,
+             Task *task, gpointer user_data) {
     AppData *app_data = (AppData *) user_data;
     GError *tmp_error = NULL;
 
@@ -218,7 +641,11 @@ io_callback (GIOChannel *io, GIOCondition condition, const gchar *logpath, gpoin
             if (fwrite (buf, sizeof (gchar), bytes_read, stdout) != bytes_read)
                 g_warning ("failed to write message");
 
-            connections_write(app_data, logpath, buf, bytes_read);
+            if (task != NULL) {
+                connections_write_task (app_data, task, logpath, buf, bytes_read);
+            } else {
+                connections_write(app_data, logpath, buf, bytes_read);
+            }
             return G_SOURCE_CONTINUE;
 
           case G_IO_STATUS_ERROR:
@@ -249,12 +676,290 @@ io_callback (GIOChannel *io, GIOCondition condition, const gchar *logpath, gpoin
 gboolean
 task_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data) {
     TaskRunData *task_run_data = (TaskRunData *) user_data;
-    return io_callback(io, condition, task_run_data->logpath, task_run_data->app_data);
+    return io_callback(io, condition, task_run_data->logpath,
+                       task_run_data->task, task_run_data->app_data);
 }
 
 gboolean
 metadata_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data) {
-    return io_callback(io, condition, LOG_PATH_HARNESS, user_data);
+    return io_callback(io, condition, LOG_PATH_HARNESS, NULL, user_data);
+}
+
+/* Timeline phase for each TaskSetupState, NULL for those not timed */
+static const gchar *task_phase_names[] = {
+    [TASK_IDLE] = NULL,
+    [TASK_FETCH] = "fetch",
+    [TASK_METADATA_PARSE] = "metadata",
+    [TASK_REFRESH_ROLES] = "roles",
+    [TASK_ENV] = "env",
+    [TASK_WATCHDOG] = "watchdog",
+    [TASK_DEPENDENCIES] = "dependencies",
+    [TASK_RUN] = "run",
+    [TASK_ABORTED] = "aborted",
+    [TASK_CANCEL] = "cancel",
+    [TASK_CANCELLED] = "cancelled",
+    [TASK_NEXT] = NULL,
+    [TASK_COMPLETE] = "complete",
+    [TASK_COMPLETED] = NULL,
+};
+
+/*
+ * Moves the task's timeline on to the phase of its current state.  The
+ * timeline is kept in the task config so it survives a reboot.
+ */
+static void
+task_timing_update (AppData *app_data, Task *task, const gchar *phase)
+{
+    // Nothing to time yet, don't bother reading the saved timeline
+    if (task->timing == NULL && phase == NULL) {
+        return;
+    }
+    if (task->timing == NULL) {
+        gchar *saved = NULL;
+        if (app_data->config_file) {
+            saved = restraint_config_get_string (app_data->config_file,
+                                                 task->task_id, "timing",
+                                                 NULL);
+        }
+        task->timing = restraint_task_timing_new (saved);
+        g_free (saved);
+    }
+
+    if (restraint_task_timing_enter (task->timing, phase) &&
+            app_data->config_file) {
+        gchar *timing = restraint_task_timing_to_json (task->timing);
+        restraint_config_set (app_data->config_file, task->task_id,
+                              "timing", NULL, G_TYPE_STRING, timing);
+        g_free (timing);
+    }
+}
+
+/* Processes run for a task are timed with the task */
+void
+restraint_task_process_timing (const gchar *command, gint64 start_time,
+                               gint64 end_time, gint pid_result,
+                               gpointer timing_data)
+{
+    Task *task = (Task *) timing_data;
+
+    if (task->timing != NULL) {
+        restraint_task_timing_add_process (task->timing, command, start_time,
+                                           end_time, pid_result);
+    }
+}
+
+/* The current task, or a concurrently running one, with task_id */
+Task *
+restraint_task_lookup (AppData *app_data, const gchar *task_id)
+{
+    // A concurrent task is only found while it is running
+    if (app_data->tasks != NULL) {
+        Task *task = app_data->tasks->data;
+        if (!task->concurrent && g_strcmp0 (task->task_id, task_id) == 0) {
+            return task;
+        }
+    }
+    for (GSList *iter = app_data->running; iter != NULL;
+         iter = g_slist_next (iter)) {
+        TaskRunData *task_run_data = (TaskRunData *) iter->data;
+        if (g_strcmp0 (task_run_data->task->task_id, task_id) == 0) {
+            return task_run_data->task;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Each task and each run of its completion plugins gets a cgroup of its
+ * own, so that whatever they leave running can be killed with them.
+ */
+static RestraintCgroup *
+task_cgroup_new (Task *task, const gchar *suffix)
+{
+    GError *error = NULL;
+
+    gchar *name = g_strdup_printf ("task-%s%s", task->task_id, suffix);
+    g_strdelimit (name, "/", '_');
+    RestraintCgroup *cgroup = restraint_cgroup_new (name, &error);
+    if (error != NULL && !g_error_matches (error, RESTRAINT_CGROUP_ERROR,
+                                           RESTRAINT_CGROUP_UNAVAILABLE)) {
+        g_warning ("%s", error->message);
+    }
+    g_clear_error (&error);
+    g_free (name);
+    return cgroup;
+}
+
+static void
+task_cgroup_free (Task *task)
+{
+    if (task->cgroup == NULL) {
+        return;
+    }
+    restraint_cgroup_kill (task->cgroup);
+    restraint_cgroup_get_stats (task->cgroup, &task->resources);
+    restraint_cgroup_free (task->cgroup);
+    task->cgroup = NULL;
+}
+
+/*
+ * Concurrent groups
+ *
+ * Consecutive tasks with the same RSTRNT_CONCURRENT_GROUP task param are
+ * independent of each other.  Each is still set up in turn, but once it
+ * starts running the next task of the group is set up straight away,
+ * until RSTRNT_CONCURRENCY tasks (by default one per CPU) are running.
+ * A running task of the group finishes on its own: its output, local
+ * watchdog, results and abort all go by its task id, not the current
+ * task.  The task after the group waits for all of it to finish.
+ */
+static const gchar *
+task_concurrent_group (Task *task)
+{
+    const gchar *group = NULL;
+
+    // The next task may not have been read yet, it fails on its own if
+    // its params are broken.
+    restraint_recipe_materialize_task (task, NULL);
+
+    for (GList *iter = task->params; iter != NULL; iter = g_list_next (iter)) {
+        Param *param = (Param *) iter->data;
+        if (g_strcmp0 (param->name, CONCURRENT_GROUP_PARAM) == 0) {
+            group = param->value;
+        }
+    }
+    return group != NULL && *group != '\0' ? group : NULL;
+}
+
+static guint
+task_concurrency (Task *task)
+{
+    const gchar *value = restraint_recipe_get_param (task->recipe,
+                                                     CONCURRENCY_PARAM);
+    guint64 concurrency = value ? g_ascii_strtoull (value, NULL, 10) : 0;
+
+    return concurrency > 0 ? MIN (concurrency, G_MAXUINT) : g_get_num_processors ();
+}
+
+/* Can the task after the current one be set up now? */
+static gboolean
+task_concurrent_has_room (AppData *app_data)
+{
+    if (app_data->running == NULL) {
+        return TRUE;
+    }
+    GList *next = g_list_next (app_data->tasks);
+    if (next == NULL) {
+        return FALSE;
+    }
+    Task *task = (Task *) next->data;
+    TaskRunData *running = (TaskRunData *) app_data->running->data;
+    if (g_strcmp0 (task_concurrent_group (task),
+                   task_concurrent_group (running->task)) != 0) {
+        return FALSE;
+    }
+    return g_slist_length (app_data->running) < task_concurrency (task);
+}
+
+static void
+task_concurrent_recipe_cancelled (GCancellable *cancellable, gpointer user_data)
+{
+    TaskRunData *task_run_data = (TaskRunData *) user_data;
+
+    // Aborting the current task leaves the rest of the group running
+    if (task_run_data->app_data->aborted != ABORTED_TASK) {
+        g_cancellable_cancel (task_run_data->task->cancellable);
+    }
+}
+
+static void
+task_concurrent_start (AppData *app_data, TaskRunData *task_run_data)
+{
+    Task *task = task_run_data->task;
+
+    task->cancellable = g_cancellable_new ();
+    task_run_data->cancel_id = g_cancellable_connect (app_data->cancellable,
+                                                      G_CALLBACK (task_concurrent_recipe_cancelled),
+                                                      task_run_data, NULL);
+    app_data->running = g_slist_prepend (app_data->running, task_run_data);
+}
+
+/*
+ * Once its status is sent a task is only needed to skip over it, drop
+ * everything but that to keep long recipes small.
+ */
+static void
+task_release (Task *task)
+{
+    g_list_free_full (task->params, (GDestroyNotify) restraint_param_free);
+    task->params = NULL;
+    g_list_free_full (task->roles, (GDestroyNotify) restraint_role_free);
+    task->roles = NULL;
+    if (task->env) {
+        g_ptr_array_free (task->env, TRUE);
+        task->env = NULL;
+    }
+    // task->name may be borrowed from the metadata
+    if (task->metadata && task->name != task->metadata->name) {
+        restraint_metadata_free (task->metadata);
+        task->metadata = NULL;
+    }
+    restraint_task_timing_free (task->timing);
+    task->timing = NULL;
+    g_hash_table_remove_all (task->offsets);
+    g_clear_object (&task->cancellable);
+}
+
+static void
+task_concurrent_status_complete (SoupSession *session, SoupMessage *msg,
+                                 gpointer user_data)
+{
+    TaskRunData *task_run_data = (TaskRunData *) user_data;
+    AppData *app_data = task_run_data->app_data;
+    Task *task = task_run_data->task;
+
+    g_cancellable_disconnect (app_data->cancellable, task_run_data->cancel_id);
+    app_data->running = g_slist_remove (app_data->running, task_run_data);
+    task_release (task);
+    g_slice_free (TaskRunData, task_run_data);
+
+    // The current task may be waiting for a place in the group
+    if (app_data->running_waiting) {
+        app_data->running_waiting = FALSE;
+        app_data->task_handler_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                                                    task_handler,
+                                                    app_data,
+                                                    NULL);
+    }
+}
+
+/* What TASK_COMPLETE and TASK_COMPLETED do for the current task */
+static void
+task_concurrent_complete (TaskRunData *task_run_data)
+{
+    AppData *app_data = task_run_data->app_data;
+    Task *task = task_run_data->task;
+    GString *message = g_string_new (NULL);
+
+    task_timing_update (app_data, task, task_phase_names[TASK_COMPLETE]);
+    task_complete (app_data, task, message);
+    if (fwrite(message->str, sizeof(gchar), message->len, stderr) != message->len)
+        g_warning ("failed to write message");
+    connections_write_task (app_data, task, LOG_PATH_HARNESS,
+                            message->str, message->len);
+    g_string_free (message, TRUE);
+    task_timing_update (app_data, task, NULL);
+
+    if (task->error) {
+        task_status_post (task, app_data, "Aborted", task->version, task->error,
+                          task_concurrent_status_complete, task_run_data);
+        g_clear_error (&task->error);
+    } else {
+        task_status_post (task, app_data, "Completed", task->version, NULL,
+                          task_concurrent_status_complete, task_run_data);
+    }
+    restraint_config_set (app_data->config_file, task->task_id, NULL, NULL, -1);
+    task->state = TASK_NEXT;
 }
 
 void
@@ -263,6 +968,14 @@ task_finish_plugins_callback (gint pid_result, gboolean localwatchdog, gpointer
     TaskRunData *task_run_data = (TaskRunData *) user_data;
     AppData *app_data = task_run_data->app_data;
 
+    restraint_cgroup_free (task_run_data->cgroup);
+    task_run_data->cgroup = NULL;
+
+    if (task_run_data->task != NULL && task_run_data->task->concurrent) {
+        task_concurrent_complete (task_run_data);
+        return;
+    }
+
     app_data->task_handler_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
                                                 task_handler,
                                                 app_data,
@@ -275,7 +988,11 @@ task_finish_callback (gint pid_result, gboolean localwatchdog, gpointer user_dat
 {
     TaskRunData *task_run_data = (TaskRunData *) user_data;
     AppData *app_data = task_run_data->app_data;
-    Task *task = app_data->tasks->data;
+    Task *task = task_run_data->task;
+
+    // Nothing the task started outlives it
+    task_cgroup_free (task);
+    task_timing_update (app_data, task, "plugins");
 
     // Did the command Succeed?
     if (pid_result == 0) {
@@ -313,41 +1030,44 @@ task_finish_callback (gint pid_result, gboolean localwatchdog, gpointer user_dat
     // Run Finish/Completed plugins
     // Always run completed plugins and if localwatchdog triggered run those as well.
     gchar *command = g_strdup_printf ("%s %s", TASK_PLUGIN_SCRIPT, PLUGIN_SCRIPT);
-    // Last four entries are NULL.  Replace first three with plugin vars
+    // Last five entries are NULL.  Replace first three with plugin vars
     gchar *localwatchdog_plugin = g_strdup_printf(" %s/localwatchdog.d", PLUGIN_DIR);
     gchar *plugin_dir = g_strdup_printf("RSTRNT_PLUGINS_DIR=%s/completed.d%s", PLUGIN_DIR, localwatchdog ? localwatchdog_plugin : "");
     g_free (localwatchdog_plugin);
-    if (task->env->pdata[task->env->len - 5] != NULL) {
-        g_free (task->env->pdata[task->env->len - 5]);
+    if (task->env->pdata[task->env->len - 6] != NULL) {
+        g_free (task->env->pdata[task->env->len - 6]);
     }
-    task->env->pdata[task->env->len - 5] = plugin_dir;
+    task->env->pdata[task->env->len - 6] = plugin_dir;
 
     gchar *no_plugins = g_strdup_printf("RSTRNT_NOPLUGINS=1");
-    if (task->env->pdata[task->env->len - 4] != NULL) {
-        g_free (task->env->pdata[task->env->len - 4]);
+    if (task->env->pdata[task->env->len - 5] != NULL) {
+        g_free (task->env->pdata[task->env->len - 5]);
     }
-    task->env->pdata[task->env->len - 4] = no_plugins;
+    task->env->pdata[task->env->len - 5] = no_plugins;
 
     gchar *rstrnt_localwatchdog = g_strdup_printf("RSTRNT_LOCALWATCHDOG=%s", localwatchdog ? "TRUE" : "FALSE");
-    if (task->env->pdata[task->env->len - 3] != NULL) {
-        g_free (task->env->pdata[task->env->len - 3]);
+    if (task->env->pdata[task->env->len - 4] != NULL) {
+        g_free (task->env->pdata[task->env->len - 4]);
     }
-    task->env->pdata[task->env->len - 3] = rstrnt_localwatchdog;
+    task->env->pdata[task->env->len - 4] = rstrnt_localwatchdog;
 
     task_run_data->logpath = LOG_PATH_HARNESS;
-    process_run ((const gchar *) command,
-                 (const gchar **) task->env->pdata,
-                 "/usr/share/restraint/plugins",
-                 FALSE,
-                 0,
-                 NULL,
-                 task_io_callback,
-                 task_finish_plugins_callback,
-                 NULL,
-                 0,
-                 FALSE,
-                 app_data->cancellable,
-                 task_run_data);
+    task_run_data->cgroup = task_cgroup_new (task, "-plugins");
+    process_run_in_cgroup (task_run_data->cgroup ? task_run_data->cgroup->fd : -1,
+                           (const gchar *) command,
+                           (const gchar **) task->env->pdata,
+                           "/usr/share/restraint/plugins",
+                           FALSE,
+                           0,
+                           NULL,
+                           task_io_callback,
+                           task_finish_plugins_callback,
+                           NULL,
+                           0,
+                           FALSE,
+                           task->cancellable ? task->cancellable : app_data->cancellable,
+                           task,
+                           task_run_data);
     g_free (command);
 }
 
@@ -502,7 +1222,7 @@ task_heartbeat_callback (gpointer user_data)
 {
     TaskRunData *task_run_data = (TaskRunData *) user_data;
     AppData *app_data = task_run_data->app_data;
-    Task *task = (Task *) app_data->tasks->data;
+    Task *task = task_run_data->task;
 
     time_t rawtime;
     double delta_sec = 0;
@@ -554,7 +1274,7 @@ task_heartbeat_callback (gpointer user_data)
                     (modified_wd) ? " User Adjusted" : "",
                     task_run_data->expire_time);
     g_message ("%s", message->str);
-    connections_write(app_data, LOG_PATH_HARNESS, message->str, message->len);
+    connections_write_task (app_data, task, LOG_PATH_HARNESS, message->str, message->len);
     g_string_free(message, TRUE);
     return G_SOURCE_CONTINUE;
 }
@@ -562,8 +1282,7 @@ task_heartbeat_callback (gpointer user_data)
 void task_timeout_cb(gpointer user_data, guint64 *time_remain)
 {
     TaskRunData *task_run_data = (TaskRunData *) user_data;
-    AppData *app_data = task_run_data->app_data;
-    Task *task = (Task *) app_data->tasks->data;
+    Task *task = task_run_data->task;
     gboolean result;
 
     result = task_heartbeat_callback(task_run_data);
@@ -575,13 +1294,16 @@ void task_timeout_cb(gpointer user_data, guint64 *time_remain)
 }
 
 void
-task_run (AppData *app_data)
+task_run (AppData *app_data, Task *task)
 {
-    Task *task = (Task *) app_data->tasks->data;
     TaskRunData *task_run_data = g_slice_new0 (TaskRunData);
     task_run_data->app_data = app_data;
+    task_run_data->task = task;
     task_run_data->pass_state = TASK_COMPLETE;
     task_run_data->fail_state = TASK_COMPLETE;
+    if (task->concurrent) {
+        task_concurrent_start (app_data, task_run_data);
+    }
 
     gchar *entry_point;
     if (task->metadata->entry_point) {
@@ -597,19 +1319,22 @@ task_run (AppData *app_data)
     restraint_start_heartbeat(task_run_data,
                               task->metadata->nolocalwatchdog ? 0 : task->remaining_time,
                               NULL);
-    process_run ((const gchar *) entry_point,
-                 (const gchar **)task->env->pdata,
-                 task->path,
-                 task->metadata->use_pty,
-                 task->remaining_time,
-                 task_timeout_cb,
-                 task_io_callback,
-                 task_finish_callback,
-                 NULL,
-                 0,
-                 FALSE,
-                 app_data->cancellable,
-                 task_run_data);
+    task->cgroup = task_cgroup_new (task, "");
+    process_run_in_cgroup (task->cgroup ? task->cgroup->fd : -1,
+                           (const gchar *) entry_point,
+                           (const gchar **)task->env->pdata,
+                           task->path,
+                           task->metadata->use_pty,
+                           task->remaining_time,
+                           task_timeout_cb,
+                           task_io_callback,
+                           task_finish_callback,
+                           NULL,
+                           0,
+                           FALSE,
+                           task->cancellable ? task->cancellable : app_data->cancellable,
+                           task,
+                           task_run_data);
 
     g_free (entry_point);
 }
@@ -665,9 +1390,22 @@ restraint_task_result (Task *task, AppData *app_data, gchar *result,
                             app_data);
 }
 
-void
-restraint_task_status (Task *task, AppData *app_data, gchar *status,
-                       gchar *taskversion, GError *reason)
+static void
+task_status_add_resource (GHashTable *data_table, GPtrArray *values,
+                          gchar *key, gint64 value)
+{
+    if (value < 0) {
+        return;
+    }
+    gchar *string = g_strdup_printf("%" G_GINT64_FORMAT, value);
+    g_hash_table_insert(data_table, key, string);
+    g_ptr_array_add(values, string);
+}
+
+static void
+task_status_post (Task *task, AppData *app_data, gchar *status,
+                  gchar *taskversion, GError *reason,
+                  MessageFinishCallback finish_callback, gpointer user_data)
 {
     g_return_if_fail(task != NULL);
 
@@ -694,7 +1432,22 @@ restraint_task_status (Task *task, AppData *app_data, gchar *status,
         g_hash_table_insert(data_table, "etime", etime);
         g_message("%s task %s due to error: %s", status, task->task_id, reason->message);
     }
+    GPtrArray *resources = g_ptr_array_new_with_free_func(g_free);
+    if (task->timing != NULL && g_strcmp0(status, "Running") != 0) {
+        gchar *timing = restraint_task_timing_to_json(task->timing);
+        g_hash_table_insert(data_table, "timing", timing);
+        g_ptr_array_add(resources, timing);
+    }
+    task_status_add_resource(data_table, resources, "cpu_usec",
+                             task->resources.cpu_usec);
+    task_status_add_resource(data_table, resources, "memory_peak",
+                             task->resources.memory_peak);
+    task_status_add_resource(data_table, resources, "io_read_bytes",
+                             task->resources.io_rbytes);
+    task_status_add_resource(data_table, resources, "io_write_bytes",
+                             task->resources.io_wbytes);
     data = soup_form_encode_hash(data_table);
+    g_ptr_array_free(resources, TRUE);
 
     soup_message_set_request(server_msg, "application/x-www-form-urlencoded",
             SOUP_MEMORY_TAKE, data, strlen(data));
@@ -706,9 +1459,17 @@ restraint_task_status (Task *task, AppData *app_data, gchar *status,
     app_data->queue_message(soup_session,
                             server_msg,
                             app_data->message_data,
-                            task_message_complete,
+                            finish_callback,
                             app_data->cancellable,
-                            app_data);
+                            user_data);
+}
+
+void
+restraint_task_status (Task *task, AppData *app_data, gchar *status,
+                       gchar *taskversion, GError *reason)
+{
+    task_status_post (task, app_data, status, taskversion, reason,
+                      task_message_complete, app_data);
 }
 
 void
@@ -735,10 +1496,12 @@ restraint_task_watchdog (Task *task, AppData *app_data, guint64 seconds)
     soup_message_set_request(server_msg, "application/x-www-form-urlencoded",
             SOUP_MEMORY_TAKE, data, strlen(data));
 
+    // Only the latest extension matters and nothing waits on it
+    restraint_message_supersedes(server_msg);
     app_data->queue_message(soup_session,
                             server_msg,
                             app_data->message_data,
-                            task_message_complete,
+                            NULL,
                             app_data->cancellable,
                             app_data);
 
@@ -748,6 +1511,10 @@ restraint_task_watchdog (Task *task, AppData *app_data, guint64 seconds)
 Task *restraint_task_new(void) {
     Task *task = g_slice_new0(Task);
     task->remaining_time = -1;
+    task->resources.cpu_usec = -1;
+    task->resources.memory_peak = -1;
+    task->resources.io_rbytes = -1;
+    task->resources.io_wbytes = -1;
     task->offsets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
                                           g_free);
     return task;
@@ -777,6 +1544,9 @@ void restraint_task_free(Task *task) {
     if (task->env)
         g_ptr_array_free (task->env, TRUE);
     restraint_metadata_free(task->metadata);
+    restraint_cgroup_free(task->cgroup);
+    restraint_task_timing_free(task->timing);
+    g_clear_object(&task->cancellable);
     g_slice_free(Task, task);
 }
 
@@ -878,6 +1648,18 @@ parse_task_config (gchar *config_file, Task *task, GError **error)
     }
     g_clear_error (&tmp_error);
 
+    task->prefetched = restraint_config_get_boolean (config_file,
+                                                     task->task_id,
+                                                     "prefetched",
+                                                     &tmp_error);
+    if (tmp_error) {
+        g_propagate_prefixed_error(error, tmp_error,
+                    "Task %s:  parse_task_config,", task->task_id);
+        goto error;
+    }
+    g_clear_error (&tmp_error);
+    task->config_read = TRUE;
+
     return TRUE;
 
 error:
@@ -887,14 +1669,15 @@ error:
 static void
 recipe_fetch_complete(GError *error, xmlDoc *doc, gpointer user_data)
 {
-    AppData *app_data = (AppData *)user_data;
-    Task *task = app_data->tasks->data;
+    RefreshRolesData *refresh_data = (RefreshRolesData *) user_data;
+    AppData *app_data = refresh_data->app_data;
+    Task *task = refresh_data->task;
 
     if (error) {
         if (app_data->fetch_retries < FETCH_RETRIES) {
             g_print("* RETRY refresh roles [%d]**:%s\n", ++app_data->fetch_retries,
                     error->message);
-            g_timeout_add_seconds(FETCH_INTERVAL, refresh_role_retry, app_data);
+            g_timeout_add_seconds(FETCH_INTERVAL, refresh_role_retry, refresh_data);
             return;
         } else {
             g_warn_if_fail(!doc);
@@ -902,21 +1685,52 @@ recipe_fetch_complete(GError *error, xmlDoc *doc, gpointer user_data)
             task->state = TASK_COMPLETE;
         }
     } else {
-        g_warn_if_fail(doc != NULL);
+        // A 304 still gives the cached doc, which may be newer than the
+        // one the recipe was parsed from
         GError *tmp_error = NULL;
         restraint_recipe_update_roles(app_data->recipe, doc, &tmp_error);
         if (tmp_error) {
+            xmlFreeDoc(doc);
             g_propagate_error(&task->error, tmp_error);
             task->state = TASK_COMPLETE;
         } else {
+            // Tasks not read yet now read from the newest doc
+            xmlFreeDoc(app_data->recipe_xmldoc);
+            app_data->recipe_xmldoc = doc;
             task->state = TASK_ENV;
         }
     }
+    g_slice_free (RefreshRolesData, refresh_data);
 
     app_data->task_handler_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
             task_handler, app_data, NULL);
 }
 
+static void
+task_complete (AppData *app_data, Task *task, GString *message)
+{
+    // Set task finished
+    gboolean aborted = task->cancellable != NULL ?
+        g_cancellable_is_cancelled (task->cancellable) :
+        g_cancellable_is_cancelled (app_data->cancellable) &&
+        app_data->aborted != ABORTED_NONE;
+    if (aborted) {
+      g_clear_error(&task->error);
+      g_set_error(&task->error, RESTRAINT_ERROR,
+                  RESTRAINT_TASK_RUNNER_ABORTED,
+                  "Aborted by rstrnt-abort");
+    }
+
+    if (task->error) {
+        g_string_printf(message, "** ERROR: %s\n** Completed Task : %s\n",
+                       task->error->message, task->task_id);
+    } else {
+        g_string_printf(message, "** Completed Task : %s\n", task->task_id);
+    }
+    task->endtime = time(NULL);
+    task->state = TASK_COMPLETED;
+}
+
 gboolean
 task_handler (gpointer user_data)
 {
@@ -932,6 +1746,11 @@ task_handler (gpointer user_data)
   GString *message = g_string_new(NULL);
   gboolean result = G_SOURCE_CONTINUE;
 
+  // A task running concurrently keeps its own timeline
+  if (!task->concurrent) {
+      task_timing_update (app_data, task, task_phase_names[task->state]);
+  }
+
   /*
    *  - Fetch the task
    *  - Update metadata
@@ -946,11 +1765,13 @@ task_handler (gpointer user_data)
   switch (task->state) {
     case TASK_IDLE:
       // Read in previous state..
-      if (parse_task_config (app_data->config_file, task, &task->error)) {
-          if (task->finished) {
-              // If the task is finished skip to the next task.
-              task->state = TASK_NEXT;
-          } else if (g_cancellable_is_cancelled (app_data->cancellable)) {
+      if (task->finished) {
+          // Finished tasks are skipped without reading the rest of them
+          task->state = TASK_NEXT;
+      } else if (!restraint_recipe_materialize_task (task, &task->error)) {
+          task->state = TASK_COMPLETE;
+      } else if (parse_task_config (app_data->config_file, task, &task->error)) {
+          if (g_cancellable_is_cancelled (app_data->cancellable)) {
               task->state = TASK_COMPLETE;
           } else if (task->localwatchdog) {
               // If the task is not finished but localwatchdog expired.
@@ -961,9 +1782,11 @@ task_handler (gpointer user_data)
               g_string_printf(message, "** Continuing task: %s [%s]\n", task->task_id, task->path);
               task->state = TASK_METADATA_PARSE;
           } else {
-              // If neither started nor finished then fetch the task
-              restraint_task_status (task, app_data, "Running", NULL, NULL);
-              result = G_SOURCE_REMOVE;
+              // If neither started nor finished then fetch the task.
+              // The queue keeps it ahead of anything else the task
+              // sends, so there's no need to wait for it.
+              task_status_post (task, app_data, "Running", NULL, NULL,
+                                NULL, NULL);
               g_string_printf(message, "** Fetching task: %s [%s]\n", task->task_id, task->path);
               app_data->fetch_retries = 0;
               task->state = TASK_FETCH;
@@ -973,6 +1796,17 @@ task_handler (gpointer user_data)
       }
       break;
     case TASK_FETCH:
+      // Let any prefetches finish first so we never unpack on top of them.
+      if (app_data->prefetches != NULL) {
+          app_data->prefetch_waiting = TRUE;
+          result = G_SOURCE_REMOVE;
+          break;
+      }
+      if (task->prefetched) {
+          g_string_printf(message, "** Using prefetched task\n");
+          task->state = TASK_METADATA_PARSE;
+          break;
+      }
       // Fetch Task from rpm or url
       if (app_data->fetch_retries > 0) {
           g_string_printf(message, "** Fetching task: Retries %" G_GINT32_FORMAT "\n",
@@ -982,19 +1816,28 @@ task_handler (gpointer user_data)
       result = G_SOURCE_REMOVE;
       break;
     case TASK_METADATA_PARSE:
-      g_string_printf (message, "** Preparing metadata\n");
-      task->rhts_compat = restraint_get_metadata(task->path,
-                            task->recipe->osmajor, &task->metadata,
-                            app_data->cancellable, metadata_finish_cb,
-                            metadata_io_callback, app_data);
+      if (task->metadata != NULL) {
+          // Already parsed when the task was prefetched
+          g_string_printf (message, "** Using prefetched metadata\n");
+          metadata_finish_cb (app_data, NULL);
+      } else {
+          g_string_printf (message, "** Preparing metadata\n");
+          task->rhts_compat = restraint_get_metadata(task->path,
+                                task->recipe->osmajor, &task->metadata,
+                                app_data->cancellable, metadata_finish_cb,
+                                metadata_io_callback, task, app_data);
+      }
       result = G_SOURCE_REMOVE;
       break;
     case TASK_REFRESH_ROLES:
       if (app_data->recipe_url) {
           g_string_printf(message, "** Refreshing peer role hostnames: Retries %"
                                      G_GINT32_FORMAT "\n", app_data->fetch_retries);
+          RefreshRolesData *refresh_data = g_slice_new (RefreshRolesData);
+          refresh_data->app_data = app_data;
+          refresh_data->task = task;
           restraint_xml_parse_from_url(soup_session, app_data->recipe_url,
-                  recipe_fetch_complete, app_data);
+                  recipe_fetch_complete, refresh_data);
           result = G_SOURCE_REMOVE;
       } else {
           task->state = TASK_ENV;
@@ -1012,9 +1855,15 @@ task_handler (gpointer user_data)
     case TASK_WATCHDOG:
       // Setup external watchdog
       if (!task->started) {
-          g_string_printf(message, "** Updating external watchdog: %" G_GINT64_FORMAT " seconds\n", task->remaining_time + EWD_TIME);
-          restraint_task_watchdog (task, app_data, task->remaining_time + EWD_TIME);
-          result = G_SOURCE_REMOVE;
+          // Leave enough time for the rest of the group to finish too
+          gint64 watchdog_time = task->remaining_time;
+          for (GSList *iter = app_data->running; iter != NULL;
+               iter = g_slist_next (iter)) {
+              TaskRunData *running = (TaskRunData *) iter->data;
+              watchdog_time = MAX (watchdog_time, running->task->remaining_time);
+          }
+          g_string_printf(message, "** Updating external watchdog: %" G_GINT64_FORMAT " seconds\n", watchdog_time + EWD_TIME);
+          restraint_task_watchdog (task, app_data, watchdog_time + EWD_TIME);
       }
       task->state = TASK_DEPENDENCIES;
       break;
@@ -1047,7 +1896,8 @@ task_handler (gpointer user_data)
           task->state = TASK_COMPLETE;
       } else {
           g_string_printf(message, "** Running task: %s [%s]\n", task->task_id, task->name);
-          task_run (app_data);
+          task->concurrent = task_concurrent_group (task) != NULL;
+          task_run (app_data, task);
           task->starttime = time(NULL);
           result = G_SOURCE_REMOVE;
           task->started = TRUE;
@@ -1062,26 +1912,16 @@ task_handler (gpointer user_data)
                                 "reboots", NULL,
                                 G_TYPE_UINT64,
                                 task->reboots + 1);
+          restraint_task_prefetch (app_data, task);
+          if (task->concurrent) {
+              // It finishes on its own, set up the next task meanwhile.
+              task->state = TASK_NEXT;
+              result = G_SOURCE_CONTINUE;
+          }
       }
       break;
     case TASK_COMPLETE:
-      // Set task finished
-      if (g_cancellable_is_cancelled(app_data->cancellable) &&
-          app_data->aborted != ABORTED_NONE) {
-        g_clear_error(&task->error);
-        g_set_error(&task->error, RESTRAINT_ERROR,
-                    RESTRAINT_TASK_RUNNER_ABORTED,
-                    "Aborted by rstrnt-abort");
-      }
-
-      if (task->error) {
-          g_string_printf(message, "** ERROR: %s\n** Completed Task : %s\n",
-                         task->error->message, task->task_id);
-      } else {
-          g_string_printf(message, "** Completed Task : %s\n", task->task_id);
-      }
-      task->endtime = time(NULL);
-      task->state = TASK_COMPLETED;
+      task_complete (app_data, task, message);
       break;
     case TASK_COMPLETED:
     {
@@ -1105,6 +1945,18 @@ task_handler (gpointer user_data)
       break;
     }
     case TASK_NEXT:
+      // Wait for a place in the concurrent group, or for all of it to
+      // finish before moving past it.
+      if (!task_concurrent_has_room (app_data)) {
+          app_data->running_waiting = TRUE;
+          result = G_SOURCE_REMOVE;
+          break;
+      }
+      // Requests still reach the current task until it is moved past,
+      // a concurrent one is released once its own status is sent.
+      if (!task->concurrent) {
+          task_release (task);
+      }
       // Get the next task and run it.
       result = restraint_next_task (app_data, TASK_IDLE);
       break;
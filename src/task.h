@@ -23,17 +23,27 @@
 #include <libsoup/soup.h>
 #include <pty.h>
 #include <time.h>
+#include <libxml/tree.h>
 #include "recipe.h"
 #include "message.h"
 #include "server.h"
 #include "metadata.h"
 #include "utils.h"
+#include "cgroup.h"
+#include "task_timing.h"
 
 #define DEFAULT_MAX_TIME 10 * 60 // default amount of time before local watchdog kills process
 #define DEFAULT_ENTRY_POINT "make run"
 #define ENV_PREFIX "RSTRNT_"
 #define EWD_TIME 30 * 60 // amount of time to add to local watchdog for externl watchdog
 
+#define PREFETCH_PARAM "RSTRNT_PREFETCH"
+#define PREFETCH_MAX 8 // upper limit on how many tasks we look ahead
+#define COMPANIONS_MAX 32 // upper limit on tasks extracted along with one
+
+#define CONCURRENT_GROUP_PARAM "RSTRNT_CONCURRENT_GROUP"
+#define CONCURRENCY_PARAM "RSTRNT_CONCURRENCY"
+
 #define LOG_PATH_HARNESS "logs/harness.log"
 #define LOG_PATH_TASK "logs/taskout.log"
 
@@ -80,6 +90,8 @@ typedef struct {
     /* Whether to keep task changes */
     gboolean keepchanges;
     gboolean ssl_verify;
+    /* <task/> element params and roles are still to be read from */
+    xmlNode *node;
     /* List of Params */
     GList *params;
     /* List of Roles */
@@ -90,6 +102,10 @@ typedef struct {
     gboolean started;
     /* Has this task finished already? */
     gboolean finished;
+    /* Was this task fetched while the previous task was running? */
+    gboolean prefetched;
+    /* Have started and prefetched been read from the config yet? */
+    gboolean config_read;
     /* Has this task triggered the localwatchdog? */
     gboolean localwatchdog;
     /* Are we running in rhts_compat mode? */
@@ -114,6 +130,16 @@ typedef struct {
     /* Start stop times */
     time_t starttime;
     time_t endtime;
+    /* cgroup the task is running in, NULL when not running or unavailable */
+    RestraintCgroup *cgroup;
+    /* Resources used by the task's cgroup, reported with its status */
+    RestraintCgroupStats resources;
+    /* Time spent in each state and process, reported with its status */
+    TaskTiming *timing;
+    /* Is this task running alongside the rest of its concurrent group? */
+    gboolean concurrent;
+    /* Aborts just this task while it runs concurrently, NULL otherwise */
+    GCancellable *cancellable;
 } Task;
 
 typedef struct {
@@ -123,6 +149,10 @@ typedef struct {
     gchar expire_time[80];
     const gchar *logpath;
     gboolean skip_remaining;
+    RestraintCgroup *cgroup;
+    /* Task being run, NULL for commands run for the current task */
+    Task *task;
+    gulong cancel_id;
 } TaskRunData;
 
 Task *restraint_task_new(void);
@@ -137,6 +167,16 @@ void restraint_task_free(Task *task);
 void restraint_init_result_hash (AppData *app_data);
 gboolean task_io_callback (GIOChannel *io, GIOCondition condition, gpointer user_data);
 void task_handler_callback (gint pid_result, gboolean localwatchdog, gpointer user_data, GError *error);
+void task_finish_plugins_callback (gint pid_result, gboolean localwatchdog, gpointer user_data, GError *error);
 gboolean idle_task_setup (gpointer user_data);
+void restraint_task_prefetch (AppData *app_data, Task *current);
+void restraint_task_prefetch_orphan (AppData *app_data);
+void restraint_task_process_timing (const gchar *command, gint64 start_time,
+                                    gint64 end_time, gint pid_result,
+                                    gpointer timing_data);
+Task *restraint_task_lookup (AppData *app_data, const gchar *task_id);
+gboolean restraint_recipe_materialize_task (Task *task, GError **error);
+void connections_write_task (AppData *app_data, Task *task, const gchar *path,
+                             const gchar *msg_data, gsize msg_len);
 extern SoupSession *soup_session;
 #endif
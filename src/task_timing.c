@@ -0,0 +1,174 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <json.h>
+
+#include "task_timing.h"
+
+#define TIMING_MS(usec) ((usec) / 1000)
+
+static gint64
+timing_end_of (struct json_object *entries)
+{
+    gint64 end = 0;
+
+    for (gsize i = 0; i < json_object_array_length (entries); i++) {
+        struct json_object *entry = json_object_array_get_idx (entries, i);
+        struct json_object *start, *duration;
+        if (json_object_object_get_ex (entry, "start", &start) &&
+                json_object_object_get_ex (entry, "duration", &duration)) {
+            end = MAX (end, json_object_get_int64 (start) +
+                            json_object_get_int64 (duration));
+        }
+    }
+    return end;
+}
+
+/*
+ * Starts a new timeline, or picks up the one saved by
+ * restraint_task_timing_to_json before a reboot.
+ */
+TaskTiming *
+restraint_task_timing_new (const gchar *saved)
+{
+    TaskTiming *timing = g_slice_new0 (TaskTiming);
+    struct json_object *restored = saved ? json_tokener_parse (saved) : NULL;
+    struct json_object *phases = NULL;
+    struct json_object *processes = NULL;
+
+    if (restored != NULL &&
+            json_object_object_get_ex (restored, "phases", &phases) &&
+            json_object_is_type (phases, json_type_array) &&
+            json_object_object_get_ex (restored, "processes", &processes) &&
+            json_object_is_type (processes, json_type_array)) {
+        timing->phases = json_object_get (phases);
+        timing->processes = json_object_get (processes);
+    } else {
+        timing->phases = json_object_new_array ();
+        timing->processes = json_object_new_array ();
+    }
+    if (restored != NULL) {
+        json_object_put (restored);
+    }
+
+    gint64 elapsed = MAX (timing_end_of (timing->phases),
+                          timing_end_of (timing->processes));
+    timing->base = g_get_monotonic_time () - elapsed * 1000;
+    return timing;
+}
+
+static struct json_object *
+timing_phase_entry (TaskTiming *timing, gint64 now)
+{
+    struct json_object *entry = json_object_new_object ();
+
+    json_object_object_add (entry, "name",
+                            json_object_new_string (timing->phase));
+    json_object_object_add (entry, "start", json_object_new_int64 (
+                            TIMING_MS (timing->phase_start - timing->base)));
+    json_object_object_add (entry, "duration", json_object_new_int64 (
+                            TIMING_MS (now - timing->phase_start)));
+    return entry;
+}
+
+/*
+ * Ends the current phase and starts timing phase, unless it is the one
+ * already being timed.  A NULL phase stops timing until the next call.
+ * Returns TRUE when a phase was added to the timeline.
+ */
+gboolean
+restraint_task_timing_enter (TaskTiming *timing, const gchar *phase)
+{
+    g_return_val_if_fail (timing != NULL, FALSE);
+
+    if (g_strcmp0 (timing->phase, phase) == 0) {
+        return FALSE;
+    }
+
+    gint64 now = g_get_monotonic_time ();
+    gboolean closed = timing->phase != NULL;
+    if (closed) {
+        json_object_array_add (timing->phases, timing_phase_entry (timing, now));
+        g_free (timing->phase);
+    }
+    timing->phase = g_strdup (phase);
+    timing->phase_start = now;
+    return closed;
+}
+
+/* start and end are monotonic times, as from g_get_monotonic_time () */
+void
+restraint_task_timing_add_process (TaskTiming *timing, const gchar *command,
+                                   gint64 start, gint64 end, gint pid_result)
+{
+    g_return_if_fail (timing != NULL);
+    g_return_if_fail (command != NULL);
+
+    struct json_object *entry = json_object_new_object ();
+
+    json_object_object_add (entry, "command", json_object_new_string (command));
+    if (timing->phase != NULL) {
+        json_object_object_add (entry, "phase",
+                                json_object_new_string (timing->phase));
+    }
+    json_object_object_add (entry, "start",
+                            json_object_new_int64 (TIMING_MS (start - timing->base)));
+    json_object_object_add (entry, "duration",
+                            json_object_new_int64 (TIMING_MS (end - start)));
+    json_object_object_add (entry, "status", json_object_new_int (pid_result));
+    json_object_array_add (timing->processes, entry);
+}
+
+/* The timeline so far, with the current phase counted up to now. */
+gchar *
+restraint_task_timing_to_json (TaskTiming *timing)
+{
+    g_return_val_if_fail (timing != NULL, NULL);
+
+    struct json_object *root = json_object_new_object ();
+    struct json_object *phases = json_object_new_array ();
+
+    for (gsize i = 0; i < json_object_array_length (timing->phases); i++) {
+        json_object_array_add (phases, json_object_get (
+                               json_object_array_get_idx (timing->phases, i)));
+    }
+    if (timing->phase != NULL) {
+        json_object_array_add (phases, timing_phase_entry (
+                               timing, g_get_monotonic_time ()));
+    }
+    json_object_object_add (root, "phases", phases);
+    json_object_object_add (root, "processes",
+                            json_object_get (timing->processes));
+
+    gchar *json = g_strdup (json_object_to_json_string_ext (root,
+                                                            JSON_C_TO_STRING_PLAIN));
+    json_object_put (root);
+    return json;
+}
+
+void
+restraint_task_timing_free (TaskTiming *timing)
+{
+    if (timing == NULL) {
+        return;
+    }
+    json_object_put (timing->phases);
+    json_object_put (timing->processes);
+    g_free (timing->phase);
+    g_slice_free (TaskTiming, timing);
+}
@@ -0,0 +1,50 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RESTRAINT_TASK_TIMING_H
+#define _RESTRAINT_TASK_TIMING_H
+
+#include <glib.h>
+
+struct json_object;
+
+/*
+ * Timeline of a task: when each phase was entered and how long it lasted,
+ * and every process spawned while it ran.  Offsets are milliseconds of
+ * monotonic time from the start of the task, carried over reboots by
+ * continuing from where the saved timeline ended.
+ */
+typedef struct {
+    // monotonic time in microseconds of offset 0
+    gint64 base;
+    // phase currently being timed, NULL when between phases
+    gchar *phase;
+    gint64 phase_start;
+    struct json_object *phases;
+    struct json_object *processes;
+} TaskTiming;
+
+TaskTiming *restraint_task_timing_new (const gchar *saved);
+gboolean restraint_task_timing_enter (TaskTiming *timing, const gchar *phase);
+void restraint_task_timing_add_process (TaskTiming *timing,
+                                        const gchar *command,
+                                        gint64 start, gint64 end,
+                                        gint pid_result);
+gchar *restraint_task_timing_to_json (TaskTiming *timing);
+void restraint_task_timing_free (TaskTiming *timing);
+
+#endif
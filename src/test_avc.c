@@ -0,0 +1,265 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+
+#include "avc.h"
+
+#define AVC_DENIED "type=AVC msg=audit(1571245371.152:213): avc:  denied  { read } for  pid=1520 comm=\"sshd\" name=\"motd\" dev=\"vda1\" ino=4247 scontext=system_u:system_r:sshd_t:s0-s0:c0.c1023 tcontext=system_u:object_r:user_home_t:s0 tclass=file permissive=0\n"
+#define AVC_GRANTED "type=AVC msg=audit(1571245371.153:214): avc:  granted  { setsecparam } for  pid=1 comm=\"systemd\" scontext=system_u:system_r:init_t:s0 tcontext=system_u:object_r:security_t:s0 tclass=security\n"
+#define USER_AVC_DENIED "type=USER_AVC msg=audit(1571245371.154:215): pid=1 uid=0 auid=4294967295 ses=4294967295 subj=system_u:system_r:init_t:s0 msg='avc:  denied  { status } for auid=n/a uid=0 gid=0 cmdline=\"\" scontext=system_u:system_r:init_t:s0 tcontext=system_u:system_r:init_t:s0 tclass=system exe=\"/usr/lib/systemd/systemd\" sauid=0 hostname=? addr=? terminal=?'\n"
+#define USER_AVC_POLICYLOAD "type=USER_AVC msg=audit(1571245371.155:216): pid=1 uid=0 auid=4294967295 ses=4294967295 msg='avc:  received policyload notice (seqno=2)  exe=\"/usr/lib/systemd/systemd\" sauid=0 hostname=? addr=? terminal=?'\n"
+#define SELINUX_ERR "type=SELINUX_ERR msg=audit(1571245371.156:217): op=security_compute_av reason=bounds scontext=system_u:system_r:httpd_t:s0 tcontext=system_u:object_r:var_t:s0 tclass=dir perms=search\n"
+#define SYSCALL "type=SYSCALL msg=audit(1571245371.152:213): arch=c000003e syscall=2 success=no exit=-13 a0=7ffd a1=0 a2=1b6 a3=24 items=0 ppid=1 pid=1520 auid=4294967295 uid=0 gid=0 comm=\"sshd\" exe=\"/usr/sbin/sshd\" subj=system_u:system_r:sshd_t:s0-s0:c0.c1023 key=(null)\n"
+
+typedef struct {
+    gchar *dir;
+    gchar *audit_log;
+    gchar *config_file;
+} AvcLog;
+
+/* An audit log and restraint config of its own for each test */
+static AvcLog *
+avc_log_new (void)
+{
+    AvcLog *avc = g_slice_new0 (AvcLog);
+
+    avc->dir = g_dir_make_tmp ("test_avc_XXXXXX", NULL);
+    g_assert_nonnull (avc->dir);
+    avc->audit_log = g_build_filename (avc->dir, "audit.log", NULL);
+    avc->config_file = g_build_filename (avc->dir, "config.conf", NULL);
+    return avc;
+}
+
+static void
+avc_log_free (AvcLog *avc)
+{
+    gchar *rotated = g_strdup_printf ("%s.1", avc->audit_log);
+    gchar *rotated2 = g_strdup_printf ("%s.2", avc->audit_log);
+
+    g_remove (avc->audit_log);
+    g_remove (rotated);
+    g_remove (rotated2);
+    g_remove (avc->config_file);
+    g_rmdir (avc->dir);
+
+    g_free (rotated);
+    g_free (rotated2);
+    g_free (avc->audit_log);
+    g_free (avc->config_file);
+    g_free (avc->dir);
+    g_slice_free (AvcLog, avc);
+}
+
+static void
+append_log (const gchar *path, const gchar *data)
+{
+    FILE *fp = fopen (path, "a");
+    g_assert_nonnull (fp);
+    g_assert_cmpint (fputs (data, fp), >=, 0);
+    fclose (fp);
+}
+
+static guint
+scan_section (AvcLog *avc, gchar *section, gchar *seed_section)
+{
+    GError *error = NULL;
+    guint denials = 0;
+
+    g_assert_true (restraint_avc_scan (avc->audit_log,
+                                       avc->config_file,
+                                       section, seed_section,
+                                       &denials, &error));
+    g_assert_no_error (error);
+    return denials;
+}
+
+static guint
+scan (AvcLog *avc)
+{
+    return scan_section (avc, "restraint", NULL);
+}
+
+static void
+test_is_denial (void)
+{
+    g_assert_true (restraint_avc_is_denial (AVC_DENIED));
+    g_assert_true (restraint_avc_is_denial (USER_AVC_DENIED));
+    g_assert_true (restraint_avc_is_denial (SELINUX_ERR));
+    g_assert_true (restraint_avc_is_denial ("node=example.com " AVC_DENIED));
+    g_assert_false (restraint_avc_is_denial (AVC_GRANTED));
+    g_assert_false (restraint_avc_is_denial (USER_AVC_POLICYLOAD));
+    g_assert_false (restraint_avc_is_denial (SYSCALL));
+}
+
+static void
+test_scan_incremental (void)
+{
+    AvcLog *avc = avc_log_new ();
+
+    append_log (avc->audit_log, AVC_DENIED SYSCALL AVC_GRANTED SELINUX_ERR);
+    g_assert_cmpuint (scan (avc), ==, 2);
+
+    // Nothing new since the last scan
+    g_assert_cmpuint (scan (avc), ==, 0);
+
+    append_log (avc->audit_log, USER_AVC_POLICYLOAD SYSCALL);
+    g_assert_cmpuint (scan (avc), ==, 0);
+
+    append_log (avc->audit_log, USER_AVC_DENIED);
+    g_assert_cmpuint (scan (avc), ==, 1);
+
+    avc_log_free (avc);
+}
+
+static void
+test_scan_partial_record (void)
+{
+    AvcLog *avc = avc_log_new ();
+
+    append_log (avc->audit_log, SYSCALL "type=AVC msg=audit(1571245371.152:213): avc:  denied ");
+    g_assert_cmpuint (scan (avc), ==, 0);
+
+    // Once the record is complete it is counted
+    append_log (avc->audit_log, " { read } for  pid=1520 comm=\"sshd\"\n");
+    g_assert_cmpuint (scan (avc), ==, 1);
+    g_assert_cmpuint (scan (avc), ==, 0);
+
+    avc_log_free (avc);
+}
+
+static void
+test_scan_truncated (void)
+{
+    AvcLog *avc = avc_log_new ();
+
+    append_log (avc->audit_log, SYSCALL SYSCALL SYSCALL AVC_DENIED);
+    g_assert_cmpuint (scan (avc), ==, 1);
+
+    FILE *fp = fopen (avc->audit_log, "w");
+    g_assert_nonnull (fp);
+    fclose (fp);
+    append_log (avc->audit_log, SELINUX_ERR);
+    g_assert_cmpuint (scan (avc), ==, 1);
+
+    avc_log_free (avc);
+}
+
+static void
+test_scan_rotated (void)
+{
+    AvcLog *avc = avc_log_new ();
+    gchar *rotated = g_strdup_printf ("%s.1", avc->audit_log);
+
+    append_log (avc->audit_log, AVC_DENIED);
+    g_assert_cmpuint (scan (avc), ==, 1);
+
+    // Records written just before rotation are still picked up
+    append_log (avc->audit_log, SELINUX_ERR);
+    g_assert_cmpint (g_rename (avc->audit_log, rotated), ==, 0);
+    append_log (avc->audit_log, SYSCALL USER_AVC_DENIED);
+    g_assert_cmpuint (scan (avc), ==, 2);
+    g_assert_cmpuint (scan (avc), ==, 0);
+
+    g_free (rotated);
+    avc_log_free (avc);
+}
+
+static void
+test_scan_mark_lost (void)
+{
+    AvcLog *avc = avc_log_new ();
+    gchar *rotated2 = g_strdup_printf ("%s.2", avc->audit_log);
+    GError *error = NULL;
+    guint denials = 0;
+
+    append_log (avc->audit_log, AVC_DENIED);
+    g_assert_cmpuint (scan (avc), ==, 1);
+
+    // Rotated more than once since the last scan
+    g_assert_cmpint (g_rename (avc->audit_log, rotated2), ==, 0);
+    append_log (avc->audit_log, SYSCALL);
+    g_assert_false (restraint_avc_scan (avc->audit_log,
+                                        avc->config_file,
+                                        "restraint", NULL,
+                                        &denials, &error));
+    g_assert_error (error, RESTRAINT_AVC_ERROR, RESTRAINT_AVC_MARK_LOST_ERROR);
+    g_clear_error (&error);
+
+    // The mark was moved to the new log
+    g_assert_cmpuint (scan (avc), ==, 0);
+
+    g_free (rotated2);
+    avc_log_free (avc);
+}
+
+static void
+test_scan_missing_log (void)
+{
+    AvcLog *avc = avc_log_new ();
+    GError *error = NULL;
+    guint denials = 0;
+
+    g_assert_false (restraint_avc_scan (avc->audit_log,
+                                        avc->config_file,
+                                        "restraint", NULL,
+                                        &denials, &error));
+    g_assert_error (error, RESTRAINT_AVC_ERROR, RESTRAINT_AVC_OPEN_ERROR);
+    g_clear_error (&error);
+
+    avc_log_free (avc);
+}
+
+static void
+test_scan_sections (void)
+{
+    AvcLog *avc = avc_log_new ();
+
+    append_log (avc->audit_log, AVC_DENIED);
+    g_assert_cmpuint (scan_section (avc, "restraint", NULL), ==, 1);
+
+    // A second recipe doesn't lose the denial to the first one
+    append_log (avc->audit_log, SELINUX_ERR);
+    g_assert_cmpuint (scan_section (avc, "restraint", NULL), ==, 1);
+    g_assert_cmpuint (scan_section (avc, "restraint:two", NULL), ==, 2);
+    g_assert_cmpuint (scan_section (avc, "restraint:two", NULL), ==, 0);
+
+    // Concurrent tasks start from the recipe mark and keep their own
+    append_log (avc->audit_log, USER_AVC_DENIED);
+    g_assert_cmpuint (scan_section (avc, "10", "restraint"), ==, 1);
+    g_assert_cmpuint (scan_section (avc, "11", "restraint"), ==, 1);
+    g_assert_cmpuint (scan_section (avc, "10", "restraint"), ==, 0);
+    g_assert_cmpuint (scan_section (avc, "restraint", NULL), ==, 1);
+
+    avc_log_free (avc);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func ("/avc/is_denial", test_is_denial);
+    g_test_add_func ("/avc/scan/incremental", test_scan_incremental);
+    g_test_add_func ("/avc/scan/partial_record", test_scan_partial_record);
+    g_test_add_func ("/avc/scan/truncated", test_scan_truncated);
+    g_test_add_func ("/avc/scan/rotated", test_scan_rotated);
+    g_test_add_func ("/avc/scan/mark_lost", test_scan_mark_lost);
+    g_test_add_func ("/avc/scan/missing_log", test_scan_missing_log);
+    g_test_add_func ("/avc/scan/sections", test_scan_sections);
+    return g_test_run();
+}
@@ -0,0 +1,172 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "cgroup.h"
+
+typedef struct {
+    gchar *root;
+    RestraintCgroup *cgroup;
+} CgroupDir;
+
+/* A plain directory stands in for the cgroup filesystem */
+static CgroupDir *
+cgroup_dir_new (void)
+{
+    CgroupDir *dir = g_slice_new0 (CgroupDir);
+    GError *error = NULL;
+
+    dir->root = g_dir_make_tmp ("test_cgroup_XXXXXX", NULL);
+    g_assert_nonnull (dir->root);
+    restraint_cgroup_configure (dir->root);
+    dir->cgroup = restraint_cgroup_new ("task-1", &error);
+    g_assert_no_error (error);
+    g_assert_nonnull (dir->cgroup);
+    return dir;
+}
+
+static void
+cgroup_dir_free (CgroupDir *dir)
+{
+    const gchar *files[] = { "cpu.stat", "memory.peak", "io.stat",
+                             "cgroup.procs", "cgroup.events", NULL };
+
+    for (const gchar **file = files; *file != NULL; file++) {
+        gchar *filename = g_build_filename (dir->cgroup->path, *file, NULL);
+        g_remove (filename);
+        g_free (filename);
+    }
+    gchar *path = g_strdup (dir->cgroup->path);
+    restraint_cgroup_free (dir->cgroup);
+    g_assert_false (g_file_test (path, G_FILE_TEST_EXISTS));
+    g_rmdir (dir->root);
+    restraint_cgroup_configure (NULL);
+    g_free (path);
+    g_free (dir->root);
+    g_slice_free (CgroupDir, dir);
+}
+
+static void
+cgroup_write_file (RestraintCgroup *cgroup, const gchar *name,
+                   const gchar *contents)
+{
+    GError *error = NULL;
+
+    gchar *filename = g_build_filename (cgroup->path, name, NULL);
+    g_file_set_contents (filename, contents, -1, &error);
+    g_assert_no_error (error);
+    g_free (filename);
+}
+
+static void
+test_cgroup_unavailable (void)
+{
+    GError *error = NULL;
+
+    restraint_cgroup_configure (NULL);
+    RestraintCgroup *cgroup = restraint_cgroup_new ("task-1", &error);
+    g_assert_null (cgroup);
+    g_assert_error (error, RESTRAINT_CGROUP_ERROR, RESTRAINT_CGROUP_UNAVAILABLE);
+    g_clear_error (&error);
+}
+
+static void
+test_cgroup_stats (void)
+{
+    CgroupDir *dir = cgroup_dir_new ();
+    RestraintCgroupStats stats;
+
+    cgroup_write_file (dir->cgroup, "cpu.stat",
+                       "usage_usec 1500\nuser_usec 1000\nsystem_usec 500\n");
+    cgroup_write_file (dir->cgroup, "memory.peak", "4096\n");
+    cgroup_write_file (dir->cgroup, "io.stat",
+                       "8:0 rbytes=100 wbytes=200 rios=1 wios=2 dbytes=0 dios=0\n"
+                       "8:16 rbytes=1 wbytes=2 rios=1 wios=1 dbytes=0 dios=0\n");
+
+    restraint_cgroup_get_stats (dir->cgroup, &stats);
+    g_assert_cmpint (stats.cpu_usec, ==, 1500);
+    g_assert_cmpint (stats.memory_peak, ==, 4096);
+    g_assert_cmpint (stats.io_rbytes, ==, 101);
+    g_assert_cmpint (stats.io_wbytes, ==, 202);
+
+    cgroup_dir_free (dir);
+}
+
+static void
+test_cgroup_stats_unaccounted (void)
+{
+    CgroupDir *dir = cgroup_dir_new ();
+    RestraintCgroupStats stats;
+
+    // Only cpu.stat exists without the memory and io controllers
+    cgroup_write_file (dir->cgroup, "cpu.stat", "usage_usec 7\n");
+
+    restraint_cgroup_get_stats (dir->cgroup, &stats);
+    g_assert_cmpint (stats.cpu_usec, ==, 7);
+    g_assert_cmpint (stats.memory_peak, ==, -1);
+    g_assert_cmpint (stats.io_rbytes, ==, -1);
+    g_assert_cmpint (stats.io_wbytes, ==, -1);
+
+    cgroup_dir_free (dir);
+}
+
+static void
+test_cgroup_kill_procs (void)
+{
+    CgroupDir *dir = cgroup_dir_new ();
+    GError *error = NULL;
+    gchar *argv[] = { "sleep", "60", NULL };
+    GPid pid;
+    gint status;
+
+    g_spawn_async (NULL, argv, NULL,
+                   G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                   NULL, NULL, &pid, &error);
+    g_assert_no_error (error);
+
+    // When cgroup.kill can't be written every listed process is
+    // signalled, a 0 must not take the test's process group with it.
+    gchar *procs = g_strdup_printf ("0\n%d\n", pid);
+    gchar *kill_file = g_build_filename (dir->cgroup->path, "cgroup.kill", NULL);
+    g_assert_cmpint (g_mkdir (kill_file, 0755), ==, 0);
+    cgroup_write_file (dir->cgroup, "cgroup.procs", procs);
+    cgroup_write_file (dir->cgroup, "cgroup.events", "populated 1\nfrozen 0\n");
+    restraint_cgroup_kill (dir->cgroup);
+    g_rmdir (kill_file);
+    g_free (kill_file);
+
+    g_assert_cmpint (waitpid (pid, &status, 0), ==, pid);
+    g_assert_true (WIFSIGNALED (status));
+    g_assert_cmpint (WTERMSIG (status), ==, SIGKILL);
+    g_spawn_close_pid (pid);
+    g_free (procs);
+    cgroup_dir_free (dir);
+}
+
+int main (int argc, char *argv[])
+{
+    g_test_init (&argc, &argv, NULL);
+    g_test_add_func ("/cgroup/unavailable", test_cgroup_unavailable);
+    g_test_add_func ("/cgroup/stats", test_cgroup_stats);
+    g_test_add_func ("/cgroup/stats/unaccounted", test_cgroup_stats_unaccounted);
+    g_test_add_func ("/cgroup/kill/procs", test_cgroup_kill_procs);
+    return g_test_run ();
+}
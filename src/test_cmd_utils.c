@@ -1,4 +1,8 @@
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <string.h>
 
 #include "cmd_utils.h"
 #include "errors.h"
@@ -165,6 +169,102 @@ test_rstrnt_getenv_prefix (void)
     g_assert_cmpstr (value, ==, "42");
 }
 
+/* Answers a single request on a unix socket */
+typedef struct {
+    GSocket *listener;
+    gchar *request;
+} UnixServer;
+
+static gpointer
+unix_server_thread (gpointer user_data)
+{
+    UnixServer *server = (UnixServer *) user_data;
+    GSocket *socket = g_socket_accept (server->listener, NULL, NULL);
+    GString *request = g_string_new (NULL);
+    gchar buf[1024];
+    gssize len;
+    const gchar *response = "HTTP/1.1 201 Created\r\n"
+                            "Location: /recipes/1/tasks/1/results/2\r\n"
+                            "Content-Length: 2\r\n\r\nok";
+
+    g_assert_nonnull (socket);
+    // The form body is short, it arrives with the headers
+    while (strstr (request->str, "seconds=") == NULL &&
+           (len = g_socket_receive (socket, buf, sizeof (buf), NULL, NULL)) > 0) {
+        g_string_append_len (request, buf, len);
+    }
+    g_socket_send (socket, response, strlen (response), NULL, NULL);
+    g_socket_close (socket, NULL);
+    g_object_unref (socket);
+    server->request = g_string_free (request, FALSE);
+    return NULL;
+}
+
+static void
+test_send_message_unix (void)
+{
+    gchar *dir = g_dir_make_tmp ("test_cmd_utils_XXXXXX", NULL);
+    gchar *path = g_build_filename (dir, "rstrnt.sock", NULL);
+    GSocketAddress *address = g_unix_socket_address_new (path);
+    UnixServer server = { 0 };
+    GError *error = NULL;
+
+    server.listener = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                                    G_SOCKET_PROTOCOL_DEFAULT, &error);
+    g_assert_no_error (error);
+    g_socket_bind (server.listener, address, TRUE, &error);
+    g_assert_no_error (error);
+    g_socket_listen (server.listener, &error);
+    g_assert_no_error (error);
+    GThread *thread = g_thread_new ("unix-server", unix_server_thread, &server);
+
+    g_setenv ("SOCKET", path, TRUE);
+    SoupSession *session = soup_session_new ();
+    SoupMessage *msg = soup_message_new ("POST",
+            "http://localhost:1/recipes/1/tasks/1/watchdog");
+    soup_message_set_request (msg, "application/x-www-form-urlencoded",
+                              SOUP_MEMORY_STATIC, "seconds=60", 10);
+    guint status = rstrnt_send_message (session, msg);
+    g_thread_join (thread);
+    g_unsetenv ("SOCKET");
+
+    g_assert_cmpuint (status, ==, SOUP_STATUS_CREATED);
+    g_assert_cmpstr (soup_message_headers_get_one (msg->response_headers, "Location"),
+                     ==, "/recipes/1/tasks/1/results/2");
+    g_assert_cmpmem (msg->response_body->data, msg->response_body->length, "ok", 2);
+    g_assert_true (g_str_has_prefix (server.request,
+                   "POST /recipes/1/tasks/1/watchdog HTTP/1.1\r\n"));
+    g_assert_nonnull (strstr (server.request, "\r\nContent-Length: 10\r\n"));
+    g_assert_true (g_str_has_suffix (server.request, "\r\n\r\nseconds=60"));
+
+    g_object_unref (msg);
+    g_object_unref (session);
+    g_free (server.request);
+    g_object_unref (server.listener);
+    g_object_unref (address);
+    g_unlink (path);
+    g_rmdir (dir);
+    g_free (path);
+    g_free (dir);
+}
+
+static void
+test_send_message_fallback (void)
+{
+    // Nothing listens on either, so TCP is what reports the failure
+    g_setenv ("SOCKET", "/nonexistent/rstrnt.sock", TRUE);
+    SoupSession *session = soup_session_new ();
+    SoupMessage *msg = soup_message_new ("POST",
+            "http://localhost:1/recipes/1/tasks/1/watchdog");
+    guint status = rstrnt_send_message (session, msg);
+    g_unsetenv ("SOCKET");
+
+    g_assert_cmpuint (status, ==, SOUP_STATUS_CANT_CONNECT);
+
+    g_object_unref (msg);
+    g_object_unref (session);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -198,5 +298,10 @@ main (int   argc,
     g_test_add_func ("/cmd_utils/get_recipe_url/prefix",
                      test_get_recipe_url_prefix);
 
+    g_test_add_func ("/cmd_utils/send_message/unix",
+                     test_send_message_unix);
+    g_test_add_func ("/cmd_utils/send_message/fallback",
+                     test_send_message_fallback);
+
     return g_test_run ();
 }
@@ -29,6 +29,7 @@ typedef struct {
     GError *error;
     GMainLoop *loop;
     GString *output;
+    guint common_fetches;
 } RunData;
 
 gboolean
@@ -185,6 +186,87 @@ static void test_dependencies_success (void)
     g_slice_free(Task, task);
 }
 
+static gboolean
+run_preinstalled (const gchar *rpm_exit, const gchar *expected)
+{
+    RunData *run_data;
+    GSList *dependencies = NULL;
+    gboolean preinstalled;
+    dependencies = g_slist_prepend (dependencies, "PackageA");
+    dependencies = g_slist_prepend (dependencies, "PackageB");
+    dependencies = g_slist_prepend (dependencies, "PackageC");
+
+    run_data = g_slice_new0 (RunData);
+    run_data->loop = g_main_loop_new (NULL, TRUE);
+    run_data->output = g_string_new (NULL);
+
+    Task *task = g_slice_new0(Task);
+    task->fetch_method = TASK_FETCH_UNPACK;
+    task->metadata = g_slice_new(MetaData);
+    task->metadata->dependencies = dependencies;
+    task->metadata->softdependencies = NULL;
+    task->metadata->repodeps = NULL;
+    task->fetch.url = soup_uri_new("git://localhost/repo1?master#restraint/sanity/fetch_git");
+    task->rhts_compat = FALSE;
+    task->name = "restraint/sanity/fetch_git";
+    task->recipe = g_slice_new0(Recipe);
+    task->recipe->base_path = g_dir_make_tmp("test_repodep_git_XXXXXX", NULL);
+    task->recipe->installed_dependencies = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_add (task->recipe->installed_dependencies, "PackageB");
+
+    // rpm -q tells whether PackageB is still installed
+    gchar *path = g_strdup_printf ("./test-dummies/cmd_utils/bin:%s", g_getenv ("PATH"));
+    gchar *path_bkp = g_strdup (g_getenv ("PATH"));
+    g_setenv ("PATH", path, TRUE);
+    g_setenv ("MOCK_RPM_EXIT", rpm_exit, TRUE);
+
+    restraint_install_dependencies (task,
+                                    dependency_io_cb,
+                                    NULL,
+                                    dependency_finish_cb,
+                                    NULL,
+                                    run_data);
+
+    // run event loop while process is running.
+    g_main_loop_run (run_data->loop);
+
+    g_setenv ("PATH", path_bkp, TRUE);
+    g_unsetenv ("MOCK_RPM_EXIT");
+    g_free (path_bkp);
+    g_free (path);
+
+    // process finished, check our results.
+    g_assert_no_error (run_data->error);
+    g_clear_error (&run_data->error);
+    g_assert_cmpstr(run_data->output->str, == , expected);
+    g_string_free (run_data->output, TRUE);
+    g_slice_free (RunData, run_data);
+    g_slist_free (dependencies);
+
+    preinstalled = g_hash_table_contains (task->recipe->installed_dependencies,
+                                          "PackageB");
+    soup_uri_free(task->fetch.url);
+    g_remove (task->recipe->base_path);
+    g_free (task->recipe->base_path);
+    g_hash_table_destroy (task->recipe->installed_dependencies);
+    g_slice_free(Recipe, task->recipe);
+    g_slice_free(MetaData, task->metadata);
+    g_slice_free(Task, task);
+
+    return preinstalled;
+}
+
+static void test_dependencies_preinstalled (void)
+{
+    g_assert_true (run_preinstalled ("0", "dummy yum: installing PackageC PackageA\n"));
+}
+
+static void test_dependencies_preinstalled_removed (void)
+{
+    // An earlier task removed it, install it again from now on
+    g_assert_false (run_preinstalled ("1", "dummy yum: installing PackageC PackageB PackageA\n"));
+}
+
 static void test_dependencies_fail (void)
 {
     RunData *run_data;
@@ -631,6 +713,79 @@ static void test_git_rec_repodeps_success (void)
     g_slice_free(Task, task);
 }
 
+static void
+count_common_cb (const gchar *entry, gpointer user_data)
+{
+    RunData *run_data = (RunData *) user_data;
+
+    if (g_str_has_suffix (entry, "/restraint/sanity/common")) {
+        run_data->common_fetches++;
+    }
+}
+
+static void test_git_rec_repodeps_shared (void)
+{
+    RunData *run_data;
+    GSList *repodeps = NULL;
+    // fetch_git itself requires common as well
+    repodeps = g_slist_prepend(repodeps, "restraint/sanity/common");
+    repodeps = g_slist_prepend(repodeps, "restraint/sanity/fetch_git");
+
+    run_data = g_slice_new0 (RunData);
+    run_data->output = g_string_new (NULL);
+    run_data->loop = g_main_loop_new (NULL, TRUE);
+
+    Task *task = g_slice_new0(Task);
+    task->fetch_method = TASK_FETCH_UNPACK;
+    task->metadata = g_slice_new(MetaData);
+    task->metadata->dependencies = NULL;
+    task->metadata->softdependencies = NULL;
+    task->metadata->repodeps = repodeps;
+    task->fetch.url = soup_uri_new("git://localhost/repo1?master#restraint/sanity/fake");
+    task->rhts_compat = FALSE;
+    task->name = "restraint/sanity/fake";
+    task->recipe = g_slice_new0(Recipe);
+    task->recipe->base_path = g_dir_make_tmp("test_rec_repodep_git_XXXXXX", NULL);
+
+    restraint_install_dependencies (task,
+                                    dependency_io_cb,
+                                    count_common_cb,
+                                    dependency_finish_cb,
+                                    NULL,
+                                    run_data);
+
+    // run event loop while process is running.
+    g_main_loop_run (run_data->loop);
+
+    // process finished, check our results.
+    g_assert_no_error (run_data->error);
+    g_clear_error (&run_data->error);
+    g_assert_cmpuint (run_data->common_fetches, ==, 1);
+
+    gchar *fullpath = g_strdup_printf("%s/%s/%s/%s", task->recipe->base_path,
+            task->fetch.url->host,
+            task->fetch.url->path,
+            "restraint/sanity/common");
+    GFile *base = g_file_new_for_path(fullpath);
+
+    GFile *file = g_file_get_child (base, "runtest.sh");
+    g_assert(g_file_query_exists (file, NULL) != FALSE);
+    g_object_unref(file);
+
+    g_object_unref(base);
+    g_free(fullpath);
+
+    g_string_free (run_data->output, TRUE);
+    g_slice_free (RunData, run_data);
+    g_slist_free (repodeps);
+    soup_uri_free(task->fetch.url);
+    g_remove (task->recipe->base_path);
+    g_free (task->recipe->base_path);
+    g_slice_free(Recipe, task->recipe);
+    g_slice_free(MetaData, task->metadata);
+    g_slice_free(Task, task);
+}
+
 static void test_git_rec_repodeps_fail (void)
 {
     RunData *run_data;
@@ -835,6 +990,8 @@ int main(int argc, char *argv[]) {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/dependencies/success", test_dependencies_success);
     g_test_add_func("/dependencies/failure", test_dependencies_fail);
+    g_test_add_func("/dependencies/preinstalled", test_dependencies_preinstalled);
+    g_test_add_func("/dependencies/preinstalled/removed", test_dependencies_preinstalled_removed);
     g_test_add_func("/dependencies/ignore_failure", test_dependencies_ignore_fail);
     g_test_add_func("/softdependencies/success", test_soft_dependencies_success);
     g_test_add_func("/repodeps/git/success", test_git_repodeps_success);
@@ -842,6 +999,7 @@ int main(int argc, char *argv[]) {
     g_test_add_func("/repodeps/http/success", test_http_repodeps_success);
     g_test_add_func("/repodeps/http/fail", test_http_repodeps_fail);
     g_test_add_func("/repodeps/recursive/git/success", test_git_rec_repodeps_success);
+    g_test_add_func("/repodeps/recursive/git/shared", test_git_rec_repodeps_shared);
     g_test_add_func("/repodeps/recursive/git/fail", test_git_rec_repodeps_fail);
     g_test_add_func("/repodeps/recursive/http/success", test_http_rec_repodeps_success);
     g_test_add_func("/repodeps/recursive/http/fail", test_http_rec_repodeps_fail);
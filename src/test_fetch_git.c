@@ -24,6 +24,7 @@
 
 #include "fetch.h"
 #include "fetch_git.h"
+#include "fetch_cache.h"
 
 typedef struct {
     GString *entry;
@@ -273,10 +274,76 @@ test_fetch_git_keepchanges(void) {
     soup_uri_free(url);
 }
 
+static void
+test_fetch_git_cache(void) {
+    RunData *run_data;
+
+    gchar *cache_dir = g_dir_make_tmp ("test_fetch_cache_XXXXXX", NULL);
+    restraint_fetch_cache_configure (cache_dir, 64 * 1024 * 1024);
+
+    run_data = g_slice_new0 (RunData);
+    run_data->entry = g_string_new (NULL);
+
+    SoupURI *url = soup_uri_new("git://localhost/repo1?master#restraint/sanity/fetch_git");
+    gchar *path = g_dir_make_tmp ("test_fetch_git_XXXXXX", NULL);
+    gchar *expected = g_strdup_printf("git://localhost/repo1?master#restraint/sanity/fetch_git%sMakefilePURPOSEmetadataruntest.sh", path);
+
+    // the first fetch fills the cache, the second is served from it
+    for (gint i = 0; i < 2; i++) {
+        g_string_truncate (run_data->entry, 0);
+        restraint_fetch_git (url,
+                             path,
+                             FALSE,
+                             archive_entry_callback,
+                             fetch_finish_callback,
+                             run_data);
+
+        run_data->loop = g_main_loop_new (NULL, TRUE);
+        g_main_loop_run (run_data->loop);
+
+        g_assert_no_error (run_data->error);
+        g_assert_cmpstr (run_data->entry->str, ==, expected);
+        gchar *runtest = g_build_filename (path, "runtest.sh", NULL);
+        g_assert_cmpint (access (runtest, F_OK), ==, 0);
+        g_free (runtest);
+    }
+
+    gchar *blobs_dir = g_build_filename (cache_dir, "blobs", NULL);
+    GDir *dir = g_dir_open (blobs_dir, 0, NULL);
+    g_assert (dir != NULL);
+    guint blobs = 0;
+    while (g_dir_read_name (dir) != NULL) {
+        blobs++;
+    }
+    g_dir_close (dir);
+    g_assert_cmpuint (blobs, ==, 1);
+
+    // the archive is recorded against the commit master resolved to
+    FetchCacheEntry *entry = restraint_fetch_cache_lookup (url);
+    g_assert (entry != NULL);
+    g_assert_cmpuint (strlen (entry->etag), ==, 40);
+    restraint_fetch_cache_entry_free (entry);
+
+    restraint_fetch_cache_configure (NULL, 0);
+    rmrf (cache_dir);
+    rmrf (path);
+
+    // free our memory
+    g_free (blobs_dir);
+    g_free (cache_dir);
+    g_string_free (run_data->entry, TRUE);
+    g_clear_error (&run_data->error);
+    g_slice_free (RunData, run_data);
+    g_free (path);
+    g_free (expected);
+    soup_uri_free(url);
+}
+
 int main(int argc, char *argv[]) {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/fetch_git/success", test_fetch_git_success);
     g_test_add_func("/fetch_git/fail", test_fetch_git_fail);
     g_test_add_func("/fetch_git/keepchanges", test_fetch_git_keepchanges);
+    g_test_add_func("/fetch_git/cache", test_fetch_git_cache);
     return g_test_run();
 }
@@ -16,14 +16,22 @@
 */
 
 
+#define _GNU_SOURCE
+
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <archive.h>
+#include <archive_entry.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "fetch.h"
 #include "fetch_uri.h"
+#include "fetch_cache.h"
+#include "expect_http.h"
 
 typedef struct {
     GString *entry;
@@ -610,6 +618,707 @@ static void test_fetch_file_fragment_fail(void) {
     soup_uri_free(url);
 }
 
+typedef struct {
+    GError *error;
+    guint32 match_cnt;
+    guint *pending;
+    GMainLoop *loop;
+} TargetData;
+
+static void
+target_finish_callback (GError *error, guint32 match_cnt,
+                        guint32 nonmatch_cnt, gpointer user_data)
+{
+    TargetData *target_data = (TargetData *) user_data;
+    if (error)
+        g_propagate_error(&target_data->error, error);
+    target_data->match_cnt = match_cnt;
+    if (--(*target_data->pending) == 0)
+        g_main_loop_quit (target_data->loop);
+}
+
+static void test_fetch_http_targets(void) {
+    const gchar *fragments[] = { "restraint/sanity/fetch_git",
+                                 "restraint/sanity/common",
+                                 "restraint/sanity/fetch_git",
+                                 "nonexistant" };
+    TargetData target_data[G_N_ELEMENTS (fragments)];
+    gchar *paths[G_N_ELEMENTS (fragments)];
+    GMainLoop *loop = g_main_loop_new (NULL, TRUE);
+    guint pending = G_N_ELEMENTS (fragments);
+    GSList *targets = NULL;
+
+    SoupURI *url = soup_uri_new("http://localhost:8000/fetch_http.tgz");
+
+    for (guint i = 0; i < G_N_ELEMENTS (fragments); i++) {
+        target_data[i].error = NULL;
+        target_data[i].match_cnt = 0;
+        target_data[i].pending = &pending;
+        target_data[i].loop = loop;
+        paths[i] = g_dir_make_tmp ("test_fetch_http_XXXXXX", NULL);
+        targets = g_slist_append (targets,
+                                  restraint_fetch_uri_target_new (fragments[i],
+                                                                  paths[i],
+                                                                  FALSE,
+                                                                  NULL,
+                                                                  target_finish_callback,
+                                                                  &target_data[i]));
+    }
+
+    restraint_fetch_uri_targets (url, TRUE, targets);
+
+    // run event loop while process is running.
+    g_main_loop_run (loop);
+
+    g_assert_no_error (target_data[0].error);
+    g_assert_no_error (target_data[1].error);
+    g_assert_no_error (target_data[2].error);
+    g_assert_error (target_data[3].error, RESTRAINT_FETCH_LIBARCHIVE_ERROR, ARCHIVE_WARN);
+
+    // the same fragment twice ends up the same both times
+    g_assert_cmpuint (target_data[0].match_cnt, >, 0);
+    g_assert_cmpuint (target_data[0].match_cnt, ==, target_data[2].match_cnt);
+
+    gchar *file = g_build_filename (paths[1], "runtest.sh", NULL);
+    g_assert_cmpint (access (file, F_OK), ==, 0);
+    g_free (file);
+    file = g_build_filename (paths[2], "subdir/data", NULL);
+    g_assert_cmpint (access (file, F_OK), ==, 0);
+    g_free (file);
+
+    // free our memory
+    for (guint i = 0; i < G_N_ELEMENTS (fragments); i++) {
+        g_clear_error (&target_data[i].error);
+        rmrf (paths[i]);
+        g_free (paths[i]);
+    }
+    g_main_loop_unref (loop);
+    soup_uri_free(url);
+}
+
+static void
+write_archive_entry (struct archive *a, const gchar *path, mode_t type,
+                     const gchar *hardlink, const gchar *data, gsize size)
+{
+    struct archive_entry *entry = archive_entry_new ();
+
+    archive_entry_set_pathname (entry, path);
+    archive_entry_set_filetype (entry, type);
+    archive_entry_set_perm (entry, type == AE_IFDIR ? 0755 : 0644);
+    if (hardlink != NULL)
+        archive_entry_set_hardlink (entry, hardlink);
+    archive_entry_set_size (entry, size);
+    g_assert_cmpint (archive_write_header (a, entry), ==, ARCHIVE_OK);
+    if (data != NULL)
+        g_assert_cmpint (archive_write_data (a, data, size), ==, size);
+    archive_entry_free (entry);
+}
+
+static void test_fetch_file_targets_hardlink(void) {
+    const gchar *fragments[] = { "links", "links/sub" };
+    const gchar *links[] = { "sub/link", "link" };
+    const gchar *files[] = { "sub/data", "data" };
+    TargetData target_data[G_N_ELEMENTS (fragments)];
+    gchar *paths[G_N_ELEMENTS (fragments)];
+    GMainLoop *loop = g_main_loop_new (NULL, TRUE);
+    guint pending = G_N_ELEMENTS (fragments);
+    GSList *targets = NULL;
+
+    gchar *archive_dir = g_dir_make_tmp ("test_fetch_file_XXXXXX", NULL);
+    gchar *archive_path = g_build_filename (archive_dir, "links.tar", NULL);
+    struct archive *a = archive_write_new ();
+    archive_write_set_format_pax_restricted (a);
+    g_assert_cmpint (archive_write_open_filename (a, archive_path), ==, ARCHIVE_OK);
+    write_archive_entry (a, "links/", AE_IFDIR, NULL, NULL, 0);
+    write_archive_entry (a, "links/sub/", AE_IFDIR, NULL, NULL, 0);
+    write_archive_entry (a, "links/sub/data", AE_IFREG, NULL, "hello\n", 6);
+    write_archive_entry (a, "links/sub/link", AE_IFREG, "links/sub/data", NULL, 0);
+    archive_write_close (a);
+    archive_write_free (a);
+
+    gchar *fulluri = g_strdup_printf ("file://%s", archive_path);
+    SoupURI *url = soup_uri_new (fulluri);
+    g_free (fulluri);
+
+    for (guint i = 0; i < G_N_ELEMENTS (fragments); i++) {
+        target_data[i].error = NULL;
+        target_data[i].match_cnt = 0;
+        target_data[i].pending = &pending;
+        target_data[i].loop = loop;
+        paths[i] = g_dir_make_tmp ("test_fetch_file_XXXXXX", NULL);
+        targets = g_slist_append (targets,
+                                  restraint_fetch_uri_target_new (fragments[i],
+                                                                  paths[i],
+                                                                  FALSE,
+                                                                  NULL,
+                                                                  target_finish_callback,
+                                                                  &target_data[i]));
+    }
+
+    restraint_fetch_uri_targets (url, TRUE, targets);
+
+    // run event loop while process is running.
+    g_main_loop_run (loop);
+
+    // the first target extracts, the second one links within its own copy
+    for (guint i = 0; i < G_N_ELEMENTS (fragments); i++) {
+        struct stat data_st, link_st;
+        gchar *contents = NULL;
+
+        g_assert_no_error (target_data[i].error);
+        gchar *file = g_build_filename (paths[i], files[i], NULL);
+        gchar *link = g_build_filename (paths[i], links[i], NULL);
+        g_assert_cmpint (stat (file, &data_st), ==, 0);
+        g_assert_cmpint (stat (link, &link_st), ==, 0);
+        g_assert_cmpuint (data_st.st_ino, ==, link_st.st_ino);
+        g_assert_cmpuint (link_st.st_nlink, ==, 2);
+        g_assert_true (g_file_get_contents (link, &contents, NULL, NULL));
+        g_assert_cmpstr (contents, ==, "hello\n");
+        g_free (contents);
+        g_free (file);
+        g_free (link);
+    }
+
+    // free our memory
+    for (guint i = 0; i < G_N_ELEMENTS (fragments); i++) {
+        g_clear_error (&target_data[i].error);
+        rmrf (paths[i]);
+        g_free (paths[i]);
+    }
+    rmrf (archive_dir);
+    g_free (archive_dir);
+    g_free (archive_path);
+    g_main_loop_unref (loop);
+    soup_uri_free(url);
+}
+
+/*
+ * Serves a tar with a single file of file_size bytes followed by
+ * padding chunks of 1 MiB, from the main loop the fetch runs in.
+ */
+#define STREAM_CHUNK_SIZE (1024 * 1024)
+
+typedef struct {
+    SoupServer *server;
+    SoupURI *url;
+    gchar *data;
+    gsize file_size;
+    gchar *archive;
+    gsize archive_size;
+    gchar *padding;
+    guint padding_cnt;
+    guint padding_sent;
+    // client port of every request
+    GSList *ports;
+    GThread *main_thread;
+    gboolean entry_in_main;
+} StreamServer;
+
+static void
+stream_server_wrote_chunk (SoupMessage *msg, gpointer user_data)
+{
+    StreamServer *ss = user_data;
+
+    if (ss->padding_sent < ss->padding_cnt) {
+        ss->padding_sent++;
+        soup_message_body_append (msg->response_body, SOUP_MEMORY_STATIC,
+                                  ss->padding, STREAM_CHUNK_SIZE);
+    } else {
+        soup_message_body_complete (msg->response_body);
+    }
+}
+
+static void
+stream_server_handler (SoupServer *server, SoupMessage *msg,
+                       const char *path, GHashTable *query,
+                       SoupClientContext *client, gpointer user_data)
+{
+    StreamServer *ss = user_data;
+    GSocketAddress *addr = soup_client_context_get_remote_address (client);
+    guint16 port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (addr));
+
+    ss->ports = g_slist_append (ss->ports, GUINT_TO_POINTER (port));
+    ss->padding_sent = 0;
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+    soup_message_headers_set_encoding (msg->response_headers,
+                                       SOUP_ENCODING_CHUNKED);
+    soup_message_body_set_accumulate (msg->response_body, FALSE);
+    g_signal_connect (msg, "wrote-chunk",
+                      G_CALLBACK (stream_server_wrote_chunk), ss);
+    soup_message_body_append (msg->response_body, SOUP_MEMORY_STATIC,
+                              ss->archive, ss->archive_size);
+}
+
+static StreamServer *
+stream_server_new (gsize file_size, guint padding_cnt)
+{
+    StreamServer *ss = g_slice_new0 (StreamServer);
+
+    ss->main_thread = g_thread_self ();
+    ss->file_size = file_size;
+    ss->data = g_malloc (file_size);
+    for (gsize i = 0; i < file_size; i++)
+        ss->data[i] = (i * 31) % 251;
+    ss->padding_cnt = padding_cnt;
+    ss->padding = g_malloc0 (STREAM_CHUNK_SIZE);
+
+    gchar *archive_dir = g_dir_make_tmp ("test_fetch_http_XXXXXX", NULL);
+    gchar *archive_path = g_build_filename (archive_dir, "stream.tar", NULL);
+    struct archive *a = archive_write_new ();
+    archive_write_set_format_pax_restricted (a);
+    g_assert_cmpint (archive_write_open_filename (a, archive_path), ==, ARCHIVE_OK);
+    write_archive_entry (a, "stream/", AE_IFDIR, NULL, NULL, 0);
+    write_archive_entry (a, "stream/data", AE_IFREG, NULL, ss->data, file_size);
+    archive_write_close (a);
+    archive_write_free (a);
+    g_assert_true (g_file_get_contents (archive_path, &ss->archive,
+                                        &ss->archive_size, NULL));
+    rmrf (archive_dir);
+    g_free (archive_dir);
+    g_free (archive_path);
+
+    ss->server = soup_server_new (SOUP_SERVER_SERVER_HEADER, "test_fetch_uri",
+                                  NULL);
+    soup_server_add_handler (ss->server, NULL, stream_server_handler, ss, NULL);
+    ss->url = expect_http_listen_local (ss->server);
+    soup_uri_set_path (ss->url, "/stream.tar");
+    return ss;
+}
+
+static void
+stream_server_free (StreamServer *ss)
+{
+    soup_server_disconnect (ss->server);
+    g_object_unref (ss->server);
+    soup_uri_free (ss->url);
+    g_slist_free (ss->ports);
+    g_free (ss->data);
+    g_free (ss->archive);
+    g_free (ss->padding);
+    g_slice_free (StreamServer, ss);
+}
+
+static void
+stream_entry_callback (const gchar *entry, gpointer user_data)
+{
+    StreamServer *ss = user_data;
+    ss->entry_in_main = g_thread_self () == ss->main_thread;
+}
+
+/*
+ * Fetch ss->url into a new directory for each of cnt targets, all at
+ * once, the directories are returned in paths.
+ */
+static void
+stream_fetch (StreamServer *ss, guint cnt, gchar **paths)
+{
+    GMainLoop *loop = g_main_loop_new (NULL, TRUE);
+    TargetData target_data[cnt];
+    guint pending = cnt;
+
+    for (guint i = 0; i < cnt; i++) {
+        target_data[i].error = NULL;
+        target_data[i].match_cnt = 0;
+        target_data[i].pending = &pending;
+        target_data[i].loop = loop;
+        paths[i] = g_dir_make_tmp ("test_fetch_http_XXXXXX", NULL);
+        restraint_fetch_uri_targets (ss->url, TRUE,
+                g_slist_prepend (NULL,
+                    restraint_fetch_uri_target_new ("stream", paths[i], FALSE,
+                                                    stream_entry_callback,
+                                                    target_finish_callback,
+                                                    &target_data[i])));
+    }
+
+    g_main_loop_run (loop);
+
+    for (guint i = 0; i < cnt; i++) {
+        g_assert_no_error (target_data[i].error);
+        g_assert_cmpuint (target_data[i].match_cnt, ==, 1);
+    }
+    g_main_loop_unref (loop);
+}
+
+static void test_fetch_http_stream_pause(void) {
+    // several times the buffer between curl and libarchive
+    StreamServer *ss = stream_server_new (12 * 1024 * 1024, 0);
+    gchar *path;
+    gchar *contents = NULL;
+    gsize length;
+
+    restraint_fetch_cache_configure (NULL, 0);
+    // the server runs in this main loop, extracting in it would deadlock
+    stream_fetch (ss, 1, &path);
+
+    g_assert_true (ss->entry_in_main);
+    gchar *file = g_build_filename (path, "data", NULL);
+    g_assert_true (g_file_get_contents (file, &contents, &length, NULL));
+    g_assert_cmpuint (length, ==, ss->file_size);
+    g_assert_true (memcmp (contents, ss->data, length) == 0);
+
+    g_free (contents);
+    g_free (file);
+    rmrf (path);
+    g_free (path);
+    stream_server_free (ss);
+}
+
+static void test_fetch_http_stream_abort(void) {
+    StreamServer *ss = stream_server_new (6, 64);
+    gchar *path;
+
+    restraint_fetch_cache_configure (NULL, 0);
+    stream_fetch (ss, 1, &path);
+
+    // nothing to cache, the padding after the archive wasn't waited for
+    g_assert_cmpuint (ss->padding_sent, <, ss->padding_cnt);
+
+    rmrf (path);
+    g_free (path);
+    stream_server_free (ss);
+}
+
+static void test_fetch_http_stream_reuse(void) {
+    StreamServer *ss = stream_server_new (6, 0);
+    gchar *paths[3];
+
+    restraint_fetch_cache_configure (NULL, 0);
+    stream_fetch (ss, 1, &paths[0]);
+    stream_fetch (ss, 1, &paths[1]);
+
+    // the second fetch went over the connection of the first
+    g_assert_cmpuint (g_slist_length (ss->ports), ==, 2);
+    g_assert_cmpuint (GPOINTER_TO_UINT (ss->ports->data), ==,
+                      GPOINTER_TO_UINT (ss->ports->next->data));
+
+    // and the multi handle runs several at once
+    rmrf (paths[1]);
+    g_free (paths[1]);
+    stream_fetch (ss, 2, &paths[1]);
+    g_assert_cmpuint (g_slist_length (ss->ports), ==, 4);
+
+    for (guint i = 0; i < G_N_ELEMENTS (paths); i++) {
+        rmrf (paths[i]);
+        g_free (paths[i]);
+    }
+    stream_server_free (ss);
+}
+
+static void test_fetch_http_cache(void) {
+    RunData *run_data;
+
+    gchar *expected = "././Makefile./metadata./subdir/./subdir/datafile./PURPOSE./runtest.sh";
+    gchar *cache_dir = g_dir_make_tmp ("test_fetch_cache_XXXXXX", NULL);
+    restraint_fetch_cache_configure (cache_dir, 64 * 1024 * 1024);
+
+    run_data = g_slice_new0 (RunData);
+    run_data->entry = g_string_new (NULL);
+
+    SoupURI *url = soup_uri_new("http://localhost:8000/fetch_git.tgz");
+    gchar *path = g_dir_make_tmp ("test_fetch_http_XXXXXX", NULL);
+
+    // the first fetch fills the cache, the second is served from it
+    for (gint i = 0; i < 2; i++) {
+        g_string_truncate (run_data->entry, 0);
+        restraint_fetch_uri (url,
+                              path,
+                              FALSE,
+                              TRUE,
+                              archive_entry_callback,
+                              fetch_finish_callback,
+                              run_data);
+
+        run_data->loop = g_main_loop_new (NULL, TRUE);
+        g_main_loop_run (run_data->loop);
+
+        g_assert_no_error (run_data->error);
+        g_assert_cmpstr (run_data->entry->str, ==, expected);
+    }
+
+    gchar *blobs_dir = g_build_filename (cache_dir, "blobs", NULL);
+    GDir *dir = g_dir_open (blobs_dir, 0, NULL);
+    g_assert (dir != NULL);
+    guint blobs = 0;
+    while (g_dir_read_name (dir) != NULL) {
+        blobs++;
+    }
+    g_dir_close (dir);
+    g_assert_cmpuint (blobs, ==, 1);
+
+    restraint_fetch_cache_configure (NULL, 0);
+    rmrf (cache_dir);
+    rmrf (path);
+
+    // free our memory
+    g_free (blobs_dir);
+    g_free (cache_dir);
+    g_string_free (run_data->entry, TRUE);
+    g_clear_error (&run_data->error);
+    g_slice_free (RunData, run_data);
+    g_free (path);
+    soup_uri_free(url);
+}
+
+static FetchCacheEntry *
+cache_add (const gchar *url, const gchar *etag, const gchar *data)
+{
+    GError *error = NULL;
+    SoupURI *uri = soup_uri_new (url);
+    FetchCacheEntry *entry = restraint_fetch_cache_lookup (uri);
+    gchar *header = g_strdup_printf ("ETag: %s\r\n", etag);
+
+    g_assert_nonnull (entry);
+    restraint_fetch_cache_header (entry, header, strlen (header));
+    restraint_fetch_cache_write (entry, data, strlen (data));
+    g_assert_true (restraint_fetch_cache_commit (entry, &error));
+    g_assert_no_error (error);
+
+    g_free (header);
+    soup_uri_free (uri);
+    return entry;
+}
+
+static void test_fetch_cache_pinned(void) {
+    GError *error = NULL;
+    gchar buf[16];
+    gsize bytes_read;
+
+    gchar *cache_dir = g_dir_make_tmp ("test_fetch_cache_XXXXXX", NULL);
+    restraint_fetch_cache_configure (cache_dir, 64 * 1024 * 1024);
+    restraint_fetch_cache_entry_free (cache_add ("http://localhost:8000/a.tgz",
+                                                 "\"a\"", "AAAA"));
+
+    // About to make a conditional GET for a.tgz
+    SoupURI *url = soup_uri_new ("http://localhost:8000/a.tgz");
+    FetchCacheEntry *entry = restraint_fetch_cache_lookup (url);
+    g_assert_true (restraint_fetch_cache_valid (entry));
+
+    // Meanwhile another fetch fills the cache past its limit
+    restraint_fetch_cache_configure (cache_dir, 1);
+    restraint_fetch_cache_entry_free (cache_add ("http://localhost:8000/b.tgz",
+                                                 "\"b\"", "BBBB"));
+    gchar *blob_path = g_build_filename (cache_dir, "blobs", entry->checksum, NULL);
+    g_assert_false (g_file_test (blob_path, G_FILE_TEST_EXISTS));
+
+    // The 304 still gets the evicted blob
+    GInputStream *stream = restraint_fetch_cache_read (entry, &error);
+    g_assert_no_error (error);
+    g_assert_nonnull (stream);
+    g_assert_true (g_input_stream_read_all (stream, buf, sizeof (buf),
+                                            &bytes_read, NULL, &error));
+    g_assert_no_error (error);
+    g_assert_cmpuint (bytes_read, ==, 4);
+    g_assert_cmpint (memcmp (buf, "AAAA", 4), ==, 0);
+
+    g_object_unref (stream);
+    restraint_fetch_cache_entry_free (entry);
+    restraint_fetch_cache_configure (NULL, 0);
+    rmrf (cache_dir);
+    g_free (blob_path);
+    g_free (cache_dir);
+    soup_uri_free (url);
+}
+
+static void test_fetch_http_manifest(void) {
+    RunData *run_data;
+    struct stat before, after;
+
+    run_data = g_slice_new0 (RunData);
+    run_data->entry = g_string_new (NULL);
+
+    SoupURI *url = soup_uri_new("http://localhost:8000/fetch_git.tgz");
+    gchar *path = g_dir_make_tmp ("test_fetch_http_XXXXXX", NULL);
+    gchar *runtest = g_build_filename (path, "runtest.sh", NULL);
+    gchar *purpose = g_build_filename (path, "PURPOSE", NULL);
+    gchar *stray = g_build_filename (path, "subdir", "STRAY", NULL);
+
+    for (gint i = 0; i < 2; i++) {
+        if (i == 1) {
+            g_assert_cmpint (stat (runtest, &before), ==, 0);
+            g_file_set_contents (purpose, "CHANGED", -1, &run_data->error);
+            g_assert_no_error (run_data->error);
+            g_file_set_contents (stray, "STRAY", -1, &run_data->error);
+            g_assert_no_error (run_data->error);
+        }
+        restraint_fetch_uri (url,
+                              path,
+                              FALSE,
+                              TRUE,
+                              archive_entry_callback,
+                              fetch_finish_callback,
+                              run_data);
+
+        run_data->loop = g_main_loop_new (NULL, TRUE);
+        g_main_loop_run (run_data->loop);
+
+        g_assert_no_error (run_data->error);
+    }
+
+    // the unchanged file was not written again, the rest was put right
+    g_assert_cmpint (stat (runtest, &after), ==, 0);
+    g_assert_cmpuint (before.st_ino, ==, after.st_ino);
+    gchar *contents = NULL;
+    g_file_get_contents (purpose, &contents, NULL, &run_data->error);
+    g_assert_no_error (run_data->error);
+    g_assert_cmpstr (contents, !=, "CHANGED");
+    g_free (contents);
+    g_assert_cmpint (access (stray, F_OK), ==, -1);
+
+    rmrf (path);
+
+    // free our memory
+    g_free (runtest);
+    g_free (purpose);
+    g_free (stray);
+    g_string_free (run_data->entry, TRUE);
+    g_clear_error (&run_data->error);
+    g_slice_free (RunData, run_data);
+    g_free (path);
+    soup_uri_free(url);
+}
+
+static void test_fetch_file_manifest_newline(void) {
+    RunData *run_data;
+    struct stat before, after;
+
+    run_data = g_slice_new0 (RunData);
+    run_data->entry = g_string_new (NULL);
+
+    gchar *archive_dir = g_dir_make_tmp ("test_fetch_file_XXXXXX", NULL);
+    gchar *archive_path = g_build_filename (archive_dir, "newline.tar", NULL);
+    struct archive *a = archive_write_new ();
+    archive_write_set_format_pax_restricted (a);
+    g_assert_cmpint (archive_write_open_filename (a, archive_path), ==, ARCHIVE_OK);
+    write_archive_entry (a, "nl/", AE_IFDIR, NULL, NULL, 0);
+    write_archive_entry (a, "nl/new\nline", AE_IFREG, NULL, "hello\n", 6);
+    write_archive_entry (a, "nl/sub\ndir/", AE_IFDIR, NULL, NULL, 0);
+    write_archive_entry (a, "nl/sub\ndir/data", AE_IFREG, NULL, "hello\n", 6);
+    archive_write_close (a);
+    archive_write_free (a);
+
+    gchar *fulluri = g_strdup_printf ("file://%s#nl", archive_path);
+    SoupURI *url = soup_uri_new (fulluri);
+    g_free (fulluri);
+    gchar *path = g_dir_make_tmp ("test_fetch_file_XXXXXX", NULL);
+    gchar *newline = g_build_filename (path, "new\nline", NULL);
+    gchar *data = g_build_filename (path, "sub\ndir", "data", NULL);
+
+    for (gint i = 0; i < 2; i++) {
+        restraint_fetch_uri (url,
+                              path,
+                              FALSE,
+                              TRUE,
+                              archive_entry_callback,
+                              fetch_finish_callback,
+                              run_data);
+
+        run_data->loop = g_main_loop_new (NULL, TRUE);
+        g_main_loop_run (run_data->loop);
+
+        g_assert_no_error (run_data->error);
+        g_assert_cmpint (access (data, F_OK), ==, 0);
+        g_assert_cmpint (stat (newline, i == 0 ? &before : &after), ==, 0);
+    }
+
+    // recorded in the manifest, neither pruned nor written again
+    g_assert_cmpuint (before.st_ino, ==, after.st_ino);
+
+    rmrf (path);
+    rmrf (archive_dir);
+
+    // free our memory
+    g_free (newline);
+    g_free (data);
+    g_free (archive_path);
+    g_free (archive_dir);
+    g_string_free (run_data->entry, TRUE);
+    g_clear_error (&run_data->error);
+    g_slice_free (RunData, run_data);
+    g_free (path);
+    soup_uri_free(url);
+}
+
+static gint trash_deleted;
+
+static void
+trash_log_handler (const gchar *log_domain, GLogLevelFlags log_level,
+                   const gchar *message, gpointer user_data)
+{
+    if (g_str_has_prefix (message, "Deleted "))
+        g_atomic_int_inc (&trash_deleted);
+}
+
+static gboolean
+dir_is_empty (const gchar *path)
+{
+    GDir *dir = g_dir_open (path, 0, NULL);
+    gboolean empty = dir == NULL || g_dir_read_name (dir) == NULL;
+
+    if (dir != NULL)
+        g_dir_close (dir);
+    return empty;
+}
+
+static void test_fetch_rmrf_async(void) {
+    gchar *trash_dir = g_dir_make_tmp ("test_fetch_trash_XXXXXX", NULL);
+    gchar *task_dir = g_dir_make_tmp ("test_fetch_task_XXXXXX", NULL);
+    gchar *tree = g_build_filename (task_dir, "tree", NULL);
+    gchar *leftover = g_build_filename (trash_dir, FETCH_TRASH_PREFIX "leftover",
+                                        NULL);
+    gchar *file;
+
+    file = g_build_filename (tree, "sub", NULL);
+    g_mkdir_with_parents (file, 0755);
+    g_free (file);
+    file = g_build_filename (tree, "sub", "data", NULL);
+    g_assert_true (g_file_set_contents (file, "data", -1, NULL));
+    g_free (file);
+    file = g_build_filename (leftover, "data", NULL);
+    g_mkdir (leftover, 0755);
+    g_assert_true (g_file_set_contents (file, "data", -1, NULL));
+    g_free (file);
+
+    // getpriority() and ioprio_get() of the calling thread on Linux
+    gint nice = getpriority (PRIO_PROCESS, syscall (SYS_gettid));
+#ifdef SYS_ioprio_get
+    glong ioprio = syscall (SYS_ioprio_get, 1, 0);
+#endif
+    guint handler = g_log_set_handler (NULL, G_LOG_LEVEL_DEBUG,
+                                       trash_log_handler, NULL);
+    trash_deleted = 0;
+
+    // the leftover is only queued once
+    restraint_rmrf_configure (trash_dir);
+    restraint_rmrf_configure (trash_dir);
+    restraint_rmrf_async (tree);
+
+    // moved out of the task directory right away
+    g_assert_false (g_file_test (tree, G_FILE_TEST_EXISTS));
+    g_assert_true (dir_is_empty (task_dir));
+
+    for (gint i = 0; i < 100 && g_atomic_int_get (&trash_deleted) < 2; i++)
+        g_usleep (G_USEC_PER_SEC / 10);
+    // a duplicate would run right after on the single thread
+    g_usleep (G_USEC_PER_SEC / 5);
+    g_assert_cmpint (g_atomic_int_get (&trash_deleted), ==, 2);
+    g_assert_true (dir_is_empty (trash_dir));
+
+    // only the deleting thread runs at idle priority
+    g_assert_cmpint (getpriority (PRIO_PROCESS, syscall (SYS_gettid)), ==, nice);
+#ifdef SYS_ioprio_get
+    g_assert_cmpint (syscall (SYS_ioprio_get, 1, 0), ==, ioprio);
+#endif
+
+    g_log_remove_handler (NULL, handler);
+    restraint_rmrf_configure (NULL);
+    rmrf (trash_dir);
+    rmrf (task_dir);
+    g_free (trash_dir);
+    g_free (task_dir);
+    g_free (tree);
+    g_free (leftover);
+}
+
 int main(int argc, char *argv[]) {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/fetch_http/nofragment/success", test_fetch_http_nofragment_success);
@@ -618,6 +1327,16 @@ int main(int argc, char *argv[]) {
     g_test_add_func("/fetch_http/nofragment/keepchanges", test_fetch_http_nofragment_keepchanges);
     g_test_add_func("/fetch_http/fragment/success", test_fetch_http_fragment_success);
     g_test_add_func("/fetch_http/fragment/fail", test_fetch_http_fragment_fail);
+    g_test_add_func("/fetch_http/targets", test_fetch_http_targets);
+    g_test_add_func("/fetch_file/targets/hardlink", test_fetch_file_targets_hardlink);
+    g_test_add_func("/fetch_http/stream/pause", test_fetch_http_stream_pause);
+    g_test_add_func("/fetch_http/stream/abort", test_fetch_http_stream_abort);
+    g_test_add_func("/fetch_http/stream/reuse", test_fetch_http_stream_reuse);
+    g_test_add_func("/fetch_http/cache", test_fetch_http_cache);
+    g_test_add_func("/fetch_cache/pinned", test_fetch_cache_pinned);
+    g_test_add_func("/fetch_http/manifest", test_fetch_http_manifest);
+    g_test_add_func("/fetch_file/manifest/newline", test_fetch_file_manifest_newline);
+    g_test_add_func("/fetch/rmrf_async", test_fetch_rmrf_async);
     g_test_add_func("/fetch_file/fragment/trailing/slash", test_fetch_file_fragment_trailing_slash);
     g_test_add_func("/fetch_file/fragment/no/trailing/slash", test_fetch_file_fragment_no_trailing_slash);
     g_test_add_func("/fetch_file/fragment/success", test_fetch_file_fragment_success);
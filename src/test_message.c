@@ -0,0 +1,146 @@
+/*
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "expect_http.h"
+#include "message.h"
+
+/* A stub lab controller, it records "METHOD path body" of each request */
+typedef struct {
+    SoupServer *server;
+    SoupURI *uri;
+    SoupSession *session;
+    GPtrArray *requests;
+    // Messages sent that had a callback
+    guint sent;
+} Upstream;
+
+static void
+upstream_handler (SoupServer *server, SoupMessage *msg,
+                  const char *path, GHashTable *query,
+                  SoupClientContext *client, gpointer user_data)
+{
+    Upstream *up = (Upstream *) user_data;
+
+    g_ptr_array_add (up->requests,
+                     g_strdup_printf ("%s %s %.*s", msg->method, path,
+                                      (int) msg->request_body->length,
+                                      msg->request_body->data));
+    soup_message_set_status (msg, SOUP_STATUS_NO_CONTENT);
+}
+
+static Upstream *
+upstream_new (void)
+{
+    Upstream *up = g_slice_new0 (Upstream);
+
+    up->requests = g_ptr_array_new_with_free_func (g_free);
+    up->server = soup_server_new (NULL, NULL);
+    soup_server_add_handler (up->server, NULL, upstream_handler, up, NULL);
+    up->uri = expect_http_listen_local (up->server);
+    up->session = soup_session_new ();
+    return up;
+}
+
+static void
+upstream_free (Upstream *up)
+{
+    soup_session_abort (up->session);
+    g_object_unref (up->session);
+    soup_server_disconnect (up->server);
+    g_object_unref (up->server);
+    soup_uri_free (up->uri);
+    g_ptr_array_free (up->requests, TRUE);
+    g_slice_free (Upstream, up);
+}
+
+static void
+message_sent (SoupSession *session, SoupMessage *msg, gpointer user_data)
+{
+    Upstream *up = (Upstream *) user_data;
+    up->sent++;
+}
+
+/* Queue a POST like restraint_task_watchdog and restraint_task_status do */
+static void
+queue_post (Upstream *up, const gchar *path, const gchar *body,
+            gboolean supersedes, MessageFinishCallback callback)
+{
+    SoupURI *uri = soup_uri_new_with_base (up->uri, path);
+    SoupMessage *msg = soup_message_new_from_uri ("POST", uri);
+
+    soup_uri_free (uri);
+    soup_message_set_request (msg, "application/x-www-form-urlencoded",
+                              SOUP_MEMORY_COPY, body, strlen (body));
+    if (supersedes) {
+        restraint_message_supersedes (msg);
+    }
+    restraint_queue_message (up->session, msg, NULL, callback, NULL, up);
+}
+
+static void
+test_message_superseded (void)
+{
+    Upstream *up = upstream_new ();
+
+    // Nothing is sent until the main loop runs, so all of these queue up
+    queue_post (up, "/recipes/1/watchdog", "seconds=1", TRUE, NULL);
+    queue_post (up, "/recipes/1/watchdog", "seconds=2", TRUE,
+                message_sent);
+    queue_post (up, "/recipes/1/tasks/1/status", "status=Running",
+                FALSE, NULL);
+    queue_post (up, "/recipes/1/tasks/1/status", "status=Running",
+                FALSE, NULL);
+    queue_post (up, "/recipes/1/watchdog", "seconds=3", TRUE, NULL);
+    queue_post (up, "/recipes/2/watchdog", "seconds=4", TRUE, NULL);
+    queue_post (up, "/recipes/1/watchdog", "seconds=5", TRUE, NULL);
+    queue_post (up, "/recipes/1/tasks/1/status", "status=Completed",
+                FALSE, message_sent);
+
+    // The queue is FIFO, the last callback means everything was sent
+    while (up->sent < 2) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    // Let the queue notice it is empty
+    while (g_main_context_iteration (NULL, FALSE));
+
+    // Older watchdogs nobody waits on are dropped, the one with a
+    // callback and the other recipe's are kept, status updates all go.
+    const gchar *expected[] = {
+        "POST /recipes/1/watchdog seconds=2",
+        "POST /recipes/1/tasks/1/status status=Running",
+        "POST /recipes/1/tasks/1/status status=Running",
+        "POST /recipes/2/watchdog seconds=4",
+        "POST /recipes/1/watchdog seconds=5",
+        "POST /recipes/1/tasks/1/status status=Completed",
+    };
+    g_assert_cmpuint (up->requests->len, ==, G_N_ELEMENTS (expected));
+    for (guint i = 0; i < G_N_ELEMENTS (expected); i++) {
+        g_assert_cmpstr (up->requests->pdata[i], ==, expected[i]);
+    }
+
+    upstream_free (up);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func ("/message/superseded", test_message_superseded);
+    return g_test_run();
+}
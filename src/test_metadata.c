@@ -16,7 +16,11 @@
 */
 
 
+#include <string.h>
+#include <time.h>
+#include <utime.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include "metadata.h"
@@ -437,6 +441,208 @@ static void test_metadata_environment(void) {
     restraint_metadata_free (metadata);
 }
 
+typedef struct {
+    GMainLoop *loop;
+    GError *error;
+    gboolean finished;
+} MetadataRunData;
+
+static gboolean
+metadata_io_cb (GIOChannel *io, GIOCondition condition, gpointer user_data)
+{
+    gchar buf[4096];
+    gsize bytes_read;
+
+    if (condition & G_IO_IN) {
+        if (g_io_channel_read_chars (io, buf, sizeof (buf), &bytes_read, NULL) ==
+                G_IO_STATUS_NORMAL) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void
+metadata_finish_cb (gpointer user_data, GError *error)
+{
+    MetadataRunData *run_data = user_data;
+
+    if (error) {
+        g_propagate_error (&run_data->error, error);
+    }
+    run_data->finished = TRUE;
+    g_main_loop_quit (run_data->loop);
+}
+
+static MetaData *
+get_metadata_sync (gchar *path, gboolean *rhts_compat)
+{
+    MetadataRunData run_data = { g_main_loop_new (NULL, FALSE), NULL, FALSE };
+    MetaData *metadata = NULL;
+
+    *rhts_compat = restraint_get_metadata (path, "RedHatEnterpriseLinux7",
+                                           &metadata, NULL, metadata_finish_cb,
+                                           metadata_io_cb, NULL, &run_data);
+    if (!run_data.finished) {
+        g_main_loop_run (run_data.loop);
+    }
+    g_main_loop_unref (run_data.loop);
+    g_assert_no_error (run_data.error);
+    return metadata;
+}
+
+static void test_metadata_cache(void) {
+    GError *error = NULL;
+    MetaData *metadata;
+    gboolean rhts_compat;
+    gchar *runs = NULL;
+
+    gchar *cache_dir = g_dir_make_tmp ("test_metadata_cache_XXXXXX", NULL);
+    gchar *path = g_dir_make_tmp ("test_metadata_task_XXXXXX", NULL);
+    gchar *makefile = g_build_filename (path, "Makefile", NULL);
+    gchar *testinfo = g_build_filename (path, "testinfo.desc", NULL);
+    gchar *runs_file = g_build_filename (path, "runs", NULL);
+    const gchar *contents =
+        "testinfo.desc:\n"
+        "\techo run >> runs\n"
+        "\techo 'Name: /cached/task' > $@\n"
+        "\techo 'TestTime: 5m' >> $@\n";
+
+    g_file_set_contents (makefile, contents, -1, &error);
+    g_assert_no_error (error);
+    restraint_metadata_cache_configure (cache_dir);
+
+    // make runs once, then the cache stands in for the generated file
+    for (gint i = 0; i < 2; i++) {
+        metadata = get_metadata_sync (path, &rhts_compat);
+        g_assert (rhts_compat);
+        g_assert_cmpstr (metadata->name, ==, "/cached/task");
+        g_assert_cmpint (metadata->max_time, ==, 300);
+        restraint_metadata_free (metadata);
+        g_remove (testinfo);
+    }
+    g_file_get_contents (runs_file, &runs, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpstr (runs, ==, "run\n");
+    g_free (runs);
+
+    // a changed Makefile is made again
+    gchar *changed = g_strconcat (contents, "\techo 'Use_pty: true' >> $@\n", NULL);
+    g_file_set_contents (makefile, changed, -1, &error);
+    g_assert_no_error (error);
+    metadata = get_metadata_sync (path, &rhts_compat);
+    g_assert (metadata->use_pty);
+    restraint_metadata_free (metadata);
+    g_file_get_contents (runs_file, &runs, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpstr (runs, ==, "run\nrun\n");
+    g_free (runs);
+
+    // unused for too long, gone the next time restraintd starts
+    GDir *dir = g_dir_open (cache_dir, 0, NULL);
+    const gchar *name;
+    gint entries = 0;
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *entry = g_build_filename (cache_dir, name, NULL);
+        struct utimbuf times;
+        times.actime = times.modtime = time (NULL) -
+                                       (METADATA_CACHE_MAX_AGE + 1) * 24 * 60 * 60;
+        // the first one stays recent
+        if (entries++ > 0) {
+            g_assert_cmpint (utime (entry, &times), ==, 0);
+        }
+        g_free (entry);
+    }
+    g_dir_close (dir);
+    g_assert_cmpint (entries, ==, 2);
+    restraint_metadata_cache_configure (cache_dir);
+    entries = 0;
+    dir = g_dir_open (cache_dir, 0, NULL);
+    while (g_dir_read_name (dir) != NULL) {
+        entries++;
+    }
+    g_dir_close (dir);
+    g_assert_cmpint (entries, ==, 1);
+
+    restraint_metadata_cache_configure (NULL);
+    g_free (changed);
+    g_free (makefile);
+    g_free (testinfo);
+    g_free (runs_file);
+    g_free (path);
+    g_free (cache_dir);
+}
+
+static void test_metadata_testinfo_native(void) {
+    GError *error = NULL;
+    MetaData *metadata;
+    gboolean rhts_compat;
+    gchar *testinfo_contents = NULL;
+
+    gchar *path = g_dir_make_tmp ("test_metadata_task_XXXXXX", NULL);
+    gchar *makefile = g_build_filename (path, "Makefile", NULL);
+    gchar *testinfo = g_build_filename (path, "testinfo.desc", NULL);
+    // make itself would fail on the missing include
+    const gchar *contents =
+        "export TEST=/native/task\n"
+        "export TESTVERSION=1.0\n"
+        "PACKAGE_NAME = native\n"
+        "FILES=$(METADATA) runtest.sh Makefile\n"
+        "\n"
+        ".PHONY: all install download clean\n"
+        "\n"
+        "run: $(FILES) build\n"
+        "\t./runtest.sh\n"
+        "\n"
+        "clean:\n"
+        "\trm -f *~ $(BUILT_FILES)\n"
+        "\n"
+        "include /usr/share/rhts/lib/rhts-make.include\n"
+        "\n"
+        "$(METADATA): Makefile\n"
+        "\t@echo \"Owner:     Test User <test@example.com>\" > $(METADATA)\n"
+        "\t@echo \"Name:      $(TEST)\" >> $(METADATA)\n"
+        "\t@echo \"Path:      $(TEST_DIR)\" >> $(METADATA)\n"
+        "\t@echo \"TestTime:  10m\" >> $(METADATA)\n"
+        "\t@echo \"Requires:  $(PACKAGE_NAME)-devel\" >> $(METADATA)\n"
+        "\trhts-lint $(METADATA)\n";
+
+    g_file_set_contents (makefile, contents, -1, &error);
+    g_assert_no_error (error);
+
+    metadata = get_metadata_sync (path, &rhts_compat);
+    g_assert (rhts_compat);
+    g_assert_cmpstr (metadata->name, ==, "/native/task");
+    g_assert_cmpint (metadata->max_time, ==, 600);
+    g_assert_cmpstr (g_slist_nth_data (metadata->dependencies, 0), ==,
+                     "native-devel");
+    restraint_metadata_free (metadata);
+
+    g_file_get_contents (testinfo, &testinfo_contents, NULL, &error);
+    g_assert_no_error (error);
+    g_assert (strstr (testinfo_contents,
+                      "Path:      /mnt/tests/native/task\n") != NULL);
+    g_free (testinfo_contents);
+    g_remove (testinfo);
+
+    // $(shell) is left to make
+    g_file_set_contents (makefile,
+                         "testinfo.desc: Makefile\n"
+                         "\t@echo \"Name: $(shell echo /shelled/task)\" > $@\n",
+                         -1, &error);
+    g_assert_no_error (error);
+    metadata = get_metadata_sync (path, &rhts_compat);
+    g_assert_cmpstr (metadata->name, ==, "/shelled/task");
+    restraint_metadata_free (metadata);
+
+    g_remove (testinfo);
+    g_remove (makefile);
+    g_rmdir (path);
+    g_free (makefile);
+    g_free (testinfo);
+    g_free (path);
+}
+
 int main(int argc, char *argv[]) {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/testinfo.desc/testtime/day", test_testinfo_testtime_day);
@@ -460,5 +666,7 @@ int main(int argc, char *argv[]) {
     g_test_add_func("/metadata/use_pty", test_metadata_use_pty);
     g_test_add_func("/metadata/no_localwatchdog", test_metadata_no_localwatchdog);
     g_test_add_func("/metadata/environment", test_metadata_environment);
+    g_test_add_func("/metadata/cache", test_metadata_cache);
+    g_test_add_func("/metadata/testinfo/native", test_metadata_testinfo_native);
     return g_test_run();
 }
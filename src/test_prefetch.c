@@ -0,0 +1,182 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+#include "fetch.h"
+#include "param.h"
+#include "recipe.h"
+#include "task.h"
+
+typedef struct {
+    gchar *base;
+    AppData *app_data;
+    Recipe *recipe;
+} PrefetchRecipe;
+
+static Task *
+add_task (PrefetchRecipe *pr, const gchar *task_id, const gchar *fragment)
+{
+    Task *task = restraint_task_new ();
+    gchar *cwd = g_get_current_dir ();
+    gchar *url = g_strdup_printf ("file://%s/test-data/http-remote/fetch_http.tgz#%s",
+                                  cwd, fragment);
+    gchar *suffix = g_strconcat ("tasks/", task_id, "/", NULL);
+
+    task->task_id = g_strdup (task_id);
+    task->recipe = pr->recipe;
+    task->task_uri = soup_uri_new_with_base (pr->recipe->recipe_uri, suffix);
+    task->fetch_method = TASK_FETCH_UNPACK;
+    task->fetch.url = soup_uri_new (url);
+    task->ssl_verify = TRUE;
+    task->path = g_build_filename (pr->base, fragment, NULL);
+    pr->recipe->tasks = g_list_append (pr->recipe->tasks, task);
+    pr->app_data->tasks = pr->recipe->tasks;
+
+    g_free (suffix);
+    g_free (url);
+    g_free (cwd);
+    return task;
+}
+
+static void
+set_prefetch (PrefetchRecipe *pr, const gchar *depth)
+{
+    Param *param = restraint_param_new ();
+    param->name = g_strdup (PREFETCH_PARAM);
+    param->value = g_strdup (depth);
+    pr->recipe->params = g_list_append (pr->recipe->params, param);
+}
+
+static void
+wait_prefetches (AppData *app_data)
+{
+    while (app_data->prefetches != NULL) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+}
+
+/* A recipe of its own for each test, its tasks are added by add_task */
+static PrefetchRecipe *
+prefetch_recipe_new (void)
+{
+    PrefetchRecipe *pr = g_slice_new0 (PrefetchRecipe);
+
+    pr->base = g_dir_make_tmp ("test_prefetch_XXXXXX", NULL);
+    g_assert_nonnull (pr->base);
+
+    pr->recipe = g_slice_new0 (Recipe);
+    pr->recipe->recipe_id = g_strdup ("1");
+    pr->recipe->osmajor = g_strdup ("RedHatEnterpriseLinux7");
+    pr->recipe->recipe_uri = soup_uri_new ("http://localhost:8000/recipes/1/");
+    pr->recipe->base_path = pr->base;
+
+    pr->app_data = server_app_data_new (CONFIG_SECTION);
+    pr->app_data->config_file = g_build_filename (pr->base, "config.conf",
+                                                  NULL);
+    pr->app_data->recipe = pr->recipe;
+    return pr;
+}
+
+static void
+prefetch_recipe_free (PrefetchRecipe *pr)
+{
+    hosted_recipes = g_list_remove (hosted_recipes, pr->app_data);
+    restraint_free_app_data (pr->app_data);
+    rmrf (pr->base);
+    g_free (pr->base);
+    g_slice_free (PrefetchRecipe, pr);
+}
+
+static void
+test_prefetch_depth (void)
+{
+    PrefetchRecipe *pr = prefetch_recipe_new ();
+    Task *current = add_task (pr, "1", "restraint/sanity/common");
+    Task *next = add_task (pr, "2", "restraint/sanity/fetch_git");
+    Task *later = add_task (pr, "3", "restraint/sanity/rdep_fail");
+    set_prefetch (pr, "1");
+
+    restraint_task_prefetch (pr->app_data, current);
+    wait_prefetches (pr->app_data);
+
+    g_assert_true (next->prefetched);
+    g_assert_nonnull (next->metadata);
+    g_assert_true (restraint_config_get_boolean (pr->app_data->config_file,
+                                                 "2", "prefetched", NULL));
+    g_assert_false (later->prefetched);
+    g_assert_null (later->metadata);
+
+    prefetch_recipe_free (pr);
+}
+
+static void
+test_prefetch_started (void)
+{
+    PrefetchRecipe *pr = prefetch_recipe_new ();
+    Task *current = add_task (pr, "1", "restraint/sanity/common");
+    Task *started = add_task (pr, "2", "restraint/sanity/fetch_git");
+    Task *later = add_task (pr, "3", "restraint/sanity/rdep_fail");
+    set_prefetch (pr, "2");
+
+    // Started before a reboot
+    restraint_config_set (pr->app_data->config_file, "2", "started",
+                          NULL, G_TYPE_BOOLEAN, TRUE);
+    restraint_task_prefetch (pr->app_data, current);
+    wait_prefetches (pr->app_data);
+
+    g_assert_false (started->prefetched);
+    g_assert_true (later->prefetched);
+
+    // The config is only read once per task, after that the task has it
+    restraint_config_set (pr->app_data->config_file, "2", "started",
+                          NULL, G_TYPE_BOOLEAN, FALSE);
+    restraint_task_prefetch (pr->app_data, current);
+    g_assert_null (pr->app_data->prefetches);
+    g_assert_false (started->prefetched);
+
+    prefetch_recipe_free (pr);
+}
+
+static void
+test_prefetch_task_aborted (void)
+{
+    PrefetchRecipe *pr = prefetch_recipe_new ();
+    Task *current = add_task (pr, "1", "restraint/sanity/common");
+    Task *next = add_task (pr, "2", "restraint/sanity/fetch_git");
+    set_prefetch (pr, "1");
+
+    // Aborting the running task leaves the prefetch alone
+    restraint_task_prefetch (pr->app_data, current);
+    g_cancellable_cancel (pr->app_data->cancellable);
+    wait_prefetches (pr->app_data);
+
+    g_assert_true (next->prefetched);
+    g_assert_nonnull (next->metadata);
+
+    prefetch_recipe_free (pr);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func ("/task/prefetch/depth", test_prefetch_depth);
+    g_test_add_func ("/task/prefetch/started", test_prefetch_started);
+    g_test_add_func ("/task/prefetch/task_aborted", test_prefetch_task_aborted);
+    return g_test_run();
+}
@@ -16,8 +16,14 @@
 */
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
+#include "common.h"
 #include "process.h"
 #include "errors.h"
 
@@ -94,6 +100,7 @@ static void test_process_success(void) {
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     // run event loop while process is running.
@@ -125,6 +132,7 @@ static void test_process_failure(void) {
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     // run event loop while process is running.
@@ -158,6 +166,7 @@ static void test_watchdog_success(void) {
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     // run event loop while process is running.
@@ -193,6 +202,7 @@ static void test_watchdog_failure(void) {
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     // run event loop while process is running.
@@ -240,6 +250,7 @@ static void test_no_hang(void) {
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     guint toid = g_timeout_add(20000, hang_quit_loop, run_data);
@@ -292,6 +303,7 @@ static void test_use_pty(void) {
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     // run event loop while process is running.
@@ -329,6 +341,7 @@ static void test_dont_use_pty(void) {
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     // run event loop while process is running.
@@ -372,6 +385,7 @@ test_process_read_empty_stdin (void)
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     g_main_loop_run (run_data->loop);
@@ -414,6 +428,7 @@ test_process_read_content_input (void)
                  strlen (expected),
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     g_main_loop_run (run_data->loop);
@@ -456,6 +471,7 @@ test_process_read_empty_stdin_pty (void)
                  0,
                  FALSE,
                  NULL,
+                 NULL,
                  run_data);
 
     g_main_loop_run (run_data->loop);
@@ -470,6 +486,186 @@ test_process_read_empty_stdin_pty (void)
     g_slice_free (RunData, run_data);
 }
 
+static void
+test_process_path (void)
+{
+    RunData *run_data;
+
+    run_data = g_slice_new0 (RunData);
+    run_data->loop = g_main_loop_new (NULL, TRUE);
+    run_data->output = g_string_new (NULL);
+
+    process_run ("pwd",
+                 NULL,
+                 "/",
+                 FALSE,
+                 3,
+                 NULL,
+                 test_process_io_cb,
+                 test_process_finish_cb,
+                 NULL,
+                 0,
+                 FALSE,
+                 NULL,
+                 NULL,
+                 run_data);
+
+    g_main_loop_run (run_data->loop);
+
+    g_assert_no_error (run_data->error);
+    g_assert_cmpint (run_data->pid_result, ==, 0);
+    g_assert (g_str_has_prefix (run_data->output->str, "/\n"));
+
+    g_string_free (run_data->output, TRUE);
+    g_clear_error (&run_data->error);
+    g_slice_free (RunData, run_data);
+}
+
+static void
+test_process_exec_failure (void)
+{
+    RunData *run_data;
+
+    run_data = g_slice_new0 (RunData);
+    run_data->loop = g_main_loop_new (NULL, TRUE);
+    run_data->output = g_string_new (NULL);
+
+    process_run ("/nonexistent/command",
+                 NULL,
+                 NULL,
+                 FALSE,
+                 3,
+                 NULL,
+                 test_process_io_cb,
+                 test_process_finish_cb,
+                 NULL,
+                 0,
+                 FALSE,
+                 NULL,
+                 NULL,
+                 run_data);
+
+    g_main_loop_run (run_data->loop);
+
+    // Reported like a child that failed to exec, not as a fork error
+    g_assert_no_error (run_data->error);
+    g_assert (WIFEXITED (run_data->pid_result));
+    g_assert_cmpint (WEXITSTATUS (run_data->pid_result), ==,
+                     SPAWN_COMMAND_FAILED);
+    g_assert (strstr (run_data->output->str, "Failed to exec()") != NULL);
+    g_assert (!run_data->localwatchdog);
+
+    g_string_free (run_data->output, TRUE);
+    g_clear_error (&run_data->error);
+    g_slice_free (RunData, run_data);
+}
+
+static void
+test_process_cgroup (void)
+{
+#ifdef POSIX_SPAWN_SETCGROUP
+    g_test_skip ("posix_spawn starts the child in its cgroup");
+#else
+    RunData *run_data;
+    gchar *procs = NULL;
+
+    // A plain directory stands in for the cgroup
+    gchar *cgroup = g_dir_make_tmp ("test_process_cgroup_XXXXXX", NULL);
+    gchar *procs_file = g_build_filename (cgroup, "cgroup.procs", NULL);
+    g_assert_true (g_file_set_contents (procs_file, "", 0, NULL));
+    gint cgroup_fd = open (cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    g_assert_cmpint (cgroup_fd, !=, -1);
+
+    run_data = g_slice_new0 (RunData);
+    run_data->loop = g_main_loop_new (NULL, TRUE);
+    run_data->output = g_string_new (NULL);
+
+    process_run_in_cgroup (cgroup_fd,
+                           "true",
+                           NULL,
+                           NULL,
+                           FALSE,
+                           3,
+                           NULL,
+                           test_process_io_cb,
+                           test_process_finish_cb,
+                           NULL,
+                           0,
+                           FALSE,
+                           NULL,
+                           NULL,
+                           run_data);
+
+    g_main_loop_run (run_data->loop);
+
+    g_assert_no_error (run_data->error);
+    g_assert_cmpint (run_data->pid_result, ==, 0);
+    // Moved in by the child itself before exec, not by restraintd after
+    g_assert_true (g_file_get_contents (procs_file, &procs, NULL, NULL));
+    g_assert_cmpstr (procs, ==, "0");
+
+    close (cgroup_fd);
+    g_remove (procs_file);
+    g_rmdir (cgroup);
+    g_free (procs);
+    g_free (procs_file);
+    g_free (cgroup);
+    g_string_free (run_data->output, TRUE);
+    g_clear_error (&run_data->error);
+    g_slice_free (RunData, run_data);
+#endif
+}
+
+static void
+test_process_timing_cb (const gchar *command, gint64 start_time,
+                        gint64 end_time, gint pid_result, gpointer timing_data)
+{
+    GString *timed = (GString *) timing_data;
+
+    g_assert_cmpint (start_time, <=, end_time);
+    g_string_append_printf (timed, "%s=%d;", command, WEXITSTATUS (pid_result));
+}
+
+static void
+test_process_timing (void)
+{
+    GString *first = g_string_new (NULL);
+    GString *second = g_string_new (NULL);
+    const gchar *commands[] = { "true", "false", "true" };
+    GString *timing_data[] = { first, second, NULL };
+
+    process_set_timing_callback (test_process_timing_cb);
+    for (guint i = 0; i < G_N_ELEMENTS (commands); i++) {
+        RunData *run_data = g_slice_new0 (RunData);
+        run_data->loop = g_main_loop_new (NULL, TRUE);
+
+        process_run (commands[i],
+                     NULL,
+                     NULL,
+                     FALSE,
+                     0,
+                     NULL,
+                     NULL,
+                     test_process_finish_cb,
+                     NULL,
+                     0,
+                     FALSE,
+                     NULL,
+                     timing_data[i],
+                     run_data);
+        g_main_loop_run (run_data->loop);
+        g_assert_no_error (run_data->error);
+        g_slice_free (RunData, run_data);
+    }
+    process_set_timing_callback (NULL);
+
+    // Each process is timed with what it was run with, or not at all
+    g_assert_cmpstr (first->str, ==, "true=0;");
+    g_assert_cmpstr (second->str, ==, "false=1;");
+    g_string_free (first, TRUE);
+    g_string_free (second, TRUE);
+}
+
 int main(int argc, char *argv[]) {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/process/success", test_process_success);
@@ -483,6 +679,10 @@ int main(int argc, char *argv[]) {
     g_test_add_func ("/process/read_content_input", test_process_read_content_input);
     g_test_add_func ("/process/read_empty_stdin", test_process_read_empty_stdin);
     g_test_add_func ("/process/read_empty_stdin_pty", test_process_read_empty_stdin_pty);
+    g_test_add_func ("/process/path", test_process_path);
+    g_test_add_func ("/process/exec_failure", test_process_exec_failure);
+    g_test_add_func ("/process/cgroup", test_process_cgroup);
+    g_test_add_func ("/process/timing", test_process_timing);
 
     return g_test_run();
 }
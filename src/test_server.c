@@ -0,0 +1,780 @@
+/*
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <libxml/parser.h>
+
+#include "config.h"
+#include "expect_http.h"
+#include "fetch.h"
+#include "message.h"
+#include "metadata.h"
+#include "param.h"
+#include "recipe.h"
+#include "role.h"
+#include "server.h"
+#include "task.h"
+
+/*
+ * restraintd's handlers on a server of their own, the recipe they serve
+ * points at a stub lab controller.  Both run on the test's main loop.
+ */
+typedef struct {
+    gchar *base;
+    AppData *app_data;
+    Recipe *recipe;
+    SoupServer *restraintd;
+    SoupURI *restraintd_uri;
+    SoupServer *upstream;
+    SoupURI *upstream_uri;
+    SoupSession *client;
+    // "METHOD path" of each request the lab controller got
+    GPtrArray *upstream_requests;
+} ServerTest;
+
+static void
+upstream_handler (SoupServer *server, SoupMessage *msg,
+                  const char *path, GHashTable *query,
+                  SoupClientContext *client, gpointer user_data)
+{
+    ServerTest *st = (ServerTest *) user_data;
+
+    g_ptr_array_add (st->upstream_requests,
+                     g_strdup_printf ("%s %s", msg->method, path));
+    soup_message_set_status (msg, SOUP_STATUS_NO_CONTENT);
+}
+
+static gboolean
+upstream_got (ServerTest *st, const gchar *request)
+{
+    for (guint i = 0; i < st->upstream_requests->len; i++) {
+        if (g_strcmp0 (st->upstream_requests->pdata[i], request) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void
+add_param (GList **params, const gchar *name, const gchar *value)
+{
+    Param *param = restraint_param_new ();
+    param->name = g_strdup (name);
+    param->value = g_strdup (value);
+    *params = g_list_append (*params, param);
+}
+
+static Task *
+add_task (Recipe *recipe, const gchar *task_id, const gchar *group)
+{
+    Task *task = restraint_task_new ();
+    gchar *suffix = g_strconcat ("tasks/", task_id, "/", NULL);
+
+    task->task_id = g_strdup (task_id);
+    task->recipe = recipe;
+    task->task_uri = soup_uri_new_with_base (recipe->recipe_uri, suffix);
+    task->fetch_method = TASK_FETCH_UNPACK;
+    task->fetch.url = soup_uri_new ("http://localhost:8000/fetch_http.tgz");
+    task->path = g_strconcat ("/restraint/server/", task_id, NULL);
+    if (group != NULL) {
+        add_param (&task->params, CONCURRENT_GROUP_PARAM, group);
+    }
+    recipe->tasks = g_list_append (recipe->tasks, task);
+
+    g_free (suffix);
+    return task;
+}
+
+/* What task_run leaves behind for a task of a concurrent group */
+static TaskRunData *
+start_task (ServerTest *st, Task *task)
+{
+    TaskRunData *task_run_data = g_slice_new0 (TaskRunData);
+
+    task_run_data->app_data = st->app_data;
+    task_run_data->task = task;
+    task_run_data->logpath = LOG_PATH_TASK;
+    task->concurrent = TRUE;
+    task->started = TRUE;
+    task->cancellable = g_cancellable_new ();
+    st->app_data->running = g_slist_prepend (st->app_data->running,
+                                             task_run_data);
+    return task_run_data;
+}
+
+static void
+request_finished (SoupSession *session, SoupMessage *msg, gpointer user_data)
+{
+    gboolean *done = (gboolean *) user_data;
+    *done = TRUE;
+}
+
+/* Send a request to restraintd like the rstrnt-* commands do */
+static guint
+server_request (ServerTest *st, const gchar *method,
+                const gchar *path, const gchar *body)
+{
+    SoupURI *uri = soup_uri_new_with_base (st->restraintd_uri, path);
+    SoupMessage *msg = soup_message_new_from_uri (method, uri);
+    gboolean done = FALSE;
+
+    soup_uri_free (uri);
+    soup_message_set_request (msg, "application/x-www-form-urlencoded",
+                              SOUP_MEMORY_COPY, body, strlen (body));
+    g_object_ref (msg);
+    soup_session_queue_message (st->client, msg, request_finished, &done);
+    while (!done) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    guint status = msg->status_code;
+    g_object_unref (msg);
+    return status;
+}
+
+/*
+ * Stands in for restraint_queue_message, log pieces are held here until
+ * the test answers them so it decides how far behind the lab controller is.
+ */
+typedef struct {
+    SoupSession *session;
+    SoupMessage *msg;
+    MessageFinishCallback callback;
+    gpointer user_data;
+} HeldMessage;
+
+static GQueue held_messages = G_QUEUE_INIT;
+
+static void
+hold_message (SoupSession *session, SoupMessage *msg, gpointer message_data,
+              MessageFinishCallback callback, GCancellable *cancellable,
+              gpointer user_data)
+{
+    HeldMessage *held = g_slice_new0 (HeldMessage);
+
+    held->session = session;
+    held->msg = msg;
+    held->callback = callback;
+    held->user_data = user_data;
+    g_queue_push_tail (&held_messages, held);
+}
+
+static void
+wait_held (guint count)
+{
+    while (g_queue_get_length (&held_messages) < count) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    while (g_main_context_iteration (NULL, FALSE));
+}
+
+/* Answer the oldest held piece, checking it is the expected range */
+static void
+release_message (const gchar *range, gsize length, guint status)
+{
+    wait_held (1);
+    HeldMessage *held = g_queue_pop_head (&held_messages);
+
+    g_assert_cmpstr (held->msg->method, ==, "PUT");
+    g_assert_cmpstr (soup_message_headers_get_one (held->msg->request_headers,
+                                                   "Content-Range"), ==, range);
+    g_assert_cmpuint (held->msg->request_body->length, ==, length);
+    soup_message_set_status (held->msg, status);
+    held->callback (held->session, held->msg, held->user_data);
+    g_object_unref (held->msg);
+    g_slice_free (HeldMessage, held);
+}
+
+/* Throw away held messages without finishing them */
+static void
+drop_held_messages (void)
+{
+    HeldMessage *held;
+
+    while ((held = g_queue_pop_head (&held_messages)) != NULL) {
+        g_object_unref (held->msg);
+        g_slice_free (HeldMessage, held);
+    }
+}
+
+/* Start a log upload bigger than what restraintd passes on in one piece */
+static SoupMessage *
+log_put_start (ServerTest *st, gsize length, const gchar *range,
+               gboolean *done)
+{
+    SoupURI *uri = soup_uri_new_with_base (st->restraintd_uri,
+                                           "/recipes/1/tasks/2/logs/big.log");
+    SoupMessage *msg = soup_message_new_from_uri ("PUT", uri);
+    gchar *body = g_malloc (length);
+
+    soup_uri_free (uri);
+    memset (body, 'x', length);
+    soup_message_set_request (msg, "text/plain", SOUP_MEMORY_TAKE,
+                              body, length);
+    if (range != NULL) {
+        soup_message_headers_replace (msg->request_headers, "Content-Range",
+                                      range);
+    }
+    st->app_data->queue_message = (QueueMessage) hold_message;
+    g_object_ref (msg);
+    soup_session_queue_message (st->client, msg, request_finished, done);
+    return msg;
+}
+
+/* A recipe restraintd runs, its lab controller is the stub */
+static AppData *
+hosted_recipe_new (ServerTest *st, const gchar *config_section,
+                   const gchar *recipe_id)
+{
+    AppData *app_data = server_app_data_new (config_section);
+    gchar *recipe_path = g_strconcat ("/recipes/", recipe_id, "/", NULL);
+
+    app_data->recipe = g_slice_new0 (Recipe);
+    app_data->recipe->recipe_id = g_strdup (recipe_id);
+    app_data->recipe->recipe_uri = soup_uri_new_with_base (st->upstream_uri,
+                                                           recipe_path);
+    app_data->recipe->base_path = st->base;
+    app_data->config_file = g_build_filename (st->base, "config.conf", NULL);
+    app_data->state = RECIPE_RUNNING;
+    app_data->queue_message = (QueueMessage) restraint_queue_message;
+
+    g_free (recipe_path);
+    return app_data;
+}
+
+static ServerTest *
+server_test_new (void)
+{
+    ServerTest *st = g_slice_new0 (ServerTest);
+
+    st->base = g_dir_make_tmp ("test_server_XXXXXX", NULL);
+    g_assert_nonnull (st->base);
+
+    st->upstream_requests = g_ptr_array_new_with_free_func (g_free);
+    st->upstream = soup_server_new (NULL, NULL);
+    soup_server_add_handler (st->upstream, NULL, upstream_handler, st, NULL);
+    st->upstream_uri = expect_http_listen_local (st->upstream);
+
+    st->app_data = hosted_recipe_new (st, CONFIG_SECTION, "1");
+    st->recipe = st->app_data->recipe;
+
+    st->restraintd = soup_server_new (NULL, NULL);
+    g_signal_connect (st->restraintd, "request-started",
+                      G_CALLBACK (server_request_started), NULL);
+    soup_server_add_handler (st->restraintd, "/recipes",
+                             server_recipe_callback, NULL, NULL);
+    st->restraintd_uri = expect_http_listen_local (st->restraintd);
+    st->client = soup_session_new ();
+    return st;
+}
+
+static void
+task_run_data_free (gpointer data)
+{
+    g_slice_free (TaskRunData, data);
+}
+
+static void
+server_test_free (ServerTest *st)
+{
+    soup_session_abort (st->client);
+    g_object_unref (st->client);
+    soup_server_disconnect (st->restraintd);
+    g_object_unref (st->restraintd);
+    soup_uri_free (st->restraintd_uri);
+
+    while (hosted_recipes != NULL) {
+        AppData *app_data = (AppData *) hosted_recipes->data;
+        hosted_recipes = g_list_remove (hosted_recipes, app_data);
+        g_slist_free_full (app_data->running, task_run_data_free);
+        restraint_free_app_data (app_data);
+    }
+
+    soup_server_disconnect (st->upstream);
+    g_object_unref (st->upstream);
+    soup_uri_free (st->upstream_uri);
+    g_ptr_array_free (st->upstream_requests, TRUE);
+    rmrf (st->base);
+    g_free (st->base);
+    g_slice_free (ServerTest, st);
+}
+
+/*
+ * Tasks 2 and 3 of group "g" are running, 3 was the last one set up and
+ * is still the current task.
+ */
+static Task *
+start_group (ServerTest *st, TaskRunData **first)
+{
+    Task *done = add_task (st->recipe, "1", NULL);
+    done->started = TRUE;
+    done->finished = TRUE;
+    *first = start_task (st, add_task (st->recipe, "2", "g"));
+    Task *current = add_task (st->recipe, "3", "g");
+    start_task (st, current);
+    current->state = TASK_NEXT;
+    st->app_data->tasks = g_list_find (st->recipe->tasks, current);
+    return current;
+}
+
+static void
+test_concurrent_limit (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    Task *current = start_group (st, &first);
+    Task *next = add_task (st->recipe, "4", "g");
+    add_param (&st->recipe->params, CONCURRENCY_PARAM, "2");
+
+    // Both places are taken, the next task of the group waits
+    g_assert_false (task_handler (st->app_data));
+    g_assert_true (st->app_data->running_waiting);
+    g_assert_true (st->app_data->tasks->data == current);
+
+    // With room for one more it is set up alongside the others
+    st->app_data->running_waiting = FALSE;
+    add_param (&st->recipe->params, CONCURRENCY_PARAM, "3");
+    g_assert_true (task_handler (st->app_data));
+    g_assert_false (st->app_data->running_waiting);
+    g_assert_true (st->app_data->tasks->data == next);
+    g_assert_cmpint (next->state, ==, TASK_IDLE);
+    g_assert_cmpuint (g_slist_length (st->app_data->running), ==, 2);
+
+    server_test_free (st);
+}
+
+static void
+test_concurrent_group_end (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    Task *current = start_group (st, &first);
+    add_task (st->recipe, "4", NULL);
+    add_param (&st->recipe->params, CONCURRENCY_PARAM, "8");
+
+    // The task after the group waits for all of it, not just for room
+    g_assert_false (task_handler (st->app_data));
+    g_assert_true (st->app_data->running_waiting);
+
+    // A task of the group finishes on its own, by its own task id
+    task_finish_plugins_callback (0, FALSE, first, NULL);
+    while (st->app_data->running->next != NULL ||
+           !st->app_data->running_waiting) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_true (upstream_got (st, "POST /recipes/1/tasks/2/status"));
+    g_assert_true (upstream_got (st, "PUT /recipes/1/tasks/2/logs/harness.log"));
+    g_assert_false (upstream_got (st, "POST /recipes/1/tasks/3/status"));
+
+    // The rest of the group is still running, the next task still waits
+    g_assert_true (st->app_data->tasks->data == current);
+    TaskRunData *running = st->app_data->running->data;
+    g_assert_true (running->task == current);
+
+    server_test_free (st);
+}
+
+static void
+test_task_running (void)
+{
+    ServerTest *st = server_test_new ();
+    Task *task = add_task (st->recipe, "1", NULL);
+    st->app_data->tasks = st->recipe->tasks;
+
+    // "Running" is queued and the task moves on to fetching at once
+    g_assert_true (task_handler (st->app_data));
+    g_assert_cmpint (task->state, ==, TASK_FETCH);
+    g_assert_false (upstream_got (st, "POST /recipes/1/tasks/1/status"));
+
+    while (!upstream_got (st, "POST /recipes/1/tasks/1/status")) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    while (g_main_context_iteration (NULL, FALSE));
+
+    server_test_free (st);
+}
+
+static void
+test_task_completed (void)
+{
+    ServerTest *st = server_test_new ();
+    Task *task = add_task (st->recipe, "1", NULL);
+    Task *next = add_task (st->recipe, "2", NULL);
+    st->app_data->tasks = st->recipe->tasks;
+    // What build_env leaves, with the slots for the plugin variables
+    task->env = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (task->env, g_strdup ("HOME=/root"));
+    for (guint i = 0; i < 6; i++) {
+        g_ptr_array_add (task->env, NULL);
+    }
+    task->metadata = g_slice_new0 (MetaData);
+    task->state = TASK_COMPLETED;
+
+    // The Completed status is on its way, the task is still current
+    st->app_data->queue_message = (QueueMessage) hold_message;
+    g_assert_false (task_handler (st->app_data));
+    g_assert_cmpuint (g_queue_get_length (&held_messages), ==, 1);
+    st->app_data->queue_message = (QueueMessage) restraint_queue_message;
+
+    // Something the task left running reports late.  The report plugins
+    // may not be installed where this runs, don't fail on that.
+    GLogLevelFlags fatal = g_log_set_always_fatal (G_LOG_FATAL_MASK | G_LOG_LEVEL_CRITICAL);
+    server_request (st, "POST", "/recipes/1/tasks/1/results/",
+                    "result=PASS&path=late");
+    g_log_set_always_fatal (fatal);
+    g_assert_true (upstream_got (st, "POST /recipes/1/tasks/1/results/"));
+    g_assert_cmpuint (server_request (st, "POST", "/recipes/1/watchdog",
+                                      "seconds=60"), ==, SOUP_STATUS_NO_CONTENT);
+    g_assert_true (upstream_got (st, "POST /recipes/1/watchdog"));
+    g_assert_nonnull (task->env);
+    g_assert_nonnull (task->metadata);
+
+    // Once it is moved past it is released and no longer found
+    drop_held_messages ();
+    g_assert_true (task_handler (st->app_data));
+    g_assert_true (st->app_data->tasks->data == next);
+    g_assert_null (task->env);
+    g_assert_cmpuint (server_request (st, "POST", "/recipes/1/tasks/1/results/",
+                                      "result=PASS&path=late"), ==, SOUP_STATUS_NOT_FOUND);
+
+    server_test_free (st);
+}
+
+static void
+test_task_abort (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    Task *current = start_group (st, &first);
+
+    // Only the task named in the path is aborted
+    g_assert_cmpuint (server_request (st, "POST", "/recipes/1/tasks/2/status",
+                                      "status=Aborted"), ==, SOUP_STATUS_OK);
+    g_assert_true (g_cancellable_is_cancelled (first->task->cancellable));
+    g_assert_false (g_cancellable_is_cancelled (current->cancellable));
+    g_assert_false (g_cancellable_is_cancelled (st->app_data->cancellable));
+    g_assert_cmpint (st->app_data->aborted, ==, ABORTED_NONE);
+
+    // A task that isn't running can't be aborted
+    g_assert_cmpuint (server_request (st, "POST", "/recipes/1/tasks/1/status",
+                                      "status=Aborted"), ==, SOUP_STATUS_BAD_REQUEST);
+    g_assert_false (g_cancellable_is_cancelled (st->app_data->cancellable));
+
+    server_test_free (st);
+}
+
+static void
+test_task_logs (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    start_group (st, &first);
+
+    // Logs go to the task named in the path, not to the current task
+    g_assert_cmpuint (server_request (st, "PUT", "/recipes/1/tasks/2/logs/test.log",
+                                      "output"), ==, SOUP_STATUS_NO_CONTENT);
+    g_assert_true (upstream_got (st, "PUT /recipes/1/tasks/2/logs/test.log"));
+    g_assert_cmpuint (st->upstream_requests->len, ==, 1);
+
+    // Nothing is passed on for a task that isn't running
+    g_assert_cmpuint (server_request (st, "PUT", "/recipes/1/tasks/1/logs/test.log",
+                                      "output"), ==, SOUP_STATUS_NOT_FOUND);
+    // While a group runs there is no single task for a request naming none
+    g_assert_cmpuint (server_request (st, "POST", "/recipes/1/watchdog",
+                                      "seconds=60"), ==, SOUP_STATUS_NOT_FOUND);
+    g_assert_cmpuint (st->upstream_requests->len, ==, 1);
+
+    server_test_free (st);
+}
+
+// server.c passes big logs on in pieces of this size, 4 at a time
+#define LOG_PIECE 131072
+
+static void
+test_log_stream_pieces (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    gboolean done = FALSE;
+    gsize length = 6 * LOG_PIECE + 1000;
+    start_group (st, &first);
+
+    SoupMessage *msg = log_put_start (st, length, NULL, &done);
+
+    // With 4 pieces outstanding restraintd stops reading the upload
+    wait_held (4);
+    g_assert_cmpuint (g_queue_get_length (&held_messages), ==, 4);
+    g_assert_false (done);
+
+    for (guint i = 0; i < 6; i++) {
+        gchar *range = g_strdup_printf ("bytes %u-%u/%" G_GSIZE_FORMAT,
+                                        i * LOG_PIECE, (i + 1) * LOG_PIECE - 1,
+                                        length);
+        release_message (range, LOG_PIECE, SOUP_STATUS_NO_CONTENT);
+        g_free (range);
+    }
+    g_assert_false (done);
+    release_message ("bytes 786432-787431/787432", 1000, SOUP_STATUS_NO_CONTENT);
+
+    // Answered once the last piece is through
+    while (!done) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_NO_CONTENT);
+    g_object_unref (msg);
+
+    server_test_free (st);
+}
+
+static void
+test_log_stream_failure (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    gboolean done = FALSE;
+    start_group (st, &first);
+
+    SoupMessage *msg = log_put_start (st, 3 * LOG_PIECE, NULL, &done);
+
+    // The client hears about the first piece that failed
+    release_message ("bytes 0-131071/393216", LOG_PIECE, SOUP_STATUS_NO_CONTENT);
+    release_message ("bytes 131072-262143/393216", LOG_PIECE, SOUP_STATUS_FORBIDDEN);
+    release_message ("bytes 262144-393215/393216", LOG_PIECE, SOUP_STATUS_NO_CONTENT);
+    while (!done) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_FORBIDDEN);
+    g_object_unref (msg);
+
+    server_test_free (st);
+}
+
+static void
+test_log_stream_range (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    gboolean done = FALSE;
+    start_group (st, &first);
+
+    // A client sending part of a log has its range split up
+    SoupMessage *msg = log_put_start (st, 2 * LOG_PIECE,
+                                      "bytes 1000000-1262143/5000000", &done);
+    release_message ("bytes 1000000-1131071/5000000", LOG_PIECE,
+                     SOUP_STATUS_NO_CONTENT);
+    release_message ("bytes 1131072-1262143/5000000", LOG_PIECE,
+                     SOUP_STATUS_NO_CONTENT);
+    while (!done) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_NO_CONTENT);
+    g_object_unref (msg);
+
+    server_test_free (st);
+}
+
+static void
+test_log_stream_disconnect (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    gboolean done = FALSE;
+    start_group (st, &first);
+
+    SoupMessage *msg = log_put_start (st, 6 * LOG_PIECE, NULL, &done);
+    wait_held (4);
+
+    // The client goes away while its pieces are still queued
+    soup_session_cancel_message (st->client, msg, SOUP_STATUS_CANCELLED);
+    while (!done) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    for (guint i = 0; !g_queue_is_empty (&held_messages); i++) {
+        gchar *range = g_strdup_printf ("bytes %u-%u/%u", i * LOG_PIECE,
+                                        (i + 1) * LOG_PIECE - 1, 6 * LOG_PIECE);
+        release_message (range, LOG_PIECE, SOUP_STATUS_NO_CONTENT);
+        g_free (range);
+        while (g_main_context_iteration (NULL, FALSE));
+    }
+    g_object_unref (msg);
+
+    // Finishing them touches nothing of the gone request
+    st->app_data->queue_message = (QueueMessage) restraint_queue_message;
+    g_assert_cmpuint (server_request (st, "PUT", "/recipes/1/tasks/2/logs/test.log",
+                                      "output"), ==, SOUP_STATUS_NO_CONTENT);
+
+    server_test_free (st);
+}
+
+static void
+test_hosted_config (void)
+{
+    ServerTest *st = server_test_new ();
+    gchar *config_file = st->app_data->config_file;
+
+    restraint_config_set (config_file, CONFIG_SECTION, "recipe_url", NULL,
+                          G_TYPE_STRING, "http://lab/recipes/1/");
+    restraint_config_set (config_file, HOSTED_SECTION_PREFIX "two", "recipe_url",
+                          NULL, G_TYPE_STRING, "http://lab/recipes/2/");
+    restraint_config_set (config_file, HOSTED_SECTION_PREFIX "no_url", "port",
+                          NULL, G_TYPE_UINT64, (guint64) 8081);
+    restraint_config_set (config_file, HOSTED_SECTION_PREFIX "a/b", "recipe_url",
+                          NULL, G_TYPE_STRING, "http://lab/recipes/3/");
+
+    g_test_expect_message (NULL, G_LOG_LEVEL_WARNING,
+                           "Ignoring config section [restraint:no_url]*");
+    g_test_expect_message (NULL, G_LOG_LEVEL_WARNING,
+                           "Ignoring config section [restraint:a/b]*");
+    server_add_hosted_recipes (config_file);
+    g_test_assert_expected_messages ();
+
+    // Only the valid section is added, after the recipe from [restraint]
+    g_assert_cmpuint (g_list_length (hosted_recipes), ==, 2);
+    g_assert_true (hosted_recipes->data == st->app_data);
+    AppData *hosted = (AppData *) hosted_recipes->next->data;
+    g_assert_cmpstr (hosted->config_section, ==, HOSTED_SECTION_PREFIX "two");
+    g_assert_cmpstr (hosted->recipe_url, ==, "http://lab/recipes/2/");
+    g_assert_cmpstr (hosted->config_file, ==, config_file);
+    g_assert_cmpstr (hosted->task_base, ==, TASK_LOCATION "/two");
+
+    server_test_free (st);
+}
+
+static void
+test_hosted_routing (void)
+{
+    ServerTest *st = server_test_new ();
+    TaskRunData *first;
+    start_group (st, &first);
+    AppData *second = hosted_recipe_new (st, HOSTED_SECTION_PREFIX "two", "2");
+    add_task (second->recipe, "5", NULL);
+    second->tasks = second->recipe->tasks;
+
+    // Each request goes to the recipe named in its path
+    g_assert_cmpuint (server_request (st, "PUT", "/recipes/2/tasks/5/logs/test.log",
+                                      "output"), ==, SOUP_STATUS_NO_CONTENT);
+    g_assert_true (upstream_got (st, "PUT /recipes/2/tasks/5/logs/test.log"));
+    g_assert_cmpuint (server_request (st, "PUT", "/recipes/1/tasks/3/logs/test.log",
+                                      "output"), ==, SOUP_STATUS_NO_CONTENT);
+    g_assert_true (upstream_got (st, "PUT /recipes/1/tasks/3/logs/test.log"));
+
+    // A task of one recipe isn't found through another
+    g_assert_cmpuint (server_request (st, "PUT", "/recipes/2/tasks/3/logs/test.log",
+                                      "output"), ==, SOUP_STATUS_NOT_FOUND);
+    g_assert_cmpuint (server_request (st, "PUT", "/recipes/9/tasks/5/logs/test.log",
+                                      "output"), ==, SOUP_STATUS_BAD_REQUEST);
+    g_assert_cmpuint (st->upstream_requests->len, ==, 2);
+
+    // Aborting one recipe leaves the other running
+    g_assert_cmpuint (server_request (st, "POST", "/recipes/2/status",
+                                      "status=Aborted"), ==, SOUP_STATUS_OK);
+    g_assert_true (g_cancellable_is_cancelled (second->cancellable));
+    g_assert_false (g_cancellable_is_cancelled (st->app_data->cancellable));
+
+    server_test_free (st);
+}
+
+#define ROLES_RECIPE \
+    "<job id=\"1\"><recipeSet id=\"1\">" \
+    "<recipe id=\"1\" job_id=\"1\" recipe_set_id=\"1\" family=\"Fedora\">" \
+    "<task id=\"1\" name=\"/server\">" \
+    "<fetch url=\"http://localhost:8000/fetch_http.tgz#server\"/>" \
+    "<roles><role value=\"SERVERS\"><system value=\"%s\"/></role></roles>" \
+    "</task>" \
+    "<task id=\"2\" name=\"/client\">" \
+    "<fetch url=\"http://localhost:8000/fetch_http.tgz#client\"/>" \
+    "<roles><role value=\"SERVERS\"><system value=\"%s\"/></role></roles>" \
+    "</task>" \
+    "</recipe></recipeSet></job>"
+
+static xmlDoc *
+roles_doc_new (const gchar *server)
+{
+    gchar *xml = g_strdup_printf (ROLES_RECIPE, server, server);
+    xmlDoc *doc = xmlReadMemory (xml, strlen (xml), NULL, NULL, 0);
+    g_assert_nonnull (doc);
+    g_free (xml);
+    return doc;
+}
+
+static const gchar *
+task_servers (Task *task)
+{
+    g_assert_cmpuint (g_list_length (task->roles), ==, 1);
+    return ((Role *) task->roles->data)->systems;
+}
+
+static void
+test_multihost_roles (void)
+{
+    ServerTest *st = server_test_new ();
+    AppData *app_data = st->app_data;
+    GError *error = NULL;
+
+    // Parse the recipe like restraintd does, tasks are read lazily
+    restraint_recipe_free (app_data->recipe);
+    app_data->recipe = NULL;
+    app_data->recipe_url = soup_uri_to_string (st->upstream_uri, FALSE);
+    app_data->recipe_xmldoc = roles_doc_new ("old.example.com");
+    app_data->state = RECIPE_PARSE;
+    recipe_handler (app_data);
+    g_assert_no_error (app_data->error);
+    g_assert_cmpint (app_data->state, ==, RECIPE_RUN);
+    Task *first = app_data->recipe->tasks->data;
+    Task *later = app_data->recipe->tasks->next->data;
+    g_assert_true (restraint_recipe_materialize_task (first, &error));
+    g_assert_cmpstr (task_servers (first), ==, "old.example.com");
+
+    // The first task refreshes the roles, the doc it got replaces the old
+    xmlDoc *doc = roles_doc_new ("new.example.com");
+    restraint_recipe_update_roles (app_data->recipe, doc, &error);
+    g_assert_no_error (error);
+    xmlFreeDoc (app_data->recipe_xmldoc);
+    app_data->recipe_xmldoc = doc;
+    g_assert_cmpstr (task_servers (first), ==, "new.example.com");
+
+    // A later task read afterwards sees the refreshed roles too
+    g_assert_true (restraint_recipe_materialize_task (later, &error));
+    g_assert_cmpstr (task_servers (later), ==, "new.example.com");
+
+    xmlFreeDoc (app_data->recipe_xmldoc);
+    app_data->recipe_xmldoc = NULL;
+
+    server_test_free (st);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+    soup_session = soup_session_new ();
+    g_test_add_func ("/server/concurrent/limit", test_concurrent_limit);
+    g_test_add_func ("/server/concurrent/group_end", test_concurrent_group_end);
+    g_test_add_func ("/server/task/running", test_task_running);
+    g_test_add_func ("/server/task/completed", test_task_completed);
+    g_test_add_func ("/server/task/abort", test_task_abort);
+    g_test_add_func ("/server/task/logs", test_task_logs);
+    g_test_add_func ("/server/log_stream/pieces", test_log_stream_pieces);
+    g_test_add_func ("/server/log_stream/failure", test_log_stream_failure);
+    g_test_add_func ("/server/log_stream/range", test_log_stream_range);
+    g_test_add_func ("/server/log_stream/disconnect", test_log_stream_disconnect);
+    g_test_add_func ("/server/hosted/config", test_hosted_config);
+    g_test_add_func ("/server/hosted/routing", test_hosted_routing);
+    g_test_add_func ("/server/multihost/roles", test_multihost_roles);
+    int ret = g_test_run();
+    g_object_unref (soup_session);
+    return ret;
+}
@@ -0,0 +1,154 @@
+/*  
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <json.h>
+
+#include "task_timing.h"
+
+static struct json_object *
+timing_array (struct json_object *timing, const gchar *key)
+{
+    struct json_object *array;
+
+    g_assert_true (json_object_object_get_ex (timing, key, &array));
+    g_assert_true (json_object_is_type (array, json_type_array));
+    return array;
+}
+
+static gint64
+timing_entry_int (struct json_object *entry, const gchar *key)
+{
+    struct json_object *value;
+
+    g_assert_true (json_object_object_get_ex (entry, key, &value));
+    return json_object_get_int64 (value);
+}
+
+static const gchar *
+timing_entry_string (struct json_object *entry, const gchar *key)
+{
+    struct json_object *value;
+
+    g_assert_true (json_object_object_get_ex (entry, key, &value));
+    return json_object_get_string (value);
+}
+
+static void test_timing_phases (void)
+{
+    TaskTiming *timing = restraint_task_timing_new (NULL);
+
+    g_assert_false (restraint_task_timing_enter (timing, "fetch"));
+    g_assert_false (restraint_task_timing_enter (timing, "fetch"));
+    g_usleep (20 * 1000);
+    g_assert_true (restraint_task_timing_enter (timing, "run"));
+    restraint_task_timing_add_process (timing, "make run",
+                                       g_get_monotonic_time () - 5000,
+                                       g_get_monotonic_time (), 0);
+    g_assert_true (restraint_task_timing_enter (timing, NULL));
+    g_assert_false (restraint_task_timing_enter (timing, NULL));
+
+    gchar *json = restraint_task_timing_to_json (timing);
+    struct json_object *root = json_tokener_parse (json);
+    g_assert_nonnull (root);
+
+    struct json_object *phases = timing_array (root, "phases");
+    g_assert_cmpuint (json_object_array_length (phases), ==, 2);
+    struct json_object *fetch = json_object_array_get_idx (phases, 0);
+    g_assert_cmpstr (timing_entry_string (fetch, "name"), ==, "fetch");
+    g_assert_cmpint (timing_entry_int (fetch, "duration"), >=, 20);
+    struct json_object *run = json_object_array_get_idx (phases, 1);
+    g_assert_cmpstr (timing_entry_string (run, "name"), ==, "run");
+    g_assert_cmpint (timing_entry_int (run, "start"), >=,
+                     timing_entry_int (fetch, "start") +
+                     timing_entry_int (fetch, "duration"));
+
+    struct json_object *processes = timing_array (root, "processes");
+    g_assert_cmpuint (json_object_array_length (processes), ==, 1);
+    struct json_object *process = json_object_array_get_idx (processes, 0);
+    g_assert_cmpstr (timing_entry_string (process, "command"), ==, "make run");
+    g_assert_cmpstr (timing_entry_string (process, "phase"), ==, "run");
+    g_assert_cmpint (timing_entry_int (process, "duration"), >=, 5);
+    g_assert_cmpint (timing_entry_int (process, "status"), ==, 0);
+
+    json_object_put (root);
+    g_free (json);
+    restraint_task_timing_free (timing);
+}
+
+static void test_timing_open_phase (void)
+{
+    TaskTiming *timing = restraint_task_timing_new (NULL);
+
+    restraint_task_timing_enter (timing, "run");
+    gchar *json = restraint_task_timing_to_json (timing);
+    struct json_object *root = json_tokener_parse (json);
+
+    // The phase still running is reported but stays open
+    struct json_object *phases = timing_array (root, "phases");
+    g_assert_cmpuint (json_object_array_length (phases), ==, 1);
+    g_assert_cmpstr (timing_entry_string (json_object_array_get_idx (phases, 0),
+                                          "name"), ==, "run");
+    g_assert_false (restraint_task_timing_enter (timing, "run"));
+
+    json_object_put (root);
+    g_free (json);
+    restraint_task_timing_free (timing);
+}
+
+static void test_timing_restore (void)
+{
+    const gchar *saved = "{\"phases\":[{\"name\":\"run\",\"start\":0,"
+                         "\"duration\":60000}],\"processes\":[]}";
+    TaskTiming *timing = restraint_task_timing_new (saved);
+
+    restraint_task_timing_enter (timing, "complete");
+    restraint_task_timing_enter (timing, NULL);
+
+    gchar *json = restraint_task_timing_to_json (timing);
+    struct json_object *root = json_tokener_parse (json);
+    struct json_object *phases = timing_array (root, "phases");
+    g_assert_cmpuint (json_object_array_length (phases), ==, 2);
+    struct json_object *complete = json_object_array_get_idx (phases, 1);
+    g_assert_cmpstr (timing_entry_string (complete, "name"), ==, "complete");
+    // Carries on from where the saved timeline ended
+    g_assert_cmpint (timing_entry_int (complete, "start"), >=, 60000);
+
+    json_object_put (root);
+    g_free (json);
+    restraint_task_timing_free (timing);
+}
+
+static void test_timing_restore_invalid (void)
+{
+    TaskTiming *timing = restraint_task_timing_new ("not json");
+
+    gchar *json = restraint_task_timing_to_json (timing);
+    g_assert_cmpstr (json, ==, "{\"phases\":[],\"processes\":[]}");
+
+    g_free (json);
+    restraint_task_timing_free (timing);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/task_timing/phases", test_timing_phases);
+    g_test_add_func("/task_timing/open_phase", test_timing_open_phase);
+    g_test_add_func("/task_timing/restore", test_timing_restore);
+    g_test_add_func("/task_timing/restore/invalid", test_timing_restore_invalid);
+    return g_test_run();
+}
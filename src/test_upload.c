@@ -0,0 +1,303 @@
+/*
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <time.h>
+#include <utime.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+
+#include "expect_http.h"
+#include "upload.h"
+#include "utils.h"
+
+// upload_file starts with chunks of this size, 4 at a time
+#define UPLOAD_CHUNK 131072
+#define UPLOAD_SIZE (8 * UPLOAD_CHUNK)
+
+/*
+ * A lab controller taking log chunks on the main loop while upload_file
+ * blocks in a thread of its own.
+ */
+typedef struct {
+    gchar *base;
+    gchar *filepath;
+    gchar *contents;
+    gsize length;
+    SoupServer *server;
+    SoupURI *results_uri;
+    SoupSession *session;
+    // what the server has of the log
+    GByteArray *received;
+    // Content-Range of each chunk, in the order they were answered
+    GPtrArray *ranges;
+    // chunks starting here or later are refused
+    goffset fail_from;
+    // the first chunk is held back until the others are answered
+    gboolean hold_first;
+    gboolean fail_held;
+    SoupMessage *held;
+    gint finished;
+    gboolean result;
+    GError *error;
+} UploadServer;
+
+static void
+chunk_answer (UploadServer *us, SoupMessage *msg, goffset offset,
+              gboolean fail)
+{
+    const gchar *range = soup_message_headers_get_one (msg->request_headers,
+                                                       "Content-Range");
+
+    g_ptr_array_add (us->ranges, g_strdup (range));
+    if (fail || offset >= us->fail_from) {
+        soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
+        return;
+    }
+    if (us->received->len < offset + msg->request_body->length) {
+        g_byte_array_set_size (us->received,
+                               offset + msg->request_body->length);
+    }
+    memcpy (us->received->data + offset, msg->request_body->data,
+            msg->request_body->length);
+    soup_message_set_status (msg, SOUP_STATUS_NO_CONTENT);
+}
+
+static void
+upload_handler (SoupServer *server, SoupMessage *msg,
+                const char *path, GHashTable *query,
+                SoupClientContext *client, gpointer user_data)
+{
+    UploadServer *us = (UploadServer *) user_data;
+    const gchar *range = soup_message_headers_get_one (msg->request_headers,
+                                                       "Content-Range");
+    goffset offset;
+
+    g_assert_cmpstr (msg->method, ==, "PUT");
+    g_assert_cmpstr (path, ==, "/recipes/1/tasks/1/logs/test.log");
+    g_assert_true (g_str_has_prefix (range, "bytes "));
+    offset = g_ascii_strtoll (range + strlen ("bytes "), NULL, 10);
+
+    if (offset == 0 && us->hold_first) {
+        us->hold_first = FALSE;
+        us->held = msg;
+        soup_server_pause_message (server, msg);
+        return;
+    }
+    chunk_answer (us, msg, offset, FALSE);
+    // The ones after it are through, now answer the first chunk
+    if (us->held != NULL && us->ranges->len == 3) {
+        chunk_answer (us, us->held, 0, us->fail_held);
+        soup_server_unpause_message (server, us->held);
+        us->held = NULL;
+    }
+}
+
+static void
+write_log (UploadServer *us, gsize length)
+{
+    GError *error = NULL;
+
+    g_free (us->contents);
+    us->length = length;
+    us->contents = g_malloc (length);
+    for (gsize i = 0; i < length; i++) {
+        us->contents[i] = 'a' + (i / 1000) % 26;
+    }
+    g_file_set_contents (us->filepath, us->contents, length, &error);
+    g_assert_no_error (error);
+}
+
+static UploadServer *
+upload_server_new (void)
+{
+    UploadServer *us = g_slice_new0 (UploadServer);
+
+    us->base = g_dir_make_tmp ("test_upload_XXXXXX", NULL);
+    g_assert_nonnull (us->base);
+    us->filepath = g_build_filename (us->base, "test.log", NULL);
+    write_log (us, UPLOAD_SIZE);
+
+    us->received = g_byte_array_new ();
+    us->ranges = g_ptr_array_new_with_free_func (g_free);
+    us->fail_from = G_MAXINT64;
+    us->server = soup_server_new (NULL, NULL);
+    soup_server_add_handler (us->server, NULL, upload_handler, us, NULL);
+    us->results_uri = expect_http_listen_local (us->server);
+    soup_uri_set_path (us->results_uri, "/recipes/1/tasks/1/logs/");
+    us->session = soup_session_new ();
+    return us;
+}
+
+static void
+upload_server_free (UploadServer *us)
+{
+    soup_session_abort (us->session);
+    g_object_unref (us->session);
+    soup_server_disconnect (us->server);
+    g_object_unref (us->server);
+    soup_uri_free (us->results_uri);
+    g_byte_array_free (us->received, TRUE);
+    g_ptr_array_free (us->ranges, TRUE);
+    g_clear_error (&us->error);
+    g_free (us->contents);
+    g_remove (us->filepath);
+    g_free (us->filepath);
+    g_rmdir (us->base);
+    g_free (us->base);
+    g_slice_free (UploadServer, us);
+}
+
+static gpointer
+upload_thread (gpointer user_data)
+{
+    UploadServer *us = (UploadServer *) user_data;
+
+    us->result = upload_file (us->session, us->filepath, "test.log",
+                              us->results_uri, &us->error);
+    g_atomic_int_set (&us->finished, TRUE);
+    g_main_context_wakeup (NULL);
+    return NULL;
+}
+
+/* Run rstrnt-report-log's upload, the server answers meanwhile */
+static void
+upload_run (UploadServer *us)
+{
+    g_ptr_array_set_size (us->ranges, 0);
+    g_clear_error (&us->error);
+    us->finished = FALSE;
+
+    GThread *thread = g_thread_new ("upload", upload_thread, us);
+    while (!g_atomic_int_get (&us->finished)) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_thread_join (thread);
+}
+
+/* Where the upload started, chunks are answered in no particular order */
+static goffset
+lowest_offset (UploadServer *us)
+{
+    goffset lowest = G_MAXINT64;
+
+    for (guint i = 0; i < us->ranges->len; i++) {
+        const gchar *range = us->ranges->pdata[i];
+        lowest = MIN (lowest, g_ascii_strtoll (range + strlen ("bytes "),
+                                               NULL, 10));
+    }
+    return lowest;
+}
+
+static void
+assert_received_all (UploadServer *us)
+{
+    g_assert_true (us->result);
+    g_assert_no_error (us->error);
+    g_assert_cmpuint (us->received->len, ==, us->length);
+    g_assert_true (memcmp (us->received->data, us->contents,
+                           us->length) == 0);
+}
+
+static void
+test_upload_out_of_order (void)
+{
+    UploadServer *us = upload_server_new ();
+
+    // The first chunk is refused after those behind it were taken
+    us->hold_first = TRUE;
+    us->fail_held = TRUE;
+    upload_run (us);
+    g_assert_false (us->result);
+    g_assert_error (us->error, SOUP_HTTP_ERROR, SOUP_STATUS_FORBIDDEN);
+    g_assert_cmpuint (us->ranges->len, >=, 4);
+    g_assert_true (g_str_has_prefix (us->ranges->pdata[3], "bytes 0-"));
+
+    // Only an unbroken acknowledged range is skipped, so it starts over.
+    // The first chunk is acknowledged last this time.
+    us->hold_first = TRUE;
+    us->fail_held = FALSE;
+    upload_run (us);
+    assert_received_all (us);
+    g_assert_cmpint (lowest_offset (us), ==, 0);
+    g_assert_true (g_str_has_prefix (us->ranges->pdata[3], "bytes 0-"));
+
+    // Once it is all sent a new upload is a new upload
+    upload_run (us);
+    assert_received_all (us);
+    g_assert_cmpint (lowest_offset (us), ==, 0);
+
+    upload_server_free (us);
+}
+
+static void
+test_upload_resume (void)
+{
+    UploadServer *us = upload_server_new ();
+    gchar *stale = g_build_filename (g_file_test (CMD_ENV_DIR, G_FILE_TEST_IS_DIR) ?
+                                     CMD_ENV_DIR : g_get_tmp_dir (),
+                                     "rstrnt-upload-test_upload.state", NULL);
+    struct utimbuf times;
+    times.actime = times.modtime = time (NULL) - 8 * 24 * 60 * 60;
+    g_assert_true (g_file_set_contents (stale, "", 0, NULL));
+    g_assert_cmpint (utime (stale, &times), ==, 0);
+
+    // The first 4 chunks are taken, the rest refused
+    us->fail_from = 4 * UPLOAD_CHUNK;
+    upload_run (us);
+    g_assert_false (us->result);
+    g_assert_error (us->error, SOUP_HTTP_ERROR, SOUP_STATUS_FORBIDDEN);
+    // and a week old state of an upload nobody ran again is gone
+    g_assert_false (g_file_test (stale, G_FILE_TEST_EXISTS));
+
+    // Running it again sends only what wasn't taken
+    us->fail_from = G_MAXINT64;
+    upload_run (us);
+    assert_received_all (us);
+    g_assert_cmpint (lowest_offset (us), ==, 4 * UPLOAD_CHUNK);
+    g_free (stale);
+    upload_server_free (us);
+}
+
+static void
+test_upload_changed (void)
+{
+    UploadServer *us = upload_server_new ();
+
+    us->fail_from = 4 * UPLOAD_CHUNK;
+    upload_run (us);
+    g_assert_false (us->result);
+
+    // What was taken is of a file that is no longer there
+    write_log (us, UPLOAD_SIZE + 1000);
+    g_byte_array_set_size (us->received, 0);
+    us->fail_from = G_MAXINT64;
+    upload_run (us);
+    assert_received_all (us);
+    g_assert_cmpint (lowest_offset (us), ==, 0);
+
+    upload_server_free (us);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func ("/upload/out_of_order", test_upload_out_of_order);
+    g_test_add_func ("/upload/resume", test_upload_resume);
+    g_test_add_func ("/upload/changed", test_upload_changed);
+    return g_test_run();
+}
@@ -0,0 +1,150 @@
+/*
+    This file is part of Restraint.
+
+    Restraint is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Restraint is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <libxml/parser.h>
+
+#include "expect_http.h"
+#include "fetch.h"
+#include "fetch_cache.h"
+#include "xml.h"
+
+#define RECIPE_XML "<job id=\"1\"><recipeSet id=\"1\"><recipe id=\"1\"/></recipeSet></job>"
+#define RECIPE_ETAG "\"1\""
+
+/* Answers with RECIPE_XML, or 304 to a request carrying its ETag */
+typedef struct {
+    SoupServer *server;
+    gchar *url;
+    guint not_modified;
+    gchar *if_none_match;
+} XmlServer;
+
+typedef struct {
+    GMainLoop *loop;
+    GError *error;
+    xmlDoc *doc;
+} ParseData;
+
+static void
+xml_server_handler (SoupServer *server, SoupMessage *msg,
+                    const char *path, GHashTable *query,
+                    SoupClientContext *client, gpointer user_data)
+{
+    XmlServer *xs = user_data;
+
+    g_free (xs->if_none_match);
+    xs->if_none_match = g_strdup (soup_message_headers_get_one (msg->request_headers,
+                                                                "If-None-Match"));
+    soup_message_headers_replace (msg->response_headers, "ETag", RECIPE_ETAG);
+    if (g_strcmp0 (xs->if_none_match, RECIPE_ETAG) == 0) {
+        xs->not_modified++;
+        soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+    } else {
+        soup_message_set_status (msg, SOUP_STATUS_OK);
+        soup_message_set_response (msg, "text/xml", SOUP_MEMORY_STATIC,
+                                   RECIPE_XML, strlen (RECIPE_XML));
+    }
+}
+
+static XmlServer *
+xml_server_new (void)
+{
+    XmlServer *xs = g_slice_new0 (XmlServer);
+
+    xs->server = soup_server_new (NULL, NULL);
+    soup_server_add_handler (xs->server, NULL, xml_server_handler, xs, NULL);
+    SoupURI *url = expect_http_listen_local (xs->server);
+    soup_uri_set_path (url, "/recipes/1/");
+    xs->url = soup_uri_to_string (url, FALSE);
+    soup_uri_free (url);
+    return xs;
+}
+
+static void
+xml_server_free (XmlServer *xs)
+{
+    soup_server_disconnect (xs->server);
+    g_object_unref (xs->server);
+    g_free (xs->url);
+    g_free (xs->if_none_match);
+    g_slice_free (XmlServer, xs);
+}
+
+static void
+parse_finish (GError *error, xmlDoc *doc, gpointer user_data)
+{
+    ParseData *parse_data = user_data;
+
+    parse_data->error = error;
+    parse_data->doc = doc;
+    g_main_loop_quit (parse_data->loop);
+}
+
+static void
+parse_url (SoupSession *session, const gchar *url, ParseData *parse_data)
+{
+    parse_data->error = NULL;
+    parse_data->doc = NULL;
+    parse_data->loop = g_main_loop_new (NULL, TRUE);
+    restraint_xml_parse_from_url (session, url, parse_finish, parse_data);
+    g_main_loop_run (parse_data->loop);
+    g_main_loop_unref (parse_data->loop);
+}
+
+static void
+test_parse_from_url_not_modified (void)
+{
+    SoupSession *session = soup_session_new ();
+    XmlServer *xs = xml_server_new ();
+    ParseData parse_data;
+    gchar *cache_dir = g_dir_make_tmp ("test_xml_cache_XXXXXX", NULL);
+
+    restraint_fetch_cache_configure (cache_dir, 64 * 1024 * 1024);
+
+    // Nothing cached yet, an unconditional GET
+    parse_url (session, xs->url, &parse_data);
+    g_assert_no_error (parse_data.error);
+    g_assert_nonnull (parse_data.doc);
+    g_assert_null (xs->if_none_match);
+    xmlFreeDoc (parse_data.doc);
+
+    // A 304 is parsed from the cached copy
+    parse_url (session, xs->url, &parse_data);
+    g_assert_no_error (parse_data.error);
+    g_assert_cmpstr (xs->if_none_match, ==, RECIPE_ETAG);
+    g_assert_cmpuint (xs->not_modified, ==, 1);
+    g_assert_nonnull (parse_data.doc);
+    xmlNode *root = xmlDocGetRootElement (parse_data.doc);
+    g_assert_cmpstr ((gchar *) root->name, ==, "job");
+    xmlFreeDoc (parse_data.doc);
+
+    restraint_fetch_cache_configure (NULL, 0);
+    rmrf (cache_dir);
+    g_free (cache_dir);
+    xml_server_free (xs);
+    g_object_unref (session);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func ("/xml/parse_from_url/not_modified",
+                     test_parse_from_url_not_modified);
+    return g_test_run();
+}
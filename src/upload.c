@@ -14,58 +14,192 @@
     You should have received a copy of the GNU General Public License
     along with Restraint.  If not, see <http://www.gnu.org/licenses/>.
 */
-
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <libsoup/soup.h>
+#include <sys/stat.h>
+#include "cmd_utils.h"
+#include "utils.h"
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
-#define READ_BUFFER_SIZE 131072
-static gchar input_buf[READ_BUFFER_SIZE];
-static gssize offset = 0;
+/*
+ * Chunks start at 128 KiB and double, up to UPLOAD_CHUNK_MAX, each time
+ * one is acknowledged within UPLOAD_CHUNK_FAST.  A failed chunk halves
+ * them again.  UPLOAD_IN_FLIGHT chunks are sent at once, each is retried
+ * UPLOAD_RETRIES times before the upload gives up.
+ */
+#define UPLOAD_CHUNK_MIN 131072
+#define UPLOAD_CHUNK_MAX 4194304
+#define UPLOAD_CHUNK_FAST G_USEC_PER_SEC
+#define UPLOAD_IN_FLIGHT 4
+#define UPLOAD_RETRIES 4
+#define UPLOAD_STATE_GROUP "upload"
+#define UPLOAD_STATE_MAX_AGE 7 // days
 
-static gint
-upload_chunk (SoupSession *session,
-              GInputStream *in,
-              guint64 filesize,
-              guint64 bytes_left,
-              SoupURI *result_log_uri,
-              GError **error)
+typedef struct {
+    SoupSession *session;
+    SoupURI *uri;
+    guint64 filesize;
+    GMutex mutex;
+    GCond cond;
+    GQueue *done;
+} Upload;
+
+typedef struct {
+    goffset offset;
+    gsize length;
+    gchar *data;
+    guint status;
+    gchar *reason;
+    gint64 elapsed;
+} UploadChunk;
+
+static void
+upload_chunk_free (UploadChunk *chunk)
 {
-    SoupMessage *server_msg;
-    gchar *range;
-    gssize bytes_read;
-    gint ret;
-    GError *tmp_error = NULL;
-    bytes_read = g_input_stream_read (
-        in, input_buf, (bytes_left < READ_BUFFER_SIZE) ? bytes_left : READ_BUFFER_SIZE,
-        NULL, &tmp_error);
-    if (tmp_error) {
-        g_propagate_error (error, tmp_error);
-        return -1;
-    }
-    if (bytes_read > 0) {
-        server_msg = soup_message_new_from_uri ("PUT", result_log_uri);
-        range = g_strdup_printf ("bytes %" G_GSSIZE_FORMAT "-%" G_GSSIZE_FORMAT "/%" G_GUINT64_FORMAT,
-                                 offset,
-                                 offset + bytes_read - 1,
-                                 filesize);
-        offset += bytes_read;
+    g_free (chunk->data);
+    g_free (chunk->reason);
+    g_slice_free (UploadChunk, chunk);
+}
+
+/* Runs in the thread pool, so only the sync session API is used */
+static void
+upload_chunk (gpointer data, gpointer user_data)
+{
+    UploadChunk *chunk = (UploadChunk *) data;
+    Upload *upload = (Upload *) user_data;
+    gchar *range = g_strdup_printf ("bytes %" G_GOFFSET_FORMAT "-%" G_GOFFSET_FORMAT "/%" G_GUINT64_FORMAT,
+                                    chunk->offset,
+                                    chunk->offset + chunk->length - 1,
+                                    upload->filesize);
+    gint64 start = g_get_monotonic_time ();
+
+    for (guint attempt = 0; ; attempt++) {
+        SoupMessage *server_msg = soup_message_new_from_uri ("PUT", upload->uri);
         soup_message_headers_append (server_msg->request_headers, "Content-Range", range);
-        g_free (range);
-        soup_message_set_request (server_msg, "text/plain", SOUP_MEMORY_COPY, input_buf, bytes_read);
-        ret = soup_session_send_message (session, server_msg);
-        if (SOUP_STATUS_IS_SUCCESSFUL (ret)) {
-            return bytes_read;
-        } else {
-            g_set_error_literal (error, SOUP_HTTP_ERROR, server_msg->status_code,
-                                     server_msg->reason_phrase);
+        soup_message_set_request (server_msg, "text/plain", SOUP_MEMORY_STATIC,
+                                  chunk->data, chunk->length);
+        chunk->status = rstrnt_send_message (upload->session, server_msg);
+        if (SOUP_STATUS_IS_SUCCESSFUL (chunk->status) ||
+            SOUP_STATUS_IS_CLIENT_ERROR (chunk->status) ||
+            attempt == UPLOAD_RETRIES) {
+            chunk->reason = g_strdup (server_msg->reason_phrase);
             g_object_unref (server_msg);
-            return -1;
+            break;
         }
+        g_object_unref (server_msg);
+        g_usleep ((1 << attempt) * G_USEC_PER_SEC);
     }
-    return 0;
+    chunk->elapsed = g_get_monotonic_time () - start;
+    g_free (range);
+
+    g_mutex_lock (&upload->mutex);
+    g_queue_push_tail (upload->done, chunk);
+    g_cond_signal (&upload->cond);
+    g_mutex_unlock (&upload->mutex);
+}
+
+/*
+ * How far an upload got is kept per log URL and file, next to the
+ * commands env file, so that running the command again continues it.
+ * Nothing may ever run it again, so an upload that fails removes the
+ * state of any left behind more than UPLOAD_STATE_MAX_AGE days ago.
+ */
+static const gchar *
+upload_state_dir (void)
+{
+    return g_file_test (CMD_ENV_DIR, G_FILE_TEST_IS_DIR) ?
+           CMD_ENV_DIR : g_get_tmp_dir ();
+}
+
+static gchar *
+upload_state_filename (SoupURI *uri, const gchar *filepath)
+{
+    gchar *url = soup_uri_to_string (uri, FALSE);
+    gchar *key = g_strconcat (url, "\n", filepath, NULL);
+    gchar *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+    gchar *basename = g_strdup_printf ("rstrnt-upload-%s.state", checksum);
+    gchar *filename = g_build_filename (upload_state_dir (), basename, NULL);
+
+    g_free (basename);
+    g_free (checksum);
+    g_free (key);
+    g_free (url);
+    return filename;
+}
+
+static void
+upload_state_expire (void)
+{
+    gint64 expires = g_get_real_time () / G_USEC_PER_SEC -
+                     UPLOAD_STATE_MAX_AGE * 24 * 60 * 60;
+    const gchar *dirname = upload_state_dir ();
+    const gchar *name;
+    GDir *dir;
+
+    dir = g_dir_open (dirname, 0, NULL);
+    if (dir == NULL) {
+        return;
+    }
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (!g_str_has_prefix (name, "rstrnt-upload-") ||
+            !g_str_has_suffix (name, ".state")) {
+            continue;
+        }
+        gchar *filename = g_build_filename (dirname, name, NULL);
+        struct stat st;
+        if (g_lstat (filename, &st) == 0 && S_ISREG (st.st_mode) &&
+            st.st_mtime < expires) {
+            g_unlink (filename);
+        }
+        g_free (filename);
+    }
+    g_dir_close (dir);
+}
+
+static guint64
+upload_state_load (const gchar *state_file, guint64 filesize, guint64 mtime)
+{
+    GKeyFile *keyfile = g_key_file_new ();
+    guint64 offset = 0;
+
+    // A changed file starts over
+    if (g_key_file_load_from_file (keyfile, state_file, G_KEY_FILE_NONE, NULL) &&
+        g_key_file_get_uint64 (keyfile, UPLOAD_STATE_GROUP, "size", NULL) == filesize &&
+        g_key_file_get_uint64 (keyfile, UPLOAD_STATE_GROUP, "mtime", NULL) == mtime) {
+        offset = g_key_file_get_uint64 (keyfile, UPLOAD_STATE_GROUP, "offset", NULL);
+    }
+    g_key_file_free (keyfile);
+    return MIN (offset, filesize);
+}
+
+static void
+upload_state_save (const gchar *state_file, guint64 filesize, guint64 mtime,
+                   guint64 offset)
+{
+    GKeyFile *keyfile = g_key_file_new ();
+    gchar *s_data;
+    gsize length;
+
+    g_key_file_set_uint64 (keyfile, UPLOAD_STATE_GROUP, "size", filesize);
+    g_key_file_set_uint64 (keyfile, UPLOAD_STATE_GROUP, "mtime", mtime);
+    g_key_file_set_uint64 (keyfile, UPLOAD_STATE_GROUP, "offset", offset);
+    s_data = g_key_file_to_data (keyfile, &length, NULL);
+    // Losing this only means uploading some of the file again
+    g_file_set_contents (state_file, s_data, length, NULL);
+    g_free (s_data);
+    g_key_file_free (keyfile);
+}
+
+static gint
+upload_chunk_cmp (gconstpointer a, gconstpointer b)
+{
+    const UploadChunk *chunk_a = a;
+    const UploadChunk *chunk_b = b;
+
+    return (chunk_a->offset > chunk_b->offset) - (chunk_a->offset < chunk_b->offset);
 }
 
 gboolean
@@ -78,13 +212,18 @@ upload_file (SoupSession *session,
     GFile *f = g_file_new_for_path (filepath);
     GFileInputStream *fis = NULL;
     GFileInfo *fileinfo = NULL;
-    guint64 filesize, uploaded;
+    guint64 filesize, mtime, acked, next;
     GError *tmp_error = NULL;
     SoupURI *result_log_uri;
-    gint ret;
     char *uri_estring_filename = NULL;
+    gchar *state_file;
+    GThreadPool *pool;
+    GSList *unacked = NULL;
+    gsize chunk_size = UPLOAD_CHUNK_MIN;
+    guint in_flight = 0;
+    Upload upload;
 
-    fileinfo = g_file_query_info (f, "standard::*", G_FILE_QUERY_INFO_NONE,
+    fileinfo = g_file_query_info (f, "standard::*,time::modified", G_FILE_QUERY_INFO_NONE,
                                   NULL, &tmp_error);
     if (tmp_error != NULL) {
         g_propagate_prefixed_error (error, tmp_error,
@@ -95,6 +234,8 @@ upload_file (SoupSession *session,
 
     filesize = g_file_info_get_attribute_uint64 (
                    fileinfo, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+    mtime = g_file_info_get_attribute_uint64 (
+                fileinfo, G_FILE_ATTRIBUTE_TIME_MODIFIED);
     g_object_unref(fileinfo);
 
     /* get input stream */
@@ -110,20 +251,103 @@ upload_file (SoupSession *session,
     uri_estring_filename = g_uri_escape_string(filename, NULL, FALSE);
     result_log_uri = soup_uri_new_with_base (results_uri,
                                              uri_estring_filename);
-    uploaded = 0;
-    while (uploaded < filesize) {
-        ret = upload_chunk (
-            session, G_INPUT_STREAM (fis), filesize, (filesize - uploaded),
-            result_log_uri, &tmp_error);
-        if (ret < 0) {
+
+    state_file = upload_state_filename (result_log_uri, filepath);
+    acked = next = upload_state_load (state_file, filesize, mtime);
+    if (acked > 0 &&
+        !g_seekable_seek (G_SEEKABLE (fis), acked, G_SEEK_SET, NULL, &tmp_error)) {
+        goto done;
+    }
+
+    upload.session = session;
+    upload.uri = result_log_uri;
+    upload.filesize = filesize;
+    upload.done = g_queue_new ();
+    g_mutex_init (&upload.mutex);
+    g_cond_init (&upload.cond);
+    pool = g_thread_pool_new (upload_chunk, &upload, UPLOAD_IN_FLIGHT, FALSE, NULL);
+
+    while (TRUE) {
+        // Keep UPLOAD_IN_FLIGHT chunks going until something fails
+        while (tmp_error == NULL && in_flight < UPLOAD_IN_FLIGHT && next < filesize) {
+            UploadChunk *chunk = g_slice_new0 (UploadChunk);
+            gsize bytes_read;
+            chunk->offset = next;
+            chunk->length = MIN (chunk_size, filesize - next);
+            chunk->data = g_malloc (chunk->length);
+            if (!g_input_stream_read_all (G_INPUT_STREAM (fis), chunk->data,
+                                          chunk->length, &bytes_read, NULL,
+                                          &tmp_error) ||
+                bytes_read != chunk->length) {
+                if (tmp_error == NULL) {
+                    g_set_error (&tmp_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 "%s is shorter than %" G_GUINT64_FORMAT " bytes",
+                                 filepath, filesize);
+                }
+                upload_chunk_free (chunk);
+                break;
+            }
+            next += chunk->length;
+            in_flight++;
+            g_thread_pool_push (pool, chunk, NULL);
+        }
+        if (in_flight == 0) {
             break;
-        } else {
-            uploaded += ret;
-            // replace with callback
-            g_print (".");
+        }
+
+        g_mutex_lock (&upload.mutex);
+        while (g_queue_is_empty (upload.done)) {
+            g_cond_wait (&upload.cond, &upload.mutex);
+        }
+        UploadChunk *chunk = g_queue_pop_head (upload.done);
+        g_mutex_unlock (&upload.mutex);
+        in_flight--;
+
+        if (!SOUP_STATUS_IS_SUCCESSFUL (chunk->status)) {
+            if (tmp_error == NULL) {
+                g_set_error_literal (&tmp_error, SOUP_HTTP_ERROR, chunk->status,
+                                     chunk->reason);
+            }
+            chunk_size = MAX (chunk_size / 2, UPLOAD_CHUNK_MIN);
+            upload_chunk_free (chunk);
+            continue;
+        }
+        if (chunk->elapsed < UPLOAD_CHUNK_FAST) {
+            chunk_size = MIN (chunk_size * 2, UPLOAD_CHUNK_MAX);
+        }
+        g_print (".");
+
+        // Chunks finish out of order, only what was acknowledged
+        // without a gap can be skipped next time.
+        g_free (chunk->data);
+        chunk->data = NULL;
+        unacked = g_slist_insert_sorted (unacked, chunk, upload_chunk_cmp);
+        guint64 was_acked = acked;
+        while (unacked != NULL &&
+               ((UploadChunk *) unacked->data)->offset == acked) {
+            UploadChunk *first = unacked->data;
+            acked += first->length;
+            unacked = g_slist_delete_link (unacked, unacked);
+            upload_chunk_free (first);
+        }
+        if (acked != was_acked && acked < filesize) {
+            upload_state_save (state_file, filesize, mtime, acked);
         }
     }
 
+    g_thread_pool_free (pool, FALSE, TRUE);
+    g_slist_free_full (unacked, (GDestroyNotify) upload_chunk_free);
+    g_queue_free (upload.done);
+    g_mutex_clear (&upload.mutex);
+    g_cond_clear (&upload.cond);
+
+done:
+    if (acked == filesize) {
+        g_unlink (state_file);
+    } else {
+        upload_state_expire ();
+    }
+    g_free (state_file);
     g_free(uri_estring_filename);
     soup_uri_free (result_log_uri);
     g_object_unref(fis);
@@ -135,5 +359,5 @@ upload_file (SoupSession *session,
         return FALSE;
     }
 
-    return uploaded == filesize;
+    return acked == filesize;
 }
@@ -43,12 +43,14 @@ void update_env_file (gchar *prefix, gchar *restraint_url,
                       guint port, GError **error)
 {
     gchar *filename = get_envvar_filename(port);
+    gchar *socket_filename = get_socket_filename(port);
     FILE *env_file;
 
     env_file = g_fopen(filename, "w");
 
     g_free(filename);
     if (env_file == NULL) {
+        g_free(socket_filename);
         g_set_error (error, RESTRAINT_ERROR, RESTRAINT_OPEN,
                      "update_env_file env_file is NULL, errno=%s\n",
                      g_strerror (errno));
@@ -59,7 +61,9 @@ void update_env_file (gchar *prefix, gchar *restraint_url,
     g_fprintf(env_file, "%sURL=%s\n", prefix, restraint_url);
     g_fprintf(env_file, "%sRECIPE_URL=%s/recipes/%s\n", prefix, restraint_url, recipe_id);
     g_fprintf(env_file, "%sTASKID=%s\n", prefix, task_id);
+    g_fprintf(env_file, "%sSOCKET=%s\n", prefix, socket_filename);
     fclose(env_file);
+    g_free(socket_filename);
 }
 
 void
@@ -188,3 +192,18 @@ get_envvar_filename(guint port)
     }
     return(filename);
 }
+
+/* get_socket_filename()
+ *
+ * The unix socket restraintd listening on port also accepts
+ * the rstrnt-* commands on, found the same way as the env file.
+ */
+gchar *
+get_socket_filename(guint port)
+{
+    if (g_file_test(CMD_ENV_DIR, G_FILE_TEST_IS_DIR)) {
+        return g_strdup_printf(CMD_SOCKET_FORMAT, CMD_ENV_DIR, port);
+    } else {
+        return g_strdup_printf(CMD_SOCKET_FORMAT, ".", port);
+    }
+}
@@ -6,6 +6,7 @@
 #include <libxml/tree.h>
 
 #include "xml.h"
+#include "fetch_cache.h"
 
 GQuark restraint_xml_parse_error_quark(void) {
     return g_quark_from_static_string("restraint-xml-parse-error-quark");
@@ -16,10 +17,22 @@ typedef struct {
     char buf[4096];
     xmlParserCtxt *parser_ctxt;
     gchar *url;
+    SoupMessage *msg;
+    FetchCacheEntry *cache;
     RestraintXmlRequestCompletionCallback completion_callback;
     gpointer completion_callback_user_data;
 } RestraintXmlRequestContext;
 
+static void
+restraint_xml_request_context_free(RestraintXmlRequestContext *ctxt)
+{
+    g_clear_error(&ctxt->error);
+    g_clear_object(&ctxt->msg);
+    restraint_fetch_cache_entry_free(ctxt->cache);
+    g_free(ctxt->url);
+    g_slice_free(RestraintXmlRequestContext, ctxt);
+}
+
 static void
 restraint_xml_read_callback(GObject *source, GAsyncResult *result, gpointer user_data)
 {
@@ -37,6 +50,8 @@ restraint_xml_read_callback(GObject *source, GAsyncResult *result, gpointer user
         goto finished;
     }
 
+    restraint_fetch_cache_write(ctxt->cache, ctxt->buf, size);
+
     // We only initialise the XML parsing context after we have read some
     // bytes, not sooner, because it uses the initial bytes for charset detection.
     if (ctxt->parser_ctxt == NULL) {
@@ -81,15 +96,19 @@ finished:
     } else {
         g_warn_if_fail(ctxt->parser_ctxt != NULL);
         g_warn_if_fail(ctxt->parser_ctxt->myDoc != NULL);
+        // Only a document which parsed is worth revalidating later
+        GError *cache_error = NULL;
+        if (!restraint_fetch_cache_commit(ctxt->cache, &cache_error)) {
+            g_warning("Unable to cache %s: %s", ctxt->url, cache_error->message);
+            g_clear_error(&cache_error);
+        }
         // If there was no error, we transfer ownership of myDoc to the callback.
         ctxt->completion_callback(NULL, ctxt->parser_ctxt->myDoc,
                 ctxt->completion_callback_user_data);
         xmlFreeParserCtxt(ctxt->parser_ctxt);
     }
 
-    g_clear_error(&ctxt->error);
-    g_free(ctxt->url);
-    g_slice_free(RestraintXmlRequestContext, ctxt);
+    restraint_xml_request_context_free(ctxt);
 }
 
 void
@@ -120,9 +139,34 @@ restraint_xml_request_callback(GObject *source, GAsyncResult *res, gpointer user
     GInputStream *stream = soup_request_send_finish(SOUP_REQUEST(source), res, &ctxt->error);
     if (!stream) {
         ctxt->completion_callback(ctxt->error, NULL, ctxt->completion_callback_user_data);
+        restraint_xml_request_context_free(ctxt);
         return;
     }
 
+    if (ctxt->msg != NULL && ctxt->msg->status_code == SOUP_STATUS_NOT_MODIFIED) {
+        g_input_stream_close(stream, /* cancellable */ NULL, NULL);
+        g_object_unref(stream);
+        // Not modified, the document comes from the cache
+        stream = restraint_fetch_cache_read(ctxt->cache, &ctxt->error);
+        g_clear_pointer(&ctxt->cache, restraint_fetch_cache_entry_free);
+        if (!stream) {
+            ctxt->completion_callback(ctxt->error, NULL, ctxt->completion_callback_user_data);
+            restraint_xml_request_context_free(ctxt);
+            return;
+        }
+    } else if (ctxt->cache != NULL) {
+        if (ctxt->msg->status_code == SOUP_STATUS_OK) {
+            g_free(ctxt->cache->etag);
+            ctxt->cache->etag = g_strdup(soup_message_headers_get_one(
+                    ctxt->msg->response_headers, "ETag"));
+            g_free(ctxt->cache->last_modified);
+            ctxt->cache->last_modified = g_strdup(soup_message_headers_get_one(
+                    ctxt->msg->response_headers, "Last-Modified"));
+        } else {
+            g_clear_pointer(&ctxt->cache, restraint_fetch_cache_entry_free);
+        }
+    }
+
     g_input_stream_read_async(stream, ctxt->buf, sizeof(ctxt->buf),
             G_PRIORITY_DEFAULT, /* cancellable */ NULL,
             restraint_xml_read_callback, ctxt);
@@ -152,6 +196,22 @@ restraint_xml_parse_from_url(
     ctxt->completion_callback = completion_callback;
     ctxt->completion_callback_user_data = user_data;
 
+    // Only http(s) responses carry validators for a conditional GET
+    if (SOUP_IS_REQUEST_HTTP(request)) {
+        ctxt->msg = soup_request_http_get_message(SOUP_REQUEST_HTTP(request));
+        ctxt->cache = restraint_fetch_cache_lookup(soup_request_get_uri(request));
+    }
+    if (restraint_fetch_cache_valid(ctxt->cache)) {
+        if (ctxt->cache->etag != NULL) {
+            soup_message_headers_append(ctxt->msg->request_headers,
+                    "If-None-Match", ctxt->cache->etag);
+        }
+        if (ctxt->cache->last_modified != NULL) {
+            soup_message_headers_append(ctxt->msg->request_headers,
+                    "If-Modified-Since", ctxt->cache->last_modified);
+        }
+    }
+
     soup_request_send_async(request, /* cancellable */ NULL,
             restraint_xml_request_callback, ctxt);
     g_object_unref(request);
@@ -40,6 +40,17 @@ void restraint_xml_parse_from_stream(
     RestraintXmlRequestCompletionCallback completion_callback,
     gpointer user_data);
 
+/**
+ * restraint_xml_parse_from_url:
+ * @soup_session: the session to make the request with.
+ * @url: the URL to fetch the XML from.
+ * @completion_callback: called as for restraint_xml_parse_from_stream().
+ * @user_data (closure): extra argument for the completion callback.
+ *
+ * Fetches and parses the XML at @url. When the fetch cache is configured
+ * http(s) documents are kept in it and later fetches are conditional GETs,
+ * a 304 response is parsed from the cached copy.
+ */
 void restraint_xml_parse_from_url(
     SoupSession *soup_session,
     const gchar *url,